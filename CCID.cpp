@@ -58,7 +58,7 @@ USBCCIDBase::product_vendor_mapping_t USBCCIDBase::pid_vid_mapping[] = {
 void USBCCIDBase::init()
 {
 	contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
-	contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
+	contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t), this);
 	contribute_String_Buffers(mystring_bufs, sizeof(mystring_bufs)/sizeof(strbuf_t));
 	driver_ready_for_device(this);
 }
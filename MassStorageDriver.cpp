@@ -54,7 +54,7 @@ static const uint8_t mbdpGuid[16] PROGMEM = {0xA2, 0xA0, 0xD0, 0xEB, 0xE5, 0xB9,
 void USBDrive::init()
 {
 	contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
-	contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
+	contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t), this);
 	contribute_String_Buffers(mystring_bufs, sizeof(mystring_bufs)/sizeof(strbuf_t));
 	driver_ready_for_device(this);
 }
@@ -163,6 +163,8 @@ bool USBDrive::claim(Device_t *dev, int type, const uint8_t *descriptors, uint32
 	println("polling intervalOut = ", intervalOut);
 	datapipeIn = new_Pipe(dev, 2, endpointIn, 1, packetSizeIn, intervalIn);
 	datapipeOut = new_Pipe(dev, 2, endpointOut, 0, packetSizeOut, intervalOut);
+	set_Priority(datapipeIn, 1);
+	set_Priority(datapipeOut, 1);
 	datapipeIn->callback_function = callbackIn;
 	datapipeOut->callback_function = callbackOut;
 
@@ -606,9 +608,6 @@ uint8_t USBDrive::msReadBlocks(
 							  (uint8_t)(BlockAddress & 0xFF),
 							   0x00, BlockHi, BlockLo, 0x00}
 	};
-	#if defined(__IMXRT1062__)
-	if ((uint32_t)sectorBuffer >= 0x20200000u)  arm_dcache_flush_delete(sectorBuffer, CommandBlockWrapper.TransferLength);
-	#endif
 	return msDoCommand(&CommandBlockWrapper, sectorBuffer);
 }
 
@@ -732,9 +731,6 @@ uint8_t USBDrive::msWriteBlocks(
 							  (uint8_t)(BlockAddress & 0xFF),
 							  0x00, BlockHi, BlockLo, 0x00}
 	};
-	#if defined(__IMXRT1062__)
-	if ((uint32_t)sectorBuffer >= 0x20200000u)  arm_dcache_flush((void*)sectorBuffer, CommandBlockWrapper.TransferLength);
-	#endif
 	return msDoCommand(&CommandBlockWrapper, (void *)sectorBuffer);
 }
 
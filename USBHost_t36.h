@@ -29,7 +29,6 @@
 #if !defined(__MK66FX1M0__) && !defined(__IMXRT1052__) && !defined(__IMXRT1062__)
 #error "USBHost_t36 only works with Teensy 3.6 or Teensy 4.x.  Please select it in Tools > Boards"
 #endif
-#include "utility/imxrt_usbhs.h"
 #include "utility/msc.h"
 
 // Dear inquisitive reader, USB is a complex protocol defined with
@@ -61,6 +60,40 @@
 // Uncomment this line to see lots of debugging info!
 //#define USBHOST_PRINT_DEBUG
 
+// Uncomment this line to keep statistics for every pipe, see pipeStats()
+//#define USBHOST_PIPE_STATS
+
+// Uncomment this line to record events into a trace buffer, which
+// traceDump() prints for the extras/trace_decode tool.  Unlike debug
+// printing, tracing barely changes the timing.
+//#define USBHOST_TRACE
+
+// Uncomment this line to capture USB traffic, which captureWrite() saves
+// as pcapng files for Wireshark, in the same format as Linux usbmon.
+//#define USBHOST_CAPTURE
+
+// Uncomment this line for a few buffers in DTCM (not cached), which IN
+// transfers use on Teensy 4.x when the driver's buffer is in cached
+// memory and doesn't fill whole cache lines.  USBHOST_BOUNCE_SIZE sets
+// the largest transfer which can use them, 512 bytes by default.
+//#define USBHOST_BOUNCE_BUFFERS 2
+
+
+// Teensy 4.x uses its USB2 controller for the host port.  Uncomment this
+// line to use USB1 instead, on boards which wire it for host mode.  Set
+// Tools > USB Type to "No USB", as Teensy's own USB port normally uses it.
+//#define USBHOST_CONTROLLER 1
+
+// Uncomment this line to run host ports on both of Teensy 4's USB
+// controllers at once, see USBHostController.  Each needs its own
+// periodic schedule, about 2.5K with the default settings.
+//#define USBHOST_CONTROLLERS 2
+
+// Uncomment this line to have the compiler print USBHostConfig's memory
+// use, as a warning, when Arduino's compiler warnings are turned on.
+//#define USBHOST_PRINT_MEMORY_BUDGET
+#include "utility/imxrt_usbhs.h"
+
 
 // This can let you control where to send the debugging messages
 //#define USBHDBGSerial	Serial1
@@ -80,6 +113,10 @@
 // All common USB functionality is implemented here.
 class USBHost;
 
+// USBHostController is one EHCI and its root port.  Most
+// programs use only the one USBHost::begin() starts.
+class USBHostController;
+
 // These 3 structures represent the actual USB entities
 // USBHost manipulates.  One Device_t is created for
 // each active USB device.  One Pipe_t is create for
@@ -87,10 +124,13 @@ class USBHost;
 // when any data transfer is added to the EHCI work
 // queues, and then returned to the free pool after the
 // data transfer completes and the driver has processed
-// the results.
+// the results.  Isochronous pipes use Isochronous_t
+// instead of Transfer_t, which remain in the EHCI
+// schedule for as long as the pipe is streaming.
 typedef struct Device_struct       Device_t;
 typedef struct Pipe_struct         Pipe_t;
 typedef struct Transfer_struct     Transfer_t;
+typedef struct Isochronous_struct  Isochronous_t;
 typedef enum { CLAIM_NO=0, CLAIM_REPORT, CLAIM_INTERFACE} hidclaim_t;
 
 // All USB device drivers inherit use these classes.
@@ -177,6 +217,47 @@ typedef struct {
 	uint8_t buffer[STRING_BUF_SIZE];
 } strbuf_t;
 
+// segment_t describes 1 piece of a data transfer made from several
+// separate buffers, for queue_Data_Transfer's scatter-gather form.
+typedef struct {
+	void     *data;
+	uint32_t length;
+} segment_t;
+
+// pipestats_t counts the work done by a pipe, or by all the pipes of a
+// device, when USBHOST_PIPE_STATS is defined.  Latency is measured with
+// the cycle counter, from when a transfer is queued until it completes.
+typedef struct {
+	uint32_t transfers;      // completed transfers
+	uint32_t bytes;          // data moved, by all completed qTDs
+	uint32_t short_packets;  // IN qTDs ending with a short packet
+	uint32_t latency[20];    // [n] counts 2^n to 2^(n+1)-1 us, [0] also 0 us
+	uint32_t stalls;         // these 4 come from the pipe's error counters
+	uint32_t babbles;
+	uint32_t xacterrs;
+	uint32_t buffer_errors;
+} pipestats_t;
+
+// poolstats_t shows how much of a memory pool is used, from poolStats(),
+// to help decide how many of each item drivers should contribute.
+typedef struct {
+	uint16_t total;          // number contributed
+	uint16_t free;           // currently not in use
+	uint16_t min_free;       // lowest free has ever been
+	uint16_t failures;       // allocations which found the pool empty
+	USBDriver *failed_driver; // most recent failure, NULL if not for a driver
+} poolstats_t;
+
+// irqstats_t shows how much work each USBHS interrupt does, from
+// interruptStats(), to help choose setInterruptCoalescing().  Rates are
+// averaged since the last reset.
+typedef struct {
+	uint32_t interrupts_per_second;  // interrupts for completed transfers
+	uint32_t completions_per_second; // transfers completed
+	float    completions_per_interrupt;
+	uint8_t  microframes;            // interrupt threshold in use now
+} irqstats_t;
+
 #define DEVICE_STRUCT_STRING_BUF_SIZE 50
 
 // Device_t holds all the information about a USB device
@@ -199,6 +280,10 @@ struct Device_struct {
 	uint16_t idVendor;
 	uint16_t idProduct;
 	uint16_t LanguageID;
+	uint8_t  tt_port; // port number if the hub has a TT per port (Multi-TT)
+	uint8_t  tt_hub_address; // high speed hub doing split transactions
+	uint8_t  tt_hub_port;    // for a full or low speed device
+	USBHostController *controller; // EHCI this device is connected to
 };
 
 // Pipe_t holes all information about each USB endpoint/pipe
@@ -220,7 +305,10 @@ struct Pipe_struct {
 	uint8_t  start_mask;
 	uint8_t  complete_mask;
 	Pipe_t   *next;
-	void     (*callback_function)(const Transfer_t *);
+	union {
+		void (*callback_function)(const Transfer_t *);
+		void (*isochronous_callback)(Isochronous_t *); // type=1 only
+	};
 	uint16_t periodic_interval;
 	uint16_t periodic_offset;
 	uint16_t bandwidth_interval;
@@ -228,12 +316,46 @@ struct Pipe_struct {
 	uint16_t bandwidth_shift;
 	uint8_t  bandwidth_stime;
 	uint8_t  bandwidth_ctime;
-	uint32_t unused1;
-	uint32_t unused2;
-	uint32_t unused3;
-	uint32_t unused4;
-	uint32_t unused5;
-};
+	// Queued transfers not yet completed, oldest first.  The EHCI always
+	// completes the qTDs on a QH in order, so only first_followup needs
+	// to be checked when the USBHS interrupt says work has completed.
+	Transfer_t *first_followup;
+	Transfer_t *last_followup;
+	// Linked list of pipes which have queued, not-yet-completed transfers
+	Pipe_t   *next_followup;
+	Pipe_t   *prev_followup;
+	// Isochronous pipes keep a ring of iTD or siTD in the periodic
+	// schedule, this one being the next the EHCI will complete.
+	Isochronous_t *isochronous;
+	uint16_t isochronous_frames; // number of iTD or siTD in the ring
+	uint8_t  callback_deferred; // 1=callback runs from USBHost::Task()
+	uint8_t  persistent; // 1=ring of qTDs re-armed after each callback
+	uint16_t removal_frame; // FRINDEX when removed from periodic schedule
+	// Interrupt pipe error recovery.  After a halt, the endpoint's halt
+	// is cleared and the transfer resumes, unless too many errors happen
+	// in a row.  The counters are totals, for drivers or debugging.
+	uint8_t  errors;     // consecutive halts, reset by any success
+	uint8_t  halt_state; // 0=running, 1=clearing endpoint halt, 2=gave up
+	uint16_t stall_count;
+	uint16_t babble_count;
+	uint16_t xacterr_count;
+	uint16_t buffer_error_count;
+	setup_t  clear_halt_setup;
+	// Full speed & low speed periodic pipes are also budgeted on their
+	// hub's transaction translator, see allocate_interrupt_pipe_bandwidth
+	uint16_t tt_time;    // best case full speed byte times per transaction
+	uint8_t  tt_index;   // TT budget table + 1, or 0 if none
+	int8_t   priority;   // control & bulk: order in async schedule
+	uint16_t capture_remain; // bytes not sent by earlier qTDs, USBHOST_CAPTURE
+	uint8_t  unused7[2];
+#if defined(USBHOST_PIPE_STATS)
+	uint32_t stat_transfers;
+	uint32_t stat_bytes;
+	uint32_t stat_short_packets;
+	uint32_t stat_latency[20];
+	uint32_t unused6;
+#endif
+} __attribute__ ((aligned(32)));
 
 // Transfer_t represents a single transaction on the USB bus.
 // The first portion is an EHCI qTD structure.  Transfer_t are
@@ -242,7 +364,12 @@ struct Pipe_struct {
 // and placed on ECHI Queue Heads.  When the ECHI interrupt
 // occurs, the followup lists are used to find the Transfer_t
 // in memory.  Callbacks are made, and then the Transfer_t are
-// returned to the memory pool.
+// returned to the memory pool.  The qTD is exactly the first 32 byte
+// cache line and the rest is only used by software, so on Teensy 4.x
+// they never share a cache line, and free Transfer_t are linked by
+// next_followup without writing to the qTD.  Like Pipe_t, Transfer_t
+// must not be in cached memory (DMAMEM), as the EHCI writes to both.
+// Ordinary static variables are in DTCM, which is never cached.
 struct Transfer_struct {
 	// Queue Element Transfer Descriptor (qTD), EHCI pg 40-45
 	struct {  // must be aligned to 32 byte boundary
@@ -261,9 +388,48 @@ struct Transfer_struct {
 	// set in the last Transfer_t of the list.
 	void       *buffer;
 	uint32_t   length;
-	setup_t    setup;
+	setup_t    setup;         // bulk & interrupt: word1 is the flags
 	USBDriver  *driver;
-};
+#if defined(USBHOST_PIPE_STATS)
+	uint32_t   queued_cycles; // ARM_DWT_CYCCNT when queued
+	uint32_t   qtd_length;    // bytes this qTD was given to transfer
+	uint32_t   unused[6];
+#endif
+} __attribute__ ((aligned(32)));
+
+// Isochronous_t holds 1 frame (1 ms) of isochronous data for a pipe.
+// The first portion is an EHCI iTD for high speed devices, or siTD for
+// full speed devices behind a hub's transaction translator.  Each pipe
+// uses a ring of these, which are reused for later frames after the
+// driver's callback has processed the data.  Packets are stored in the
+// buffer consecutively, in the order of their microframes.
+struct Isochronous_struct {
+	union {  // must be aligned to 32 byte boundary
+		// High-Speed Isochronous Transfer Descriptor (iTD), EHCI pg 30-35
+		struct {
+			volatile uint32_t next;
+			volatile uint32_t transaction[8];
+			volatile uint32_t buffer[7];
+		} itd;
+		// Split Transaction Isochronous Transfer Descriptor (siTD), EHCI pg 36-40
+		struct {
+			volatile uint32_t next;
+			volatile uint32_t capabilities;
+			volatile uint32_t schedule;
+			volatile uint32_t state;
+			volatile uint32_t buffer[2];
+			volatile uint32_t back;
+		} sitd;
+	};
+	Isochronous_t *next; // ring of descriptors owned by the pipe
+	Pipe_t     *pipe;
+	void       *buffer;
+	USBDriver  *driver;
+	uint16_t   frame;  // periodic schedule slot, 0 to PERIODIC_LIST_SIZE-1
+	uint16_t   length; // iTD: bytes per packet, siTD: bytes to transfer
+	uint32_t   flags;  // start_Isochronous flags
+	uint32_t   unused[2];
+} __attribute__ ((aligned(32)));
 
 
 /************************************************/
@@ -275,44 +441,140 @@ public:
 	static void begin();
 	static void Task();
 	static void countFree(uint32_t &devices, uint32_t &pipes, uint32_t &trans, uint32_t &strs);
+	static void poolStats(poolstats_t &devices, poolstats_t &pipes, poolstats_t &trans,
+		poolstats_t &strs, bool reset=false);
+	// The EHCI waits up to 1 (the default), 2, 4, 8, 16, 32 or 64
+	// microframes of 125 us before interrupting for completed transfers.
+	// Waiting longer means fewer interrupts, but more latency.  Zero
+	// means adaptive, where busy bulk pipes raise it, up to 1 ms.
+	static void setInterruptCoalescing(uint32_t microframes);
+	static void interruptStats(irqstats_t &stats, bool reset=false);
+	// Result of the periodic bandwidth check for the most recently
+	// created interrupt or isochronous pipe.  When new_Pipe() fails,
+	// this tells why the pipe could not fit into the schedule.
+	enum bandwidth_result_t {
+		BANDWIDTH_OK = 0,
+		BANDWIDTH_UFRAME_FULL,   // high speed uframes are 80% periodic
+		BANDWIDTH_TT_UFRAME,     // TT has no uframe with 188 bytes free
+		BANDWIDTH_TT_FRAME,      // TT full speed frame budget (1157 bytes) used
+		BANDWIDTH_TT_TABLES,     // too many hubs with TTs, see USBHOST_TT_COUNT
+		BANDWIDTH_PACKET_SIZE    // packet too large for split transactions
+	};
+	static bandwidth_result_t bandwidthResult() { return bandwidth_result; }
+#if defined(USBHOST_PIPE_STATS)
+	// Add up the statistics of all pipes of a device, optionally
+	// resetting them to zero.  Returns false if dev is NULL.
+	static bool pipeStats(Device_t *dev, pipestats_t &stats, bool reset=false);
+#endif
+	// Event codes in the trace buffer.  extras/trace_decode uses these
+	// same numbers, so only add new ones at the end.
+	enum trace_event_t {
+		TRACE_ISR_ENTER = 1, // value = USBSTS
+		TRACE_ISR_EXIT,
+		TRACE_PORT_CHANGE,   // value = PORTSC1
+		TRACE_QUEUE,         // ptr = first qTD, value = its token
+		TRACE_COMPLETE,      // ptr = qTD, value = token
+		TRACE_HALT,          // ptr = pipe, value = token
+		TRACE_ISOCHRONOUS,   // ptr = iTD or siTD, value = frame
+		TRACE_TIMER,         // ptr = USBDriverTimer
+		TRACE_ENUMERATION    // ptr = device, value = enum_state
+	};
+#if defined(USBHOST_TRACE)
+	static void traceDump(Print &out);
+	static void traceClear();
+protected:
+	static void trace_(trace_event_t event, const void *ptr, uint32_t value);
+	friend class USBDriverTimer; // for trace_
+#endif
+#if defined(USBHOST_CAPTURE)
+public:
+	// Record transfers for Wireshark.  After captureStart(), call
+	// captureWrite() often, to save them to a File or send to Serial.
+	static void captureStart();
+	static void captureStop();
+	static uint32_t captureWrite(Print &out);
+	static uint32_t captureDropped();
+protected:
+	static void capture_submit(const Transfer_t *transfer);
+	static void capture_complete(const Transfer_t *transfer, uint32_t remain,
+		uint32_t token);
+#endif
+public:
+	// queue_Data_Transfer & start_Isochronous flags
+	enum { TRANSFER_UNCACHED=1 }; // no cache maintenance, buffer isn't cached
 protected:
 	static Pipe_t * new_Pipe(Device_t *dev, uint32_t type, uint32_t endpoint,
 		uint32_t direction, uint32_t maxlen, uint32_t interval=0);
 	static bool queue_Control_Transfer(Device_t *dev, setup_t *setup,
 		void *buf, USBDriver *driver);
 	static bool queue_Data_Transfer(Pipe_t *pipe, void *buffer,
-		uint32_t len, USBDriver *driver);
-	static Device_t * new_Device(uint32_t speed, uint32_t hub_addr, uint32_t hub_port);
+		uint32_t len, USBDriver *driver, uint32_t flags=0);
+	static bool queue_Data_Transfer(Pipe_t *pipe, const segment_t *segments,
+		uint32_t count, USBDriver *driver, uint32_t flags=0);
+	static void defer_Callbacks(Pipe_t *pipe, bool deferred=true);
+	static void set_NAK_Reload(Pipe_t *pipe, uint32_t nak_reload);
+	static void set_Priority(Pipe_t *pipe, int32_t priority);
+	static bool start_Persistent(Pipe_t *pipe, void *buffer, uint32_t len,
+		uint32_t count, USBDriver *driver);
+	static bool start_Isochronous(Pipe_t *pipe, void *buffer, uint32_t frames,
+		USBDriver *driver, uint32_t flags=0);
+	static uint32_t isochronous_Length(const Isochronous_t *iso, uint32_t packet);
+	static uint32_t isochronous_Status(const Isochronous_t *iso, uint32_t packet);
+	static void isochronous_Set_Length(Isochronous_t *iso, uint32_t packet, uint32_t len);
+	static Device_t * new_Device(uint32_t speed, uint32_t hub_addr, uint32_t hub_port,
+		const Device_t *hub, USBHostController *controller=NULL);
 	static void disconnect_Device(Device_t *dev);
 	static void enumeration(const Transfer_t *transfer);
 	static void driver_ready_for_device(USBDriver *driver);
+	// Transfer_t normally come from the queue functions.  These may be
+	// called from any code, interrupt or not, see memory.cpp.
+	static Transfer_t * allocate_Transfer(USBDriver *driver=NULL);
+	static void free_Transfer(Transfer_t *q);
 	static volatile bool enumeration_busy;
+	// during claim(), for poolStats, and whose Transfer_t count new pipes'
+	// halt qTDs go in.  Drivers making pipes later may set it meanwhile.
+	static USBDriver *claiming_driver;
 public: // Maybe others may want/need to contribute memory example HID devices may want to add transfers.
 	static void contribute_Devices(Device_t *devices, uint32_t num);
 	static void contribute_Pipes(Pipe_t *pipes, uint32_t num);
-	static void contribute_Transfers(Transfer_t *transfers, uint32_t num);
+	static void contribute_Transfers(Transfer_t *transfers, uint32_t num, USBDriver *owner=NULL);
+	static void contribute_Isochronous(Isochronous_t *isochronous, uint32_t num);
 	static void contribute_String_Buffers(strbuf_t *strbuf, uint32_t num);
+	static void contribute_Periodic_Schedule(uint32_t *memory, uint32_t frames);
 private:
 	static void isr();
 	static void convertStringDescriptorToASCIIString(uint8_t string_index, Device_t *dev, const Transfer_t *transfer);
 	static void claim_drivers(Device_t *dev);
 	static uint32_t assign_address(void);
 	static bool queue_Transfer(Pipe_t *pipe, Transfer_t *transfer);
-	static void init_Device_Pipe_Transfer_memory(void);
 	static Device_t * allocate_Device(void);
 	static void delete_Pipe(Pipe_t *pipe);
 	static void free_Device(Device_t *q);
-	static Pipe_t * allocate_Pipe(void);
+	static Pipe_t * allocate_Pipe(USBDriver *driver=NULL);
 	static void free_Pipe(Pipe_t *q);
-	static Transfer_t * allocate_Transfer(void);
-	static void free_Transfer(Transfer_t *q);
+	static Isochronous_t * allocate_Isochronous(void);
+	static void free_Isochronous(Isochronous_t *q);
 	static strbuf_t * allocate_string_buffer(void);
 	static void free_string_buffer(strbuf_t *strbuf);
 	static bool allocate_interrupt_pipe_bandwidth(Pipe_t *pipe,
 		uint32_t maxlen, uint32_t interval);
 	static void add_qh_to_periodic_schedule(Pipe_t *pipe);
+	static void verify_periodic_schedule(USBHostController *hc);
+	static bandwidth_result_t bandwidth_result;
 	static bool followup_Transfer(Transfer_t *transfer);
-	static void followup_Error(void);
+	static Pipe_t * followup_Pipe(Pipe_t *pipe);
+	static Pipe_t * followup_Isochronous(Pipe_t *pipe);
+	static Pipe_t * followup_Persistent(Pipe_t *pipe);
+	static void followup_Halted_Pipe(Pipe_t *pipe, bool restart=true);
+	static void followup_Periodic_Halt(Pipe_t *pipe);
+	static void followup_Clear_Halt(const Transfer_t *transfer);
+	static void resume_Halted_Pipe(Pipe_t *pipe);
+	static void followup_Error(USBHostController *hc);
+	static bool defer_Transfer(Transfer_t *transfer);
+	static void run_deferred_callbacks(void);
+	static void free_removed_Pipe(Pipe_t *pipe);
+	static void poll_removed_periodic_Pipes(void);
+	friend class USBHostController;
 protected:
 #ifdef USBHOST_PRINT_DEBUG
 	static void print_(const Transfer_t *transfer);
@@ -395,6 +657,204 @@ protected:
 	}
 };
 
+// Record a trace event, or nothing at all without USBHOST_TRACE
+#if defined(USBHOST_TRACE)
+#define USBHOST_TRACE_EVENT(event, ptr, value) USBHost::trace_(USBHost::event, (ptr), (value))
+#else
+#define USBHOST_TRACE_EVENT(event, ptr, value)
+#endif
+
+
+/************************************************/
+/*  EHCI Controllers                            */
+/************************************************/
+
+// The EHCI registers used in host mode.  Teensy 3.6's USBHS and both of
+// Teensy 4's USB controllers have them at these same offsets.  The host
+// simulator in extras/host_sim defines USBHS_REGISTER, to see each access.
+#ifndef USBHS_REGISTER
+#define USBHS_REGISTER volatile uint32_t
+#endif
+typedef struct {
+	USBHS_REGISTER unused1[32];
+	USBHS_REGISTER GPTIMER0LD;       // 0x080
+	USBHS_REGISTER GPTIMER0CTRL;     // 0x084
+	USBHS_REGISTER GPTIMER1LD;       // 0x088
+	USBHS_REGISTER GPTIMER1CTRL;     // 0x08C
+	USBHS_REGISTER SBUSCFG;          // 0x090
+	USBHS_REGISTER unused2[43];
+	USBHS_REGISTER USBCMD;           // 0x140
+	USBHS_REGISTER USBSTS;           // 0x144
+	USBHS_REGISTER USBINTR;          // 0x148
+	USBHS_REGISTER FRINDEX;          // 0x14C
+	USBHS_REGISTER unused3;
+	USBHS_REGISTER PERIODICLISTBASE; // 0x154
+	USBHS_REGISTER ASYNCLISTADDR;    // 0x158
+	USBHS_REGISTER unused4[10];
+	USBHS_REGISTER PORTSC1;          // 0x184
+	USBHS_REGISTER unused5[8];
+	USBHS_REGISTER USBMODE;          // 0x1A8
+} USBHS_t;
+
+typedef struct ehci_schedule_struct ehci_schedule_t; // see ehci.cpp
+typedef struct periodic_anchor_struct periodic_anchor_t;
+
+// The periodic schedule's anchor QHs (see ehci.cpp) are a tree with at
+// most PERIODIC_ANCHOR_LEAVES leaves, so a frame list longer than twice
+// that costs only its 4 byte pointers.
+#define PERIODIC_ANCHOR_LEAVES 32
+#define PERIODIC_ANCHORS(frames) \
+	((((frames) / 2 < PERIODIC_ANCHOR_LEAVES) ? (frames) / 2 : PERIODIC_ANCHOR_LEAVES) * 2 - 1)
+
+// Each USBHostController runs one EHCI, with its own schedule, interrupt
+// and root port.  USBHost::begin() starts the default one, which is the
+// only one on Teensy 3.6.  Teensy 4 also has USB1, normally Teensy's own
+// USB port.  With Tools > USB Type set to "No USB" and USBHOST_CONTROLLERS
+// set to 2, it can be a second host port:
+//
+//   USBHost myusb;             // USB2, the usual host port
+//   USBHostController usb1(1); // USB1
+//   ...
+//   myusb.begin();
+//   usb1.begin();
+//
+// The controllers share the memory pools, drivers and Task().  Drivers
+// bind to devices on any of them, and their callbacks run from the
+// interrupt of the controller the device is connected to.
+class USBHostController {
+public:
+	// Teensy 4: 1 for USB1, 2 for USB2.  Teensy 3.6 has only USBHS.
+	USBHostController(uint32_t number);
+	// Any EHCI with these registers, interrupting on irq
+	USBHostController(USBHS_t *registers, uint32_t irq, uint32_t number=0);
+	// Returns false if no schedule memory is left for this controller
+	bool begin();
+	Device_t * rootDevice() { return rootdev; }
+private:
+	void phy_begin();
+	void disconnect_detect(bool on);
+	static void set_itc(uint32_t microframes);
+	static void adapt_coalescing();
+	void isr();
+	void add_to_async_schedule(Pipe_t *pipe);
+	void add_to_async_followup_list(Pipe_t *pipe);
+	void remove_from_async_followup_list(Pipe_t *pipe);
+	void add_to_periodic_followup_list(Pipe_t *pipe);
+	void remove_from_periodic_followup_list(Pipe_t *pipe);
+	void free_removed_periodic_Pipes();
+	volatile uint32_t * periodic_qh_link(uint32_t frame);
+	volatile uint32_t * periodic_anchor_link(uint32_t interval, uint32_t offset);
+	uint32_t periodic_anchor_next(uint32_t interval, uint32_t offset);
+	bool is_periodic_anchor(uint32_t num);
+	uint32_t periodic_level(uint32_t interval);
+	uint8_t * bandwidth_node(uint32_t interval, uint32_t offset);
+	uint32_t bandwidth_own(uint32_t interval, uint32_t offset, uint32_t j);
+	uint32_t bandwidth_worst(uint32_t interval, uint32_t offset, const uint8_t *load);
+	void bandwidth_update(uint32_t interval, uint32_t offset, const uint8_t *load, bool add);
+	void link_Isochronous(Pipe_t *pipe, Isochronous_t *iso);
+	void unlink_Isochronous(Isochronous_t *iso);
+	USBHS_t  *regs;
+	uint8_t  irq;
+	uint8_t  number;
+	uint8_t  port_state;
+	bool     irq_deferred;   // masked while IRQ_USBHS was, see USBHost::isr()
+	Device_t *rootdev;       // device on the root port, or NULL
+	USBHostController *next; // list of running controllers
+	uint32_t *periodictable; // NULL until begin()
+	periodic_anchor_t *anchor; // PERIODIC_ANCHORS(periodic_size) of them
+	uint16_t periodic_size;  // frames in periodictable
+	uint16_t anchor_leaves;  // slowest anchor interval, below periodic_size
+	ehci_schedule_t *schedule;
+	Pipe_t   *async_followup_first;
+	Pipe_t   *async_followup_last;
+	Pipe_t   *periodic_followup_first;
+	Pipe_t   *periodic_followup_last;
+	Pipe_t   *async_removed_doorbell;
+	Pipe_t   *async_removed_waiting;
+	Pipe_t   *periodic_removed_first;
+	Pipe_t   *periodic_removed_last;
+	Pipe_t   async_head __attribute__ ((aligned(32)));
+	// Memory for the device on the root port and its enumeration, given
+	// to the pools at begin(), so each controller can always enumerate:
+	// endpoint 0's halt qTD, the status qTD of the control transfer whose
+	// callback queues the next, and that one's setup, data & status
+	Pipe_t   root_pipe __attribute__ ((aligned(32)));
+	Transfer_t root_transfers[5] __attribute__ ((aligned(32)));
+	Device_t root_device;
+	friend class USBHost;
+};
+
+
+/************************************************/
+/*  Host Memory Configuration                   */
+/************************************************/
+
+// USBHostConfig gives USBHost a stated amount of memory, in addition to
+// what the drivers contribute.  Create 1 instance, like the drivers,
+// near the beginning of your program.  Don't put it in DMAMEM, as the
+// EHCI needs Pipe_t and Transfer_t in memory which isn't cached.
+//
+//   USBHostConfig<2, 12, 40, 2, 64> myusbmemory; // devices, pipes, transfers, strings, frames
+//
+// These transfers aren't reserved for any driver.  They add to the ones
+// all drivers may borrow beyond their own, and enumeration uses them too.
+// PERIODIC_SIZE, if not 0, replaces the default periodic schedule (see
+// USBHS_PERIODIC_LIST_SIZE in ehci.cpp) of the first controller started,
+// which sets how slowly interrupt endpoints may be polled: 8 to 1024 ms.
+// The frame list uses 4 bytes per frame and must be 4096 byte aligned.
+// Its tree anchors add 64 bytes per frame, up to 4032 bytes at 64 frames.
+//
+// Arduino's memory summary includes all of it.  MEMORY_SIZE is the total
+// bytes, which a static_assert can check against a budget:
+//
+//   static_assert(decltype(myusbmemory)::MEMORY_SIZE <= 8192, "too much USB");
+//
+#if defined(USBHOST_PRINT_MEMORY_BUDGET)
+template <uint32_t BYTES> __attribute__((deprecated("this is the USB host memory, not an error")))
+inline void USBHostConfig_memory_bytes() { }
+#endif
+template <uint16_t FRAMES> struct USBHostConfig_periodic {
+	enum { SIZE = FRAMES * 4 + PERIODIC_ANCHORS(FRAMES) * 64 }; // frame list & anchor QHs
+	uint32_t memory[SIZE / 4] __attribute__ ((aligned(4096)));
+	void contribute() { USBHost::contribute_Periodic_Schedule(memory, FRAMES); }
+};
+template <> struct USBHostConfig_periodic<0> {
+	enum { SIZE = 0 };
+	void contribute() { }
+};
+template <uint16_t DEVICES, uint16_t PIPES, uint16_t TRANSFERS, uint16_t STRINGS=0,
+	uint16_t PERIODIC_SIZE=0>
+class USBHostConfig {
+	static_assert(sizeof(Pipe_t) % 32 == 0, "Pipe_t must be a multiple of 32 bytes");
+	static_assert(sizeof(Transfer_t) % 32 == 0, "Transfer_t must be a multiple of 32 bytes");
+	static_assert(sizeof(Isochronous_t) % 32 == 0, "Isochronous_t must be a multiple of 32 bytes");
+	static_assert(DEVICES > 0 && PIPES > 0 && TRANSFERS > 0,
+		"USBHostConfig needs at least 1 each of devices, pipes & transfers");
+	static_assert(PERIODIC_SIZE == 0 || (PERIODIC_SIZE >= 8 && PERIODIC_SIZE <= 1024
+		&& (PERIODIC_SIZE & (PERIODIC_SIZE - 1)) == 0),
+		"USBHostConfig periodic size must be 0 or a power of 2, 8 to 1024");
+public:
+	enum { MEMORY_SIZE = sizeof(Pipe_t) * PIPES + sizeof(Transfer_t) * TRANSFERS
+		+ sizeof(Device_t) * DEVICES + sizeof(strbuf_t) * STRINGS
+		+ USBHostConfig_periodic<PERIODIC_SIZE>::SIZE };
+	USBHostConfig() {
+		#if defined(USBHOST_PRINT_MEMORY_BUDGET)
+		USBHostConfig_memory_bytes<MEMORY_SIZE>();
+		#endif
+		USBHost::contribute_Pipes(pipes, PIPES);
+		USBHost::contribute_Transfers(transfers, TRANSFERS);
+		USBHost::contribute_Devices(devices, DEVICES);
+		USBHost::contribute_String_Buffers(strbufs, STRINGS);
+		periodic.contribute();
+	}
+private:
+	USBHostConfig_periodic<PERIODIC_SIZE> periodic; // first, for its alignment
+	Pipe_t pipes[PIPES] __attribute__ ((aligned(32)));
+	Transfer_t transfers[TRANSFERS] __attribute__ ((aligned(32)));
+	Device_t devices[DEVICES];
+	strbuf_t strbufs[STRINGS ? STRINGS : 1];
+};
+
 
 /************************************************/
 /*  USB Device Driver Common Base Class         */
@@ -407,6 +867,13 @@ public:
 		Device_t *dev = *(Device_t * volatile *)&device;
 		return dev != nullptr;
 	}
+#if defined(USBHOST_PIPE_STATS)
+	// statistics for all pipes of the device this driver is using
+	using USBHost::pipeStats;
+	bool pipeStats(pipestats_t &stats, bool reset=false) {
+		return USBHost::pipeStats(*(Device_t * volatile *)&device, stats, reset);
+	}
+#endif
 	uint16_t idVendor() {
 		Device_t *dev = *(Device_t * volatile *)&device;
 		return (dev != nullptr) ? dev->idVendor : 0;
@@ -431,7 +898,7 @@ public:
 		return &dev->strbuf->buffer[dev->strbuf->iStrings[strbuf_t::STR_ID_SERIAL]];
 	}
 protected:
-	USBDriver() : next(NULL), device(NULL) {}
+	USBDriver() : next(NULL), device(NULL), transfers_reserved(0), transfers_used(0) {}
 	// Check if a driver wishes to claim a device or interface or group
 	// of interfaces within a device.  When this function returns true,
 	// the driver is considered bound or loaded for that device.  When
@@ -481,7 +948,13 @@ protected:
 	// wish to claim any device or interface (eg, if getting data
 	// from the HID parser).
 	Device_t *device;
+
+	// Transfer_t this driver contributed, which only it may use, and the
+	// number it is using now, including any borrowed beyond those.
+	uint16_t transfers_reserved;
+	uint16_t transfers_used;
 	friend class USBHost;
+	friend class USBDriverTimer; // for timer_event
 };
 
 // Device drivers may create these timer objects to schedule a timer call
@@ -492,18 +965,26 @@ public:
 	USBDriverTimer(USBHIDInput *hd) : driver(nullptr), hidinput(hd) { }
 
 	void init(USBDriver *d) { driver = d; };
+	// 100 us to 26 seconds, with the default USBHOST_TIMER_TICK.  Longer
+	// times are not an error, but fire early, after about 26 seconds.
 	void start(uint32_t microseconds);
 	void stop();
 	void *pointer;
 	uint32_t integer;
 	uint32_t started_micros; // testing only
 private:
+	void add_to_wheel();
+	void remove_from_wheel();
+	static void run_wheel(uint32_t tick);
+	static void schedule_wheel();
 	USBDriver      *driver;
 	USBHIDInput    *hidinput;
-	uint32_t       usec;
+	uint32_t       expires;  // tick when this timer fires
+	uint16_t       slot = 0; // wheel slot + 1, or zero when not active
 	USBDriverTimer *next;
 	USBDriverTimer *prev;
 	friend class USBHost;
+	friend class USBHostController;
 };
 
 // Device drivers may inherit from this base class, if they wish to receive
@@ -625,7 +1106,11 @@ protected:
 private:
 	Device_t mydevices[MAXPORTS];
 	Pipe_t mypipes[2] __attribute__ ((aligned(32)));
-	Transfer_t mytransfers[4] __attribute__ ((aligned(32)));
+	// at most: the change pipe's halt qTD, the change transfer completing
+	// while its callback queues the next, and 1 control transfer (3 qTDs)
+	Transfer_t mytransfers[6] __attribute__ ((aligned(32)));
+	// not reserved, for endpoint 0's halt qTD of each device on our ports
+	Transfer_t mydevice_halts[MAXPORTS] __attribute__ ((aligned(32)));
 	strbuf_t mystring_bufs[1];
 	USBDriverTimer debouncetimer;
 	USBDriverTimer resettimer;
@@ -658,6 +1143,7 @@ private:
 	portbitmask_t send_pending_setreset;
 	portbitmask_t debounce_in_use;
 	static volatile bool reset_busy;
+	friend class USBHostController; // root ports also use reset_busy
 };
 
 //--------------------------------------------------------------------------
@@ -710,8 +1196,7 @@ private:
 	uint16_t out_size;
 	setup_t setup;
 	uint8_t descriptor[800];
-	uint8_t report[64];
-	uint8_t report2[64];
+	uint8_t report_ring[2][64];  // 2 reports in flight, in_size max 64
 	uint16_t descsize;
 	bool use_report_id;
 	Pipe_t mypipes[3] __attribute__ ((aligned(32)));
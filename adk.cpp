@@ -57,7 +57,7 @@ static setup_t adksetup __attribute__ ((aligned(16)));
 void ADK::init()
 {
 	contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
-	contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
+	contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t), this);
 	
 	rx_head = 0;
 	rx_tail = 0;
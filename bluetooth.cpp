@@ -201,7 +201,7 @@ BluetoothController::product_vendor_mapping_t BluetoothController::pid_vid_mappi
 void BluetoothController::init()
 {
 	contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
-	contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
+	contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t), this);
 	contribute_String_Buffers(mystring_bufs, sizeof(mystring_bufs)/sizeof(strbuf_t));
 	driver_ready_for_device(this);
 }
@@ -300,6 +300,9 @@ bool BluetoothController::claim(Device_t *dev, int type, const uint8_t *descript
 		// Free other pipes...
 		return false;
 	}
+	// ACL data is mostly idle, so don't slow down other bulk pipes
+	set_NAK_Reload(rx2pipe_, 1);
+	set_Priority(rx2pipe_, -1);
 
 	rxpipe_->callback_function = rx_callback;
 	queue_Data_Transfer(rxpipe_, rxbuf_, rx_size_, this);
@@ -0,0 +1,305 @@
+/* USB EHCI Host for Teensy 3.6
+ * Copyright 2017 Paul Stoffregen (paul@pjrc.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <Arduino.h>
+#include "USBHost_t36.h"  // Read this header first for key info
+
+// Capture of USB traffic, for viewing with Wireshark.  Each transfer is
+// recorded when it's queued and again when it completes, the same way
+// Linux usbmon does, into a ring of fixed size records.  captureWrite()
+// turns them into pcapng, with usbmon's binary header, so captures from
+// a Teensy and from a PC can be compared side by side.
+
+#if defined(USBHOST_CAPTURE)
+
+#if defined(USBHOST_CAPTURE_SIZE)
+#define CAPTURE_SIZE (USBHOST_CAPTURE_SIZE) // must be a power of 2
+#else
+#define CAPTURE_SIZE  32
+#endif
+#if defined(USBHOST_CAPTURE_SNAPLEN)
+#define CAPTURE_SNAPLEN (USBHOST_CAPTURE_SNAPLEN) // max data bytes kept
+#else
+#define CAPTURE_SNAPLEN  64
+#endif
+// Recording costs time where transfers are queued and completed, which is
+// usually the USB interrupt.  Each record reads micros(), a few dozen
+// cycles (Teensy 3.6 disables interrupts meanwhile), and copies up to
+// CAPTURE_SNAPLEN bytes of data.  For a completed IN transfer, that data
+// was just written by DMA, so the copy reads RAM rather than the cache.
+// A larger snap length slows every data transfer's interrupt, and uses
+// CAPTURE_SIZE more bytes of RAM per byte.  While stopped, recording is
+// only a test of capture_active.
+
+typedef struct {
+	volatile uint32_t seq; // record number + 1, written last
+	uint32_t micros;
+	uint32_t id;        // Transfer_t which completes the transfer
+	uint32_t length;    // requested length ('S') or actual length ('C')
+	uint32_t datalen;   // data bytes before truncation to CAPTURE_SNAPLEN
+	int32_t  status;
+	uint8_t  type;      // 'S'=submit, 'C'=complete
+	uint8_t  xfer_type; // usbmon numbering: 0=iso, 1=interrupt, 2=control, 3=bulk
+	uint8_t  endpoint;  // bit 7 set for IN
+	uint8_t  address;
+	int8_t   flag_setup;
+	int8_t   flag_data;
+	uint16_t captured;  // bytes in data[]
+	uint8_t  setup[8];
+	uint8_t  data[CAPTURE_SNAPLEN];
+} capture_record_t;
+
+// Linux usbmon's 64 byte header, <linux/usb/mon.h> "struct mon_bin_hdr"
+// & pcap's LINKTYPE_USB_LINUX_MMAPPED.  Little endian, like ARM.
+typedef struct {
+	uint64_t id;
+	uint8_t  type;
+	uint8_t  xfer_type;
+	uint8_t  epnum;
+	uint8_t  devnum;
+	uint16_t busnum;
+	int8_t   flag_setup;
+	int8_t   flag_data;
+	int64_t  ts_sec;
+	int32_t  ts_usec;
+	int32_t  status;
+	uint32_t length;
+	uint32_t len_cap;
+	uint8_t  setup[8];
+	int32_t  interval;
+	int32_t  start_frame;
+	uint32_t xfer_flags;
+	uint32_t ndesc;
+} usbmon_header_t;
+static_assert(sizeof(usbmon_header_t) == 64, "usbmon header must be 64 bytes");
+
+#define LINKTYPE_USB_LINUX_MMAPPED  220
+
+// Linux error numbers, as usbmon would show.  These differ from newlib's
+// errno.h, so they have their own names.
+#define LINUX_EPIPE        32  // stall
+#define LINUX_ENOSR        63  // buffer overrun (IN)
+#define LINUX_ECOMM        70  // buffer underrun (OUT)
+#define LINUX_EPROTO       71  // transaction error
+#define LINUX_EOVERFLOW    75  // babble
+#define LINUX_ECONNRESET  104  // cancelled
+#define LINUX_EINPROGRESS 115  // submitted, not yet completed
+
+// Records are added by any code, interrupt or not, and removed only by
+// captureWrite().  A record is claimed with an atomic compare & exchange
+// (LDREX/STREX) of capture_head, so nothing ever waits.  If the ring is
+// full, the record is dropped and counted.
+static capture_record_t capture_ring[CAPTURE_SIZE];
+static uint32_t capture_head=0;
+static uint32_t capture_tail=0;
+static uint32_t capture_dropped=0;
+static volatile bool capture_active=false;
+static bool capture_header=false;
+static uint32_t capture_last_micros;
+static uint64_t capture_time;
+
+static capture_record_t * capture_claim()
+{
+	uint32_t head = __atomic_load_n(&capture_head, __ATOMIC_RELAXED);
+	do {
+		if (head - __atomic_load_n(&capture_tail, __ATOMIC_ACQUIRE) >= CAPTURE_SIZE) {
+			__atomic_fetch_add(&capture_dropped, 1, __ATOMIC_RELAXED);
+			return NULL;
+		}
+	} while (!__atomic_compare_exchange_n(&capture_head, &head, head + 1,
+		true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+	capture_record_t *r = &capture_ring[head & (CAPTURE_SIZE - 1)];
+	r->seq = head; // not head + 1 until finished
+	r->micros = micros();
+	return r;
+}
+
+static void capture_fill(capture_record_t *r, const Transfer_t *transfer,
+	uint8_t type, uint32_t length, int32_t status)
+{
+	const Pipe_t *pipe = transfer->pipe;
+	static const uint8_t xfer_type[4] = {2, 0, 3, 1};
+	uint32_t endpoint = (pipe->qh.capabilities[0] >> 8) & 15;
+	bool in = (pipe->type == 0) ? (transfer->setup.bmRequestType & 0x80) : pipe->direction;
+	r->type = type;
+	r->xfer_type = xfer_type[pipe->type & 3];
+	r->endpoint = endpoint | (in ? 0x80 : 0);
+	r->address = pipe->device->address;
+	r->id = (uint32_t)transfer;
+	r->length = length;
+	r->status = status;
+	if (type == 'S' && pipe->type == 0) {
+		r->flag_setup = 0; // 0 means setup is present
+		memcpy(r->setup, &transfer->setup, 8);
+	} else {
+		r->flag_setup = '-';
+		memset(r->setup, 0, 8);
+	}
+	// data goes OUT with the submit, and comes IN with the completion
+	r->datalen = 0;
+	r->captured = 0;
+	if (in == (type == 'C')) {
+		r->datalen = length;
+		r->captured = (length < CAPTURE_SNAPLEN) ? length : CAPTURE_SNAPLEN;
+		if (r->captured) memcpy(r->data, transfer->buffer, r->captured);
+		r->flag_data = 0; // 0 means data is present
+	} else {
+		r->flag_data = (type == 'S') ? '<' : '>';
+	}
+	__atomic_store_n(&r->seq, __atomic_load_n(&r->seq, __ATOMIC_RELAXED) + 1,
+		__ATOMIC_RELEASE);
+}
+
+// A transfer is about to be given to the EHCI.  The Transfer_t is the one
+// which completes the transfer, since it has the buffer, length & setup.
+void USBHost::capture_submit(const Transfer_t *transfer)
+{
+	if (!capture_active) return;
+	capture_record_t *r = capture_claim();
+	if (r) capture_fill(r, transfer, 'S', transfer->length, -LINUX_EINPROGRESS);
+}
+
+// A transfer completed, or was ended by a halt, or cancelled.  remain is
+// the number of bytes not transferred, token is the qTD which ended it.
+void USBHost::capture_complete(const Transfer_t *transfer, uint32_t remain,
+	uint32_t token)
+{
+	if (!capture_active) return;
+	int32_t status = 0;
+	if (token & 0x80) {
+		status = -LINUX_ECONNRESET;
+	} else if (token & 0x40) {
+		if (token & 0x20) {
+			status = (((token >> 8) & 3) == 1) ? -LINUX_ENOSR : -LINUX_ECOMM;
+		} else if (token & 0x10) {
+			status = -LINUX_EOVERFLOW;
+		} else if (token & 0x08) {
+			status = -LINUX_EPROTO;
+		} else {
+			status = -LINUX_EPIPE;
+		}
+	}
+	capture_record_t *r = capture_claim();
+	if (!r) return;
+	uint32_t length = (transfer->length > remain) ? transfer->length - remain : 0;
+	capture_fill(r, transfer, 'C', length, status);
+}
+
+void USBHost::captureStart()
+{
+	__disable_irq();
+	memset(capture_ring, 0, sizeof(capture_ring));
+	capture_head = 0;
+	capture_tail = 0;
+	capture_dropped = 0;
+	capture_header = true;
+	capture_last_micros = micros();
+	capture_time = capture_last_micros;
+	capture_active = true;
+	__enable_irq();
+}
+
+void USBHost::captureStop()
+{
+	capture_active = false;
+}
+
+uint32_t USBHost::captureDropped()
+{
+	return capture_dropped;
+}
+
+static void capture_write_block(Print &out, uint32_t type, const void *body,
+	uint32_t len, const void *data, uint32_t datalen)
+{
+	static const uint8_t zero[3] = {0, 0, 0};
+	uint32_t pad = (4 - (datalen & 3)) & 3;
+	uint32_t total = 12 + len + datalen + pad;
+	out.write((const uint8_t *)&type, 4);
+	out.write((const uint8_t *)&total, 4);
+	out.write((const uint8_t *)body, len);
+	if (datalen) out.write((const uint8_t *)data, datalen);
+	if (pad) out.write(zero, pad);
+	out.write((const uint8_t *)&total, 4);
+}
+
+// Write all finished records to a File, Serial or any other Print, as
+// pcapng.  The first call after captureStart() writes the file headers.
+// Returns the number of records written.  Call this often enough that the
+// ring doesn't fill, and from only 1 place, never from an interrupt.
+uint32_t USBHost::captureWrite(Print &out)
+{
+	if (capture_header) {
+		// Section Header Block: byte order magic, version 1.0, unknown length
+		const uint32_t shb[4] = {0x1A2B3C4D, 0x00000001, 0xFFFFFFFF, 0xFFFFFFFF};
+		capture_write_block(out, 0x0A0D0D0A, shb, sizeof(shb), NULL, 0);
+		// Interface Description Block: link type & snap length, microseconds
+		const uint32_t idb[2] = {LINKTYPE_USB_LINUX_MMAPPED,
+			sizeof(usbmon_header_t) + CAPTURE_SNAPLEN};
+		capture_write_block(out, 1, idb, sizeof(idb), NULL, 0);
+		capture_header = false;
+	}
+	uint32_t count = 0;
+	while (1) {
+		uint32_t tail = capture_tail;
+		if (tail == __atomic_load_n(&capture_head, __ATOMIC_ACQUIRE)) break;
+		capture_record_t *r = &capture_ring[tail & (CAPTURE_SIZE - 1)];
+		if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != tail + 1) break;
+		// copy the record, so its slot can be reused while we write
+		capture_record_t rec;
+		memcpy(&rec, r, sizeof(rec));
+		__atomic_store_n(&capture_tail, tail + 1, __ATOMIC_RELEASE);
+		// interrupts may record slightly out of order, so this keeps
+		// the time as a signed difference rather than looking for wrap
+		capture_time += (int32_t)(rec.micros - capture_last_micros);
+		capture_last_micros = rec.micros;
+		usbmon_header_t hdr;
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.id = rec.id;
+		hdr.type = rec.type;
+		hdr.xfer_type = rec.xfer_type;
+		hdr.epnum = rec.endpoint;
+		hdr.devnum = rec.address;
+		hdr.busnum = 1;
+		hdr.flag_setup = rec.flag_setup;
+		hdr.flag_data = rec.flag_data;
+		hdr.ts_sec = capture_time / 1000000;
+		hdr.ts_usec = capture_time % 1000000;
+		hdr.status = rec.status;
+		hdr.length = rec.length;
+		hdr.len_cap = rec.captured;
+		memcpy(hdr.setup, rec.setup, 8);
+		// Enhanced Packet Block: interface 0, time, captured & original length
+		uint8_t epb[20 + sizeof(hdr)];
+		const uint32_t info[5] = {0, (uint32_t)(capture_time >> 32),
+			(uint32_t)capture_time, sizeof(hdr) + rec.captured,
+			sizeof(hdr) + rec.datalen};
+		memcpy(epb, info, 20);
+		memcpy(epb + 20, &hdr, sizeof(hdr));
+		capture_write_block(out, 6, epb, sizeof(epb), rec.data, rec.captured);
+		count++;
+	}
+	return count;
+}
+
+#endif
@@ -41,6 +41,10 @@
 //     complete, a driver-supplied callback function is called to notify
 //     the driver.
 //
+//   Isochronous_t: Isochronous pipes stream data with these, one for
+//     each 1 ms frame.  A ring of them stays in the periodic schedule,
+//     each reused for a later frame after the driver's callback.
+//
 //   USBDriverTimer: Some drivers require timers.  These allow drivers
 //     to share the hardware timer, with each USBDriverTimer object
 //     able to schedule a callback function a configurable number of
@@ -49,63 +53,311 @@
 // In addition to these 3 services, the EHCI interrupt also responds
 // to changes on the main port, creating and deleting the root device.
 // See enumeration.cpp for all device-level code.
+//
+// Each EHCI is a USBHostController, with its own schedule and root port.
+// USBHost's functions find the controller from pipe->device->controller.
 
 // Size of the periodic list, in milliseconds.  This determines the
 // slowest rate we can poll interrupt endpoints.  Each entry uses
-// 12 bytes (4 for a pointer, 8 for bandwidth management).
+// 4 bytes, plus 64 for a periodic tree anchor up to 64 entries.
 // Supported values: 8, 16, 32, 64, 128, 256, 512, 1024
+// This is only the default, a USBHostConfig may give any of these.
 #if defined(USBHS_PERIODIC_LIST_SIZE)
 #define PERIODIC_LIST_SIZE (USBHS_PERIODIC_LIST_SIZE)
 #else
 #define PERIODIC_LIST_SIZE  32
 #endif
 
-// The EHCI periodic schedule, used for interrupt pipes/endpoints
+// Number of controllers with memory for their schedules.  Teensy 3.6
+// has only 1.  Teensy 4 can run a host port on each of its 2.
+#if defined(USBHOST_CONTROLLERS)
+#define CONTROLLERS (USBHOST_CONTROLLERS)
+#else
+#define CONTROLLERS  1
+#endif
+#if CONTROLLERS < 1 || CONTROLLERS > 2
+#error "USBHOST_CONTROLLERS must be 1 or 2"
+#endif
+
+// The EHCI periodic schedule, used for interrupt & isochronous pipes/endpoints
 static uint32_t periodictable[PERIODIC_LIST_SIZE] __attribute__ ((aligned(4096), used));
-static uint8_t  uframe_bandwidth[PERIODIC_LIST_SIZE*8];
+#if CONTROLLERS > 1
+static uint32_t periodictable2[PERIODIC_LIST_SIZE] __attribute__ ((aligned(4096), used));
+#endif
+
+// Periodic bandwidth is tracked for BANDWIDTH_FRAMES frames.  Pipes
+// polled less often are budgeted as if polled every BANDWIDTH_FRAMES,
+// which wastes very little, because slow pipes use little bandwidth.
+#if defined(USBHOST_BANDWIDTH_FRAMES)
+#define BANDWIDTH_FRAMES (USBHOST_BANDWIDTH_FRAMES)
+#elif PERIODIC_LIST_SIZE < 16
+#define BANDWIDTH_FRAMES PERIODIC_LIST_SIZE
+#else
+#define BANDWIDTH_FRAMES 16
+#endif
+
+// Bandwidth uses a tree with the same shape as the periodic schedule,
+// with a node for every interval & offset, 1 to BANDWIDTH_FRAMES.  For
+// each of the 8 uframes, a node holds the most bandwidth used in any
+// frame below it, counting only pipes at this node and slower nodes
+// below it.  So a node's own pipes use its value minus the larger of
+// its 2 children's, and the worst uframe for any new pipe is found by
+// adding the faster nodes above.  Time units: 32 bytes or 533 ns.
+
+// The periodic schedule is a tree, as in EHCI figure 4-18.  Each frame's
+// list begins with the pipes polled only in that frame, and then goes
+// through a chain of anchor QHs, one for each interval from the leaves
+// down to 1, shared by all the frames with the same offset.  The leaves
+// are at half the list size, but at most PERIODIC_ANCHOR_LEAVES, so long
+// lists don't need thousands of anchors.  Pipes polled less often than
+// that, but more often than the whole list, are polled at the leaves.
+// Anchors are always halted, so the EHCI passes through them.  Every
+// pipe is linked just after the anchor for its interval & offset, so
+// adding or removing a pipe never touches any other part of the tree.
+struct periodic_anchor_struct {  // must be aligned to 32 byte boundary
+	volatile uint32_t horizontal_link;
+	volatile uint32_t capabilities[2];
+	volatile uint32_t current;
+	volatile uint32_t next;
+	volatile uint32_t alt_next;
+	volatile uint32_t token;
+	volatile uint32_t buffer[5];
+	uint32_t unused[4];
+};
+static_assert(sizeof(periodic_anchor_t) == 64, "USBHostConfig_periodic assumes 64 byte anchors");
+static periodic_anchor_t periodic_anchors[CONTROLLERS][PERIODIC_ANCHORS(PERIODIC_LIST_SIZE)] __attribute__ ((aligned(32)));
+
+// Periodic schedules given by USBHostConfig, which the controllers use
+// instead of the ones above, in the order they're started.  Each is the
+// frame list, followed by its anchors.
+static uint32_t *periodic_memory[CONTROLLERS];
+static uint16_t periodic_memory_size[CONTROLLERS];
+static uint8_t periodic_memory_count=0;
+
+// Define USBHOST_VERIFY_SCHEDULE to check the periodic schedule tree
+// after every change.  Problems found are printed with USBHOST_PRINT_DEBUG.
+
+// Each transaction translator (TT) in a high speed hub runs its own full
+// speed periodic schedule, fed by the split transactions.  USB 2.0 11.18
+// allows each TT 188 full speed bytes per uframe (best case) and 1157
+// bytes of periodic transactions per 1 ms frame.  These tables track how
+// much of that budget is used.  A Single-TT hub has one TT for all its
+// ports, and Multi-TT hubs have one per port.
+#if defined(USBHOST_TT_COUNT)
+#define TT_COUNT (USBHOST_TT_COUNT)
+#else
+#define TT_COUNT  4
+#endif
+#define TT_UFRAME_BUDGET  188
+#define TT_FRAME_BUDGET   1157
+typedef struct {
+	uint8_t  hub_address;
+	uint8_t  tt_port;  // 0 for Single-TT hubs
+	uint16_t pipes;    // pipes budgeted on this TT, 0 = table unused
+	uint8_t  uframe_time[BANDWIDTH_FRAMES*8]; // best case bytes
+} tt_budget_t;
+
+// Each controller's bandwidth and TT budgets.  The periodic schedule tree
+// is separate, as its size may vary and its frame list must be 4096 byte
+// aligned.
+struct ehci_schedule_struct {
+	uint8_t  bandwidth_tree[BANDWIDTH_FRAMES*2-1][8];
+	tt_budget_t tt_budget[TT_COUNT];
+};
+static ehci_schedule_t schedules[CONTROLLERS] __attribute__ ((aligned(32)));
+static uint32_t * const frame_lists[CONTROLLERS] = {
+	periodictable,
+#if CONTROLLERS > 1
+	periodictable2,
+#endif
+};
+static uint8_t controllers_begun=0;
+
+// USBCMD's frame list size bits, for 8 to 1024 frames
+static uint32_t frame_list_size(uint32_t frames)
+{
+	uint32_t n = __builtin_ctz(frames);
+	if (n >= 7) return USBHS_USBCMD_FS(10 - n); // 1024, 512, 256, 128
+	return USBHS_USBCMD_FS2 | USBHS_USBCMD_FS(6 - n); // 64, 32, 16, 8
+}
+
+// All running controllers.  The first is always the one using IRQ_USBHS,
+// whose GPTIMER1 also runs the USBDriverTimer wheel for all of them.
+static USBHostController *controller_list=NULL;
+static USBHS_t *timer_regs=NULL;
+
+// The controller USBHost::begin() starts.  Teensy 3.6 has only USBHS.
+#if defined(__MK66FX1M0__)
+static USBHostController default_controller(0);
+#elif defined(__IMXRT1052__) || defined(__IMXRT1062__)
+static USBHostController default_controller(USBHS_CONTROLLER);
+#endif
 
-// State of the 1 and only physical USB host port on Teensy 3.6
-static uint8_t  port_state;
+USBHost::bandwidth_result_t USBHost::bandwidth_result = USBHost::BANDWIDTH_OK;
+
+// State of each controller's root port
 #define PORT_STATE_DISCONNECTED   0
 #define PORT_STATE_DEBOUNCE       1
 #define PORT_STATE_RESET          2
 #define PORT_STATE_RECOVERY       3
 #define PORT_STATE_ACTIVE         4
 
-// The device currently connected, or NULL when no device
-static Device_t   *rootdev=NULL;
-
-// List of all queued transfers in the asychronous schedule (control & bulk).
-// When the EHCI completes these transfers, this list is how we locate them
-// in memory.
-static Transfer_t *async_followup_first=NULL;
-static Transfer_t *async_followup_last=NULL;
-
-// List of all queued transfers in the asychronous schedule (interrupt endpoints)
-// When the EHCI completes these transfers, this list is how we locate them
-// in memory.
-static Transfer_t *periodic_followup_first=NULL;
-static Transfer_t *periodic_followup_last=NULL;
-
-// List of all pending timers.  This double linked list is stored in
-// chronological order.  Each timer is stored with the number of
-// microseconds which need to elapsed from the prior timer on this
-// list, to allow efficient servicing from the timer interrupt.
-static USBDriverTimer *active_timers=NULL;
+// Each controller lists all pipes in its asychronous schedule (control &
+// bulk) which have queued transfers.  Each pipe keeps its own list of
+// transfers, in the order they were queued.  When the EHCI completes
+// transfers, these lists are how we locate them in memory.  Only the oldest
+// transfer of each pipe needs to be checked, so the interrupt work scales
+// with the number of pipes which are busy and the transfers which actually
+// completed.  Another list has all its periodic pipes (interrupt
+// endpoints) which have queued transfers.
+
+// Completed transfers from pipes which run their callbacks from
+// USBHost::Task() rather than the interrupt.  Only isr() adds to this
+// queue and only Task() removes, so no locking is needed.
+#if defined(USBHOST_DEFERRED_QUEUE_SIZE)
+#define DEFERRED_QUEUE_SIZE (USBHOST_DEFERRED_QUEUE_SIZE)
+#else
+#define DEFERRED_QUEUE_SIZE  32
+#endif
+static Transfer_t * volatile deferred_queue[DEFERRED_QUEUE_SIZE];
+static volatile uint16_t deferred_queue_head=0;
+static volatile uint16_t deferred_queue_tail=0;
+
+// Each async schedule always has its async_head QH, so it never becomes
+// empty and is never turned off.  It has the H bit and never has any work.
+
+// Pipes removed from the schedule by delete_Pipe(), but not yet freed.
+// Async pipes wait for the Async Advance Doorbell.  A group of pipes
+// removed at the same time all share 1 doorbell, and pipes removed while
+// it is in progress are freed by the next doorbell.  Periodic pipes wait
+// for the EHCI to move on to later frames.  Each controller has its own
+// lists, as each has its own doorbell and frame index.
+
+// Interrupt pipes which halt this many times in a row, without any
+// successful transfer between, are left halted.
+#if defined(USBHOST_PIPE_ERROR_LIMIT)
+#define PIPE_ERROR_LIMIT (USBHOST_PIPE_ERROR_LIMIT)
+#else
+#define PIPE_ERROR_LIMIT  8
+#endif
 
+// Pending timers are kept in a hierarchical timer wheel.  Level 0 has
+// one slot per tick for the next 64 ticks, level 1 one slot per 64 ticks
+// and level 2 one slot per 4096 ticks.  Timers move down a level as the
+// wheel turns, so start() and stop() never search a list.  GPTIMER1 is
+// used as a one-shot, loaded for the next tick which has any work, so
+// idle ticks and far away timers cost no interrupts.
+#if defined(USBHOST_TIMER_TICK)
+#define TIMER_TICK (USBHOST_TIMER_TICK)
+#else
+#define TIMER_TICK  100 // microseconds
+#endif
+#define TIMER_SPAN  (64*64*64)
+static USBDriverTimer *timer_wheel[3*64];
+static uint16_t timer_level_count[3];
+static uint32_t timer_now=0;     // wheel has been run up to this tick
+static uint32_t timer_ticks=0;   // tick count at timer_micros
+static uint32_t timer_micros=0;
+static uint32_t timer_next=0;    // GPTIMER1 interrupts at this tick
+static bool timer_armed=false;
+static bool timer_running=false; // run_wheel is calling timer_event()
+
+// Interrupt coalescing, see setInterruptCoalescing() & adapt_coalescing()
+#define ITC_ADAPTIVE_MAX    8  // microframes, 1 ms
+#define ITC_ADAPTIVE_WINDOW 64 // milliseconds between adjustments
+static uint8_t  itc_setting=1;   // 0 = adaptive
+static uint8_t  itc_now=1;       // microframes, in USBCMD
+static bool     itc_begun=false; // begin() has written USBCMD
+static uint32_t irq_count=0;     // interrupts with completed transfers
+static uint32_t completion_count=0;
+static uint32_t async_completion_count=0; // control & bulk only
+static uint32_t irqstats_millis=0;
+static uint32_t itc_window_millis=0;
+static uint32_t itc_window_irqs=0;
+static uint32_t itc_window_async=0;
+
+// queue_Data_Transfer flag on each qTD of a scatter-gather transfer
+#define TRANSFER_SEGMENTS 0x80000000
 
 static void init_qTD(volatile Transfer_t *t, void *buf, uint32_t len,
               uint32_t pid, uint32_t data01, bool irq);
-static void add_to_async_followup_list(Transfer_t *first, Transfer_t *last);
-static void remove_from_async_followup_list(Transfer_t *transfer);
-static void add_to_periodic_followup_list(Transfer_t *first, Transfer_t *last);
-static void remove_from_periodic_followup_list(Transfer_t *transfer);
+static void rearm_qTD(Transfer_t *t);
+static void * dma_prepare(void *buf, uint32_t len, uint32_t in, bool bounce);
+static void dma_complete(const Pipe_t *pipe, const Transfer_t *t, uint32_t received);
+static void dma_complete_pages(const Pipe_t *pipe, const Transfer_t *t);
+static void dma_release(const Transfer_t *t);
+static void dma_complete_isochronous(const Pipe_t *pipe, const Isochronous_t *iso);
+#if defined(USBHOST_PIPE_STATS)
+static void stats_queued(Transfer_t *t, uint32_t token, uint32_t cycles);
+static void stats_completed(Pipe_t *pipe, const Transfer_t *t, uint32_t token);
+#endif
+static tt_budget_t * find_tt_budget(ehci_schedule_t *schedule, const Device_t *dev);
+static USBHost::bandwidth_result_t tt_check(const tt_budget_t *tt,
+	uint32_t frame, uint32_t y, uint32_t ttime);
+static void tt_update(tt_budget_t *tt, uint32_t offset, uint32_t interval,
+	uint32_t y, uint32_t ttime, bool add);
+static void init_Isochronous(Pipe_t *pipe, Isochronous_t *iso, bool first);
+static uint32_t isochronous_bytes(const Pipe_t *pipe, const Isochronous_t *iso);
 
 #define print   USBHost::print_
 #define println USBHost::println_
 
 void USBHost::begin()
 {
+#if defined(__MK66FX1M0__) || defined(__IMXRT1052__) || defined(__IMXRT1062__)
+	default_controller.begin();
+#endif
+}
+
+// USBHostConfig gives a periodic schedule: the frame list, 4096 byte
+// aligned, followed by PERIODIC_ANCHORS(frames) anchors.  The controllers use these in the
+// order they start, so this must happen before begin().
+void USBHost::contribute_Periodic_Schedule(uint32_t *memory, uint32_t frames)
+{
+	if (periodic_memory_count >= CONTROLLERS) return;
+	if (((uint32_t)memory & 4095) || frames < 8 || frames > 1024) return;
+	if (frames & (frames - 1)) return;
+	periodic_memory[periodic_memory_count] = memory;
+	periodic_memory_size[periodic_memory_count] = frames;
+	periodic_memory_count++;
+}
+
+#if defined(__MK66FX1M0__)
+USBHostController::USBHostController(uint32_t number)
+	: USBHostController((USBHS_t *)&USBHS_ID, IRQ_USBHS, 0)
+{
+}
+#elif defined(__IMXRT1052__) || defined(__IMXRT1062__)
+USBHostController::USBHostController(uint32_t number)
+	: USBHostController((number == 1) ? (USBHS_t *)&USB1_ID : (USBHS_t *)&USB2_ID,
+		(number == 1) ? IRQ_USB1 : IRQ_USB2, (number == 1) ? 1 : 2)
+{
+}
+#endif
+
+USBHostController::USBHostController(USBHS_t *registers, uint32_t irqnum, uint32_t num)
+{
+	regs = registers;
+	irq = irqnum;
+	number = num;
+	port_state = PORT_STATE_DISCONNECTED;
+	irq_deferred = false;
+	rootdev = NULL;
+	next = NULL;
+	periodictable = NULL;
+	anchor = NULL;
+	periodic_size = 0;
+	anchor_leaves = 0;
+	schedule = NULL;
+	async_followup_first = async_followup_last = NULL;
+	periodic_followup_first = periodic_followup_last = NULL;
+	async_removed_doorbell = async_removed_waiting = NULL;
+	periodic_removed_first = periodic_removed_last = NULL;
+}
+
+// Power up the PHY, and the USB host power on boards which control it
+void USBHostController::phy_begin()
+{
 #if defined(__MK66FX1M0__)
 	// Teensy 3.6 has USB host power controlled by PTE6
 	PORTE_PCR6 = PORT_PCR_MUX(1);
@@ -165,119 +417,203 @@ void USBHost::begin()
 
 
 #elif defined(__IMXRT1052__) || defined(__IMXRT1062__)
-	// Teensy 4.0 PLL & USB PHY powerup
+	// Teensy 4.0 PLL & USB PHY powerup.  Each controller has its own
+	// PLL and PHY.  Their SET and CLR registers are the next 2 words.
+	volatile uint32_t *pll = (number == 1) ? &CCM_ANALOG_PLL_USB1 : &CCM_ANALOG_PLL_USB2;
+	volatile uint32_t *phy_ctrl = (number == 1) ? &USBPHY1_CTRL : &USBPHY2_CTRL;
+	volatile uint32_t *phy_pwd = (number == 1) ? &USBPHY1_PWD : &USBPHY2_PWD;
+	volatile uint32_t *pll_set = pll + 1, *pll_clr = pll + 2;
 	while (1) {
-		uint32_t n = CCM_ANALOG_PLL_USB2;
-		if (n & CCM_ANALOG_PLL_USB2_DIV_SELECT) {
-			CCM_ANALOG_PLL_USB2_CLR = 0xC000; // get out of 528 MHz mode
-			CCM_ANALOG_PLL_USB2_SET = CCM_ANALOG_PLL_USB2_BYPASS;
-			CCM_ANALOG_PLL_USB2_CLR = CCM_ANALOG_PLL_USB2_POWER |
-				CCM_ANALOG_PLL_USB2_DIV_SELECT |
-				CCM_ANALOG_PLL_USB2_ENABLE |
-				CCM_ANALOG_PLL_USB2_EN_USB_CLKS;
+		uint32_t n = *pll; // the bits are the same for both
+		if (n & CCM_ANALOG_PLL_USB1_DIV_SELECT) {
+			*pll_clr = 0xC000; // get out of 528 MHz mode
+			*pll_set = CCM_ANALOG_PLL_USB1_BYPASS;
+			*pll_clr = CCM_ANALOG_PLL_USB1_POWER |
+				CCM_ANALOG_PLL_USB1_DIV_SELECT |
+				CCM_ANALOG_PLL_USB1_ENABLE |
+				CCM_ANALOG_PLL_USB1_EN_USB_CLKS;
 			continue;
 		}
-		if (!(n & CCM_ANALOG_PLL_USB2_ENABLE)) {
-			CCM_ANALOG_PLL_USB2_SET = CCM_ANALOG_PLL_USB2_ENABLE; // enable
+		if (!(n & CCM_ANALOG_PLL_USB1_ENABLE)) {
+			*pll_set = CCM_ANALOG_PLL_USB1_ENABLE; // enable
 			continue;
 		}
-		if (!(n & CCM_ANALOG_PLL_USB2_POWER)) {
-			CCM_ANALOG_PLL_USB2_SET = CCM_ANALOG_PLL_USB2_POWER; // power up
+		if (!(n & CCM_ANALOG_PLL_USB1_POWER)) {
+			*pll_set = CCM_ANALOG_PLL_USB1_POWER; // power up
 			continue;
 		}
-		if (!(n & CCM_ANALOG_PLL_USB2_LOCK)) {
+		if (!(n & CCM_ANALOG_PLL_USB1_LOCK)) {
 			continue; // wait for lock
 		}
-		if (n & CCM_ANALOG_PLL_USB2_BYPASS) {
-			CCM_ANALOG_PLL_USB2_CLR = CCM_ANALOG_PLL_USB2_BYPASS; // turn off bypass
+		if (n & CCM_ANALOG_PLL_USB1_BYPASS) {
+			*pll_clr = CCM_ANALOG_PLL_USB1_BYPASS; // turn off bypass
 			continue;
 		}
-		if (!(n & CCM_ANALOG_PLL_USB2_EN_USB_CLKS)) {
-			CCM_ANALOG_PLL_USB2_SET = CCM_ANALOG_PLL_USB2_EN_USB_CLKS; // enable
+		if (!(n & CCM_ANALOG_PLL_USB1_EN_USB_CLKS)) {
+			*pll_set = CCM_ANALOG_PLL_USB1_EN_USB_CLKS; // enable
 			continue;
 		}
-		println("USB2 PLL running");
-		break; // USB2 PLL up and running
+		println("USB PLL running");
+		break; // USB PLL up and running
 	}
 	// turn on USB clocks (should already be on)
 	CCM_CCGR6 |= CCM_CCGR6_USBOH3(CCM_CCGR_ON);
-	// turn on USB2 PHY
-	USBPHY2_CTRL_CLR = USBPHY_CTRL_SFTRST | USBPHY_CTRL_CLKGATE;
-	USBPHY2_CTRL_SET = USBPHY_CTRL_ENUTMILEVEL2 | USBPHY_CTRL_ENUTMILEVEL3;
-	USBPHY2_PWD = 0;
-	#ifdef ARDUINO_TEENSY41
-	IOMUXC_SW_MUX_CTL_PAD_GPIO_EMC_40 = 5;
-	IOMUXC_SW_PAD_CTL_PAD_GPIO_EMC_40 = 0x0008; // slow speed, weak 150 ohm drive
-	GPIO8_GDIR |= 1<<26;
-	GPIO8_DR_SET = 1<<26;
+	// turn on USB PHY
+	phy_ctrl[2] = USBPHY_CTRL_SFTRST | USBPHY_CTRL_CLKGATE; // CLR
+	phy_ctrl[1] = USBPHY_CTRL_ENUTMILEVEL2 | USBPHY_CTRL_ENUTMILEVEL3; // SET
+	*phy_pwd = 0;
+	#if defined(ARDUINO_TEENSY41)
+	if (number == 2) {
+		// Teensy 4.1 host port power
+		IOMUXC_SW_MUX_CTL_PAD_GPIO_EMC_40 = 5;
+		IOMUXC_SW_PAD_CTL_PAD_GPIO_EMC_40 = 0x0008; // slow speed, weak 150 ohm drive
+		GPIO8_GDIR |= 1<<26;
+		GPIO8_DR_SET = 1<<26;
+	}
 	#endif
 #endif
+}
+
+// Turn the PHY's high speed disconnect detector on or off
+void USBHostController::disconnect_detect(bool on)
+{
+#if defined(__MK66FX1M0__)
+	if (on) {
+		USBPHY_CTRL_SET = USBPHY_CTRL_ENHOSTDISCONDETECT;
+	} else {
+		USBPHY_CTRL_CLR = USBPHY_CTRL_ENHOSTDISCONDETECT;
+	}
+#elif defined(__IMXRT1052__) || defined(__IMXRT1062__)
+	volatile uint32_t *phy_ctrl = (number == 1) ? &USBPHY1_CTRL : &USBPHY2_CTRL;
+	phy_ctrl[on ? 1 : 2] = USBPHY_CTRL_ENHOSTDISCONDETECT; // SET or CLR
+#endif
+}
+
+bool USBHostController::begin()
+{
+	if (periodictable) return true; // already running
+	if (irq != IRQ_USBHS && controller_list == NULL) {
+		// the default controller must run first, as its interrupt
+		// and GPTIMER1 do work for all the others
+		USBHost::begin();
+		if (controller_list == NULL) return false;
+	}
+	if (controllers_begun >= CONTROLLERS) {
+		println("no schedule memory for this controller, see USBHOST_CONTROLLERS");
+		return false;
+	}
+	phy_begin();
 	delay(10);
 
 	// now with the PHY up and running, start up USBHS
 	//print("begin ehci reset");
-	USBHS_USBCMD |= USBHS_USBCMD_RST;
+	regs->USBCMD |= USBHS_USBCMD_RST;
 	int reset_count = 0;
-	while (USBHS_USBCMD & USBHS_USBCMD_RST) {
+	while (regs->USBCMD & USBHS_USBCMD_RST) {
 		reset_count++;
 	}
 	println(" reset waited ", reset_count);
 
-	init_Device_Pipe_Transfer_memory();
-	for (int i=0; i < PERIODIC_LIST_SIZE; i++) {
-		periodictable[i] = 1;
+	// memory to enumerate the device on this port, which never runs short
+	USBHost::contribute_Devices(&root_device, 1);
+	USBHost::contribute_Pipes(&root_pipe, 1);
+	USBHost::contribute_Transfers(root_transfers, sizeof(root_transfers)/sizeof(Transfer_t));
+	if (controllers_begun == 0) {
+#if defined(USBHOST_PIPE_STATS) || defined(USBHOST_TRACE)
+		// pipe statistics and tracing use the cycle counter
+		ARM_DEMCR |= ARM_DEMCR_TRCENA;
+		ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+#endif
+	}
+	schedule = &schedules[controllers_begun];
+	if (controllers_begun < periodic_memory_count) {
+		periodic_size = periodic_memory_size[controllers_begun];
+		periodictable = periodic_memory[controllers_begun];
+		anchor = (periodic_anchor_t *)(periodictable + periodic_size);
+	} else {
+		periodic_size = PERIODIC_LIST_SIZE;
+		periodictable = frame_lists[controllers_begun];
+		anchor = periodic_anchors[controllers_begun];
+	}
+	anchor_leaves = (PERIODIC_ANCHORS(periodic_size) + 1) / 2;
+	controllers_begun++;
+	// build the periodic schedule tree, with only anchors
+	memset(schedule, 0, sizeof(ehci_schedule_t));
+	for (uint32_t interval=1; interval <= anchor_leaves; interval <<= 1) {
+		for (uint32_t offset=0; offset < interval; offset++) {
+			periodic_anchor_t *anchor = &this->anchor[interval - 1 + offset];
+			anchor->horizontal_link = periodic_anchor_next(interval, offset);
+			anchor->capabilities[0] = 0x00002000; // high speed, address 0
+			anchor->capabilities[1] = 0x40000001; // S-mask must not be 0
+			anchor->next = 1;
+			anchor->alt_next = 1;
+			anchor->token = 0x40; // halted
+		}
 	}
-	memset(uframe_bandwidth, 0, sizeof(uframe_bandwidth));
+	for (uint32_t i=0; i < periodic_size; i++) {
+		periodictable[i] = periodic_anchor_next(periodic_size, i);
+	}
+	memset(&async_head, 0, sizeof(async_head));
+	async_head.qh.horizontal_link = (uint32_t)&(async_head.qh) | 2; // 2=QH
+	async_head.qh.capabilities[0] = 0x8000; // H bit
+	async_head.qh.next = 1;
+	async_head.qh.alt_next = 1;
+	async_head.qh.token = 0x40; // halted, EHCI will never do any work
 	port_state = PORT_STATE_DISCONNECTED;
 
-	USBHS_USB_SBUSCFG = 1; //  System Bus Interface Configuration
+	// TODO: what is the best setting for this register on IMXRT ???
+	regs->SBUSCFG = 1; //  System Bus Interface Configuration
 
 	// turn on the USBHS controller
-	//USBHS_USBMODE = USBHS_USBMODE_TXHSD(5) | USBHS_USBMODE_CM(3); // host mode
-	USBHS_USBMODE = USBHS_USBMODE_CM(3); // host mode
-	USBHS_USBINTR = 0;
-	USBHS_PERIODICLISTBASE = (uint32_t)periodictable;
-	USBHS_FRINDEX = 0;
-	USBHS_ASYNCLISTADDR = 0;
-	USBHS_USBCMD = USBHS_USBCMD_ITC(1) | USBHS_USBCMD_RS |
+	//regs->USBMODE = USBHS_USBMODE_TXHSD(5) | USBHS_USBMODE_CM(3); // host mode
+	regs->USBMODE = USBHS_USBMODE_CM(3); // host mode
+	regs->USBINTR = 0;
+	regs->PERIODICLISTBASE = (uint32_t)periodictable;
+	regs->FRINDEX = 0;
+	regs->ASYNCLISTADDR = (uint32_t)&(async_head.qh);
+	if (!itc_begun) irqstats_millis = itc_window_millis = millis();
+	itc_begun = true;
+	regs->USBCMD = USBHS_USBCMD_ITC(itc_now) | USBHS_USBCMD_RS |
 		USBHS_USBCMD_ASP(3) | USBHS_USBCMD_ASPE | USBHS_USBCMD_PSE |
-		#if PERIODIC_LIST_SIZE == 8
-		USBHS_USBCMD_FS2 | USBHS_USBCMD_FS(3);
-		#elif PERIODIC_LIST_SIZE == 16
-		USBHS_USBCMD_FS2 | USBHS_USBCMD_FS(2);
-		#elif PERIODIC_LIST_SIZE == 32
-		USBHS_USBCMD_FS2 | USBHS_USBCMD_FS(1);
-		#elif PERIODIC_LIST_SIZE == 64
-		USBHS_USBCMD_FS2 | USBHS_USBCMD_FS(0);
-		#elif PERIODIC_LIST_SIZE == 128
-		USBHS_USBCMD_FS(3);
-		#elif PERIODIC_LIST_SIZE == 256
-		USBHS_USBCMD_FS(2);
-		#elif PERIODIC_LIST_SIZE == 512
-		USBHS_USBCMD_FS(1);
-		#elif PERIODIC_LIST_SIZE == 1024
-		USBHS_USBCMD_FS(0);
-		#else
-		#error "Unsupported PERIODIC_LIST_SIZE"
-		#endif
+		USBHS_USBCMD_ASE | frame_list_size(periodic_size);
 
 	// turn on the USB port
-	//USBHS_PORTSC1 = USBHS_PORTSC_PP;
-	USBHS_PORTSC1 |= USBHS_PORTSC_PP;
-	//USBHS_PORTSC1 |= USBHS_PORTSC_PFSC; // force 12 Mbit/sec
-	//USBHS_PORTSC1 |= USBHS_PORTSC_PHCD; // phy off
+	//regs->PORTSC1 = USBHS_PORTSC_PP;
+	regs->PORTSC1 |= USBHS_PORTSC_PP;
+	//regs->PORTSC1 |= USBHS_PORTSC_PFSC; // force 12 Mbit/sec
+	//regs->PORTSC1 |= USBHS_PORTSC_PHCD; // phy off
 
-	println("USBHS_ASYNCLISTADDR = ", USBHS_ASYNCLISTADDR, HEX);
-	println("USBHS_PERIODICLISTBASE = ", USBHS_PERIODICLISTBASE, HEX);
+	println("USBHS_ASYNCLISTADDR = ", regs->ASYNCLISTADDR, HEX);
+	println("USBHS_PERIODICLISTBASE = ", regs->PERIODICLISTBASE, HEX);
 	println("periodictable = ", (uint32_t)periodictable, HEX);
 
-	// enable interrupts, after this point interruts to all the work
-	attachInterruptVector(IRQ_USBHS, isr);
-	NVIC_ENABLE_IRQ(IRQ_USBHS);
-	USBHS_USBINTR = USBHS_USBINTR_PCE | USBHS_USBINTR_TIE0 | USBHS_USBINTR_TIE1;
-	USBHS_USBINTR |= USBHS_USBINTR_UEE | USBHS_USBINTR_SEE;
-	USBHS_USBINTR |= USBHS_USBINTR_UPIE | USBHS_USBINTR_UAIE;
+	// add to the list the interrupt uses, with IRQ_USBHS's controller first
+	__disable_irq();
+	if (irq == IRQ_USBHS || controller_list == NULL) {
+		next = controller_list;
+		controller_list = this;
+	} else {
+		USBHostController *hc = controller_list;
+		while (hc->next) hc = hc->next;
+		hc->next = this;
+	}
+	if (irq == IRQ_USBHS) {
+		timer_regs = regs;
+		if (!timer_armed) USBDriverTimer::schedule_wheel(); // timers started before begin()
+	}
+	__enable_irq();
 
+	// enable interrupts, after this point interruts to all the work.  All
+	// controllers share 1 handler, at the same priority, see USBHost::isr()
+	attachInterruptVector((IRQ_NUMBER_t)irq, USBHost::isr);
+	if (irq != IRQ_USBHS) NVIC_SET_PRIORITY(irq, NVIC_GET_PRIORITY(IRQ_USBHS));
+	NVIC_ENABLE_IRQ(irq);
+	regs->USBINTR = USBHS_USBINTR_PCE | USBHS_USBINTR_TIE0;
+	if (irq == IRQ_USBHS) regs->USBINTR |= USBHS_USBINTR_TIE1;
+	regs->USBINTR |= USBHS_USBINTR_UEE | USBHS_USBINTR_SEE;
+	regs->USBINTR |= USBHS_USBINTR_UPIE | USBHS_USBINTR_UAIE;
+	regs->USBINTR |= USBHS_USBINTR_AAE;
+	return true;
 }
 
 
@@ -300,11 +636,40 @@ void USBHost::begin()
 // PORT_STATE_ACTIVE         4
 
 
+// All controllers share this interrupt handler, at the same priority, so
+// none ever interrupts another.  USBHostController::begin() gives each
+// controller's IRQ the priority of IRQ_USBHS, as Teensy's USB device code
+// may have changed USB1's.  Drivers and Task() mask IRQ_USBHS while they
+// change anything the interrupt uses.  When another controller interrupts
+// meanwhile, its IRQ is also masked and IRQ_USBHS set pending, so its work
+// waits until IRQ_USBHS is enabled again.
 void USBHost::isr()
 {
-	uint32_t stat = USBHS_USBSTS;
-	USBHS_USBSTS = stat; // clear pending interrupts
-	//stat &= USBHS_USBINTR; // mask away unwanted interrupts
+	if (!NVIC_IS_ENABLED(IRQ_USBHS)) {
+		for (USBHostController *hc = controller_list; hc; hc = hc->next) {
+			if (hc->irq != IRQ_USBHS && NVIC_IS_ENABLED(hc->irq)) {
+				NVIC_DISABLE_IRQ(hc->irq);
+				hc->irq_deferred = true;
+			}
+		}
+		NVIC_SET_PENDING(IRQ_USBHS);
+		return;
+	}
+	for (USBHostController *hc = controller_list; hc; hc = hc->next) {
+		hc->isr();
+		if (hc->irq_deferred) {
+			hc->irq_deferred = false;
+			NVIC_ENABLE_IRQ(hc->irq);
+		}
+	}
+}
+
+void USBHostController::isr()
+{
+	uint32_t stat = regs->USBSTS;
+	regs->USBSTS = stat; // clear pending interrupts
+	USBHOST_TRACE_EVENT(TRACE_ISR_ENTER, NULL, stat);
+	//stat &= regs->USBINTR; // mask away unwanted interrupts
 #if 0
 	println();
 	println("ISR: ", stat, HEX);
@@ -330,46 +695,46 @@ void USBHost::isr()
 
 	if (stat & USBHS_USBSTS_UAI) { // completed qTD(s) from the async schedule
 		//println("Async Followup");
-		//print(async_followup_first, async_followup_last);
-		Transfer_t *p = async_followup_first;
-		while (p) {
-			if (followup_Transfer(p)) {
-				// transfer completed
-				Transfer_t *next = p->next_followup;
-				remove_from_async_followup_list(p);
-				free_Transfer(p);
-				p = next;
-			} else {
-				// transfer still pending
-				p = p->next_followup;
-			}
+		Pipe_t *pipe = async_followup_first;
+		while (pipe) {
+			pipe = USBHost::followup_Pipe(pipe);
 		}
-		//print(async_followup_first, async_followup_last);
 	}
 	if (stat & USBHS_USBSTS_UPI) { // completed qTD(s) from the periodic schedule
 		//println("Periodic Followup");
-		Transfer_t *p = periodic_followup_first;
-		while (p) {
-			if (followup_Transfer(p)) {
-				// transfer completed
-				Transfer_t *next = p->next_followup;
-				remove_from_periodic_followup_list(p);
-				free_Transfer(p);
-				p = next;
-			} else {
-				// transfer still pending
-				p = p->next_followup;
-			}
+		Pipe_t *pipe = periodic_followup_first;
+		while (pipe) {
+			pipe = USBHost::followup_Pipe(pipe);
 		}
 	}
+	if (stat & (USBHS_USBSTS_UAI | USBHS_USBSTS_UPI)) {
+		irq_count++;
+		if (itc_setting == 0) adapt_coalescing();
+	}
 	if (stat & USBHS_USBSTS_UEI) {
-		followup_Error();
+		USBHost::followup_Error(this);
+	}
+	if (stat & USBHS_USBSTS_AAI) { // async advance doorbell
+		// the EHCI is no longer using any QH removed before the doorbell
+		Pipe_t *pipe = async_removed_doorbell;
+		while (pipe) {
+			Pipe_t *next = pipe->next_followup;
+			USBHost::free_removed_Pipe(pipe);
+			pipe = next;
+		}
+		async_removed_doorbell = async_removed_waiting;
+		async_removed_waiting = NULL;
+		if (async_removed_doorbell) regs->USBCMD |= USBHS_USBCMD_IAA;
+	}
+	if (periodic_removed_first) {
+		free_removed_periodic_Pipes();
 	}
 
 	if (stat & USBHS_USBSTS_PCI) { // port change detected
-		const uint32_t portstat = USBHS_PORTSC1;
+		USBHOST_TRACE_EVENT(TRACE_PORT_CHANGE, NULL, regs->PORTSC1);
+		const uint32_t portstat = regs->PORTSC1;
 		println("port change: ", portstat, HEX);
-		USBHS_PORTSC1 = portstat | (USBHS_PORTSC_OCC|USBHS_PORTSC_PEC|USBHS_PORTSC_CSC);
+		regs->PORTSC1 = portstat | (USBHS_PORTSC_OCC|USBHS_PORTSC_PEC|USBHS_PORTSC_CSC);
 		if (portstat & USBHS_PORTSC_OCC) {
 			println("  overcurrent change");
 		}
@@ -380,16 +745,20 @@ void USBHost::isr()
 				  || port_state == PORT_STATE_DEBOUNCE) {
 					// 100 ms debounce (USB 2.0: TATTDB, page 150 & 188)
 					port_state = PORT_STATE_DEBOUNCE;
-					USBHS_GPTIMER0LD = 100000; // microseconds
-					USBHS_GPTIMER0CTL =
+					regs->GPTIMER0LD = 100000; // microseconds
+					regs->GPTIMER0CTRL =
 						USBHS_GPTIMERCTL_RST | USBHS_GPTIMERCTL_RUN;
 					stat &= ~USBHS_USBSTS_TI0;
 				}
 			} else {
 				println("    disconnect");
+				if (port_state == PORT_STATE_RESET
+				  || port_state == PORT_STATE_RECOVERY) {
+					USBHub::reset_busy = false;
+				}
 				port_state = PORT_STATE_DISCONNECTED;
-				USBPHY_CTRL_CLR = USBPHY_CTRL_ENHOSTDISCONDETECT;
-				disconnect_Device(rootdev);
+				disconnect_detect(false);
+				USBHost::disconnect_Device(rootdev);
 				rootdev = NULL;
 			}
 		}
@@ -400,11 +769,11 @@ void USBHost::isr()
 			println("  port enabled");
 			port_state = PORT_STATE_RECOVERY;
 			// 10 ms reset recover (USB 2.0: TRSTRCY, page 151 & 188)
-			USBHS_GPTIMER0LD = 10000; // microseconds
-			USBHS_GPTIMER0CTL = USBHS_GPTIMERCTL_RST | USBHS_GPTIMERCTL_RUN;
-			if (USBHS_PORTSC1 & USBHS_PORTSC_HSP) {
+			regs->GPTIMER0LD = 10000; // microseconds
+			regs->GPTIMER0CTRL = USBHS_GPTIMERCTL_RST | USBHS_GPTIMERCTL_RUN;
+			if (regs->PORTSC1 & USBHS_PORTSC_HSP) {
 				// turn on high-speed disconnect detector
-				USBPHY_CTRL_SET = USBPHY_CTRL_ENHOSTDISCONDETECT;
+				disconnect_detect(true);
 			}
 		}
 		if (portstat & USBHS_PORTSC_FPR) {
@@ -415,38 +784,137 @@ void USBHost::isr()
 	if (stat & USBHS_USBSTS_TI0) { // timer 0 - used for built-in port events
 		//println("timer0");
 		if (port_state == PORT_STATE_DEBOUNCE) {
-			port_state = PORT_STATE_RESET;
-			// Since we have only 1 port, no other device can
-			// be in reset or enumeration.  If multiple ports
-			// are ever supported, we would need to remain in
-			// debounce if any other port was resetting or
-			// enumerating a device.
-			USBHS_PORTSC1 |= USBHS_PORTSC_PR; // begin reset sequence
-			println("  begin reset");
+			// Only 1 device may be in reset or enumeration at once,
+			// on any hub or controller, because they all share the
+			// enumeration buffer.  Remain in debounce while any other
+			// port is resetting or enumerating a device.
+			if (USBHub::reset_busy || USBHost::enumeration_busy) {
+				regs->GPTIMER0LD = 10000; // microseconds
+				regs->GPTIMER0CTRL = USBHS_GPTIMERCTL_RST | USBHS_GPTIMERCTL_RUN;
+			} else {
+				USBHub::reset_busy = true;
+				port_state = PORT_STATE_RESET;
+				regs->PORTSC1 |= USBHS_PORTSC_PR; // begin reset sequence
+				println("  begin reset");
+			}
 		} else if (port_state == PORT_STATE_RECOVERY) {
 			port_state = PORT_STATE_ACTIVE;
 			println("  end recovery");
 			//  HCSPARAMS  TTCTRL  page 1671
-			uint32_t speed = (USBHS_PORTSC1 >> 26) & 3;
-			rootdev = new_Device(speed, 0, 0);
+			uint32_t speed = (regs->PORTSC1 >> 26) & 3;
+			rootdev = USBHost::new_Device(speed, 0, 0, NULL, this);
+			USBHub::reset_busy = false; // new_Device() began enumeration
 		}
 	}
 	if (stat & USBHS_USBSTS_TI1) { // timer 1 - used for USBDriverTimer
 		//println("timer1");
-		USBDriverTimer *timer = active_timers;
-		if (timer) {
-			USBDriverTimer *next = timer->next;
-			active_timers = next;
-			if (next) {
-				// more timers scheduled
-				next->prev = NULL;
-				USBHS_GPTIMER1LD = next->usec - 1;
-				USBHS_GPTIMER1CTL = USBHS_GPTIMERCTL_RST | USBHS_GPTIMERCTL_RUN;
-			}
-			// TODO: call multiple timers if 0 elapsed between them?
-			timer->driver->timer_event(timer); // call driver's timer()
+		// GPTIMER1 and micros() are separate clocks, so allow this
+		// interrupt to arrive slightly before the tick it was loaded for
+		int32_t usec = micros() - timer_micros + TIMER_TICK/8;
+		if (usec >= TIMER_TICK) {
+			uint32_t n = usec / TIMER_TICK;
+			timer_ticks += n;
+			timer_micros += n * TIMER_TICK;
 		}
+		timer_armed = false;
+		USBDriverTimer::run_wheel(timer_ticks);
+		USBDriverTimer::schedule_wheel();
+	}
+	USBHOST_TRACE_EVENT(TRACE_ISR_EXIT, NULL, 0);
+}
+
+// Change the interrupt threshold of all controllers
+void USBHostController::set_itc(uint32_t microframes)
+{
+	if (microframes == itc_now) return;
+	itc_now = microframes;
+	if (!itc_begun) return; // begin() will use itc_now
+	for (USBHostController *hc = controller_list; hc; hc = hc->next) {
+		hc->regs->USBCMD = (hc->regs->USBCMD & ~USBHS_USBCMD_ITC(255))
+			| USBHS_USBCMD_ITC(microframes);
+	}
+}
+
+void USBHost::setInterruptCoalescing(uint32_t microframes)
+{
+	if (microframes > 64) microframes = 64;
+	// only powers of 2 are allowed
+	if (microframes) microframes = 1 << (31 - __builtin_clz(microframes));
+	if (!itc_begun) {
+		// before begin(), only remember the setting for USBCMD
+		itc_setting = microframes;
+		itc_now = microframes ? microframes : 1;
+		return;
+	}
+	NVIC_DISABLE_IRQ(IRQ_USBHS);
+	itc_setting = microframes;
+	itc_window_millis = millis();
+	itc_window_irqs = irq_count;
+	itc_window_async = async_completion_count;
+	USBHostController::set_itc(microframes ? microframes : 1);
+	NVIC_ENABLE_IRQ(IRQ_USBHS);
+}
+
+// Adaptive interrupt coalescing.  When the EHCI interrupts for a good
+// share of the opportunities it has at the present setting, and bulk or
+// control transfers are completing, the threshold is doubled.  When
+// interrupts become rare, it's halved.  If only interrupt & isochronous
+// pipes completed transfers, it goes back to 1 microframe right away,
+// since devices like keyboards & mice care more about latency.
+//
+void USBHostController::adapt_coalescing()
+{
+	uint32_t ms = millis() - itc_window_millis;
+	if (ms < ITC_ADAPTIVE_WINDOW) return;
+	uint32_t irqs = irq_count - itc_window_irqs;
+	uint32_t async = async_completion_count - itc_window_async;
+	uint32_t periods = ms * 8 / itc_now; // max possible interrupts
+	uint32_t itc = itc_now;
+	if (async == 0) {
+		itc = 1;
+	} else if (irqs * 4 >= periods) {
+		if (itc < ITC_ADAPTIVE_MAX) itc <<= 1;
+	} else if (irqs * 16 < periods) {
+		if (itc > 1) itc >>= 1;
 	}
+	set_itc(itc);
+	itc_window_millis += ms;
+	itc_window_irqs = irq_count;
+	itc_window_async = async_completion_count;
+}
+
+void USBHost::interruptStats(irqstats_t &stats, bool reset)
+{
+	if (!itc_begun) {
+		stats.microframes = itc_now;
+		stats.interrupts_per_second = 0;
+		stats.completions_per_second = 0;
+		stats.completions_per_interrupt = 0.0f;
+		return;
+	}
+	NVIC_DISABLE_IRQ(IRQ_USBHS);
+	uint32_t irqs = irq_count;
+	uint32_t completions = completion_count;
+	uint32_t ms = millis() - irqstats_millis;
+	stats.microframes = itc_now;
+	if (reset) {
+		irq_count = 0;
+		completion_count = 0;
+		async_completion_count = 0;
+		irqstats_millis += ms;
+		itc_window_irqs = 0;
+		itc_window_async = 0;
+	}
+	NVIC_ENABLE_IRQ(IRQ_USBHS);
+	if (ms == 0) ms = 1;
+	stats.interrupts_per_second = (uint64_t)irqs * 1000 / ms;
+	stats.completions_per_second = (uint64_t)completions * 1000 / ms;
+	stats.completions_per_interrupt = irqs ? (float)completions / irqs : 0.0f;
+}
+
+static inline bool timers_pending()
+{
+	return (timer_level_count[0] | timer_level_count[1] | timer_level_count[2]) != 0;
 }
 
 void USBDriverTimer::start(uint32_t microseconds)
@@ -461,91 +929,162 @@ void USBDriverTimer::start(uint32_t microseconds)
 #endif
 	if (!driver) return;
 	if (microseconds < 100) return; // minimum timer duration
+	__disable_irq();
 	started_micros = micros();
-	if (active_timers == NULL) {
-		// schedule is empty, just add this timer
-		usec = microseconds;
-		next = NULL;
-		prev = NULL;
-		active_timers = this;
-		USBHS_GPTIMER1LD = microseconds - 1;
-		USBHS_GPTIMER1CTL = USBHS_GPTIMERCTL_RST | USBHS_GPTIMERCTL_RUN;
-		return;
+	if (slot) remove_from_wheel(); // restart an already running timer
+	if (!timers_pending() && !timer_running) {
+		// wheel is idle, so restart its time reference
+		timer_ticks = timer_now;
+		timer_micros = started_micros;
 	}
-	uint32_t remain = USBHS_GPTIMER1CTL & 0xFFFFFF;
-	//USBHDBGSerial.print("remain = ");
-	//USBHDBGSerial.println(remain);
-	if (microseconds < remain) {
-		// this timer event is before any on the schedule
-		__disable_irq();
-		USBHS_GPTIMER1CTL = 0;
-		USBHS_USBSTS = USBHS_USBSTS_TI1; // TODO: UPI & UAI safety?!
-		usec = microseconds;
-		next = active_timers;
-		prev = NULL;
-		active_timers->usec = remain - microseconds;
-		active_timers->prev = this;
-		active_timers = this;
-		USBHS_GPTIMER1LD = microseconds - 1;
-		USBHS_GPTIMER1CTL = USBHS_GPTIMERCTL_RST | USBHS_GPTIMERCTL_RUN;
-		__enable_irq();
-		return;
-	}
-	// add this timer to the schedule, somewhere after the first timer
-	microseconds -= remain;
-	USBDriverTimer *list = active_timers;
-	while (list->next) {
-		list = list->next;
-		if (microseconds < list->usec) {
-			// add timer into middle of list
-			list->usec -= microseconds;
-			usec = microseconds;
-			next = list;
-			prev = list->prev;
-			list->prev = this;
-			prev->next = this;
-			return;
-		}
-		microseconds -= list->usec;
+	// round up, so the timer never fires before the requested time
+	int32_t elapsed = started_micros - timer_micros;
+	expires = timer_ticks + (elapsed + microseconds + TIMER_TICK - 1) / TIMER_TICK;
+	// the wheel reaches TIMER_SPAN ticks ahead, 26.2 seconds with the
+	// default 100 us tick, so longer timers fire early, at the limit
+	if (expires - timer_now >= TIMER_SPAN) expires = timer_now + TIMER_SPAN - 1;
+	add_to_wheel();
+	if (!timer_running && (!timer_armed || (int32_t)(expires - timer_next) < 0)) {
+		schedule_wheel();
 	}
-	// add timer to the end of the schedule
-	usec = microseconds;
-	next = NULL;
-	prev = list;
-	list->next = this;
+	__enable_irq();
 }
 
 void USBDriverTimer::stop()
 {
 	__disable_irq();
-	if (active_timers) {
-		if (active_timers == this) {
-			USBHS_GPTIMER1CTL = 0;
-			if (next) {
-				uint32_t usec_til_next = USBHS_GPTIMER1CTL & 0xFFFFFF;
-				usec_til_next += next->usec;
-				next->usec = usec_til_next;
-				USBHS_GPTIMER1LD = usec_til_next;
-				USBHS_GPTIMER1CTL = USBHS_GPTIMERCTL_RST | USBHS_GPTIMERCTL_RUN;
-				next->prev = NULL;
-				active_timers = next;
-			} else {
-				active_timers = NULL;
+	if (slot) {
+		remove_from_wheel();
+		if (!timers_pending() && !timer_running) {
+			if (timer_regs) timer_regs->GPTIMER1CTRL = 0;
+			timer_armed = false;
+		}
+	}
+	__enable_irq();
+}
+
+// Add a timer to the wheel level and slot where its expire tick
+// belongs, relative to the tick the wheel has been run up to.
+void USBDriverTimer::add_to_wheel()
+{
+	uint32_t delta = expires - timer_now;
+	uint32_t n;
+	if (delta < 64) {
+		n = expires & 63;
+	} else if (delta < 64*64) {
+		n = 64 + ((expires >> 6) & 63);
+	} else {
+		n = 128 + ((expires >> 12) & 63);
+	}
+	USBDriverTimer *head = timer_wheel[n];
+	next = head;
+	prev = NULL;
+	if (head) head->prev = this;
+	timer_wheel[n] = this;
+	slot = n + 1;
+	timer_level_count[n >> 6]++;
+}
+
+void USBDriverTimer::remove_from_wheel()
+{
+	uint32_t n = slot - 1;
+	if (prev) {
+		prev->next = next;
+	} else {
+		timer_wheel[n] = next;
+	}
+	if (next) next->prev = prev;
+	slot = 0;
+	timer_level_count[n >> 6]--;
+}
+
+// Turn the wheel forward to "tick", cascading the higher levels and
+// calling every timer which expired along the way.  Ticks where level 0
+// is empty are skipped, so catching up after a long interval is cheap.
+void USBDriverTimer::run_wheel(uint32_t tick)
+{
+	timer_running = true;
+	while (timer_now != tick) {
+		if (!timers_pending()) {
+			timer_now = tick;
+			break;
+		}
+		if (timer_level_count[0] == 0) {
+			uint32_t step = (timer_level_count[1] == 0) ? 4095 : 63;
+			uint32_t boundary = (timer_now | step) + 1;
+			if ((int32_t)(tick - boundary) < 0) {
+				timer_now = tick;
+				break;
 			}
+			timer_now = boundary;
 		} else {
-			for (USBDriverTimer *t = active_timers->next; t; t = t->next) {
-				if (t == this) {
-					t->prev->next = t->next;
-					if (t->next) {
-						t->next->usec += t->usec;
-						t->next->prev = t->prev;
-					}
-					break;
+			timer_now++;
+		}
+		if ((timer_now & 63) == 0) {
+			// move level 2, then level 1 timers down toward level 0
+			uint32_t level = ((timer_now & 4095) == 0) ? 2 : 1;
+			for (; level > 0; level--) {
+				uint32_t n = level * 64 + ((timer_now >> (level * 6)) & 63);
+				USBDriverTimer *list = timer_wheel[n];
+				timer_wheel[n] = NULL;
+				while (list) {
+					USBDriverTimer *t = list;
+					list = t->next;
+					timer_level_count[level]--;
+					t->add_to_wheel();
 				}
 			}
 		}
+		// call all timers expiring on this tick.  Each is removed before
+		// its driver is called, so timer_event() may start or stop any
+		// timer, including the one which just expired.
+		USBDriverTimer **head = &timer_wheel[timer_now & 63];
+		while (*head) {
+			USBDriverTimer *t = *head;
+			t->remove_from_wheel();
+			USBHOST_TRACE_EVENT(TRACE_TIMER, t, t->expires);
+			t->driver->timer_event(t); // call driver's timer()
+		}
 	}
-	__enable_irq();
+	timer_running = false;
+}
+
+// Load GPTIMER1 for the next tick with any work: either a level 0 timer
+// expiring, or a higher level slot needing to move down.  Until the
+// default controller begins, timers only wait in the wheel.
+void USBDriverTimer::schedule_wheel()
+{
+	if (!timer_regs) return;
+	if (!timers_pending()) {
+		timer_regs->GPTIMER1CTRL = 0;
+		timer_armed = false;
+		return;
+	}
+	uint32_t tick = timer_now + TIMER_SPAN;
+	if (timer_level_count[0]) {
+		// level 0 only holds timers within the next 64 ticks
+		for (tick = timer_now + 1; timer_wheel[tick & 63] == NULL; tick++) ;
+	}
+	if (timer_level_count[1] | timer_level_count[2]) {
+		uint32_t boundary = (timer_now | 63) + 1;
+		while ((int32_t)(tick - boundary) > 0) {
+			if ((boundary & 4095) == 0 && timer_level_count[2]) break;
+			if (timer_wheel[64 + ((boundary >> 6) & 63)]) break;
+			if (timer_level_count[1] == 0) {
+				boundary = (boundary | 4095) + 1;
+			} else {
+				boundary += 64;
+			}
+		}
+		if ((int32_t)(tick - boundary) > 0) tick = boundary;
+	}
+	int32_t usec = (tick - timer_ticks) * TIMER_TICK - (micros() - timer_micros);
+	if (usec < 10) usec = 10;
+	timer_regs->GPTIMER1CTRL = 0;
+	timer_regs->GPTIMER1LD = usec - 1;
+	timer_regs->GPTIMER1CTRL = USBHS_GPTIMERCTL_RST | USBHS_GPTIMERCTL_RUN;
+	timer_next = tick;
+	timer_armed = true;
 }
 
 
@@ -571,11 +1110,14 @@ static uint32_t QH_capabilities2(uint32_t high_bw_mult, uint32_t hub_port_number
 // Create a new pipe.  It's QH is added to the async or periodic schedule,
 // and a halt qTD is added to the QH, so we can grow the qTD list later.
 //   dev:       device owning this pipe/endpoint
-//   type:      0=control, 2=bulk, 3=interrupt
-//   endpoint:  0 for control, 1-15 for bulk or interrupt
+//   type:      0=control, 1=isochronous, 2=bulk, 3=interrupt
+//   endpoint:  0 for control, 1-15 for bulk, interrupt or isochronous
 //   direction: 0=OUT, 1=IN  (unused for control)
-//   maxlen:    maximum packet size
-//   interval:  polling interval for interrupt, power of 2, unused if control or bulk
+//   maxlen:    maximum packet size (wMaxPacketSize, including high bandwidth bits)
+//   interval:  polling interval for interrupt or isochronous, unused if control or bulk
+//
+// Isochronous pipes have no QH in the schedule.  Only bandwidth is reserved
+// here, and start_Isochronous() later adds iTD or siTD to the schedule.
 //
 Pipe_t * USBHost::new_Pipe(Device_t *dev, uint32_t type, uint32_t endpoint,
 	uint32_t direction, uint32_t maxlen, uint32_t interval)
@@ -589,15 +1131,39 @@ Pipe_t * USBHost::new_Pipe(Device_t *dev, uint32_t type, uint32_t endpoint,
 	print(", Direction:",direction);
 	print(", Maxlen:",maxlen);
 	println(", interval:",interval);
-	pipe = allocate_Pipe();
+	pipe = allocate_Pipe(claiming_driver);
 	if (!pipe) return NULL;
-	halt = allocate_Transfer();
+	if (type == 1) {
+		memset(pipe, 0, sizeof(Pipe_t));
+		pipe->device = dev;
+		pipe->direction = direction;
+		pipe->type = type;
+		if (endpoint == 0 || !allocate_interrupt_pipe_bandwidth(pipe, maxlen, interval)) {
+			free_Pipe(pipe);
+			return NULL;
+		}
+		// iTD and siTD get the address & endpoint info from these
+		pipe->qh.capabilities[0] = QH_capabilities1(0, 0, maxlen & 0x7FF, 0,
+			0, dev->speed, endpoint, 0, dev->address);
+		pipe->qh.capabilities[1] = QH_capabilities2(((maxlen >> 11) & 3) + 1,
+			dev->tt_hub_port, dev->tt_hub_address, pipe->complete_mask, pipe->start_mask);
+		Pipe_t *p = dev->data_pipes;
+		if (p == NULL) {
+			dev->data_pipes = pipe;
+		} else {
+			while (p->next) p = p->next;
+			p->next = pipe;
+		}
+		return pipe;
+	}
+	halt = allocate_Transfer(claiming_driver);
 	if (!halt) {
 		free_Pipe(pipe);
 		return NULL;
 	}
 	memset(pipe, 0, sizeof(Pipe_t));
 	memset(halt, 0, sizeof(Transfer_t));
+	halt->driver = claiming_driver; // whose Transfer_t count it's in
 	halt->qtd.next = 1;
 	halt->qtd.token = 0x40;
 	pipe->device = dev;
@@ -633,26 +1199,16 @@ Pipe_t * USBHost::new_Pipe(Device_t *dev, uint32_t type, uint32_t endpoint,
 		// interrupt
 		//pipe->qh.token = 0x80000000; // TODO: OUT starts with DATA0 or DATA1?
 	}
-	pipe->qh.capabilities[0] = QH_capabilities1(15, c, maxlen, 0,
-		dtc, dev->speed, endpoint, 0, dev->address);
-	pipe->qh.capabilities[1] = QH_capabilities2(1, dev->hub_port,
-		dev->hub_address, pipe->complete_mask, pipe->start_mask);
+	// NAK counter reload must be zero for periodic QHs, EHCI 1.0 page 47
+	pipe->qh.capabilities[0] = QH_capabilities1((type == 3) ? 0 : 15, c,
+		maxlen, 0, dtc, dev->speed, endpoint, 0, dev->address);
+	pipe->qh.capabilities[1] = QH_capabilities2(1, dev->tt_hub_port,
+		dev->tt_hub_address, pipe->complete_mask, pipe->start_mask);
 
 	if (type == 0 || type == 2) {
 		// control or bulk: add to async queue
-		Pipe_t *list = (Pipe_t *)USBHS_ASYNCLISTADDR;
-		if (list == NULL) {
-			pipe->qh.capabilities[0] |= 0x8000; // H bit
-			pipe->qh.horizontal_link = (uint32_t)&(pipe->qh) | 2; // 2=QH
-			USBHS_ASYNCLISTADDR = (uint32_t)&(pipe->qh);
-			USBHS_USBCMD |= USBHS_USBCMD_ASE; // enable async schedule
-			//println("  first in async list");
-		} else {
-			// EHCI 1.0: section 4.8.1, page 72
-			pipe->qh.horizontal_link = list->qh.horizontal_link;
-			list->qh.horizontal_link = (uint32_t)&(pipe->qh) | 2;
-			//println("  added to async list");
-		}
+		dev->controller->add_to_async_schedule(pipe);
+		//println("  added to async list");
 	} else if (type == 3) {
 		// interrupt: add to periodic schedule
 		add_qh_to_periodic_schedule(pipe);
@@ -661,6 +1217,62 @@ Pipe_t * USBHost::new_Pipe(Device_t *dev, uint32_t type, uint32_t endpoint,
 }
 
 
+// Add a control or bulk QH to the async schedule, before any with the
+// same or lower priority, so the EHCI begins each pass through the
+// schedule with the highest priority pipes.  Pipes with equal priority
+// have the most recently added first.  EHCI 1.0: section 4.8.1, page 72
+//
+void USBHostController::add_to_async_schedule(Pipe_t *pipe)
+{
+	Pipe_t *prev = &async_head;
+	while (1) {
+		Pipe_t *n = (Pipe_t *)(prev->qh.horizontal_link & 0xFFFFFFE0);
+		if (n == &async_head || n->priority <= pipe->priority) break;
+		prev = n;
+	}
+	pipe->qh.horizontal_link = prev->qh.horizontal_link;
+	prev->qh.horizontal_link = (uint32_t)&(pipe->qh) | 2;
+}
+
+// Drivers may tune how their control & bulk pipes share the async
+// schedule.  When an endpoint NAKs, the EHCI retries up to nak_reload
+// times (0 means no limit, 15 is the default) and then skips it for the
+// rest of its pass through the schedule.  Bulk IN pipes which usually
+// have nothing to send, like serial adapters, waste less bus time with
+// 1 or 2.  Pipes with higher priority (0 is the default, negative is
+// lower) are placed ahead of others, so they get the bus first.
+//
+void USBHost::set_NAK_Reload(Pipe_t *pipe, uint32_t nak_reload)
+{
+	if (!pipe || (pipe->type != 0 && pipe->type != 2)) return;
+	if (nak_reload > 15) nak_reload = 15;
+	pipe->qh.capabilities[0] = (pipe->qh.capabilities[0] & 0x0FFFFFFF)
+		| (nak_reload << 28);
+}
+
+void USBHost::set_Priority(Pipe_t *pipe, int32_t priority)
+{
+	if (!pipe || (pipe->type != 0 && pipe->type != 2)) return;
+	if (priority > 127) priority = 127;
+	if (priority < -128) priority = -128;
+	if (priority == pipe->priority) return;
+	// unlink the QH, but leave its own link alone, in case the EHCI is
+	// using it, then add it again at its new place.  The EHCI always
+	// sees a complete loop, though perhaps visits a pipe twice or not
+	// at all in this pass.
+	USBHostController *hc = pipe->device->controller;
+	Pipe_t *prev = &hc->async_head;
+	while (1) {
+		Pipe_t *n = (Pipe_t *)(prev->qh.horizontal_link & 0xFFFFFFE0);
+		if (n == pipe) break;
+		if (n == &hc->async_head) return; // not in the async schedule
+		prev = n;
+	}
+	prev->qh.horizontal_link = pipe->qh.horizontal_link;
+	pipe->priority = priority;
+	hc->add_to_async_schedule(pipe);
+}
+
 
 // Fill in the qTD fields (token & data)
 //   t       the Transfer qTD to initialize
@@ -685,6 +1297,163 @@ static void init_qTD(volatile Transfer_t *t, void *buf, uint32_t len,
 	t->qtd.buffer[4] = addr + 0x4000;
 }
 
+// How many bytes 1 qTD can transfer, starting at addr.  Each qTD can use
+// 5 pages, so up to 20K when the buffer is page aligned, and always at
+// least 15K.  Only the last qTD of a transfer may end with a short packet,
+// so others must end on a multiple of the max packet size.
+//
+static uint32_t qTD_capacity(uint32_t addr, uint32_t maxpacket)
+{
+	uint32_t capacity = 0x5000 - (addr & 0xFFF);
+	if (maxpacket) capacity -= capacity % maxpacket;
+	return capacity;
+}
+
+// Teensy 4.x caches OCRAM (DMAMEM & malloc) and EXTMEM, but the EHCI reads
+// and writes memory directly, so buffers there need cache maintenance.
+// DTCM, where most variables are, isn't cached.  OUT data is written back
+// to memory before the EHCI reads it.  IN buffers are invalidated before
+// the transfer, so no dirty cache line is later written over the data,
+// and again when it completes, in case the CPU read the buffer (or the
+// cache speculatively loaded it) in the meantime.  This is only safe with
+// whole cache lines.  If other variables share a buffer's first or last
+// cache line, the CPU may use them while the transfer runs, so small IN
+// transfers use a bounce buffer when USBHOST_BOUNCE_BUFFERS is defined.
+// Otherwise the best we can do is write back and invalidate beforehand.
+//
+#if defined(__IMXRT1062__)
+#define DMA_CACHED(buf)  ((uint32_t)(buf) >= 0x20200000)
+#define DMA_ALIGNED(buf, len)  (((uint32_t)(buf) | (len)) % 32 == 0)
+
+#if defined(USBHOST_BOUNCE_BUFFERS)
+#if defined(USBHOST_BOUNCE_SIZE)
+#define BOUNCE_SIZE (USBHOST_BOUNCE_SIZE)
+#else
+#define BOUNCE_SIZE 512
+#endif
+#if BOUNCE_SIZE > 8192
+#error "USBHOST_BOUNCE_SIZE must be 8192 or less"
+#endif
+// each bounce buffer is claimed by the driver's buffer it stands in for
+static uint8_t bounce_buffer[USBHOST_BOUNCE_BUFFERS][BOUNCE_SIZE] __attribute__ ((aligned(32)));
+static void * bounce_owner[USBHOST_BOUNCE_BUFFERS];
+#endif
+#endif
+
+static void * dma_prepare(void *buf, uint32_t len, uint32_t in, bool bounce)
+{
+#if defined(__IMXRT1062__)
+	if (len == 0 || !DMA_CACHED(buf)) return buf;
+	if (!in) {
+		arm_dcache_flush(buf, len);
+	} else if (DMA_ALIGNED(buf, len)) {
+		arm_dcache_delete(buf, len);
+	} else {
+#if defined(USBHOST_BOUNCE_BUFFERS)
+		if (bounce && len <= BOUNCE_SIZE) {
+			for (uint32_t i=0; i < USBHOST_BOUNCE_BUFFERS; i++) {
+				void *expected = NULL;
+				if (__atomic_compare_exchange_n(&bounce_owner[i], &expected,
+				  buf, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+					return bounce_buffer[i];
+				}
+			}
+		}
+#endif
+		arm_dcache_flush_delete(buf, len);
+	}
+#endif
+	return buf;
+}
+
+// A transfer is done, make its IN data visible to the CPU.  With a
+// bounce buffer, the bytes received are copied to the driver's buffer.
+static void dma_complete(const Pipe_t *pipe, const Transfer_t *t, uint32_t received)
+{
+#if defined(__IMXRT1062__)
+	void *buf = t->buffer;
+	uint32_t len = t->length;
+	if (pipe->type != 0 && (t->setup.word1 & TRANSFER_SEGMENTS)) {
+		dma_complete_pages(pipe, t); // buf is only the first segment
+		return;
+	}
+	if (len == 0 || !DMA_CACHED(buf)) return;
+	if (pipe->type == 0) {
+		if (!(t->setup.bmRequestType & 0x80)) return;
+	} else {
+		if (!pipe->direction) return;
+		if (t->setup.word1 & USBHost::TRANSFER_UNCACHED) return;
+	}
+#if defined(USBHOST_BOUNCE_BUFFERS)
+	for (uint32_t i=0; i < USBHOST_BOUNCE_BUFFERS; i++) {
+		if (bounce_owner[i] == buf) {
+			memcpy(buf, bounce_buffer[i], received);
+			__atomic_store_n(&bounce_owner[i], NULL, __ATOMIC_RELEASE);
+			return;
+		}
+	}
+#endif
+	if (DMA_ALIGNED(buf, len)) arm_dcache_delete(buf, len);
+#endif
+}
+
+// A qTD is done, if it's part of a scatter-gather transfer, and not the
+// last, whose dma_complete() comes here too.  Its pages may belong to
+// different segments, so each page's part is invalidated by itself.  The
+// EHCI changes the offset in buffer[0], so setup.word2 keeps the original
+// offset and the qTD's length.  As in dma_complete(), only whole cache
+// lines are invalidated, the others were written back and invalidated
+// before the transfer.
+static void dma_complete_pages(const Pipe_t *pipe, const Transfer_t *t)
+{
+#if defined(__IMXRT1062__)
+	if (pipe->type == 0 || !pipe->direction) return;
+	if (!(t->setup.word1 & TRANSFER_SEGMENTS)) return;
+	if (t->setup.word1 & USBHost::TRANSFER_UNCACHED) return;
+	uint32_t offset = t->setup.word2 & 0xFFF;
+	uint32_t len = t->setup.word2 >> 16;
+	for (uint32_t i=0; len > 0 && i < 5; i++) {
+		uint32_t addr = (t->qtd.buffer[i] & 0xFFFFF000) + (i ? 0 : offset);
+		uint32_t size = 0x1000 - (addr & 0xFFF);
+		if (size > len) size = len;
+		if (DMA_CACHED(addr) && DMA_ALIGNED(addr, size)) {
+			arm_dcache_delete((void *)addr, size);
+		}
+		len -= size;
+	}
+#endif
+}
+
+// An isochronous frame is done, make its IN data visible to the CPU before
+// the driver's callback.  The whole frame's part of the buffer is used,
+// as the packets are at fixed places within it.
+static void dma_complete_isochronous(const Pipe_t *pipe, const Isochronous_t *iso)
+{
+#if defined(__IMXRT1062__)
+	void *buf = iso->buffer;
+	uint32_t len = isochronous_bytes(pipe, iso);
+	if (!pipe->direction || !DMA_CACHED(buf)) return;
+	if (iso->flags & USBHost::TRANSFER_UNCACHED) return;
+	if (DMA_ALIGNED(buf, len)) arm_dcache_delete(buf, len);
+#endif
+}
+
+// A transfer was cancelled.  Its buffer belongs to the driver again, which
+// may be using it, so nothing is invalidated or copied.  Only a bounce
+// buffer standing in for it is given back.
+static void dma_release(const Transfer_t *t)
+{
+#if defined(__IMXRT1062__) && defined(USBHOST_BOUNCE_BUFFERS)
+	void *buf = t->buffer;
+	for (uint32_t i=0; i < USBHOST_BOUNCE_BUFFERS; i++) {
+		if (bounce_owner[i] == buf) {
+			__atomic_store_n(&bounce_owner[i], NULL, __ATOMIC_RELEASE);
+			return;
+		}
+	}
+#endif
+}
+
 
 
 // Create a Control Transfer and queue it
@@ -696,19 +1465,19 @@ bool USBHost::queue_Control_Transfer(Device_t *dev, setup_t *setup, void *buf, U
 
 	//println("new_Control_Transfer");
 	if (setup->wLength > 16384) return false; // max 16K data for control
-	transfer = allocate_Transfer();
+	transfer = allocate_Transfer(driver);
 	if (!transfer) {
 		println("  error allocating setup transfer");
 		return false;
 	}
-	status = allocate_Transfer();
+	status = allocate_Transfer(driver);
 	if (!status) {
 		println("  error allocating status transfer");
 		free_Transfer(transfer);
 		return false;
 	}
 	if (setup->wLength > 0) {
-		data = allocate_Transfer();
+		data = allocate_Transfer(driver);
 		if (!data) {
 			println("  error allocating data transfer");
 			free_Transfer(transfer);
@@ -716,6 +1485,7 @@ bool USBHost::queue_Control_Transfer(Device_t *dev, setup_t *setup, void *buf, U
 			return false;
 		}
 		uint32_t pid = (setup->bmRequestType & 0x80) ? 1 : 0;
+		dma_prepare(buf, setup->wLength, pid, false);
 		init_qTD(data, buf, setup->wLength, pid, 1, false);
 		transfer->qtd.next = (uint32_t)data;
 		data->qtd.next = (uint32_t)status;
@@ -725,6 +1495,7 @@ bool USBHost::queue_Control_Transfer(Device_t *dev, setup_t *setup, void *buf, U
 		status_direction = 1; // always IN, USB 2.0 page 226
 	}
 	//println("setup address ", (uint32_t)setup, HEX);
+	dma_prepare(setup, 8, 0, false);
 	init_qTD(transfer, setup, 8, 2, 0, false);
 	init_qTD(status, NULL, 0, status_direction, 1, true);
 	status->pipe = dev->control_pipe;
@@ -738,24 +1509,36 @@ bool USBHost::queue_Control_Transfer(Device_t *dev, setup_t *setup, void *buf, U
 }
 
 
-// Create a Bulk or Interrupt Transfer and queue it
+// Create a Bulk or Interrupt Transfer and queue it.  The buffer may be
+// anywhere, as cache maintenance is done here and when it completes, see
+// dma_prepare().  Drivers which know their buffer isn't cached, or which
+// take care of it themselves, can use the TRANSFER_UNCACHED flag.
 //
-bool USBHost::queue_Data_Transfer(Pipe_t *pipe, void *buffer, uint32_t len, USBDriver *driver)
+bool USBHost::queue_Data_Transfer(Pipe_t *pipe, void *buffer, uint32_t len,
+	USBDriver *driver, uint32_t flags)
 {
 	Transfer_t *transfer, *data, *next;
 	uint8_t *p = (uint8_t *)buffer;
+	uint32_t maxpacket = (pipe->qh.capabilities[0] >> 16) & 0x7FF;
 	uint32_t count;
 	bool last = false;
 
 	// TODO: option for zero length packet?  Maybe in Pipe_t fields?
 
+	if (pipe->type == 1) return false; // isochronous uses start_Isochronous()
+	if (pipe->persistent) return false; // ring is re-armed automatically
 	//println("new_Data_Transfer");
 	// allocate qTDs
-	transfer = allocate_Transfer();
+	transfer = allocate_Transfer(driver);
 	if (!transfer) return false;
 	data = transfer;
-	for (count=((len-1) >> 14); count; count--) {
-		next = allocate_Transfer();
+	count = 0;
+	for (uint32_t n = qTD_capacity((uint32_t)p, maxpacket); n < len;
+	  n += qTD_capacity((uint32_t)p + n, maxpacket)) {
+		count++;
+	}
+	for (; count; count--) {
+		next = allocate_Transfer(driver);
 		if (!next) {
 			// free already-allocated qTDs
 			while (1) {
@@ -774,19 +1557,22 @@ bool USBHost::queue_Data_Transfer(Pipe_t *pipe, void *buffer, uint32_t len, USBD
 	data->pipe = pipe;
 	data->buffer = buffer;
 	data->length = len;
-	data->setup.word1 = 0;
+	data->setup.word1 = flags;
 	data->setup.word2 = 0;
 	data->driver = driver;
+	if (!(flags & TRANSFER_UNCACHED)) {
+		p = (uint8_t *)dma_prepare(buffer, len, pipe->direction, true);
+	}
 	// initialize all qTDs
 	data = transfer;
 	while (1) {
-		uint32_t count = len;
-		if (count > 16384) {
-			count = 16384;
-		} else {
+		uint32_t count = qTD_capacity((uint32_t)p, maxpacket);
+		if (count >= len) {
+			count = len;
 			last = true;
 		}
 		init_qTD(data, p, count, pipe->direction, 0, last);
+		data->setup.word1 = flags;
 		if (last) break;
 		p += count;
 		len -= count;
@@ -795,7 +1581,109 @@ bool USBHost::queue_Data_Transfer(Pipe_t *pipe, void *buffer, uint32_t len, USBD
 	return queue_Transfer(pipe, transfer);
 }
 
-
+// Create a Bulk or Interrupt Transfer from several separate buffers and
+// queue it, so drivers don't need to copy headers & data together first.
+// Each qTD can use 5 memory pages, which need not be contiguous, so a new
+// segment continues in the same qTD when the prior one ends at a page
+// boundary and the new one starts on a page.  When a qTD's 5 pages are
+// used, it ends at the last whole packet, and the next qTD begins with the
+// rest, as with 1 buffer.  Other segment boundaries need another qTD,
+// which is only possible where the data so far is a multiple of the max
+// packet size, otherwise a short packet would end the transfer early.
+// The driver gets 1 callback, with buffer set to the first segment's data
+// and length the total of all segments.  Cache maintenance is done for
+// each segment before, and for each qTD's pages after, without bounce
+// buffers.
+//
+bool USBHost::queue_Data_Transfer(Pipe_t *pipe, const segment_t *segments,
+	uint32_t count, USBDriver *driver, uint32_t flags)
+{
+	Transfer_t *transfer=NULL, *data=NULL, *next;
+	uint32_t maxpacket = (pipe->qh.capabilities[0] >> 16) & 0x7FF;
+	uint32_t token = (pipe->direction << 8) | 0x80;
+	uint32_t total=0, len=0, end=0, npages=0;
+
+	if (pipe->type == 1 || pipe->persistent || count == 0) return false;
+	flags |= TRANSFER_SEGMENTS;
+	for (uint32_t i=0; i < count; i++) {
+		uint32_t addr = (uint32_t)(segments[i].data);
+		uint32_t remain = segments[i].length;
+		while (remain > 0) {
+			// work with pieces which are within a single page
+			uint32_t size = 0x1000 - (addr & 0xFFF);
+			if (size > remain) size = remain;
+			bool fits;
+			if (!data) {
+				fits = false;
+			} else if (addr & 0xFFF) {
+				fits = (addr == end); // continues in the same page
+			} else {
+				fits = ((end & 0xFFF) == 0 && npages < 5); // uses next page
+			}
+			if (!fits) {
+				uint32_t carry = 0;
+				if (data && (len % maxpacket) != 0) {
+					if ((addr & 0xFFF) || (end & 0xFFF)) {
+						println("  segments not aligned to packets or pages");
+						goto fail;
+					}
+					// all 5 pages used, the end of the last one goes
+					// in the next qTD
+					carry = len % maxpacket;
+				}
+				next = allocate_Transfer(driver);
+				if (!next) goto fail;
+				if (data) {
+					data->qtd.token = token | ((len - carry) << 16);
+					data->qtd.next = (uint32_t)next;
+					data->setup.word1 = flags;
+					data->setup.word2 = ((len - carry) << 16) | (data->qtd.buffer[0] & 0xFFF);
+				} else {
+					transfer = next;
+				}
+				data = next;
+				data->qtd.next = 1;
+				data->qtd.alt_next = 1; // 1=terminate
+				npages = 0;
+				if (carry) data->qtd.buffer[npages++] = end - carry;
+				data->qtd.buffer[npages++] = addr;
+				len = carry;
+			} else if ((addr & 0xFFF) == 0) {
+				data->qtd.buffer[npages++] = addr;
+			}
+			len += size;
+			total += size;
+			addr += size;
+			end = addr;
+			remain -= size;
+		}
+	}
+	if (!data) return false;
+	if (!(flags & TRANSFER_UNCACHED)) {
+		for (uint32_t i=0; i < count; i++) {
+			dma_prepare(segments[i].data, segments[i].length, pipe->direction, false);
+		}
+	}
+	// last qTD needs info for followup
+	data->qtd.token = token | (len << 16) | 0x8000;
+	data->pipe = pipe;
+	data->buffer = segments[0].data;
+	data->length = total;
+	data->setup.word1 = flags;
+	data->setup.word2 = (len << 16) | (data->qtd.buffer[0] & 0xFFF);
+	data->driver = driver;
+	return queue_Transfer(pipe, transfer);
+fail:
+	// free already-allocated qTDs
+	while (transfer) {
+		next = (transfer == data) ? NULL : (Transfer_t *)transfer->qtd.next;
+		free_Transfer(transfer);
+		transfer = next;
+	}
+	return false;
+}
+
+
 bool USBHost::queue_Transfer(Pipe_t *pipe, Transfer_t *transfer)
 {
 	// find halt qTD
@@ -803,7 +1691,9 @@ bool USBHost::queue_Transfer(Pipe_t *pipe, Transfer_t *transfer)
 	while (!(halt->qtd.token & 0x40)) halt = (Transfer_t *)(halt->qtd.next);
 	// transfer's token
 	uint32_t token = transfer->qtd.token;
-	// transfer becomes new halt qTD
+	// transfer becomes new halt qTD, and takes over halt's place in
+	// the Transfer_t counts (the driver field), see allocate_Transfer()
+	USBDriver *halt_driver = halt->driver;
 	transfer->qtd.token = 0x40;
 	// copy transfer non-token fields to halt
 	halt->qtd.next = transfer->qtd.next;
@@ -818,6 +1708,7 @@ bool USBHost::queue_Transfer(Pipe_t *pipe, Transfer_t *transfer)
 	halt->length = transfer->length;
 	halt->setup = transfer->setup;
 	halt->driver = transfer->driver;
+	transfer->driver = halt_driver;
 	// find the last qTD we're adding
 	Transfer_t *last = halt;
 	while ((uint32_t)(last->qtd.next) != 1) last = (Transfer_t *)(last->qtd.next);
@@ -825,27 +1716,48 @@ bool USBHost::queue_Transfer(Pipe_t *pipe, Transfer_t *transfer)
 	last->qtd.next = (uint32_t)transfer;
 	transfer->qtd.next = 1;
 	// link all the new qTD by next_followup & prev_followup
-	Transfer_t *prev = NULL;
+#if defined(USBHOST_PIPE_STATS)
+	uint32_t cycles = ARM_DWT_CYCCNT;
+#endif
+	Transfer_t *prev = pipe->last_followup;
 	Transfer_t *p = halt;
 	while (p->qtd.next != (uint32_t)transfer) {
 		Transfer_t *next = (Transfer_t *)p->qtd.next;
 		p->prev_followup = prev;
 		p->next_followup = next;
+#if defined(USBHOST_PIPE_STATS)
+		stats_queued(p, (p == halt) ? token : p->qtd.token, cycles);
+#endif
 		prev = p;
 		p = next;
 	}
 	p->prev_followup = prev;
 	p->next_followup = NULL;
+#if defined(USBHOST_PIPE_STATS)
+	stats_queued(p, (p == halt) ? token : p->qtd.token, cycles);
+#endif
 	//print(halt, p);
-	// add them to a followup list
-	if (pipe->type == 0 || pipe->type == 2) {
-		// control or bulk
-		add_to_async_followup_list(halt, p);
+	// add them to the end of the pipe's followup list
+	if (pipe->last_followup) {
+		pipe->last_followup->next_followup = halt;
+		pipe->last_followup = p;
 	} else {
-		// interrupt
-		add_to_periodic_followup_list(halt, p);
+		pipe->first_followup = halt;
+		pipe->last_followup = p;
+		// pipe now has work, add it to a followup list
+		if (pipe->type == 0 || pipe->type == 2) {
+			// control or bulk
+			pipe->device->controller->add_to_async_followup_list(pipe);
+		} else {
+			// interrupt
+			pipe->device->controller->add_to_periodic_followup_list(pipe);
+		}
 	}
 	// old halt becomes new transfer, this commits all new qTDs to QH
+	USBHOST_TRACE_EVENT(TRACE_QUEUE, halt, token);
+#if defined(USBHOST_CAPTURE)
+	capture_submit(p);
+#endif
 	halt->qtd.token = token;
 	return true;
 }
@@ -871,108 +1783,507 @@ bool USBHost::followup_Transfer(Transfer_t *transfer)
 	return false;
 }
 
-void USBHost::followup_Error(void)
+// Complete all finished transfers on a pipe, oldest first.  Returns the
+// next pipe on the followup list, read after any callbacks have run, since
+// callbacks are allowed to queue more transfers.
+//
+Pipe_t * USBHost::followup_Pipe(Pipe_t *pipe)
 {
-	println("ERROR Followup");
-	Transfer_t *p = async_followup_first;
+	if (pipe->halt_state) return pipe->next_followup; // nothing to do
+	if (pipe->type == 1) return followup_Isochronous(pipe);
+	if (pipe->persistent) return followup_Persistent(pipe);
+	bool isasync = (pipe->type == 0 || pipe->type == 2);
+	while (1) {
+		Transfer_t *t = pipe->first_followup;
+		uint32_t token = t->qtd.token;
+		if (token & 0x80) break; // oldest is still active, so are the rest
+		if (token & 0x40) {
+			USBHOST_TRACE_EVENT(TRACE_HALT, pipe, token);
+			Pipe_t *next = pipe->next_followup;
+			if (isasync) {
+				followup_Halted_Pipe(pipe);
+			} else {
+				followup_Periodic_Halt(pipe);
+			}
+			return next;
+		}
+		pipe->errors = 0;
+		USBHOST_TRACE_EVENT(TRACE_COMPLETE, t, token);
+#if defined(USBHOST_PIPE_STATS)
+		stats_completed(pipe, t, token);
+#endif
+		if (token & 0x8000) {
+			completion_count++;
+			if (isasync) async_completion_count++;
+			dma_complete(pipe, t, t->length - ((token >> 16) & 0x7FFF));
+		} else {
+			dma_complete_pages(pipe, t);
+		}
+#if defined(USBHOST_CAPTURE)
+		// a transfer may be several qTDs, but only the last has IOC set
+		if (token & 0x8000) {
+			capture_complete(t, pipe->capture_remain + ((token >> 16) & 0x7FFF), token);
+			pipe->capture_remain = 0;
+		} else {
+			pipe->capture_remain += (token >> 16) & 0x7FFF;
+		}
+#endif
+		Transfer_t *next;
+		if ((token & 0x8000) && pipe->callback_deferred && defer_Transfer(t)) {
+			// Task() will do the callback and free this transfer
+			next = t->next_followup;
+		} else {
+			// do the callback while the transfer is still on the pipe's
+			// list, so anything the driver queues is added after it
+			followup_Transfer(t);
+			next = t->next_followup;
+			free_Transfer(t);
+		}
+		pipe->first_followup = next;
+		if (next) {
+			next->prev_followup = NULL;
+		} else {
+			// all work is done, pipe no longer needs followup
+			pipe->last_followup = NULL;
+			Pipe_t *nextpipe = pipe->next_followup;
+			if (isasync) {
+				pipe->device->controller->remove_from_async_followup_list(pipe);
+			} else {
+				pipe->device->controller->remove_from_periodic_followup_list(pipe);
+			}
+			return nextpipe;
+		}
+	}
+	return pipe->next_followup;
+}
+
+// Start a persistent interrupt IN pipe.  Instead of drivers queuing a new
+// transfer from every callback, the pipe gets a ring of "count" qTDs which
+// each receive up to "len" bytes into their own part of the buffer (which
+// must hold count * len bytes).  After the driver's callback, the same qTD
+// is simply made active again, so no Transfer_t are allocated or freed
+// while the pipe runs.  The pipe must not have any transfers queued, and
+// no others may be queued after this.
+//
+bool USBHost::start_Persistent(Pipe_t *pipe, void *buffer, uint32_t len,
+	uint32_t count, USBDriver *driver)
+{
+	if (!pipe || pipe->type != 3 || pipe->direction != 1) return false;
+	if (pipe->persistent || pipe->first_followup) return false;
+	if (count == 0 || len == 0 || len > 16384) return false;
+	// the idle pipe's halt qTD becomes the first in the ring
+	Transfer_t *first = (Transfer_t *)(pipe->qh.next);
+	while (!(first->qtd.token & 0x40)) first = (Transfer_t *)(first->qtd.next);
+	Transfer_t *last = first;
+	for (uint32_t i=1; i < count; i++) {
+		Transfer_t *t = allocate_Transfer(driver);
+		if (!t) {
+			println("  error allocating persistent ring");
+			while (last != first) {
+				Transfer_t *prev = last->prev_followup;
+				free_Transfer(last);
+				last = prev;
+			}
+			return false;
+		}
+		t->prev_followup = last;
+		last->next_followup = t;
+		last = t;
+	}
+	last->next_followup = first;
+	first->prev_followup = last;
+	// initialize all qTDs, first's token last of all, as the EHCI may be
+	// looking at it, waiting for it to become active
+	uint8_t *p = (uint8_t *)buffer;
+	Transfer_t *t = first;
+	do {
+		t->qtd.next = (uint32_t)(t->next_followup);
+		t->qtd.alt_next = 1; // 1=terminate
+		uint32_t addr = (uint32_t)p & 0xFFFFF000;
+		for (uint32_t i=1; i < 5; i++) {
+			t->qtd.buffer[i] = addr + (i << 12);
+		}
+		t->pipe = pipe;
+		t->buffer = p;
+		t->length = len;
+		t->setup.word1 = 0;
+		t->setup.word2 = 0;
+		// first stays in the Transfer_t count of the pipe's creator,
+		// which is normally this same driver
+		if (t != first) t->driver = driver;
+#if defined(USBHOST_CAPTURE)
+		capture_submit(t);
+#endif
+		if (t != first) rearm_qTD(t);
+		p += len;
+		t = t->next_followup;
+	} while (t != first);
+	pipe->persistent = 1;
+	pipe->first_followup = first;
+	pipe->last_followup = last;
+	pipe->device->controller->add_to_periodic_followup_list(pipe);
+	rearm_qTD(first);
+	return true;
+}
+
+// Complete finished qTDs on a persistent pipe, in the same order as the
+// ring.  Each is made active again after its callback.  With deferred
+// callbacks, Task() does this instead, and until it does, the EHCI stops
+// when it gets around to that qTD again.  The IOC bit is cleared while
+// waiting for Task(), so we don't handle it twice.
+//
+Pipe_t * USBHost::followup_Persistent(Pipe_t *pipe)
+{
+	while (1) {
+		Transfer_t *t = pipe->first_followup;
+		uint32_t token = t->qtd.token;
+		if (token & 0x80) break; // still active
+		if (!(token & 0x8000)) break; // still waiting for Task()
+		if (token & 0x40) {
+			USBHOST_TRACE_EVENT(TRACE_HALT, pipe, token);
+			followup_Periodic_Halt(pipe);
+			break;
+		}
+		pipe->errors = 0;
+		USBHOST_TRACE_EVENT(TRACE_COMPLETE, t, token);
+#if defined(USBHOST_PIPE_STATS)
+		stats_completed(pipe, t, token);
+#endif
+		completion_count++;
+		dma_complete(pipe, t, t->length - ((token >> 16) & 0x7FFF));
+#if defined(USBHOST_CAPTURE)
+		capture_complete(t, (token >> 16) & 0x7FFF, token);
+#endif
+		pipe->first_followup = t->next_followup;
+		if (pipe->callback_deferred) {
+			t->qtd.token = token & ~0x8000;
+			if (defer_Transfer(t)) continue;
+			t->qtd.token = token;
+		}
+		followup_Transfer(t);
+#if defined(USBHOST_CAPTURE)
+		capture_submit(t);
+#endif
+		rearm_qTD(t);
+	}
+	return pipe->next_followup;
+}
+
+// Make a persistent pipe's qTD active again, for the same buffer.  The
+// EHCI writes back the token and the offset in buffer[0], so only those
+// need to be restored.  The token is written last.
+//
+static void rearm_qTD(Transfer_t *t)
+{
+#if defined(USBHOST_PIPE_STATS)
+	stats_queued(t, t->length << 16, ARM_DWT_CYCCNT);
+#endif
+	dma_prepare(t->buffer, t->length, 1, false);
+	t->qtd.buffer[0] = (uint32_t)(t->buffer);
+	t->qtd.token = (t->length << 16) | 0x8000 | (1 << 8) | 0x80;
+}
+
+#if defined(USBHOST_PIPE_STATS)
+#if defined(__IMXRT1062__)
+#define CYCLES_PER_MICROSECOND (F_CPU_ACTUAL / 1000000)
+#else
+#define CYCLES_PER_MICROSECOND (F_CPU / 1000000)
+#endif
+
+// Remember when a qTD was queued, and how many bytes it was given
+static void stats_queued(Transfer_t *t, uint32_t token, uint32_t cycles)
+{
+	t->queued_cycles = cycles;
+	t->qtd_length = (token >> 16) & 0x7FFF;
+}
+
+// Count a successfully completed qTD in its pipe's statistics.  The
+// latency is only counted for the qTD which completes the transfer.
+static void stats_completed(Pipe_t *pipe, const Transfer_t *t, uint32_t token)
+{
+	uint32_t remain = (token >> 16) & 0x7FFF;
+	pipe->stat_bytes += t->qtd_length - remain;
+	if (remain && ((token >> 8) & 3) == 1) pipe->stat_short_packets++;
+	if (token & 0x8000) {
+		pipe->stat_transfers++;
+		uint32_t us = (ARM_DWT_CYCCNT - t->queued_cycles) / CYCLES_PER_MICROSECOND;
+		uint32_t n = (us > 1) ? 31 - __builtin_clz(us) : 0;
+		if (n > 19) n = 19;
+		pipe->stat_latency[n]++;
+	}
+}
+
+static void add_pipe_stats(Pipe_t *pipe, pipestats_t &stats, bool reset)
+{
+	stats.transfers += pipe->stat_transfers;
+	stats.bytes += pipe->stat_bytes;
+	stats.short_packets += pipe->stat_short_packets;
+	for (uint32_t i=0; i < 20; i++) {
+		stats.latency[i] += pipe->stat_latency[i];
+	}
+	stats.stalls += pipe->stall_count;
+	stats.babbles += pipe->babble_count;
+	stats.xacterrs += pipe->xacterr_count;
+	stats.buffer_errors += pipe->buffer_error_count;
+	if (reset) {
+		pipe->stat_transfers = 0;
+		pipe->stat_bytes = 0;
+		pipe->stat_short_packets = 0;
+		memset(pipe->stat_latency, 0, sizeof(pipe->stat_latency));
+		pipe->stall_count = 0;
+		pipe->babble_count = 0;
+		pipe->xacterr_count = 0;
+		pipe->buffer_error_count = 0;
+	}
+}
+
+bool USBHost::pipeStats(Device_t *dev, pipestats_t &stats, bool reset)
+{
+	memset(&stats, 0, sizeof(stats));
+	if (!dev) return false;
+	__disable_irq();
+	if (dev->control_pipe) add_pipe_stats(dev->control_pipe, stats, reset);
+	for (Pipe_t *pipe = dev->data_pipes; pipe; pipe = pipe->next) {
+		add_pipe_stats(pipe, stats, reset);
+	}
+	__enable_irq();
+	return true;
+}
+#endif
+
+// An error halted the pipe.  The EHCI will not do any more work on this
+// QH until we remove the halted qTD.  Unfinished transfers are removed
+// too, the pipe is restored to a working state, and then the driver gets
+// callbacks for all of them.
+//
+void USBHost::followup_Halted_Pipe(Pipe_t *pipe, bool restart)
+{
+	println("    halted pipe ", (uint32_t)pipe, HEX);
+	Transfer_t *first = pipe->first_followup;
+	// the dummy halt transfer is always after the last queued qTD
+	Transfer_t *dummy = (Transfer_t *)(pipe->last_followup->qtd.next & ~0x1F);
+	pipe->first_followup = NULL;
+	pipe->last_followup = NULL;
+	if (pipe->type == 0 || pipe->type == 2) {
+		pipe->device->controller->remove_from_async_followup_list(pipe);
+	} else {
+		pipe->device->controller->remove_from_periodic_followup_list(pipe);
+	}
+	if (dummy && (dummy->qtd.token & 0x40)) {
+		// unhalt the pipe, "forget" unfinished transfers
+		println("  dummy halt: ", (uint32_t)dummy, HEX);
+		pipe->qh.next = (uint32_t)dummy;
+		pipe->qh.current = 0;
+		pipe->qh.token = restart ? 0 : 0x40;
+	} else {
+		println("  no dummy halt found, yikes!");
+		// TODO: this should never happen, but what if it does?
+	}
+	// Do any driver callbacks belonging to the halted and unfinished
+	// transfers.  This is done last, after retoring the pipe to a
+	// working state (if possible) so the driver callback can use the pipe.
+#if defined(USBHOST_CAPTURE)
+	// the first transfer ended with the halt, any others are cancelled
+	uint32_t capture_token = first ? first->qtd.token : 0;
+	pipe->capture_remain = 0;
+#endif
+	Transfer_t *p = first;
 	while (p) {
-		if (followup_Transfer(p)) {
-			// transfer completed
-			Transfer_t *next = p->next_followup;
-			remove_from_async_followup_list(p);
-			println("    remove from followup list");
-			if (p->qtd.token & 0x40) {
-				Pipe_t *haltedpipe = p->pipe;
-				free_Transfer(p);
-				// traverse the rest of the list for unfinished work
-				// from this halted pipe.  Remove from the followup
-				// list and put onto our own temporary list
-				Transfer_t *first = NULL;
-				Transfer_t *last = NULL;
+		uint32_t token = p->qtd.token;
+		Transfer_t *next = p->next_followup;
+		if (token & 0x8000) {
+			dma_complete(pipe, p, p->length - ((token >> 16) & 0x7FFF));
+		} else {
+			dma_complete_pages(pipe, p);
+		}
+#if defined(USBHOST_CAPTURE)
+		if (token & 0x8000) {
+			capture_complete(p, p->length, capture_token);
+			capture_token = 0x80;
+		}
+#endif
+		if (token & 0x8000 && pipe->callback_function) {
+			// driver expects a callback
+			p->qtd.token = token | 0x40;
+			if (pipe->callback_deferred && defer_Transfer(p)) {
 				p = next;
-				while (p) {
-					Transfer_t *next2 = p->next_followup;
-					if (p->pipe == haltedpipe) {
-						println("    stray halted ", (uint32_t)p, HEX);
-						remove_from_async_followup_list(p);
-						if (first == NULL) {
-							first = p;
-							last = p;
-						} else {
-							last->next_followup = p;
-						}
-						p->next_followup = NULL;
-						if (next == p) next = next2;
-					}
-					p = next2;
-				}
-				// halted pipe (probably) still has unfinished transfers
-				// find the halted pipe's dummy halt transfer
-				p = (Transfer_t *)(haltedpipe->qh.next & ~0x1F);
-				while (p && ((p->qtd.token & 0x40) == 0)) {
-					print("  qtd: ", (uint32_t)p, HEX);
-					print(", token=", (uint32_t)p->qtd.token, HEX);
-					println(", next=", (uint32_t)p->qtd.next, HEX);
-					p = (Transfer_t *)(p->qtd.next & ~0x1F);
-				}
-				if (p) {
-					// unhalt the pipe, "forget" unfinished transfers
-					// hopefully they're all on the list we made!
-					println("  dummy halt: ", (uint32_t)p, HEX);
-					haltedpipe->qh.next = (uint32_t)p;
-					haltedpipe->qh.current = 0;
-					haltedpipe->qh.token = 0;
-				} else {
-					println("  no dummy halt found, yikes!");
-					// TODO: this should never happen, but what if it does?
-				}
-
-				// Do any driver callbacks belonging to the unfinished
-				// transfers.  This is done last, after retoring the
-				// pipe to a working state (if possible) so the driver
-				// callback can use the pipe.
-				p = first;
-				while (p) {
-					uint32_t token = p->qtd.token;
-					if (token & 0x8000 && haltedpipe->callback_function) {
-						// driver expects a callback
-						p->qtd.token = token | 0x40;
-						(*(p->pipe->callback_function))(p);
-					}
-					Transfer_t *next2 = p->next_followup;
-					free_Transfer(p);
-					p = next2;
-				}
-			} else {
-				free_Transfer(p);
+				continue;
 			}
-			p = next;
+			(*(pipe->callback_function))(p);
+		}
+		free_Transfer(p);
+		p = next;
+	}
+}
+
+// Drivers may choose, for each pipe, whether their callback function is
+// called from the USBHS interrupt (the default) or later from Task().
+// Deferred callbacks keep lengthy driver work out of the interrupt, at
+// the cost of added latency until the user's program calls Task().
+//
+void USBHost::defer_Callbacks(Pipe_t *pipe, bool deferred)
+{
+	if (pipe) pipe->callback_deferred = deferred ? 1 : 0;
+}
+
+// Add a completed transfer to the deferred callback queue.  Returns false
+// if the queue is full, in which case the callback must be done now.
+//
+bool USBHost::defer_Transfer(Transfer_t *transfer)
+{
+	uint32_t head = deferred_queue_head + 1;
+	if (head >= DEFERRED_QUEUE_SIZE) head = 0;
+	if (head == deferred_queue_tail) return false;
+	deferred_queue[head] = transfer;
+	deferred_queue_head = head;
+	return true;
+}
+
+// Run the callbacks for deferred transfers and free them.  The USBHS
+// interrupt is masked only while each callback runs, as drivers commonly
+// queue more transfers from their callbacks.
+//
+void USBHost::run_deferred_callbacks(void)
+{
+	uint32_t tail = deferred_queue_tail;
+	while (tail != deferred_queue_head) {
+		if (++tail >= DEFERRED_QUEUE_SIZE) tail = 0;
+		NVIC_DISABLE_IRQ(IRQ_USBHS);
+		Transfer_t *transfer = deferred_queue[tail];
+		if (transfer == NULL) {
+			// delete_Pipe() removed a persistent pipe's qTD
+			deferred_queue_tail = tail;
+			NVIC_ENABLE_IRQ(IRQ_USBHS);
+			continue;
+		}
+		// pipe is NULL if delete_Pipe() ran after this transfer completed
+		Pipe_t *pipe = transfer->pipe;
+		if (pipe && pipe->callback_function) {
+			(*(pipe->callback_function))(transfer);
+		}
+		if (pipe && pipe->persistent) {
+#if defined(USBHOST_CAPTURE)
+			capture_submit(transfer);
+#endif
+			rearm_qTD(transfer);
 		} else {
-			// transfer still pending
-			println("    remain on followup list");
-			p = p->next_followup;
+			free_Transfer(transfer);
 		}
+		deferred_queue_tail = tail;
+		NVIC_ENABLE_IRQ(IRQ_USBHS);
 	}
-	// TODO: handle errors from periodic schedule!
 }
 
-static void add_to_async_followup_list(Transfer_t *first, Transfer_t *last)
+// An interrupt pipe halted, either from a STALL or because the EHCI gave
+// up after repeated errors.  Its transfers are kept.  CLEAR_FEATURE
+// (ENDPOINT_HALT) is sent to the device, and when it completes, the
+// halted transfer is resumed.  While that happens, followup_Pipe()
+// ignores this pipe.  If the pipe keeps halting, it's left halted, so a
+// misbehaving device can't use a large share of the interrupt's time.
+//
+void USBHost::followup_Periodic_Halt(Pipe_t *pipe)
 {
-	last->next_followup = NULL; // always add to end of list
+	uint32_t token = pipe->first_followup->qtd.token;
+	println("    halted periodic pipe ", (uint32_t)pipe, HEX);
+	if (token & 0x20) {
+		if (pipe->buffer_error_count < 0xFFFF) pipe->buffer_error_count++;
+	}
+	if (token & 0x10) {
+		if (pipe->babble_count < 0xFFFF) pipe->babble_count++;
+	}
+	if (token & 0x08) {
+		if (pipe->xacterr_count < 0xFFFF) pipe->xacterr_count++;
+	}
+	if (!(token & 0x38)) {
+		if (pipe->stall_count < 0xFFFF) pipe->stall_count++;
+	}
+	if (++pipe->errors <= PIPE_ERROR_LIMIT) {
+		pipe->halt_state = 1;
+		uint32_t endpoint = (pipe->qh.capabilities[0] >> 8) & 15;
+		if (pipe->direction) endpoint |= 0x80;
+		mk_setup(pipe->clear_halt_setup, 0x02, 1, 0, endpoint, 0); // 1=CLEAR_FEATURE
+		if (queue_Control_Transfer(pipe->device, &pipe->clear_halt_setup, NULL, NULL)) {
+			return;
+		}
+		// can't send the request, so try resuming anyway
+		resume_Halted_Pipe(pipe);
+		return;
+	}
+	println("    too many errors, pipe left halted");
+	if (pipe->persistent) {
+		// give the driver 1 last callback, and keep the ring for delete_Pipe
+		pipe->halt_state = 2;
+		followup_Transfer(pipe->first_followup);
+	} else {
+		// the driver gets callbacks for all transfers, as with async pipes
+		followup_Halted_Pipe(pipe, false);
+		pipe->halt_state = 2;
+	}
+}
+
+// The device finished our CLEAR_FEATURE(ENDPOINT_HALT).  Its data toggle
+// is now DATA0.  Whether it succeeded or not, resume the halted pipe.
+//
+void USBHost::followup_Clear_Halt(const Transfer_t *transfer)
+{
+	Device_t *dev = transfer->pipe->device;
+	uint32_t endpoint = transfer->setup.wIndex;
+	for (Pipe_t *pipe = dev->data_pipes; pipe; pipe = pipe->next) {
+		if (pipe->halt_state != 1) continue;
+		uint32_t n = (pipe->qh.capabilities[0] >> 8) & 15;
+		if (pipe->direction) n |= 0x80;
+		if (n == endpoint) {
+			resume_Halted_Pipe(pipe);
+			return;
+		}
+	}
+}
+
+// Restart a halted interrupt pipe, beginning with the halted qTD.
+//
+void USBHost::resume_Halted_Pipe(Pipe_t *pipe)
+{
+	println("    resume halted pipe ", (uint32_t)pipe, HEX);
+	pipe->halt_state = 0;
+	Transfer_t *t = pipe->first_followup;
+	if (!t) return;
+	// DATA0, 3 retries, active.  Remaining length & buffer position are kept.
+	t->qtd.token = (t->qtd.token & 0x7FFFF300) | (3 << 10) | 0x80;
+	pipe->qh.next = (uint32_t)t;
+	pipe->qh.current = 0;
+	pipe->qh.token = 0; // no longer halted, DATA0 toggle
+}
+
+void USBHost::followup_Error(USBHostController *hc)
+{
+	println("ERROR Followup");
+	Pipe_t *pipe = hc->async_followup_first;
+	while (pipe) {
+		pipe = followup_Pipe(pipe);
+	}
+	pipe = hc->periodic_followup_first;
+	while (pipe) {
+		pipe = followup_Pipe(pipe);
+	}
+}
+
+void USBHostController::add_to_async_followup_list(Pipe_t *pipe)
+{
+	pipe->next_followup = NULL; // always add to end of list
 	if (async_followup_last == NULL) {
-		first->prev_followup = NULL;
-		async_followup_first = first;
+		pipe->prev_followup = NULL;
+		async_followup_first = pipe;
 	} else {
-		first->prev_followup = async_followup_last;
-		async_followup_last->next_followup = first;
+		pipe->prev_followup = async_followup_last;
+		async_followup_last->next_followup = pipe;
 	}
-	async_followup_last = last;
+	async_followup_last = pipe;
 }
 
-static void remove_from_async_followup_list(Transfer_t *transfer)
+void USBHostController::remove_from_async_followup_list(Pipe_t *pipe)
 {
-	Transfer_t *next = transfer->next_followup;
-	Transfer_t *prev = transfer->prev_followup;
+	Pipe_t *next = pipe->next_followup;
+	Pipe_t *prev = pipe->prev_followup;
 	if (prev) {
 		prev->next_followup = next;
 	} else {
@@ -985,23 +2296,23 @@ static void remove_from_async_followup_list(Transfer_t *transfer)
 	}
 }
 
-static void add_to_periodic_followup_list(Transfer_t *first, Transfer_t *last)
+void USBHostController::add_to_periodic_followup_list(Pipe_t *pipe)
 {
-	last->next_followup = NULL; // always add to end of list
+	pipe->next_followup = NULL; // always add to end of list
 	if (periodic_followup_last == NULL) {
-		first->prev_followup = NULL;
-		periodic_followup_first = first;
+		pipe->prev_followup = NULL;
+		periodic_followup_first = pipe;
 	} else {
-		first->prev_followup = periodic_followup_last;
-		periodic_followup_last->next_followup = first;
+		pipe->prev_followup = periodic_followup_last;
+		periodic_followup_last->next_followup = pipe;
 	}
-	periodic_followup_last = last;
+	periodic_followup_last = pipe;
 }
 
-static void remove_from_periodic_followup_list(Transfer_t *transfer)
+void USBHostController::remove_from_periodic_followup_list(Pipe_t *pipe)
 {
-	Transfer_t *next = transfer->next_followup;
-	Transfer_t *prev = transfer->prev_followup;
+	Pipe_t *next = pipe->next_followup;
+	Pipe_t *prev = pipe->prev_followup;
 	if (prev) {
 		prev->next_followup = next;
 	} else {
@@ -1014,31 +2325,352 @@ static void remove_from_periodic_followup_list(Transfer_t *transfer)
 	}
 }
 
+// Start streaming on an isochronous pipe.  A ring of iTD (high speed) or
+// siTD (full speed) is added to the periodic schedule, one for each frame
+// the pipe uses, beginning 2 frames in the future.  The buffer must have
+// room for "frames" times 1 frame of data, which is the maximum packet
+// size (times the high bandwidth multiplier) for each microframe in the
+// pipe's start_mask.  As each frame completes, the pipe's
+// isochronous_callback is called from the interrupt, and then the same
+// iTD or siTD and part of the buffer are used again for a later frame.
+// For OUT pipes, the callback should fill the buffer with the next data,
+// and may change the packet lengths with isochronous_Set_Length().  Cache
+// maintenance is done for each frame, before the EHCI uses it and before
+// the callback, unless flags has TRANSFER_UNCACHED.
+//
+bool USBHost::start_Isochronous(Pipe_t *pipe, void *buffer, uint32_t frames,
+	USBDriver *driver, uint32_t flags)
+{
+	if (!pipe || pipe->type != 1 || pipe->isochronous || frames == 0) return false;
+	USBHostController *hc = pipe->device->controller;
+	uint32_t interval = pipe->periodic_interval;
+	// the ring must not reach around to the frame the EHCI is doing now
+	if (frames * interval + 2 > hc->periodic_size) return false;
+	uint32_t maxlen = (pipe->qh.capabilities[0] >> 16) & 0x7FF;
+	uint32_t packets = 1;
+	if (pipe->device->speed == 2) {
+		maxlen *= pipe->qh.capabilities[1] >> 30;
+		packets = __builtin_popcount(pipe->start_mask);
+	}
+	// allocate all the iTD or siTD, or none
+	Isochronous_t *first = NULL, *last = NULL;
+	for (uint32_t i=0; i < frames; i++) {
+		Isochronous_t *iso = allocate_Isochronous();
+		if (!iso) {
+			println("  error allocating isochronous ring");
+			while (first) {
+				Isochronous_t *next = first->next;
+				free_Isochronous(first);
+				first = next;
+			}
+			return false;
+		}
+		memset(iso, 0, sizeof(Isochronous_t));
+		if (last) {
+			last->next = iso;
+		} else {
+			first = iso;
+		}
+		last = iso;
+	}
+	last->next = first;
+	// each frame gets its own portion of the buffer
+	uint32_t frame = (hc->regs->FRINDEX >> 3) + 2;
+	while ((frame & (interval - 1)) != pipe->periodic_offset) frame++;
+	uint8_t *p = (uint8_t *)buffer;
+	Isochronous_t *iso = first;
+	do {
+		iso->pipe = pipe;
+		iso->buffer = p;
+		iso->driver = driver;
+		iso->length = maxlen;
+		iso->flags = flags;
+		iso->frame = frame & (hc->periodic_size - 1);
+		init_Isochronous(pipe, iso, true);
+		p += maxlen * packets;
+		frame += interval;
+		iso = iso->next;
+	} while (iso != first);
+	pipe->isochronous = first;
+	pipe->isochronous_frames = frames;
+	NVIC_DISABLE_IRQ(IRQ_USBHS);
+	do {
+		hc->link_Isochronous(pipe, iso);
+		iso = iso->next;
+	} while (iso != first);
+	hc->add_to_periodic_followup_list(pipe);
+	NVIC_ENABLE_IRQ(IRQ_USBHS);
+	return true;
+}
 
-static uint32_t max4(uint32_t n1, uint32_t n2, uint32_t n3, uint32_t n4)
+// Complete all finished frames on an isochronous pipe, oldest first.  After
+// the driver's callback, each iTD or siTD is moved to the frame after the
+// newest one still in the schedule.  If the interrupt was delayed so long
+// the EHCI already passed that frame, it waits a full trip around the
+// periodic schedule, and the data stream has a glitch.
+//
+Pipe_t * USBHost::followup_Isochronous(Pipe_t *pipe)
 {
-	if (n1 > n2) {
-		// can't be n2
-		if (n1 > n3) {
-			// can't be n3
-			if (n1 > n4) return n1;
+	USBHostController *hc = pipe->device->controller;
+	uint32_t step = pipe->isochronous_frames * pipe->periodic_interval;
+	while (1) {
+		Isochronous_t *iso = pipe->isochronous;
+		if (pipe->device->speed == 2) {
+			uint32_t status = 0;
+			for (uint32_t i=0; i < 8; i++) {
+				status |= iso->itd.transaction[i];
+			}
+			if (status & 0x80000000) break; // still active
 		} else {
-			// can't be n1
-			if (n3 > n4) return n3;
+			if (iso->sitd.state & 0x80) break; // still active
+		}
+		USBHOST_TRACE_EVENT(TRACE_ISOCHRONOUS, iso, iso->frame);
+		completion_count++;
+		dma_complete_isochronous(pipe, iso);
+		if (pipe->isochronous_callback) {
+			(*(pipe->isochronous_callback))(iso);
+		}
+		hc->unlink_Isochronous(iso);
+		iso->frame = (iso->frame + step) & (hc->periodic_size - 1);
+		init_Isochronous(pipe, iso, false);
+		hc->link_Isochronous(pipe, iso);
+		pipe->isochronous = iso->next;
+	}
+	return pipe->next_followup;
+}
+
+// Fill in the iTD or siTD fields for its data in the buffer.  The first
+// time all fields are written.  When reused, OUT packet lengths given by
+// isochronous_Set_Length() are kept.  The frame's data, which the driver
+// may have just written, is prepared for the EHCI, as in dma_prepare().
+//
+static void init_Isochronous(Pipe_t *pipe, Isochronous_t *iso, bool first)
+{
+	if (!(iso->flags & USBHost::TRANSFER_UNCACHED)) {
+		dma_prepare(iso->buffer, isochronous_bytes(pipe, iso), pipe->direction, false);
+	}
+	uint32_t addr = (uint32_t)iso->buffer;
+	uint32_t page = addr & 0xFFFFF000;
+	uint32_t cap0 = pipe->qh.capabilities[0];
+	uint32_t cap1 = pipe->qh.capabilities[1];
+	if (pipe->device->speed == 2) {
+		// high speed, iTD
+		if (first) {
+			iso->itd.buffer[0] = page | (cap0 & 0xF7F); // endpoint & address
+			iso->itd.buffer[1] = (page + 0x1000) | (pipe->direction << 11)
+				| ((cap0 >> 16) & 0x7FF);
+			iso->itd.buffer[2] = (page + 0x2000) | (cap1 >> 30); // mult
+			for (uint32_t i=3; i < 7; i++) {
+				iso->itd.buffer[i] = page + (i << 12);
+			}
+		}
+		uint32_t mask = pipe->start_mask;
+		uint32_t last = 31 - __builtin_clz(mask);
+		for (uint32_t i=0; i < 8; i++) {
+			if (!(mask & (1 << i))) {
+				iso->itd.transaction[i] = 0;
+				continue;
+			}
+			uint32_t len = iso->length;
+			if (!first && pipe->direction == 0) {
+				len = (iso->itd.transaction[i] >> 16) & 0xFFF;
+			}
+			// page select and offset together are the distance from page
+			iso->itd.transaction[i] = 0x80000000 | (len << 16) |
+				((i == last) ? 0x8000 : 0) | (addr - page);
+			addr += iso->length;
 		}
 	} else {
-		// can't be n1
-		if (n2 > n3) {
-			// can't be n3
-			if (n2 > n4) return n2;
-		} else {
-			// can't be n2
-			if (n3 > n4) return n3;
+		// full or low speed, siTD through the hub's transaction translator
+		uint32_t len = iso->length;
+		if (first) {
+			iso->sitd.capabilities = (pipe->direction << 31) |
+				(((cap1 >> 23) & 0x7F) << 24) | (((cap1 >> 16) & 0x7F) << 16) |
+				(cap0 & 0xF7F);
+			iso->sitd.schedule = (pipe->complete_mask << 8) | pipe->start_mask;
+			iso->sitd.back = 1;
+		}
+		iso->sitd.buffer[0] = addr;
+		uint32_t page1 = page + 0x1000;
+		if (pipe->direction == 0) {
+			// OUT data is sent with 1 start split per 188 bytes
+			uint32_t count = (len > 188) ? (len + 187) / 188 : 1;
+			page1 |= ((count > 1) ? (1 << 3) : 0) | count; // TP=Begin or All
 		}
+		iso->sitd.buffer[1] = page1;
+		iso->sitd.state = 0x80000000 | (len << 16) | 0x80;
 	}
-	return n4;
 }
 
+// Bytes of the buffer an iTD or siTD uses: for high speed, 1 packet for
+// each microframe in the start_mask.
+//
+static uint32_t isochronous_bytes(const Pipe_t *pipe, const Isochronous_t *iso)
+{
+	if (pipe->device->speed != 2) return iso->length;
+	return iso->length * __builtin_popcount(pipe->start_mask);
+}
+
+// Isochronous iTD & siTD are linked at the beginning of each frame's list,
+// ahead of all the interrupt QHs, so the tree of QHs built by
+// add_qh_to_periodic_schedule() never needs to know about them.
+//
+void USBHostController::link_Isochronous(Pipe_t *pipe, Isochronous_t *iso)
+{
+	uint32_t type = (pipe->device->speed == 2) ? 0 : 4; // 0=iTD, 4=siTD
+	iso->itd.next = periodictable[iso->frame];
+	periodictable[iso->frame] = (uint32_t)iso | type;
+}
+
+void USBHostController::unlink_Isochronous(Isochronous_t *iso)
+{
+	volatile uint32_t *link = &periodictable[iso->frame];
+	while (1) {
+		uint32_t num = *link;
+		if ((num & 1) || (num & 6) == 2) return; // reached the QHs, not found
+		Isochronous_t *node = (Isochronous_t *)(num & 0xFFFFFFE0);
+		if (node == iso) {
+			*link = iso->itd.next;
+			return;
+		}
+		link = &(node->itd.next);
+	}
+}
+
+// Find the link to the first QH in a frame's list, skipping past any iTD
+// or siTD, which are always first.
+//
+volatile uint32_t * USBHostController::periodic_qh_link(uint32_t frame)
+{
+	volatile uint32_t *link = &periodictable[frame];
+	while (1) {
+		uint32_t num = *link;
+		if ((num & 1) || (num & 6) == 2) return link;
+		link = &(((Isochronous_t *)(num & 0xFFFFFFE0))->itd.next);
+	}
+}
+
+// Find the link to the first QH polled at an interval & offset.  The
+// slowest interval has no anchor, each frame's own list is used.  Other
+// intervals must be periodic_level()'s.
+//
+volatile uint32_t * USBHostController::periodic_anchor_link(uint32_t interval, uint32_t offset)
+{
+	if (interval >= periodic_size) return periodic_qh_link(offset);
+	return &(anchor[interval - 1 + offset].horizontal_link);
+}
+
+// The link which ends the list of pipes at an interval & offset, to the
+// anchor of the next faster interval, or terminate after interval 1.
+//
+uint32_t USBHostController::periodic_anchor_next(uint32_t interval, uint32_t offset)
+{
+	if (interval <= 1) return 1;
+	interval >>= 1;
+	if (interval > anchor_leaves) interval = anchor_leaves;
+	return (uint32_t)&anchor[interval - 1 + (offset & (interval - 1))] | 2; // 2=QH
+}
+
+bool USBHostController::is_periodic_anchor(uint32_t num)
+{
+	uint32_t addr = num & 0xFFFFFFE0;
+	return addr >= (uint32_t)&anchor[0]
+		&& addr < (uint32_t)&anchor[anchor_leaves*2-1];
+}
+
+// The interval, in frames, a pipe wanting to be polled at least this often
+// is linked at: the whole frame list, or the anchor tree's, which has no
+// levels between its leaves and the frame list.
+//
+uint32_t USBHostController::periodic_level(uint32_t interval)
+{
+	if (interval >= periodic_size) return periodic_size;
+	if (interval > anchor_leaves) return anchor_leaves;
+	return interval;
+}
+
+#if defined(USBHOST_VERIFY_SCHEDULE)
+// Check the periodic schedule tree.  Every list must hold only pipes of
+// its own interval & offset, and end at the next faster anchor.
+//
+void USBHost::verify_periodic_schedule(USBHostController *hc)
+{
+	uint32_t errors = 0;
+	for (uint32_t interval=1; interval <= hc->periodic_size; interval <<= 1) {
+		if (hc->periodic_level(interval) != interval) continue; // no such level
+		for (uint32_t offset=0; offset < interval; offset++) {
+			volatile uint32_t *link = hc->periodic_anchor_link(interval, offset);
+			uint32_t end = hc->periodic_anchor_next(interval, offset);
+			uint32_t count = 0;
+			while (1) {
+				uint32_t num = *link;
+				if (num == end) break;
+				Pipe_t *node = (Pipe_t *)(num & 0xFFFFFFE0);
+				if ((num & 1) || (num & 6) != 2 || hc->is_periodic_anchor(num)
+				  || node->periodic_interval != interval
+				  || node->periodic_offset != offset || ++count > 1000) {
+					print("periodic schedule error, interval=", interval);
+					print(", offset=", offset);
+					println(", link=", num, HEX);
+					errors++;
+					break;
+				}
+				link = &(node->qh.horizontal_link);
+			}
+		}
+	}
+	if (errors) println("periodic schedule errors: ", errors);
+}
+#endif
+
+// Results for each packet, for use by the isochronous callback.  For high
+// speed pipes, packet is the microframe number, 0 to 7.  Full speed pipes
+// have only 1 packet per frame.
+//
+uint32_t USBHost::isochronous_Length(const Isochronous_t *iso, uint32_t packet)
+{
+	if (iso->pipe->device->speed == 2) {
+		if (packet > 7) return 0;
+		return (iso->itd.transaction[packet] >> 16) & 0xFFF;
+	}
+	uint32_t remain = (iso->sitd.state >> 16) & 0x3FF;
+	return (remain < iso->length) ? iso->length - remain : 0;
+}
+
+// Returns zero for success, or the EHCI error bits
+//   iTD:  4=data buffer error, 2=babble, 1=transaction error
+//   siTD: 0x40=ERR response, 0x20=data buffer error, 0x10=babble,
+//         0x08=transaction error, 0x04=missed microframe
+//
+uint32_t USBHost::isochronous_Status(const Isochronous_t *iso, uint32_t packet)
+{
+	if (iso->pipe->device->speed == 2) {
+		if (packet > 7) return 0;
+		return (iso->itd.transaction[packet] >> 28) & 7;
+	}
+	return iso->sitd.state & 0x7C;
+}
+
+// Change the length of an OUT packet, used the next time this iTD or siTD
+// goes into the schedule.  Audio at rates like 44.1 kHz needs this, as the
+// number of samples varies from frame to frame.  The length can't be more
+// than the maximum packet size.
+//
+void USBHost::isochronous_Set_Length(Isochronous_t *iso, uint32_t packet, uint32_t len)
+{
+	Pipe_t *pipe = iso->pipe;
+	if (pipe->device->speed == 2) {
+		if (packet > 7) return;
+		if (len > iso->length) len = iso->length;
+		iso->itd.transaction[packet] = (iso->itd.transaction[packet] & 0xF000FFFF)
+			| (len << 16);
+	} else {
+		uint32_t maxlen = (pipe->qh.capabilities[0] >> 16) & 0x7FF;
+		iso->length = (len < maxlen) ? len : maxlen;
+	}
+}
+
+
 static uint32_t round_to_power_of_two(uint32_t n, uint32_t maxnum)
 {
 	for (uint32_t pow2num=1; pow2num < maxnum; pow2num <<= 1) {
@@ -1047,46 +2679,140 @@ static uint32_t round_to_power_of_two(uint32_t n, uint32_t maxnum)
 	return maxnum;
 }
 
-// Allocate bandwidth for an interrupt pipe.  Given the packet size
-// and other parameters, find the best place to schedule this pipe.
-// Returns true if enough bandwidth is available, and the best
+// High speed pipes start in 1 uframe of each frame, or several if
+// polled faster than once per frame.
+static uint32_t hs_start_mask(uint32_t interval, uint32_t offset)
+{
+	if (interval == 1) return 0xFF;
+	if (interval == 2) return 0x55 << (offset & 1);
+	if (interval <= 4) return 0x11 << (offset & 3);
+	return 0x01 << (offset & 7);
+}
+
+// Bandwidth a pipe uses in each uframe of a frame
+static void bandwidth_load(uint8_t *load, uint32_t smask, uint32_t cmask,
+	uint32_t stime, uint32_t ctime)
+{
+	for (uint32_t j=0; j < 8; j++) {
+		load[j] = ((smask & (1 << j)) ? stime : 0) + ((cmask & (1 << j)) ? ctime : 0);
+	}
+}
+
+inline uint8_t * USBHostController::bandwidth_node(uint32_t interval, uint32_t offset)
+{
+	return schedule->bandwidth_tree[interval - 1 + offset];
+}
+
+// Bandwidth used in uframe j by only the pipes at one node
+uint32_t USBHostController::bandwidth_own(uint32_t interval, uint32_t offset, uint32_t j)
+{
+	uint32_t n = bandwidth_node(interval, offset)[j];
+	if (interval < BANDWIDTH_FRAMES) {
+		uint32_t a = bandwidth_node(interval * 2, offset)[j];
+		uint32_t b = bandwidth_node(interval * 2, offset + interval)[j];
+		n -= (a > b) ? a : b;
+	}
+	return n;
+}
+
+// The worst uframe bandwidth, if a pipe with this load was added to a node
+uint32_t USBHostController::bandwidth_worst(uint32_t interval, uint32_t offset, const uint8_t *load)
+{
+	uint32_t max_bandwidth = 0;
+	for (uint32_t j=0; j < 8; j++) {
+		uint32_t bandwidth = bandwidth_node(interval, offset)[j] + load[j];
+		// add the faster pipes, also polled in all these frames
+		for (uint32_t i=interval, o=offset; i > 1; ) {
+			i >>= 1;
+			o &= i - 1;
+			bandwidth += bandwidth_own(i, o, j);
+		}
+		if (bandwidth > max_bandwidth) max_bandwidth = bandwidth;
+	}
+	return max_bandwidth;
+}
+
+// Add or remove a pipe's load at a node, and update all nodes above it
+void USBHostController::bandwidth_update(uint32_t interval, uint32_t offset, const uint8_t *load, bool add)
+{
+	for (uint32_t j=0; j < 8; j++) {
+		if (load[j] == 0) continue;
+		// remember each node's own bandwidth, before anything changes
+		uint8_t own[12];
+		uint32_t depth = 0;
+		for (uint32_t i=interval, o=offset; i > 1; ) {
+			i >>= 1;
+			o &= i - 1;
+			own[depth++] = bandwidth_own(i, o, j);
+		}
+		if (add) {
+			bandwidth_node(interval, offset)[j] += load[j];
+		} else {
+			bandwidth_node(interval, offset)[j] -= load[j];
+		}
+		depth = 0;
+		for (uint32_t i=interval, o=offset; i > 1; ) {
+			i >>= 1;
+			o &= i - 1;
+			uint32_t a = bandwidth_node(i * 2, o)[j];
+			uint32_t b = bandwidth_node(i * 2, o + i)[j];
+			bandwidth_node(i, o)[j] = own[depth++] + ((a > b) ? a : b);
+		}
+	}
+}
+
+// Allocate bandwidth for an interrupt or isochronous pipe.  Given the
+// packet size and other parameters, find the best place to schedule this
+// pipe.  Returns true if enough bandwidth is available, and the best
 // frame offset, smask and cmask.  Or returns false if no group
-// of microframes has enough bandwidth available.
+// of microframes has enough bandwidth available, with bandwidth_result
+// telling why.  Full and low speed pipes must also fit into the budget
+// of their hub's transaction translator.
 //
 //   pipe:
 //     device->speed      [in]   0=full speed, 1=low speed, 2=high speed
+//     type               [in]   1=isochronous, 3=interrupt
 //     direction          [in]   0=OUT, 1=IN
 //     start_mask         [out]  uframes to start transfer
 //     complete_mask      [out]  uframes to complete transfer (FS & LS only)
 //     periodic_interval  [out]  fream repeat level: 1, 2, 4, 8... PERIODIC_LIST_SIZE
 //     periodic_offset    [out]  frame repeat offset: 0 to periodic_interval-1
-//   maxlen:              [in]   maximum packet length
-//   interval:            [in]   polling interval: LS+FS: frames, HS: 2^(n-1) uframes
+//   maxlen:              [in]   maximum packet length, with high bandwidth bits
+//   interval:            [in]   polling interval: interrupt LS+FS: frames,
+//                               isochronous FS: 2^(n-1) frames, HS: 2^(n-1) uframes
 //
 bool USBHost::allocate_interrupt_pipe_bandwidth(Pipe_t *pipe, uint32_t maxlen, uint32_t interval)
 {
 	println("allocate_interrupt_pipe_bandwidth");
+	USBHostController *hc = pipe->device->controller;
 	if (interval == 0) interval = 1;
+	// high bandwidth endpoints move up to 3 packets per uframe
+	maxlen = (maxlen & 0x7FF) * (((maxlen >> 11) & 3) + 1);
+	uint32_t bestlen = maxlen; // best case is no bit stuffing
 	maxlen = (maxlen * 76459) >> 16; // worst case bit stuffing
+	bandwidth_result = BANDWIDTH_OK;
 	if (pipe->device->speed == 2) {
 		// high speed 480 Mbit/sec
 		println("  ep interval = ", interval);
 		if (interval > 15) interval = 15;
 		interval = 1 << (interval - 1);
-		if (interval > PERIODIC_LIST_SIZE*8) interval = PERIODIC_LIST_SIZE*8;
+		if (interval > hc->periodic_size*8) interval = hc->periodic_size*8;
+		if (pipe->type == 3 && interval >= 8) {
+			interval = hc->periodic_level(interval >> 3) * 8;
+		}
 		println("  interval = ", interval);
 		uint32_t pinterval = interval >> 3;
 		pipe->periodic_interval = (pinterval > 0) ? pinterval : 1;
+		if (interval > BANDWIDTH_FRAMES*8) interval = BANDWIDTH_FRAMES*8;
+		uint32_t finterval = (pinterval > 0) ? (interval >> 3) : 1;
 		uint32_t stime = (55 + 32 + maxlen) >> 5; // time units: 32 bytes or 533 ns
 		uint32_t best_offset = 0xFFFFFFFF;
 		uint32_t best_bandwidth = 0xFFFFFFFF;
 		for (uint32_t offset=0; offset < interval; offset++) {
 			// for each possible uframe offset, find the worst uframe bandwidth
-			uint32_t max_bandwidth = 0;
-			for (uint32_t i=offset; i < PERIODIC_LIST_SIZE*8; i += interval) {
-				uint32_t bandwidth = uframe_bandwidth[i] + stime;
-				if (bandwidth > max_bandwidth) max_bandwidth = bandwidth;
-			}
+			uint8_t load[8];
+			bandwidth_load(load, hs_start_mask(interval, offset), 0, stime, 0);
+			uint32_t max_bandwidth = hc->bandwidth_worst(finterval, offset >> 3, load);
 			// remember which uframe offset is the best
 			if (max_bandwidth < best_bandwidth) {
 				best_bandwidth = max_bandwidth;
@@ -1099,67 +2825,117 @@ bool USBHost::allocate_interrupt_pipe_bandwidth(Pipe_t *pipe, uint32_t maxlen, u
 		//println(best_offset);
 		// a 125 us micro frame can fit 7500 bytes, or 234 of our 32-byte units
 		// fail if the best found needs more than 80% (234 * 0.8) in any uframe
-		if (best_bandwidth > 187) return false;
-		// save essential bandwidth specs, for cleanup in delete_Pipe
-		pipe->bandwidth_interval = interval;
-		pipe->bandwidth_offset = best_offset;
-		pipe->bandwidth_stime = stime;
-		for (uint32_t i=best_offset; i < PERIODIC_LIST_SIZE*8; i += interval) {
-			uframe_bandwidth[i] += stime;
-		}
-		if (interval == 1) {
-			pipe->start_mask = 0xFF;
-		} else if (interval == 2) {
-			pipe->start_mask = 0x55 << (best_offset & 1);
-		} else if (interval <= 4) {
-			pipe->start_mask = 0x11 << (best_offset & 3);
-		} else {
-			pipe->start_mask = 0x01 << (best_offset & 7);
+		if (best_bandwidth > 187) {
+			bandwidth_result = BANDWIDTH_UFRAME_FULL;
+			return false;
 		}
-		pipe->periodic_offset = best_offset >> 3;
+		// save essential bandwidth specs, for cleanup in delete_Pipe
+		pipe->start_mask = hs_start_mask(interval, best_offset);
 		pipe->complete_mask = 0;
+		pipe->periodic_offset = best_offset >> 3;
+		pipe->bandwidth_interval = finterval;
+		pipe->bandwidth_offset = best_offset >> 3;
+		pipe->bandwidth_stime = stime;
+		pipe->bandwidth_ctime = 0;
+		uint8_t load[8];
+		bandwidth_load(load, pipe->start_mask, 0, stime, 0);
+		hc->bandwidth_update(finterval, best_offset >> 3, load, true);
 	} else {
 		// full speed 12 Mbit/sec or low speed 1.5 Mbit/sec
-		interval = round_to_power_of_two(interval, PERIODIC_LIST_SIZE);
+		if (pipe->type == 1) {
+			if (interval > 16) interval = 16;
+			interval = 1 << (interval - 1);
+		}
+		interval = round_to_power_of_two(interval, hc->periodic_size);
+		if (pipe->type == 3) interval = hc->periodic_level(interval);
 		pipe->periodic_interval = interval;
-		uint32_t stime, ctime;
-		if (pipe->direction == 0) {
-			// for OUT direction, SSPLIT will carry the data payload
-			// TODO: how much time to SSPLIT & CSPLIT actually take?
-			// they're not documented in 5.7 or 5.11.3.
-			stime = (100 + 32 + maxlen) >> 5;
-			ctime = (55 + 32) >> 5;
+		if (interval > BANDWIDTH_FRAMES) interval = BANDWIDTH_FRAMES;
+		uint32_t smask, cmask, stime, ctime, maxshift;
+		if (pipe->type == 1) {
+			// the TT moves at most 188 bytes of isochronous data per uframe
+			uint32_t count = (maxlen > 188) ? (maxlen + 187) / 188 : 1;
+			uint32_t len = (maxlen > 188) ? 188 : maxlen;
+			if (pipe->direction == 0) {
+				// for OUT direction, 1 SSPLIT per uframe carries the data,
+				// and isochronous has no CSPLIT
+				if (count > 6) {
+					bandwidth_result = BANDWIDTH_PACKET_SIZE;
+					return false;
+				}
+				smask = (1 << count) - 1;
+				cmask = 0;
+				stime = (100 + 32 + len) >> 5;
+				ctime = 0;
+				maxshift = 6 - count;
+			} else {
+				// for IN direction, CSPLITs until all data can return.
+				// CSPLITs can't spill into the next frame without siTD
+				// back pointers, so very large packets aren't possible.
+				if (count > 4) {
+					bandwidth_result = BANDWIDTH_PACKET_SIZE;
+					return false;
+				}
+				smask = 1;
+				cmask = ((1 << (count + 2)) - 1) << 2;
+				stime = (40 + 32) >> 5;
+				ctime = (70 + 32 + len) >> 5;
+				maxshift = 4 - count;
+			}
 		} else {
-			// for IN direction, data payload in CSPLIT
-			stime = (40 + 32) >> 5;
-			ctime = (70 + 32 + maxlen) >> 5;
-		}
-		// TODO: should we take Single-TT hubs into account, avoid
-		// scheduling overlapping SSPLIT & CSPLIT to the same hub?
-		// TODO: even if Multi-TT, do we need to worry about packing
-		// too many into the same uframe?
+			smask = 0x01;
+			cmask = 0x1C;
+			maxshift = 3; // max 3 without FSTN
+			if (pipe->direction == 0) {
+				// for OUT direction, SSPLIT will carry the data payload
+				// TODO: how much time to SSPLIT & CSPLIT actually take?
+				// they're not documented in 5.7 or 5.11.3.
+				stime = (100 + 32 + maxlen) >> 5;
+				ctime = (55 + 32) >> 5;
+			} else {
+				// for IN direction, data payload in CSPLIT
+				stime = (40 + 32) >> 5;
+				ctime = (70 + 32 + maxlen) >> 5;
+			}
+		}
+		// The TT also needs room in its own full speed schedule.  The
+		// SSPLIT is sent 1 uframe before the TT is budgeted to begin
+		// the full speed transaction (best case), and the CSPLITs cover
+		// when it may complete with worst case bit stuffing.  Protocol
+		// overhead is from USB 2.0 5.11.3, and low speed is 8X slower.
+		tt_budget_t *tt = find_tt_budget(hc->schedule, pipe->device);
+		if (!tt) {
+			bandwidth_result = BANDWIDTH_TT_TABLES;
+			return false;
+		}
+		uint32_t ttime = bestlen + ((pipe->type == 1) ? 9 : 13);
+		if (pipe->device->speed == 1) ttime *= 8;
+		bandwidth_result_t tt_result = BANDWIDTH_TT_UFRAME;
 		uint32_t best_shift = 0;
 		uint32_t best_offset = 0xFFFFFFFF;
 		uint32_t best_bandwidth = 0xFFFFFFFF;
 		for (uint32_t offset=0; offset < interval; offset++) {
-			// for each 1ms frame offset, compute the worst uframe usage
-			uint32_t max_bandwidth = 0;
-			for (uint32_t i=offset; i < PERIODIC_LIST_SIZE; i += interval) {
-				for (uint32_t j=0; j <= 3; j++) { // max 3 without FSTN
-					// at each location, find worst uframe usage
-					// for SSPLIT+CSPLITs
-					uint32_t n = (i << 3) + j;
-					uint32_t bw1 = uframe_bandwidth[n+0] + stime;
-					uint32_t bw2 = uframe_bandwidth[n+2] + ctime;
-					uint32_t bw3 = uframe_bandwidth[n+3] + ctime;
-					uint32_t bw4 = uframe_bandwidth[n+4] + ctime;
-					max_bandwidth = max4(bw1, bw2, bw3, bw4);
-					// remember the best usage found
-					if (max_bandwidth < best_bandwidth) {
-						best_bandwidth = max_bandwidth;
-						best_offset = i;
-						best_shift = j;
-					}
+			for (uint32_t shift=0; shift <= maxshift; shift++) {
+				// skip any offset and shift the TT can't fit
+				bandwidth_result_t result = BANDWIDTH_OK;
+				for (uint32_t i=offset; i < BANDWIDTH_FRAMES; i += interval) {
+					result = tt_check(tt, i, shift + 1, ttime);
+					if (result != BANDWIDTH_OK) break;
+				}
+				if (result != BANDWIDTH_OK) {
+					if (result == BANDWIDTH_TT_FRAME) tt_result = result;
+					continue;
+				}
+				tt_result = BANDWIDTH_OK;
+				// for each 1ms frame offset and uframe shift, compute
+				// the worst uframe usage by the SSPLIT & CSPLITs
+				uint8_t load[8];
+				bandwidth_load(load, smask << shift, cmask << shift, stime, ctime);
+				uint32_t max_bandwidth = hc->bandwidth_worst(interval, offset, load);
+				// remember the best usage found
+				if (max_bandwidth < best_bandwidth) {
+					best_bandwidth = max_bandwidth;
+					best_offset = offset;
+					best_shift = shift;
 				}
 			}
 		}
@@ -1169,97 +2945,120 @@ bool USBHost::allocate_interrupt_pipe_bandwidth(Pipe_t *pipe, uint32_t maxlen, u
 		//print(best_offset);
 		println(", shift= ", best_shift);
 		//println(best_shift);
+		if (tt_result != BANDWIDTH_OK) {
+			println("  TT budget is full");
+			bandwidth_result = tt_result;
+			return false;
+		}
 		// a 125 us micro frame can fit 7500 bytes, or 234 of our 32-byte units
 		// fail if the best found needs more than 80% (234 * 0.8) in any uframe
-		if (best_bandwidth > 187) return false;
+		if (best_bandwidth > 187) {
+			bandwidth_result = BANDWIDTH_UFRAME_FULL;
+			return false;
+		}
 		// save essential bandwidth specs, for cleanup in delete_Pipe
 		pipe->bandwidth_interval = interval;
 		pipe->bandwidth_offset = best_offset;
 		pipe->bandwidth_shift = best_shift;
 		pipe->bandwidth_stime = stime;
 		pipe->bandwidth_ctime = ctime;
-		for (uint32_t i=best_offset; i < PERIODIC_LIST_SIZE; i += interval) {
-			uint32_t n = (i << 3) + best_shift;
-			uframe_bandwidth[n+0] += stime;
-			uframe_bandwidth[n+2] += ctime;
-			uframe_bandwidth[n+3] += ctime;
-			uframe_bandwidth[n+4] += ctime;
-		}
-		pipe->start_mask = 0x01 << best_shift;
-		pipe->complete_mask = 0x1C << best_shift;
+		pipe->start_mask = smask << best_shift;
+		pipe->complete_mask = cmask << best_shift;
 		pipe->periodic_offset = best_offset;
+		uint8_t load[8];
+		bandwidth_load(load, pipe->start_mask, pipe->complete_mask, stime, ctime);
+		hc->bandwidth_update(interval, best_offset, load, true);
+		pipe->tt_index = (tt - hc->schedule->tt_budget) + 1;
+		pipe->tt_time = ttime;
+		tt_update(tt, best_offset, interval, best_shift + 1, ttime, true);
 	}
 	return true;
 }
 
+// Find the TT budget table for a full or low speed device, or a free
+// table if no other periodic pipe is using the same TT.
+static tt_budget_t * find_tt_budget(ehci_schedule_t *schedule, const Device_t *dev)
+{
+	tt_budget_t *avail = NULL;
+	for (uint32_t i=0; i < TT_COUNT; i++) {
+		tt_budget_t *tt = &schedule->tt_budget[i];
+		if (tt->pipes == 0) {
+			if (!avail) avail = tt;
+		} else if (tt->hub_address == dev->tt_hub_address && tt->tt_port == dev->tt_port) {
+			return tt;
+		}
+	}
+	if (avail) {
+		avail->hub_address = dev->tt_hub_address;
+		avail->tt_port = dev->tt_port;
+		memset(avail->uframe_time, 0, sizeof(avail->uframe_time));
+	}
+	return avail;
+}
+
+// Check if a full speed transaction of ttime bytes fits into the TT's
+// budget for one frame, beginning in uframe y.  Long isochronous packets
+// fill whole 188 byte uframes, one for each SSPLIT or CSPLIT moving them.
+static USBHost::bandwidth_result_t tt_check(const tt_budget_t *tt,
+	uint32_t frame, uint32_t y, uint32_t ttime)
+{
+	const uint8_t *p = tt->uframe_time + (frame << 3);
+	uint32_t total = ttime;
+	for (uint32_t j=0; j < 8; j++) total += p[j];
+	while (ttime > 0) {
+		uint32_t n = (ttime > TT_UFRAME_BUDGET) ? TT_UFRAME_BUDGET : ttime;
+		if (y > 7 || p[y] + n > TT_UFRAME_BUDGET) return USBHost::BANDWIDTH_TT_UFRAME;
+		ttime -= n;
+		y++;
+	}
+	if (total > TT_FRAME_BUDGET) return USBHost::BANDWIDTH_TT_FRAME;
+	return USBHost::BANDWIDTH_OK;
+}
+
+// Add or remove a pipe's transactions from the TT budget
+static void tt_update(tt_budget_t *tt, uint32_t offset, uint32_t interval,
+	uint32_t y, uint32_t ttime, bool add)
+{
+	for (uint32_t i=offset; i < BANDWIDTH_FRAMES; i += interval) {
+		uint8_t *p = tt->uframe_time + (i << 3) + y;
+		for (uint32_t remain=ttime; remain > 0; p++) {
+			uint32_t n = (remain > TT_UFRAME_BUDGET) ? TT_UFRAME_BUDGET : remain;
+			if (add) {
+				*p += n;
+			} else {
+				*p -= n;
+			}
+			remain -= n;
+		}
+	}
+	if (add) {
+		tt->pipes++;
+	} else {
+		tt->pipes--;
+	}
+}
+
 // put a new pipe into the periodic schedule tree
 // according to periodic_interval and periodic_offset
 //
 void USBHost::add_qh_to_periodic_schedule(Pipe_t *pipe)
 {
-	// quick hack for testing, just put it into the first table entry
 	//println("add_qh_to_periodic_schedule: ", (uint32_t)pipe, HEX);
-#if 0
-	pipe->qh.horizontal_link = periodictable[0];
-	periodictable[0] = (uint32_t)&(pipe->qh) | 2; // 2=QH
-	println("init periodictable with ", periodictable[0], HEX);
-#else
-	uint32_t interval = pipe->periodic_interval;
-	uint32_t offset = pipe->periodic_offset;
-	//println("  interval = ", interval);
-	//println("  offset =   ", offset);
-
-	// By an interative miracle, hopefully make an inverted tree of EHCI figure 4-18, page 93
-	for (uint32_t i=offset; i < PERIODIC_LIST_SIZE; i += interval) {
-		//print("    old slot ", i);
-		//print(": ");
-		//print_qh_list((Pipe_t *)(periodictable[i] & 0xFFFFFFE0));
-		uint32_t num = periodictable[i];
-		Pipe_t *node = (Pipe_t *)(num & 0xFFFFFFE0);
-		if ((num & 1) || ((num & 6) == 2 && node->periodic_interval < interval)) {
-			//println("  add to slot ", i);
-			pipe->qh.horizontal_link = num;
-			periodictable[i] = (uint32_t)&(pipe->qh) | 2; // 2=QH
-		} else {
-			//println("  traverse list ", i);
-			// TODO: skip past iTD, siTD when/if we support isochronous
-			while (node->periodic_interval >= interval) {
-				if (node == pipe) goto nextslot;
-				//print("  num ", num, HEX);
-				//print("  node ", (uint32_t)node, HEX);
-				//println("->", node->qh.horizontal_link, HEX);
-				if (node->qh.horizontal_link & 1) break;
-				num = node->qh.horizontal_link;
-				node = (Pipe_t *)(num & 0xFFFFFFE0);
-			}
-			Pipe_t *n = node;
-			do {
-				if (n == pipe) goto nextslot;
-				n = (Pipe_t *)(n->qh.horizontal_link & 0xFFFFFFE0);
-			} while (n != NULL);
-			//print("  adding at node ", (uint32_t)node, HEX);
-			//print(", num=", num, HEX);
-			//println(", node->qh.horizontal_link=", node->qh.horizontal_link, HEX);
-			pipe->qh.horizontal_link = node->qh.horizontal_link;
-			node->qh.horizontal_link = (uint32_t)pipe | 2; // 2=QH
-			// TODO: is it really necessary to keep doing the outer
-			// loop?  Does adding it here satisfy all cases?  If so
-			// we could avoid extra work by just returning here.
-		}
-		nextslot:
-		//print("    new slot ", i);
-		//print(": ");
-		//print_qh_list((Pipe_t *)(periodictable[i] & 0xFFFFFFE0));
-		{}
-	}
+	USBHostController *hc = pipe->device->controller;
+	volatile uint32_t *link = hc->periodic_anchor_link(pipe->periodic_interval,
+		pipe->periodic_offset);
+	pipe->qh.horizontal_link = *link;
+	*link = (uint32_t)&(pipe->qh) | 2; // 2=QH
+#if defined(USBHOST_VERIFY_SCHEDULE)
+	verify_periodic_schedule(hc);
 #endif
 #if 0
 	println("Periodic Schedule:");
-	for (uint32_t i=0; i < PERIODIC_LIST_SIZE; i++) {
+	for (uint32_t i=0; i < hc->periodic_size; i++) {
 		if (i < 10) print(" ");
 		print(i);
 		print(": ");
-		print_qh_list((Pipe_t *)(periodictable[i] & 0xFFFFFFE0));
+		print_qh_list((Pipe_t *)(hc->periodictable[i] & 0xFFFFFFE0));
 	}
 #endif
 }
@@ -1283,143 +3082,162 @@ void USBHost::delete_Pipe(Pipe_t *pipe)
 	// another, the procedure given in the spec (deactivate the qTDs on the
 	// queue) is racy, since the controller can perform a new overlay or
 	// writeback at any time.
+	//
+	// Instead, the pipe is removed from the schedule now, but its memory
+	// is freed later, when the EHCI can no longer be using it.  Nothing
+	// here waits for the EHCI.
 
+	USBHostController *hc = pipe->device->controller;
 	bool isasync = (pipe->type == 0 || pipe->type == 2);
 	if (isasync) {
-		// find the next QH in the async schedule loop
-		Pipe_t *next = (Pipe_t *)(pipe->qh.horizontal_link & 0xFFFFFFE0);
-		if (next == pipe) {
-			// removing the only QH, so just shut down the async schedule
-			println("  shut down async schedule");
-			USBHS_USBCMD &= ~USBHS_USBCMD_ASE; // disable async schedule
-			while (USBHS_USBSTS & USBHS_USBSTS_AS) ; // busy loop wait
-			USBHS_ASYNCLISTADDR = 0;
-		} else {
-			// find the previous QH in the async schedule loop
-			println("  remove QH from async schedule");
-			Pipe_t *prev = next;
-			while (1) {
-				Pipe_t *n = (Pipe_t *)(prev->qh.horizontal_link & 0xFFFFFFE0);
-				if (n == pipe) break;
-				prev = n;
-			}
-			// if removing the one with H bit, set another
-			if (pipe->qh.capabilities[0] & 0x8000) {
-				prev->qh.capabilities[0] |= 0x8000; // set H bit
-			}
-			// link the previous QH, we're no longer in the loop
-			prev->qh.horizontal_link = pipe->qh.horizontal_link;
-			// do the Async Advance Doorbell handshake to wait to be
-			// sure the EHCI no longer references the removed QH
-			USBHS_USBCMD |= USBHS_USBCMD_IAA;
-			while (!(USBHS_USBSTS & USBHS_USBSTS_AAI)) ; // busy loop wait
-			USBHS_USBSTS = USBHS_USBSTS_AAI;
-			// TODO: does this write interfere UPI & UAI (bits 18 & 19) ??
-		}
-		// find & free all the transfers which completed
-		println("  Free transfers");
-		Transfer_t *t = async_followup_first;
-		while (t) {
-			print("    * ", (uint32_t)t);
-			Transfer_t *next = t->next_followup;
-			if (t->pipe == pipe) {
-				print(" * remove");
-				remove_from_async_followup_list(t);
-
-				// Only free if not in QH list
-				Transfer_t *tr = (Transfer_t *)(pipe->qh.next);
-				while (((uint32_t)tr & 0xFFFFFFE0) && (tr != t)){
-					tr  = (Transfer_t *)(tr->qtd.next);
-				}
-				if (tr == t) {
-					println(" * defer free until QH");
-				} else {
-					println(" * free");
-					free_Transfer(t);  // The later code should actually free it...
-				}
-			} else {
-				println("");
-			}
-			t = next;
+		// find the previous QH in the async schedule loop.  The permanent
+		// async_head QH is always in the loop, so it never becomes empty.
+		println("  remove QH from async schedule");
+		Pipe_t *prev = &hc->async_head;
+		while (1) {
+			Pipe_t *n = (Pipe_t *)(prev->qh.horizontal_link & 0xFFFFFFE0);
+			if (n == pipe) break;
+			prev = n;
+		}
+		// link the previous QH, we're no longer in the loop
+		prev->qh.horizontal_link = pipe->qh.horizontal_link;
+	} else if (pipe->type == 1) {
+		// remove the isochronous iTD or siTD ring from the periodic schedule
+		Isochronous_t *first = pipe->isochronous;
+		if (first) {
+			println("  remove isochronous ring");
+			Isochronous_t *iso = first;
+			do {
+				hc->unlink_Isochronous(iso);
+				iso = iso->next;
+			} while (iso != first);
 		}
 	} else {
-		// remove from the periodic schedule
-		for (uint32_t i=0; i < PERIODIC_LIST_SIZE; i++) {
-			uint32_t num = periodictable[i];
-			if (num & 1) continue;
+		// remove from the periodic schedule, which only requires
+		// searching the list of pipes with the same interval & offset
+		volatile uint32_t *link = hc->periodic_anchor_link(pipe->periodic_interval,
+			pipe->periodic_offset);
+		while (1) {
+			uint32_t num = *link;
+			if ((num & 1) || hc->is_periodic_anchor(num)) break;
 			Pipe_t *node = (Pipe_t *)(num & 0xFFFFFFE0);
 			if (node == pipe) {
-				periodictable[i] = pipe->qh.horizontal_link;
-				continue;
-			}
-			Pipe_t *prev = node;
-			while (1) {
-				num = node->qh.horizontal_link;
-				if (num & 1) break;
-				node = (Pipe_t *)(num & 0xFFFFFFE0);
-				if (node == pipe) {
-					prev->qh.horizontal_link = node->qh.horizontal_link;
-					break;
-				}
-				prev = node;
+				*link = pipe->qh.horizontal_link;
+				break;
 			}
+			link = &(node->qh.horizontal_link);
 		}
-		// subtract bandwidth from uframe_bandwidth array
-		if (pipe->device->speed == 2) {
-			uint32_t interval = pipe->bandwidth_interval;
-			uint32_t offset = pipe->bandwidth_offset;
-			uint32_t stime = pipe->bandwidth_stime;
-			for (uint32_t i=offset; i < PERIODIC_LIST_SIZE*8; i += interval) {
-				uframe_bandwidth[i] -= stime;
-			}
+#if defined(USBHOST_VERIFY_SCHEDULE)
+		verify_periodic_schedule(hc);
+#endif
+	}
+	if (!isasync) {
+		// subtract bandwidth from the bandwidth tree
+		uint32_t interval = pipe->bandwidth_interval;
+		uint32_t offset = pipe->bandwidth_offset;
+		uint8_t load[8];
+		bandwidth_load(load, pipe->start_mask, pipe->complete_mask,
+			pipe->bandwidth_stime, pipe->bandwidth_ctime);
+		hc->bandwidth_update(interval, offset, load, false);
+		if (pipe->tt_index) {
+			tt_update(&hc->schedule->tt_budget[pipe->tt_index - 1], offset, interval,
+				pipe->bandwidth_shift + 1, pipe->tt_time, false);
+			pipe->tt_index = 0;
+		}
+	}
+	// the pipe no longer needs followup when its transfers complete
+	if (pipe->first_followup || pipe->isochronous) {
+		if (isasync) {
+			hc->remove_from_async_followup_list(pipe);
 		} else {
-			uint32_t interval = pipe->bandwidth_interval;
-			uint32_t offset = pipe->bandwidth_offset;
-			uint32_t shift = pipe->bandwidth_shift;
-			uint32_t stime = pipe->bandwidth_stime;
-			uint32_t ctime = pipe->bandwidth_ctime;
-			for (uint32_t i=offset; i < PERIODIC_LIST_SIZE; i += interval) {
-				uint32_t n = (i << 3) + shift;
-				uframe_bandwidth[n+0] -= stime;
-				uframe_bandwidth[n+2] -= ctime;
-				uframe_bandwidth[n+3] -= ctime;
-				uframe_bandwidth[n+4] -= ctime;
+			hc->remove_from_periodic_followup_list(pipe);
+		}
+	}
+	// completed transfers waiting for a deferred callback keep their
+	// memory until Task() frees them, but must not use this pipe.  A
+	// persistent pipe's qTDs are still in its ring, so Task() skips them.
+	if (pipe->callback_deferred) {
+		uint32_t i = deferred_queue_tail;
+		while (i != deferred_queue_head) {
+			if (++i >= DEFERRED_QUEUE_SIZE) i = 0;
+			Transfer_t *t = deferred_queue[i];
+			if (t == NULL || t->pipe != pipe) continue;
+			if (pipe->persistent) {
+				deferred_queue[i] = NULL;
+			} else {
+				t->pipe = NULL;
 			}
 		}
+	}
+	// The EHCI may have cached the QH, or be part way through its work
+	// in this frame.  Async pipes are freed after the Async Advance
+	// Doorbell interrupt.  Periodic pipes are freed after the EHCI has
+	// moved on to later frames.
+	if (isasync) {
+		pipe->next_followup = hc->async_removed_waiting;
+		hc->async_removed_waiting = pipe;
+		if (hc->async_removed_doorbell == NULL) {
+			// start a doorbell now, otherwise isr() starts another
+			// for all the pipes waiting when the current one ends
+			hc->async_removed_doorbell = hc->async_removed_waiting;
+			hc->async_removed_waiting = NULL;
+			hc->regs->USBCMD |= USBHS_USBCMD_IAA;
+		}
+	} else {
+		pipe->removal_frame = hc->regs->FRINDEX;
+		pipe->next_followup = NULL;
+		if (hc->periodic_removed_last) {
+			hc->periodic_removed_last->next_followup = pipe;
+		} else {
+			hc->periodic_removed_first = pipe;
+		}
+		hc->periodic_removed_last = pipe;
+	}
+	println("* Delete Pipe completed");
+}
 
-		// find & free all the transfers which completed
-		println("  Free transfers");
-		Transfer_t *t = periodic_followup_first;
+// Free the memory of a pipe which delete_Pipe() removed from the schedule,
+// together with all its remaining qTDs, iTDs or siTDs.
+//
+void USBHost::free_removed_Pipe(Pipe_t *pipe)
+{
+	println("free removed pipe ", (uint32_t)pipe, HEX);
+	Isochronous_t *first = pipe->isochronous;
+	if (first) {
+		Isochronous_t *iso = first;
+		do {
+			Isochronous_t *next = iso->next;
+			free_Isochronous(iso);
+			iso = next;
+		} while (iso != first);
+	}
+	// free all the queued transfers, which are no longer needed
+	Transfer_t *tr = (Transfer_t *)(pipe->qh.next);
+	if (pipe->type == 1) {
+		tr = NULL; // no QH, no qTDs
+	} else if (pipe->persistent) {
+		// a persistent pipe's qTDs form a ring, with no halt qTD
+		Transfer_t *first = pipe->first_followup;
+		Transfer_t *t = first;
+		do {
+			Transfer_t *next = t->next_followup;
+			free_Transfer(t);
+			t = next;
+		} while (t != first);
+		tr = NULL;
+	} else if (pipe->first_followup) {
+		// the dummy halt qTD is always after the last queued transfer
+		tr = (Transfer_t *)(pipe->last_followup->qtd.next);
+		Transfer_t *t = pipe->first_followup;
 		while (t) {
-			print("    * ", (uint32_t)t);
+			println("    * ", (uint32_t)t);
 			Transfer_t *next = t->next_followup;
-			if (t->pipe == pipe) {
-				print(" * remove");
-				remove_from_periodic_followup_list(t);
-
-				// Only free if not in QH list
-				Transfer_t *tr = (Transfer_t *)(pipe->qh.next);
-				while (((uint32_t)tr & 0xFFFFFFE0) && (tr != t)){
-					tr  = (Transfer_t *)(tr->qtd.next);
-				}
-				if (tr == t) {
-					println(" * defer free until QH");
-				} else {
-					println(" * free");
-					free_Transfer(t);  // The later code should actually free it...
-				}
-			} else {
-				println("");
-			}
+			if (t->qtd.token & 0x8000) dma_release(t);
+			free_Transfer(t);
 			t = next;
 		}
 	}
-	//
-	// TODO: do we need to look at pipe->qh.current ??
-	//
-	// free all the transfers still attached to the QH
-	println("  Free transfers attached to QH");
-	Transfer_t *tr = (Transfer_t *)(pipe->qh.next);
+	// free the dummy halt qTD still attached to the QH
 	while ((uint32_t)tr & 0xFFFFFFE0) {
 		println("    * ", (uint32_t)tr);
 		Transfer_t *next = (Transfer_t *)(tr->qtd.next);
@@ -1428,7 +3246,43 @@ void USBHost::delete_Pipe(Pipe_t *pipe)
 	}
 	// hopefully we found everything...
 	free_Pipe(pipe);
-	println("* Delete Pipe completed");
 }
 
+// Free periodic pipes once the EHCI has gone at least 2 frames past the
+// frame when each was removed.  Called from isr(), and from Task() with
+// the USBHS interrupt masked.
+//
+void USBHostController::free_removed_periodic_Pipes()
+{
+	uint32_t frindex = regs->FRINDEX;
+	while (periodic_removed_first) {
+		Pipe_t *pipe = periodic_removed_first;
+		if (((frindex - pipe->removal_frame) & 0x3FFF) < 16) break;
+		periodic_removed_first = pipe->next_followup;
+		if (periodic_removed_first == NULL) periodic_removed_last = NULL;
+		USBHost::free_removed_Pipe(pipe);
+	}
+}
+
+// Task() calls this, because the isr only frees removed periodic pipes
+// when it's running anyway, which might not happen for a long time if no
+// other transfers are active.  Normally nothing is waiting, so the USBHS
+// interrupt is left alone.  Task() may be called before begin() or from
+// code which already has the interrupt disabled, so it's only enabled
+// again if it was before.
+//
+void USBHost::poll_removed_periodic_Pipes(void)
+{
+	USBHostController *hc = controller_list;
+	while (hc && hc->periodic_removed_first == NULL) hc = hc->next;
+	if (hc == NULL) return;
+	bool irq_enabled = NVIC_IS_ENABLED(IRQ_USBHS);
+	NVIC_DISABLE_IRQ(IRQ_USBHS);
+	for (; hc; hc = hc->next) {
+		hc->free_removed_periodic_Pipes();
+	}
+	if (irq_enabled) NVIC_ENABLE_IRQ(IRQ_USBHS);
+}
+
+
 
@@ -52,6 +52,7 @@ static uint16_t enumlen;
 // Only one USB device may be in this state at a time (responding
 // to address zero) and using the enumeration static buffer.
 volatile bool USBHost::enumeration_busy = false;
+USBDriver * USBHost::claiming_driver = NULL;
 
 
 
@@ -63,9 +64,12 @@ static void pipe_set_addr(Pipe_t *pipe, uint32_t addr);
 
 // The main user function to cause internal state to update.  Since we do
 // almost everything with DMA and interrupts, the only work to do here is
-// call all the active driver Task() functions.
+// run any callbacks pipes have deferred from the interrupt and call all
+// the active driver Task() functions.
 void USBHost::Task()
 {
+	run_deferred_callbacks();
+	poll_removed_periodic_Pipes();
 	for (Device_t *dev = devlist; dev; dev = dev->next) {
 		for (USBDriver *driver = dev->drivers; driver; driver = driver->next) {
 			(driver->Task)();
@@ -93,9 +97,13 @@ void USBHost::driver_ready_for_device(USBDriver *driver)
 	}
 }
 
-// Create a new device and begin the enumeration process
+// Create a new device and begin the enumeration process.  The device is
+// connected to port hub_port of the hub at hub_addr, and hub is that hub's
+// own Device_t.  For a controller's root port, hub_addr and hub_port are 0,
+// hub is NULL and controller is given.  Otherwise it's the hub's.
 //
-Device_t * USBHost::new_Device(uint32_t speed, uint32_t hub_addr, uint32_t hub_port)
+Device_t * USBHost::new_Device(uint32_t speed, uint32_t hub_addr, uint32_t hub_port,
+	const Device_t *hub, USBHostController *controller)
 {
 	Device_t *dev;
 
@@ -114,6 +122,17 @@ Device_t * USBHost::new_Device(uint32_t speed, uint32_t hub_addr, uint32_t hub_p
 	dev->address = 0;
 	dev->hub_address = hub_addr;
 	dev->hub_port = hub_port;
+	dev->controller = hub ? hub->controller : controller;
+	if (hub && hub->speed != 2) {
+		// behind a full speed hub, split transactions still
+		// go to the TT in the high speed hub upstream
+		dev->tt_hub_address = hub->tt_hub_address;
+		dev->tt_hub_port = hub->tt_hub_port;
+		dev->tt_port = hub->tt_port;
+	} else {
+		dev->tt_hub_address = hub_addr;
+		dev->tt_hub_port = hub_port;
+	}
 	dev->control_pipe = new_Pipe(dev, 0, 0, 0, 8);
 	if (!dev->control_pipe) {
 		free_Device(dev);
@@ -154,11 +173,17 @@ void USBHost::enumeration(const Transfer_t *transfer)
 		transfer->driver->control(transfer);
 		return;
 	}
+	// CLEAR_FEATURE(ENDPOINT_HALT) sent by ehci.cpp to recover a halted pipe
+	if (transfer->setup.word1 == 0x00000102) {
+		followup_Clear_Halt(transfer);
+		return;
+	}
 
 	println("enumeration:");
 	//print_hexbytes(transfer->buffer, transfer->length);
 	//print(transfer);
 	dev = transfer->pipe->device;
+	USBHOST_TRACE_EVENT(TRACE_ENUMERATION, dev, dev->enum_state);
 
 	while (1) {
 		// Within this large switch/case, "break" means we've done
@@ -331,7 +356,10 @@ void USBHost::claim_drivers(Device_t *dev)
 	// first check if any driver wishes to claim the entire device
 	for (driver=available_drivers; driver != NULL; driver = driver->next) {
 		if (driver->device != NULL) continue;
-		if (driver->claim(dev, 0, enumbuf + 9, enumlen - 9)) {
+		claiming_driver = driver;
+		bool claimed = driver->claim(dev, 0, enumbuf + 9, enumlen - 9);
+		claiming_driver = NULL;
+		if (claimed) {
 			if (prev) {
 				prev->next = driver->next;
 			} else {
@@ -373,7 +401,10 @@ void USBHost::claim_drivers(Device_t *dev)
 				// an accurate length.  (end - p) is the rest
 				// of ALL descriptors, likely more interfaces
 				// this driver has no business parsing
-				if (driver->claim(dev, 1, p, end - p)) {
+				claiming_driver = driver;
+				bool claimed = driver->claim(dev, 1, p, end - p);
+				claiming_driver = NULL;
+				if (claimed) {
 					// this driver claims iface
 					// remove it from available_drivers list
 					if (prev) {
@@ -0,0 +1,90 @@
+// USB Host bulk read speed, and Transfer_t used per read
+//
+// Plug in a USB drive.  This sketch reads 64 KB and 1 MB from the start
+// of the drive (nothing is written), and prints the speed and the most
+// Transfer_t in use during each read.  Each qTD holds up to 20 KB, when
+// it begins on a 4096 byte page, as it does after the first.  Before,
+// every qTD held only 16 KB, so the number that would have needed is
+// printed too.  Time is measured with the ARM_DWT_CYCCNT cycle counter.
+//
+// Teensy 4.1 needs a PSRAM chip for the 1 MB test.  Teensy 4.0 reads
+// 256 KB instead, and Teensy 3.6 only 64 KB.
+//
+// This example is in the public domain
+
+#include "USBHost_t36.h"
+
+USBHost myusb;
+USBHub hub1(myusb);
+USBDrive drive(myusb);
+// enough Transfer_t for the largest read, even at 16 KB each
+USBHostConfig<1, 1, 72> myusbmemory;
+
+#if defined(ARDUINO_TEENSY41)
+#define BIG_SIZE (1024 * 1024)
+EXTMEM uint8_t buffer[BIG_SIZE] __attribute__ ((aligned(4096)));
+#elif defined(__IMXRT1062__)
+#define BIG_SIZE (256 * 1024)
+DMAMEM uint8_t buffer[BIG_SIZE] __attribute__ ((aligned(4096)));
+#else
+#define BIG_SIZE (64 * 1024)
+uint8_t buffer[BIG_SIZE] __attribute__ ((aligned(4096)));
+#endif
+
+#if !defined(__IMXRT1062__)
+#define F_CPU_ACTUAL F_CPU
+#endif
+
+void setup()
+{
+  while (!Serial) ; // wait for Arduino Serial Monitor
+  Serial.println("USB Host bulk read speed");
+  ARM_DEMCR |= ARM_DEMCR_TRCENA; // Teensy 3.6 needs the cycle counter started
+  ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+  myusb.begin();
+}
+
+void test_read(uint32_t size)
+{
+  const uint32_t repeat = 8;
+  poolstats_t devices, pipes, trans, strs;
+  USBHost::poolStats(devices, pipes, trans, strs, true);
+  uint32_t free_before = trans.free;
+  uint32_t cycles = 0;
+  for (uint32_t i=0; i < repeat; i++) {
+    uint32_t begin = ARM_DWT_CYCCNT;
+    uint8_t status = drive.msReadBlocks(0, size / 512, 512, buffer);
+    cycles += ARM_DWT_CYCCNT - begin;
+    if (status != MS_CBW_PASS) {
+      Serial.printf("  read error %u\n", status);
+      return;
+    }
+  }
+  USBHost::poolStats(devices, pipes, trans, strs);
+  uint32_t usec = cycles / (F_CPU_ACTUAL / 1000000) / repeat;
+  Serial.printf("%5u KB: %6u us, %5u KB/sec, %2u Transfer_t (%u at 16 KB)\n",
+    size / 1024, usec, (uint32_t)((uint64_t)size * 1000000 / 1024 / usec),
+    free_before - trans.min_free, (size + 16383) / 16384);
+}
+
+void loop()
+{
+  myusb.Task();
+  if (!drive) return;
+  if (drive.checkConnectedInitialized() != MS_CBW_PASS) {
+    Serial.println("Drive not ready");
+    while (drive) myusb.Task();
+    return;
+  }
+  Serial.printf("Drive %04X:%04X\n", drive.getIDVendor(), drive.getIDProduct());
+  uint32_t big = (BIG_SIZE > 64 * 1024) ? BIG_SIZE : 0;
+#if defined(ARDUINO_TEENSY41)
+  if (external_psram_size == 0) big = 0;
+#endif
+  if (drive.msDriveInfo.capacity.Blocks < big / 512) big = 0;
+  test_read(64 * 1024);
+  if (big) test_read(big);
+  if (!big) Serial.println("No memory, or drive too small, for a larger read");
+  Serial.println("Done, unplug the drive to run again");
+  while (drive) myusb.Task();
+}
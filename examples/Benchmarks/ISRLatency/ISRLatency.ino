@@ -0,0 +1,161 @@
+// USB Host interrupt time, with many transfers waiting
+//
+// Plug in a keyboard or mouse (any device with an interrupt IN endpoint),
+// and do not touch it while the test runs.  This sketch claims it, then
+// queues more and more transfers on its interrupt pipe, which stay
+// waiting for data.  Meanwhile, control transfers complete, each with an
+// interrupt.  The time the USB interrupt takes is measured with the
+// ARM_DWT_CYCCNT cycle counter.  It should stay about the same however
+// many transfers are waiting, because only the first of each pipe is
+// checked.
+//
+// This example is in the public domain
+
+#include "USBHost_t36.h"
+
+USBHost myusb;
+USBHub hub1(myusb);
+
+// A driver claiming the first interface with an interrupt IN endpoint
+class WaitingDriver : public USBDriver {
+public:
+  WaitingDriver(USBHost &host) { init(); }
+  bool queueWaiting() {
+    if (!inpipe || waiting >= MAX_WAITING) return false;
+    NVIC_DISABLE_IRQ(IRQ_USBHS);
+    bool ok = queue_Data_Transfer(inpipe, buffer[waiting], packet_size, this);
+    if (ok) waiting++;
+    NVIC_ENABLE_IRQ(IRQ_USBHS);
+    return ok;
+  }
+  bool getStatus() {
+    control_done = false;
+    mk_setup(setup, 0x80, 0, 0, 0, 2); // GET_STATUS, device
+    NVIC_DISABLE_IRQ(IRQ_USBHS);
+    bool ok = queue_Control_Transfer(device, &setup, status, this);
+    NVIC_ENABLE_IRQ(IRQ_USBHS);
+    return ok;
+  }
+  enum { MAX_WAITING = 64 };
+  volatile uint32_t waiting = 0;
+  volatile uint32_t completed = 0;
+  volatile bool control_done = false;
+protected:
+  virtual bool claim(Device_t *dev, int type, const uint8_t *descriptors, uint32_t len) {
+    if (type != 1) return false;
+    const uint8_t *p = descriptors;
+    const uint8_t *end = p + len;
+    if (p[0] < 9 || p[1] != 4) return false; // interface descriptor
+    p += p[0];
+    while (p < end && p[1] != 4) {
+      if (p[0] < 2 || p + p[0] > end) return false;
+      if (p[1] == 5 && (p[3] & 3) == 3 && (p[2] & 0x80)) { // interrupt IN
+        packet_size = (p[4] | (p[5] << 8)) & 0x7FF;
+        if (packet_size > sizeof(buffer[0])) return false;
+        inpipe = new_Pipe(dev, 3, p[2] & 15, 1, packet_size, p[6]);
+        if (!inpipe) return false;
+        inpipe->callback_function = callback;
+        waiting = 0;
+        completed = 0;
+        return true;
+      }
+      p += p[0];
+    }
+    return false;
+  }
+  virtual void control(const Transfer_t *transfer) {
+    control_done = true;
+  }
+  virtual void disconnect() {
+    inpipe = NULL;
+    waiting = 0;
+  }
+  static void callback(const Transfer_t *transfer) {
+    WaitingDriver *d = (WaitingDriver *)transfer->driver;
+    d->waiting--;
+    d->completed++;
+  }
+  void init() {
+    contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
+    contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t), this);
+    driver_ready_for_device(this);
+  }
+  Pipe_t *inpipe = NULL;
+  uint32_t packet_size = 8;
+  setup_t setup;
+  uint8_t status[2];
+  uint8_t buffer[MAX_WAITING][64];
+  Pipe_t mypipes[2] __attribute__ ((aligned(32)));
+  Transfer_t mytransfers[MAX_WAITING + 8] __attribute__ ((aligned(32)));
+};
+
+WaitingDriver waiter(myusb);
+
+// The library's interrupt, called by timed_isr()
+void (*usb_isr)(void);
+volatile uint32_t isr_count = 0;
+volatile uint32_t isr_cycles = 0;
+volatile uint32_t isr_max = 0;
+
+void timed_isr() {
+  uint32_t begin = ARM_DWT_CYCCNT;
+  usb_isr();
+  uint32_t n = ARM_DWT_CYCCNT - begin;
+  isr_count++;
+  isr_cycles += n;
+  if (n > isr_max) isr_max = n;
+}
+
+void setup()
+{
+  while (!Serial) ; // wait for Arduino Serial Monitor
+  Serial.println("USB Host interrupt time, with transfers waiting");
+  ARM_DEMCR |= ARM_DEMCR_TRCENA; // Teensy 3.6 needs the cycle counter started
+  ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+  myusb.begin();
+  usb_isr = _VectorsRam[IRQ_USBHS + 16];
+  attachInterruptVector(IRQ_USBHS, timed_isr);
+}
+
+void measure()
+{
+  const uint32_t requests = 1000;
+  __disable_irq();
+  isr_count = 0;
+  isr_cycles = 0;
+  isr_max = 0;
+  __enable_irq();
+  for (uint32_t i=0; i < requests; i++) {
+    if (!waiter.getStatus()) {
+      Serial.println("  control transfer failed to queue");
+      return;
+    }
+    elapsedMillis ms = 0;
+    while (!waiter.control_done && ms < 100) ;
+  }
+  __disable_irq();
+  uint32_t count = isr_count;
+  uint32_t cycles = isr_cycles;
+  uint32_t most = isr_max;
+  __enable_irq();
+  Serial.printf("%2u waiting: %u interrupts, average %u cycles, max %u\n",
+    waiter.waiting, count, count ? cycles / count : 0, most);
+}
+
+void loop()
+{
+  myusb.Task();
+  if (!waiter) return;
+  delay(500); // let enumeration finish
+  Serial.printf("Device %04X:%04X\n", waiter.idVendor(), waiter.idProduct());
+  measure();
+  for (uint32_t n = 16; n <= WaitingDriver::MAX_WAITING; n += 16) {
+    while (waiter.waiting < n && waiter.queueWaiting()) ;
+    measure();
+  }
+  if (waiter.completed) {
+    Serial.printf("%u transfers completed, results are not valid\n", waiter.completed);
+  }
+  Serial.println("Done, unplug the device to run again");
+  while (waiter) myusb.Task();
+}
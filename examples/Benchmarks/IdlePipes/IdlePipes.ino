@@ -0,0 +1,147 @@
+// USB Host drive speed, with idle serial adapters sharing the bus
+//
+// Plug a USB drive and 1 to 4 serial adapters (or other devices with a
+// bulk IN endpoint) into a hub.  This sketch keeps a read waiting on each
+// adapter's bulk IN endpoint, which the adapter NAKs while it has no data,
+// and times reading from the drive (nothing is written) with the
+// ARM_DWT_CYCCNT cycle counter, 3 ways:
+//
+//   1: idle pipes first in the schedule, retried up to 15 NAKs, as before
+//   2: idle pipes first, but skipped after 1 NAK, set_NAK_Reload()
+//   3: also after the drive, set_Priority(), as USBSerial now does
+//
+// This example is in the public domain
+
+#include "USBHost_t36.h"
+
+USBHost myusb;
+USBHub hub1(myusb);
+USBHub hub2(myusb);
+USBDrive drive(myusb);
+
+#if defined(__IMXRT1062__)
+#define READ_SIZE (256 * 1024)
+DMAMEM uint8_t buffer[READ_SIZE] __attribute__ ((aligned(4096)));
+#else
+#define READ_SIZE (64 * 1024)
+#define F_CPU_ACTUAL F_CPU
+uint8_t buffer[READ_SIZE] __attribute__ ((aligned(4096)));
+#endif
+// enough Transfer_t for each read
+USBHostConfig<1, 1, READ_SIZE / 16384 + 4> myusbmemory;
+
+// A driver keeping 1 read waiting on any bulk IN endpoint, except a drive's
+class IdleBulkIn : public USBDriver {
+public:
+  IdleBulkIn(USBHost &host) { init(); }
+  void tune(uint32_t nak_reload, int32_t priority) {
+    NVIC_DISABLE_IRQ(IRQ_USBHS);
+    if (rxpipe) {
+      set_NAK_Reload(rxpipe, nak_reload);
+      set_Priority(rxpipe, priority);
+    }
+    NVIC_ENABLE_IRQ(IRQ_USBHS);
+  }
+  volatile uint32_t received = 0;
+protected:
+  virtual bool claim(Device_t *dev, int type, const uint8_t *descriptors, uint32_t len) {
+    if (type != 1) return false;
+    const uint8_t *p = descriptors;
+    const uint8_t *end = p + len;
+    if (p[0] < 9 || p[1] != 4) return false; // interface descriptor
+    if (p[5] == 8 || p[5] == 9) return false; // not mass storage or hub
+    p += p[0];
+    while (p < end && p[1] != 4) {
+      if (p[0] < 2 || p + p[0] > end) return false;
+      if (p[1] == 5 && (p[3] & 3) == 2 && (p[2] & 0x80)) { // bulk IN
+        uint32_t size = (p[4] | (p[5] << 8)) & 0x7FF;
+        if (size > sizeof(rxbuf)) return false;
+        rxpipe = new_Pipe(dev, 2, p[2] & 15, 1, size);
+        if (!rxpipe) return false;
+        rxpipe->callback_function = callback;
+        rxsize = size;
+        received = 0;
+        queue_Data_Transfer(rxpipe, rxbuf, rxsize, this);
+        return true;
+      }
+      p += p[0];
+    }
+    return false;
+  }
+  virtual void disconnect() {
+    rxpipe = NULL;
+  }
+  static void callback(const Transfer_t *transfer) {
+    IdleBulkIn *d = (IdleBulkIn *)transfer->driver;
+    d->received += transfer->length - ((transfer->qtd.token >> 16) & 0x7FFF);
+    if (d->rxpipe) queue_Data_Transfer(d->rxpipe, d->rxbuf, d->rxsize, d);
+  }
+  void init() {
+    contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
+    contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t), this);
+    driver_ready_for_device(this);
+  }
+  Pipe_t *rxpipe = NULL;
+  uint32_t rxsize = 64;
+  uint8_t rxbuf[512];
+  Pipe_t mypipes[2] __attribute__ ((aligned(32)));
+  Transfer_t mytransfers[3] __attribute__ ((aligned(32)));
+};
+
+IdleBulkIn idle1(myusb);
+IdleBulkIn idle2(myusb);
+IdleBulkIn idle3(myusb);
+IdleBulkIn idle4(myusb);
+IdleBulkIn *idlepipes[4] = {&idle1, &idle2, &idle3, &idle4};
+
+void setup()
+{
+  while (!Serial) ; // wait for Arduino Serial Monitor
+  Serial.println("USB Host drive speed, with idle pipes");
+  ARM_DEMCR |= ARM_DEMCR_TRCENA; // Teensy 3.6 needs the cycle counter started
+  ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+  myusb.begin();
+}
+
+void test_read(const char *name, uint32_t nak_reload, int32_t priority)
+{
+  const uint32_t repeat = 8;
+  for (IdleBulkIn *p : idlepipes) p->tune(nak_reload, priority);
+  uint32_t cycles = 0;
+  for (uint32_t i=0; i < repeat; i++) {
+    uint32_t begin = ARM_DWT_CYCCNT;
+    uint8_t status = drive.msReadBlocks(0, READ_SIZE / 512, 512, buffer);
+    cycles += ARM_DWT_CYCCNT - begin;
+    if (status != MS_CBW_PASS) {
+      Serial.printf("  read error %u\n", status);
+      return;
+    }
+  }
+  uint32_t usec = cycles / (F_CPU_ACTUAL / 1000000) / repeat;
+  Serial.printf("%s: %6u us, %5u KB/sec\n", name, usec,
+    (uint32_t)((uint64_t)READ_SIZE * 1000000 / 1024 / usec));
+}
+
+void loop()
+{
+  myusb.Task();
+  if (!drive) return;
+  delay(2000); // let the other devices enumerate
+  if (drive.checkConnectedInitialized() != MS_CBW_PASS) {
+    Serial.println("Drive not ready");
+    while (drive) myusb.Task();
+    return;
+  }
+  uint32_t count = 0;
+  for (IdleBulkIn *p : idlepipes) if (*p) count++;
+  Serial.printf("Drive %04X:%04X, %u idle pipes, reading %u KB\n",
+    drive.getIDVendor(), drive.getIDProduct(), count, READ_SIZE / 1024);
+  test_read("1: first, 15 NAKs", 15, 2);
+  test_read("2: first, 1 NAK  ", 1, 2);
+  test_read("3: last, 1 NAK   ", 1, -1);
+  uint32_t received = 0;
+  for (IdleBulkIn *p : idlepipes) received += p->received;
+  if (received) Serial.printf("Idle pipes received %u bytes, results may vary\n", received);
+  Serial.println("Done, unplug the drive to run again");
+  while (drive) myusb.Task();
+}
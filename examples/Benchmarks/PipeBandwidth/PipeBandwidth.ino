@@ -0,0 +1,106 @@
+// USB Host periodic bandwidth allocation speed
+//
+// Plug in any USB device, directly (not through a hub).  This sketch
+// claims it, and creates 64 interrupt pipes with a mix of intervals and
+// packet sizes, printing the time each new_Pipe() takes in ARM_DWT_CYCCNT
+// cycles, and why any pipe did not fit.  No transfers are queued, so the
+// device is never asked for data from the endpoints these pipes use.
+//
+// Change PERIODIC_SIZE to compare the schedule sizes: 8, 16, 32, 64, 128,
+// 256, 512 or 1024 frames.  Unplug and plug in again to repeat the test.
+//
+// This example is in the public domain
+
+#include "USBHost_t36.h"
+
+#define PERIODIC_SIZE 32
+#define PIPES 64
+
+USBHost myusb;
+// memory for: 1 device, the pipes & their halt qTDs, the periodic schedule
+USBHostConfig<1, PIPES + 1, PIPES + 8, 0, PERIODIC_SIZE> myusbmemory;
+
+// A driver which claims any device, to create pipes for it
+class PipeMaker : public USBDriver {
+public:
+  PipeMaker(USBHost &host) { driver_ready_for_device(this); }
+  Device_t *dev() { return device; }
+  bool makePipe(uint32_t endpoint, uint32_t maxlen, uint32_t interval,
+      uint32_t &cycles, bandwidth_result_t &result) {
+    NVIC_DISABLE_IRQ(IRQ_USBHS);
+    claiming_driver = this; // the halt qTD is ours, as if made in claim()
+    uint32_t begin = ARM_DWT_CYCCNT;
+    Pipe_t *pipe = new_Pipe(device, 3, endpoint, 1, maxlen, interval);
+    cycles = ARM_DWT_CYCCNT - begin;
+    claiming_driver = NULL;
+    result = bandwidthResult();
+    NVIC_ENABLE_IRQ(IRQ_USBHS);
+    return pipe != NULL;
+  }
+  volatile bool tested = false;
+protected:
+  virtual bool claim(Device_t *device, int type, const uint8_t *descriptors, uint32_t len) {
+    if (type != 0) return false;
+    tested = false;
+    return true;
+  }
+  virtual void disconnect() {
+  }
+};
+
+PipeMaker pipemaker(myusb);
+
+const char * bandwidth_name(USBHost::bandwidth_result_t result) {
+  switch (result) {
+    case USBHost::BANDWIDTH_OK: return "ok";
+    case USBHost::BANDWIDTH_UFRAME_FULL: return "uframe full";
+    case USBHost::BANDWIDTH_TT_UFRAME: return "TT uframe full";
+    case USBHost::BANDWIDTH_TT_FRAME: return "TT frame full";
+    case USBHost::BANDWIDTH_TT_TABLES: return "no TT tables";
+    case USBHost::BANDWIDTH_PACKET_SIZE: return "packet too large";
+  }
+  return "?";
+}
+
+void setup()
+{
+  while (!Serial) ; // wait for Arduino Serial Monitor
+  Serial.printf("USB Host bandwidth allocation, %d frame schedule\n", PERIODIC_SIZE);
+  ARM_DEMCR |= ARM_DEMCR_TRCENA; // Teensy 3.6 needs the cycle counter started
+  ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+  myusb.begin();
+}
+
+void loop()
+{
+  myusb.Task();
+  if (!pipemaker || pipemaker.tested) return;
+  delay(500); // let enumeration finish
+  pipemaker.tested = true;
+  Device_t *dev = pipemaker.dev();
+  // bInterval for high speed is 2^(n-1) uframes, otherwise milliseconds
+  static const uint8_t hs_intervals[8] = {1, 2, 3, 4, 5, 6, 8, 10};
+  static const uint8_t fs_intervals[8] = {1, 2, 4, 8, 16, 32, 64, 255};
+  static const uint8_t sizes[4] = {8, 16, 32, 64};
+  Serial.printf("Device %04X:%04X, %s speed\n", pipemaker.idVendor(), pipemaker.idProduct(),
+    (dev->speed == 2) ? "high" : ((dev->speed == 0) ? "full" : "low"));
+  uint32_t made = 0, cycles_total = 0, cycles_max = 0;
+  for (uint32_t i=0; i < PIPES; i++) {
+    uint32_t interval = (dev->speed == 2) ? hs_intervals[i % 8] : fs_intervals[i % 8];
+    uint32_t maxlen = (dev->speed == 1) ? 8 : sizes[(i / 8) % 4];
+    uint32_t cycles;
+    USBHost::bandwidth_result_t result;
+    bool ok = pipemaker.makePipe((i % 15) + 1, maxlen, interval, cycles, result);
+    cycles_total += cycles;
+    if (cycles > cycles_max) cycles_max = cycles;
+    if (ok) {
+      made++;
+    } else {
+      Serial.printf("  pipe %u, %u bytes, interval %u: %s\n", i, maxlen, interval,
+        bandwidth_name(result));
+    }
+  }
+  Serial.printf("%u of %d pipes made, average %u cycles, max %u\n",
+    made, PIPES, cycles_total / PIPES, cycles_max);
+  Serial.println("Unplug the device to free the pipes");
+}
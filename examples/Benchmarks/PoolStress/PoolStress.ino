@@ -0,0 +1,142 @@
+// USB Host memory pool stress test
+//
+// The Transfer_t pool is a lock-free stack, so interrupts and the main
+// program may allocate and free at the same time.  This sketch does that
+// as fast as it can: an IntervalTimer interrupt takes and gives back a
+// few Transfer_t every 10 us, while loop() takes and gives back batches,
+// sometimes until the pool is empty.  Each Transfer_t taken is marked
+// with who has it, so one given out twice is found.  After each run, the
+// free counts must be the same as before.  The time to take and give back
+// is measured with the ARM_DWT_CYCCNT cycle counter.
+//
+// No USB device is needed.  Don't plug one in or out while this runs, as
+// that changes the free counts.
+//
+// This example is in the public domain
+
+#include "USBHost_t36.h"
+
+USBHost myusb;
+// Transfer_t anyone may borrow, in addition to those PoolUser reserves
+USBHostConfig<1, 1, 48> myusbmemory;
+
+#define ISR_OWNER  0x15A15A
+#define LOOP_OWNER 0x100F100F
+#define NO_OWNER   0
+
+// A driver which never claims a device, only uses the pool
+class PoolUser : public USBDriver {
+public:
+  PoolUser(USBHost &host) {
+    contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t), this);
+  }
+  // Transfer_t's length is only set by the queue functions, so it can
+  // hold who has this one
+  Transfer_t * take(uint32_t owner) {
+    Transfer_t *t = allocate_Transfer(this);
+    if (!t) return NULL;
+    if (t->length == ISR_OWNER || t->length == LOOP_OWNER) errors++;
+    t->length = owner;
+    return t;
+  }
+  void give(Transfer_t *t, uint32_t owner) {
+    if (t->length != owner) errors++;
+    t->length = NO_OWNER;
+    free_Transfer(t);
+  }
+  volatile uint32_t errors = 0;
+protected:
+  virtual bool claim(Device_t *device, int type, const uint8_t *descriptors, uint32_t len) {
+    return false;
+  }
+  virtual void disconnect() {
+  }
+  Transfer_t mytransfers[16] __attribute__ ((aligned(32)));
+};
+
+PoolUser pooluser(myusb);
+IntervalTimer hammer;
+
+Transfer_t *isr_held[4];
+uint32_t isr_count = 0;
+volatile uint32_t isr_runs = 0;
+volatile uint32_t isr_empty = 0;
+
+// take 4, then give them back, in turns
+void isr_hammer() {
+  if (isr_count == 0) {
+    while (isr_count < 4) {
+      Transfer_t *t = pooluser.take(ISR_OWNER);
+      if (!t) {
+        isr_empty++;
+        break;
+      }
+      isr_held[isr_count++] = t;
+    }
+  } else {
+    while (isr_count > 0) pooluser.give(isr_held[--isr_count], ISR_OWNER);
+  }
+  isr_runs++;
+}
+
+void setup()
+{
+  while (!Serial) ; // wait for Arduino Serial Monitor
+  Serial.println("USB Host memory pool stress test");
+  ARM_DEMCR |= ARM_DEMCR_TRCENA; // Teensy 3.6 needs the cycle counter started
+  ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+  myusb.begin();
+}
+
+Transfer_t *loop_held[100];
+
+void loop()
+{
+  uint32_t before[4], after[4];
+  poolstats_t devices, pipes, trans, strs;
+  myusb.Task();
+  USBHost::countFree(before[0], before[1], before[2], before[3]);
+  USBHost::poolStats(devices, pipes, trans, strs, true);
+  pooluser.errors = 0;
+  isr_runs = 0;
+  isr_empty = 0;
+  hammer.begin(isr_hammer, 10);
+
+  uint32_t batches = 0, taken = 0, empty = 0, cycles = 0;
+  elapsedMillis ms = 0;
+  while (ms < 5000) {
+    // usually 16, but every 64th batch until the pool is empty
+    uint32_t want = ((batches & 63) == 63) ? 100 : 16;
+    uint32_t n = 0;
+    uint32_t begin = ARM_DWT_CYCCNT;
+    while (n < want) {
+      Transfer_t *t = pooluser.take(LOOP_OWNER);
+      if (!t) {
+        empty++;
+        break;
+      }
+      loop_held[n++] = t;
+    }
+    while (n > 0) pooluser.give(loop_held[--n], LOOP_OWNER);
+    if (want == 16) {
+      cycles += ARM_DWT_CYCCNT - begin;
+      taken += 16;
+    }
+    batches++;
+    myusb.Task();
+  }
+
+  hammer.end();
+  while (isr_count > 0) pooluser.give(isr_held[--isr_count], ISR_OWNER);
+  USBHost::countFree(after[0], after[1], after[2], after[3]);
+  USBHost::poolStats(devices, pipes, trans, strs);
+  Serial.printf("loop: %u batches, pool empty %u times, %u cycles per take & give\n",
+    batches, empty, taken ? cycles / taken : 0);
+  Serial.printf("interrupt: %u runs, pool empty %u times\n", isr_runs, isr_empty);
+  Serial.printf("Transfer_t: %u of %u free, %u before, lowest %u\n",
+    after[2], trans.total, before[2], trans.min_free);
+  if (pooluser.errors) Serial.printf("ERROR: %u Transfer_t given out twice\n", pooluser.errors);
+  if (memcmp(before, after, sizeof(before)) != 0) Serial.println("ERROR: free counts changed");
+  if (!pooluser.errors && memcmp(before, after, sizeof(before)) == 0) Serial.println("ok");
+  Serial.println();
+}
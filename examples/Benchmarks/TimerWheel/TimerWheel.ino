@@ -0,0 +1,135 @@
+// USB Host driver timer speed, with hundreds of timers
+//
+// Starts and stops 500 USBDriverTimer objects, printing the time each
+// start() and stop() takes in ARM_DWT_CYCCNT cycles.  Then lets them all
+// expire, counting how many fire in each USB interrupt and how long those
+// interrupts take.  No USB device is needed.
+//
+// This example is in the public domain
+
+#include "USBHost_t36.h"
+
+USBHost myusb;
+
+#define TIMERS 500
+
+// A driver which never claims a device, only owns the timers
+class TimerDriver : public USBDriver {
+public:
+  TimerDriver(USBHost &host) {
+    for (int i=0; i < TIMERS; i++) timers[i].init(this);
+  }
+  USBDriverTimer timers[TIMERS];
+  volatile uint32_t events = 0;
+  volatile uint32_t last_micros = 0;
+protected:
+  virtual bool claim(Device_t *device, int type, const uint8_t *descriptors, uint32_t len) {
+    return false;
+  }
+  virtual void disconnect() {
+  }
+  virtual void timer_event(USBDriverTimer *whichTimer) {
+    events++;
+    last_micros = micros();
+  }
+};
+
+TimerDriver timerdriver(myusb);
+
+// The library's interrupt, called by timed_isr()
+void (*usb_isr)(void);
+volatile uint32_t isr_count = 0;
+volatile uint32_t isr_cycles = 0;
+volatile uint32_t isr_max = 0;
+volatile uint32_t events_max = 0;
+
+void timed_isr() {
+  uint32_t events = timerdriver.events;
+  uint32_t begin = ARM_DWT_CYCCNT;
+  usb_isr();
+  uint32_t n = ARM_DWT_CYCCNT - begin;
+  events = timerdriver.events - events;
+  if (events == 0) return; // not a timer interrupt
+  isr_count++;
+  isr_cycles += n;
+  if (n > isr_max) isr_max = n;
+  if (events > events_max) events_max = events;
+}
+
+// 1 ms to about 2 seconds, spread to fill all levels of the wheel
+uint32_t duration(int i) {
+  return 1000 + (i * 7919UL) % 2000000;
+}
+
+void setup()
+{
+  while (!Serial) ; // wait for Arduino Serial Monitor
+  Serial.println("USB Host driver timers");
+  ARM_DEMCR |= ARM_DEMCR_TRCENA; // Teensy 3.6 needs the cycle counter started
+  ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+  myusb.begin();
+  usb_isr = _VectorsRam[IRQ_USBHS + 16];
+  attachInterruptVector(IRQ_USBHS, timed_isr);
+}
+
+void run_timers(bool same_time)
+{
+  uint32_t start_cycles = 0, start_max = 0;
+  uint32_t stop_cycles = 0, stop_max = 0;
+  // start & stop all, timing each
+  for (int i=0; i < TIMERS; i++) {
+    uint32_t begin = ARM_DWT_CYCCNT;
+    timerdriver.timers[i].start(same_time ? 100000 : duration(i));
+    uint32_t n = ARM_DWT_CYCCNT - begin;
+    start_cycles += n;
+    if (n > start_max) start_max = n;
+  }
+  for (int i=0; i < TIMERS; i++) {
+    uint32_t begin = ARM_DWT_CYCCNT;
+    timerdriver.timers[i].stop();
+    uint32_t n = ARM_DWT_CYCCNT - begin;
+    stop_cycles += n;
+    if (n > stop_max) stop_max = n;
+  }
+  Serial.printf("  start: average %u cycles, max %u\n", start_cycles / TIMERS, start_max);
+  Serial.printf("  stop:  average %u cycles, max %u\n", stop_cycles / TIMERS, stop_max);
+
+  // start all again, and let them expire
+  __disable_irq();
+  timerdriver.events = 0;
+  isr_count = 0;
+  isr_cycles = 0;
+  isr_max = 0;
+  events_max = 0;
+  __enable_irq();
+  uint32_t begin = micros();
+  for (int i=0; i < TIMERS; i++) {
+    timerdriver.timers[i].start(same_time ? 100000 : duration(i));
+  }
+  elapsedMillis ms = 0;
+  while (timerdriver.events < TIMERS && ms < 3000) ;
+  __disable_irq();
+  uint32_t events = timerdriver.events;
+  uint32_t count = isr_count;
+  uint32_t cycles = isr_cycles;
+  uint32_t most = isr_max;
+  uint32_t events_most = events_max;
+  uint32_t last = timerdriver.last_micros - begin;
+  __enable_irq();
+  Serial.printf("  expire: %u timers in %u interrupts, up to %u each\n",
+    events, count, events_most);
+  Serial.printf("  interrupt: average %u cycles, max %u\n",
+    count ? cycles / count : 0, most);
+  Serial.printf("  last timer at %u us\n", last);
+  if (events != TIMERS) Serial.println("  some timers did not fire!");
+}
+
+void loop()
+{
+  Serial.printf("%d timers, 1 ms to 2 seconds\n", TIMERS);
+  run_timers(false);
+  Serial.printf("%d timers, all 100 ms\n", TIMERS);
+  run_timers(true);
+  Serial.println();
+  delay(5000);
+}
@@ -0,0 +1,331 @@
+/* USB EHCI Host for Teensy 3.6 - capture round trip test
+ * Copyright 2017 Paul Stoffregen (paul@pjrc.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Captures known traffic with USBHOST_CAPTURE, on the host simulator in
+// ../host_sim, then reads back the pcapng which captureWrite() made and
+// checks every block and usbmon header against what was sent: control
+// requests with & without data, a stall, and bulk transfers longer than
+// the snap length.
+//
+// Build on Linux (the EHCI needs everything below 4 GB, so no PIE):
+//   g++ -O2 -std=gnu++14 -fno-rtti -fno-exceptions -fpermissive -w \
+//     -no-pie -fno-pie -D__IMXRT1062__ -DARDUINO_TEENSY41 \
+//     -DUSBHOST_CAPTURE -DUSBHOST_CAPTURE_SIZE=256 -DUSBHOST_CAPTURE_SNAPLEN=64 \
+//     -I../host_sim -I../.. -o capture_test capture_test.cpp \
+//     ../host_sim/host_sim.cpp ../../ehci.cpp ../../memory.cpp \
+//     ../../enumeration.cpp ../../hub.cpp ../../print.cpp ../../capture.cpp
+//
+// Use:
+//   ./capture_test [file.pcapng]   (the file may be opened in Wireshark)
+//
+// The exit status is the number of failed checks.
+
+#include <Arduino.h>
+#include "host_sim.h"
+#include "loopback.h"
+
+#if !defined(USBHOST_CAPTURE)
+#error "capture_test must be built with -DUSBHOST_CAPTURE"
+#endif
+#define SNAPLEN (USBHOST_CAPTURE_SNAPLEN)
+
+static uint32_t failures = 0;
+static uint32_t checks = 0;
+
+#define CHECK(cond) do { \
+	checks++; \
+	if (!(cond)) { \
+		printf("  FAIL line %d: %s\n", __LINE__, #cond); \
+		failures++; \
+	} \
+} while (0)
+
+USBHost myusb;
+LoopbackDriver loop1(myusb);
+LoopbackDevice device(2);
+
+static uint8_t out_buf[200];
+static uint8_t in_buf[200];
+
+// captureWrite() output, kept in memory
+class MemoryPrint : public Print {
+public:
+	virtual size_t write(uint8_t b) { return write(&b, 1); }
+	virtual size_t write(const uint8_t *buffer, size_t size) {
+		if (len + size > sizeof(data)) return 0;
+		memcpy(data + len, buffer, size);
+		len += size;
+		return size;
+	}
+	uint8_t data[1 << 20];
+	size_t len = 0;
+};
+static MemoryPrint pcap;
+
+// run the simulation for some milliseconds, saving the capture every 1 ms
+static void run(uint32_t ms)
+{
+	while (ms--) {
+		delay(1);
+		myusb.Task();
+		USBHost::captureWrite(pcap);
+	}
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// One Enhanced Packet Block, as read back
+typedef struct {
+	uint64_t id;
+	uint8_t  type;
+	uint8_t  xfer_type;
+	uint8_t  epnum;
+	uint8_t  devnum;
+	int8_t   flag_setup;
+	int8_t   flag_data;
+	int32_t  status;
+	uint32_t length;
+	uint32_t len_cap;
+	uint32_t orig_len; // EPB original length, less the usbmon header
+	uint64_t time;
+	uint8_t  setup[8];
+	const uint8_t *data;
+} packet_t;
+
+static packet_t packets[4096];
+static uint32_t packet_count = 0;
+
+// Walk the pcapng blocks, check the headers, and collect the packets
+static void parse(const uint8_t *p, size_t len)
+{
+	bool shb = false, idb = false;
+	uint64_t last_time = 0;
+	while (len > 0) {
+		CHECK(len >= 12);
+		if (len < 12) return;
+		uint32_t type = get32(p);
+		uint32_t total = get32(p + 4);
+		CHECK(total >= 12 && total <= len && (total & 3) == 0);
+		if (total < 12 || total > len || (total & 3)) return;
+		CHECK(get32(p + total - 4) == total);
+		const uint8_t *body = p + 8;
+		if (type == 0x0A0D0D0A) {
+			CHECK(!shb && total == 28);
+			CHECK(get32(body) == 0x1A2B3C4D);   // byte order magic
+			CHECK(get32(body + 4) == 0x00000001); // version 1.0
+			shb = true;
+		} else if (type == 1) {
+			CHECK(shb && !idb && total == 20);
+			CHECK((get32(body) & 0xFFFF) == 220); // LINKTYPE_USB_LINUX_MMAPPED
+			CHECK(get32(body + 4) == 64 + SNAPLEN);
+			idb = true;
+		} else if (type == 6) {
+			CHECK(idb);
+			CHECK(get32(body) == 0); // interface
+			uint64_t time = ((uint64_t)get32(body + 4) << 32) | get32(body + 8);
+			uint32_t captured = get32(body + 12);
+			uint32_t orig = get32(body + 16);
+			const uint8_t *h = body + 20;
+			CHECK(captured >= 64 && total == 12 + 20 + ((captured + 3) & ~3));
+			CHECK(time >= last_time);
+			last_time = time;
+			if (packet_count < sizeof(packets)/sizeof(packet_t)) {
+				packet_t *k = &packets[packet_count++];
+				k->id = get32(h) | ((uint64_t)get32(h + 4) << 32);
+				k->type = h[8];
+				k->xfer_type = h[9];
+				k->epnum = h[10];
+				k->devnum = h[11];
+				CHECK((h[12] | (h[13] << 8)) == 1); // busnum
+				k->flag_setup = h[14];
+				k->flag_data = h[15];
+				uint64_t sec = get32(h + 16) | ((uint64_t)get32(h + 20) << 32);
+				uint32_t usec = get32(h + 24);
+				CHECK(usec < 1000000 && sec * 1000000 + usec == time);
+				k->status = get32(h + 28);
+				k->length = get32(h + 32);
+				k->len_cap = get32(h + 36);
+				memcpy(k->setup, h + 40, 8);
+				CHECK(k->len_cap == captured - 64 && k->len_cap <= SNAPLEN);
+				k->orig_len = orig - 64;
+				k->time = time;
+				k->data = h + 64;
+			}
+		} else {
+			CHECK(0); // unknown block
+		}
+		p += total;
+		len -= total;
+	}
+	CHECK(shb && idb);
+}
+
+// The packet submitting a control request, or NULL
+static const packet_t * find_setup(uint32_t bmRequestType, uint32_t bRequest)
+{
+	for (uint32_t i=0; i < packet_count; i++) {
+		const packet_t *k = &packets[i];
+		if (k->type == 'S' && k->xfer_type == 2 && k->flag_setup == 0
+		  && k->setup[0] == bmRequestType && k->setup[1] == bRequest) return k;
+	}
+	return NULL;
+}
+
+// The packet with the same id and type, after this one
+static const packet_t * find_next(const packet_t *k, uint8_t type)
+{
+	for (const packet_t *n = k + 1; n < packets + packet_count; n++) {
+		if (n->id == k->id && n->type == type) return n;
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	myusb.begin();
+	sim_connect(2, &device);
+	delay(500);
+	CHECK(loop1);
+	if (!loop1) return 1;
+
+	printf("capture control & bulk transfers\n");
+	USBHost::captureStart();
+	run(5);
+	loop1.request(0x40, 1, 0x1234, 0);
+	run(5);
+	loop1.request(0xC0, 2, 0, 2);
+	run(5);
+	loop1.request(0xC0, 3, 0, 2); // stalls
+	run(5);
+	for (uint32_t i=0; i < sizeof(out_buf); i++) out_buf[i] = i * 3;
+	loop1.send(out_buf, sizeof(out_buf));
+	loop1.receive(in_buf, sizeof(in_buf));
+	run(10);
+	USBHost::captureStop();
+	USBHost::captureWrite(pcap);
+	CHECK(loop1.in_done && memcmp(in_buf, out_buf, sizeof(in_buf)) == 0);
+	CHECK(USBHost::captureDropped() == 0);
+	if (argc > 1) {
+		FILE *f = fopen(argv[1], "wb");
+		if (f) {
+			fwrite(pcap.data, 1, pcap.len, f);
+			fclose(f);
+		}
+	}
+
+	printf("read back %u bytes of pcapng\n", (uint32_t)pcap.len);
+	parse(pcap.data, pcap.len);
+	printf("  %u packets\n", packet_count);
+
+	// Every control & bulk completion follows its submit, and interrupt
+	// transfers complete about once per ms
+	uint32_t interrupts = 0;
+	for (uint32_t i=0; i < packet_count; i++) {
+		const packet_t *k = &packets[i];
+		CHECK(k->devnum == device.address);
+		if (k->type == 'S') continue;
+		CHECK(k->type == 'C');
+		if (k->xfer_type == 1) {
+			CHECK(k->epnum == 0x81 && k->length == 8 && k->status == 0);
+			interrupts++;
+			continue;
+		}
+		bool submitted = false;
+		for (uint32_t j=0; j < i; j++) {
+			if (packets[j].id == k->id && packets[j].type == 'S'
+			  && packets[j].epnum == k->epnum) submitted = true;
+		}
+		CHECK(submitted);
+	}
+	CHECK(interrupts >= 28 && interrupts <= 32);
+
+	printf("control OUT, no data\n");
+	const packet_t *s = find_setup(0x40, 1);
+	const packet_t *c = s ? find_next(s, 'C') : NULL;
+	CHECK(s && c);
+	if (s && c) {
+		CHECK(s->epnum == 0x00 && s->status == -115 && s->length == 0);
+		CHECK(s->setup[2] == 0x34 && s->setup[3] == 0x12 && s->setup[6] == 0);
+		CHECK(c->status == 0 && c->length == 0 && c->flag_setup == '-');
+		CHECK(c->time >= s->time);
+	}
+
+	printf("control IN, 2 bytes\n");
+	s = find_setup(0xC0, 2);
+	c = s ? find_next(s, 'C') : NULL;
+	CHECK(s && c);
+	if (s && c) {
+		CHECK(s->epnum == 0x80 && s->length == 2 && s->flag_data == '<');
+		CHECK(c->status == 0 && c->length == 2 && c->len_cap == 2);
+		CHECK(c->flag_data == 0 && c->data[0] == 0x34 && c->data[1] == 0x12);
+	}
+
+	printf("control IN, stalled\n");
+	s = find_setup(0xC0, 3);
+	c = s ? find_next(s, 'C') : NULL;
+	CHECK(s && c);
+	if (s && c) {
+		CHECK(c->status == -32); // -EPIPE
+		CHECK(c->length == 0);
+	}
+
+	printf("bulk OUT & IN, %u bytes\n", (uint32_t)sizeof(out_buf));
+	s = NULL;
+	for (uint32_t i=0; i < packet_count; i++) {
+		if (packets[i].xfer_type == 3 && packets[i].epnum == 0x02) {
+			s = &packets[i];
+			break;
+		}
+	}
+	c = s ? find_next(s, 'C') : NULL;
+	CHECK(s && c);
+	if (s && c) {
+		CHECK(s->type == 'S' && s->length == sizeof(out_buf) && s->flag_data == 0);
+		CHECK(s->len_cap == SNAPLEN && s->orig_len == sizeof(out_buf));
+		CHECK(memcmp(s->data, out_buf, SNAPLEN) == 0);
+		CHECK(c->status == 0 && c->length == sizeof(out_buf) && c->len_cap == 0);
+		CHECK(c->flag_data == '>');
+	}
+	s = NULL;
+	for (uint32_t i=0; i < packet_count; i++) {
+		if (packets[i].xfer_type == 3 && packets[i].epnum == 0x83) {
+			s = &packets[i];
+			break;
+		}
+	}
+	c = s ? find_next(s, 'C') : NULL;
+	CHECK(s && c);
+	if (s && c) {
+		CHECK(s->type == 'S' && s->length == sizeof(in_buf) && s->len_cap == 0);
+		CHECK(s->flag_data == '<');
+		CHECK(c->status == 0 && c->length == sizeof(in_buf));
+		CHECK(c->len_cap == SNAPLEN && c->orig_len == sizeof(in_buf));
+		CHECK(memcmp(c->data, out_buf, SNAPLEN) == 0);
+	}
+
+	printf("%u checks, %u failed\n", checks, failures);
+	return failures;
+}
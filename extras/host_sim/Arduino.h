@@ -0,0 +1,314 @@
+/* USB EHCI Host for Teensy 3.6 - host simulator, Arduino & Teensy 4 stand-ins
+ * Copyright 2017 Paul Stoffregen (paul@pjrc.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Just enough of Arduino and Teensy 4's imxrt.h for the library to compile
+// and run on a PC, with both USB controllers modeled by host_sim.cpp.  Time
+// is simulated: it only moves forward inside delay(), delayMicroseconds(),
+// yield() and sim_run(), which is also when interrupts happen.
+
+#ifndef HOST_SIM_ARDUINO_H_
+#define HOST_SIM_ARDUINO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <utility>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HEX 16
+#define DEC 10
+#define OCT 8
+#define BIN 2
+#define F(x) (x)
+#define PROGMEM
+#define DMAMEM
+#define FASTRUN
+#define FLASHMEM
+#define PSTR(x) (x)
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define constrain(x, lo, hi) ((x) < (lo) ? (lo) : ((x) > (hi) ? (hi) : (x)))
+
+class Print {
+public:
+	virtual size_t write(uint8_t b) = 0;
+	virtual size_t write(const uint8_t *buffer, size_t size) {
+		size_t count = 0;
+		while (size--) count += write(*buffer++);
+		return count;
+	}
+	size_t write(const char *str) { return write((const uint8_t *)str, strlen(str)); }
+	size_t write(const char *buf, size_t size) { return write((const uint8_t *)buf, size); }
+	virtual int availableForWrite() { return 0; }
+	virtual void flush() { }
+	size_t print(const char *s) { return write(s); }
+	size_t print(char c) { return write((uint8_t)c); }
+	size_t print(uint8_t b, int base=DEC) { return print((unsigned long)b, base); }
+	size_t print(int n, int base=DEC) { return print((long)n, base); }
+	size_t print(unsigned int n, int base=DEC) { return print((unsigned long)n, base); }
+	size_t print(long n, int base=DEC) {
+		if (base == 0) return write((uint8_t)n);
+		if (n < 0 && base == DEC) return print('-') + number((unsigned long long)-n, base);
+		return number((unsigned long)n, base);
+	}
+	size_t print(unsigned long n, int base=DEC) {
+		if (base == 0) return write((uint8_t)n);
+		return number(n, base);
+	}
+	size_t print(long long n, int base=DEC) {
+		if (n < 0 && base == DEC) return print('-') + number((unsigned long long)-n, base);
+		return number((unsigned long long)n, base);
+	}
+	size_t print(unsigned long long n, int base=DEC) { return number(n, base); }
+	size_t print(double n, int digits=2) { return printf("%.*f", digits, n); }
+	size_t println() { return write("\r\n"); }
+	template <typename T> size_t println(T n) { return print(n) + println(); }
+	template <typename T> size_t println(T n, int base) { return print(n, base) + println(); }
+	int printf(const char *format, ...) __attribute__ ((format (printf, 2, 3))) {
+		char buf[512];
+		va_list args;
+		va_start(args, format);
+		int len = vsnprintf(buf, sizeof(buf), format, args);
+		va_end(args);
+		if (len > (int)sizeof(buf) - 1) len = sizeof(buf) - 1;
+		return (len > 0) ? write((const uint8_t *)buf, len) : 0;
+	}
+private:
+	size_t number(unsigned long long n, int base) {
+		char buf[66], *p = buf + sizeof(buf);
+		if (base < 2) base = 10;
+		do {
+			unsigned digit = n % base;
+			*--p = (digit < 10) ? '0' + digit : 'A' + digit - 10;
+			n /= base;
+		} while (n);
+		return write((const uint8_t *)p, buf + sizeof(buf) - p);
+	}
+};
+
+class Stream : public Print {
+public:
+	virtual int available() = 0;
+	virtual int read() = 0;
+	virtual int peek() = 0;
+	void setTimeout(unsigned long) { }
+	size_t readBytes(char *buffer, size_t length) {
+		size_t count = 0;
+		while (count < length && available()) buffer[count++] = read();
+		return count;
+	}
+};
+
+// Serial writes to stdout, unless sim_serial_quiet is set
+extern bool sim_serial_quiet;
+class HardwareSerial : public Stream {
+public:
+	void begin(uint32_t) { }
+	virtual size_t write(uint8_t b) {
+		if (!sim_serial_quiet) putchar(b);
+		return 1;
+	}
+	virtual size_t write(const uint8_t *buffer, size_t size) {
+		if (!sim_serial_quiet) fwrite(buffer, 1, size, stdout);
+		return size;
+	}
+	using Print::write;
+	virtual int available() { return 0; }
+	virtual int read() { return -1; }
+	virtual int peek() { return -1; }
+	virtual void flush() { fflush(stdout); }
+	operator bool() { return true; }
+};
+extern HardwareSerial Serial;
+extern HardwareSerial Serial1;
+
+// Simulated time, in microseconds since the program started
+uint32_t micros(void);
+uint32_t millis(void);
+void delay(uint32_t msec);
+void delayMicroseconds(uint32_t usec);
+void yield(void);
+
+class elapsedMillis {
+public:
+	elapsedMillis() : ms(millis()) { }
+	elapsedMillis(unsigned long val) : ms(millis() - val) { }
+	operator unsigned long() const { return millis() - ms; }
+	elapsedMillis & operator = (unsigned long val) { ms = millis() - val; return *this; }
+	elapsedMillis & operator += (unsigned long val) { ms -= val; return *this; }
+	elapsedMillis & operator -= (unsigned long val) { ms += val; return *this; }
+private:
+	unsigned long ms;
+};
+
+class elapsedMicros {
+public:
+	elapsedMicros() : us(micros()) { }
+	elapsedMicros(unsigned long val) : us(micros() - val) { }
+	operator unsigned long() const { return micros() - us; }
+	elapsedMicros & operator = (unsigned long val) { us = micros() - val; return *this; }
+	elapsedMicros & operator += (unsigned long val) { us -= val; return *this; }
+	elapsedMicros & operator -= (unsigned long val) { us += val; return *this; }
+private:
+	unsigned long us;
+};
+
+// Interrupts.  Like the NVIC, each IRQ has enable & pending bits, and
+// pending interrupts run (never nested) as soon as they're allowed.  Each
+// also has a priority, 128 at startup like Teensy's, which is only kept
+// for code reading it back.
+typedef int IRQ_NUMBER_t;
+#define IRQ_USB1  112
+#define IRQ_USB2  113
+void attachInterruptVector(IRQ_NUMBER_t irq, void (*function)(void));
+void sim_disable_irq(void);
+void sim_enable_irq(void);
+void sim_nvic_enable(uint32_t irq);
+void sim_nvic_disable(uint32_t irq);
+void sim_nvic_set_pending(uint32_t irq);
+bool sim_nvic_is_enabled(uint32_t irq);
+void sim_nvic_set_priority(uint32_t irq, uint32_t priority);
+uint32_t sim_nvic_get_priority(uint32_t irq);
+#define __disable_irq()          sim_disable_irq()
+#define __enable_irq()           sim_enable_irq()
+#define NVIC_ENABLE_IRQ(n)       sim_nvic_enable(n)
+#define NVIC_DISABLE_IRQ(n)      sim_nvic_disable(n)
+#define NVIC_SET_PENDING(n)      sim_nvic_set_pending(n)
+#define NVIC_IS_ENABLED(n)       sim_nvic_is_enabled(n)
+#define NVIC_SET_PRIORITY(n, p)  sim_nvic_set_priority(n, p)
+#define NVIC_GET_PRIORITY(n)     sim_nvic_get_priority(n)
+
+// The cycle counter runs at F_CPU_ACTUAL in simulated time
+#define F_CPU 600000000
+extern uint32_t F_CPU_ACTUAL;
+uint32_t sim_cycle_count(void);
+extern uint32_t ARM_DEMCR, ARM_DWT_CTRL;
+#define ARM_DWT_CYCCNT           sim_cycle_count()
+#define ARM_DEMCR_TRCENA         (1 << 24)
+#define ARM_DWT_CTRL_CYCCNTENA   (1 << 0)
+
+// Cache maintenance, tracked by host_sim.cpp for memory from 0x20200000
+// up, see sim_cached_memory() in host_sim.h
+void sim_dcache(uint32_t op, void *addr, uint32_t size);
+static inline void arm_dcache_flush(void *addr, uint32_t size) { sim_dcache(1, addr, size); }
+static inline void arm_dcache_delete(void *addr, uint32_t size) { sim_dcache(2, addr, size); }
+static inline void arm_dcache_flush_delete(void *addr, uint32_t size) { sim_dcache(3, addr, size); }
+
+// The USB controllers.  Every access to a register calls host_sim.cpp,
+// which is how the EHCI model sees writes to its registers.
+class sim_register {
+public:
+	operator uint32_t();
+	sim_register & operator = (uint32_t n);
+	sim_register & operator = (sim_register &r) { return *this = (uint32_t)r; }
+	sim_register & operator |= (uint32_t n) { return *this = (uint32_t)*this | n; }
+	sim_register & operator &= (uint32_t n) { return *this = (uint32_t)*this & n; }
+	uint32_t value;
+};
+#define USBHS_REGISTER sim_register
+extern sim_register sim_usb_registers[2][128];
+#define USB1_ID (sim_usb_registers[0][0])
+#define USB2_ID (sim_usb_registers[1][0])
+
+// Clock & PHY registers, which are only written.  The PLLs are always locked.
+extern volatile uint32_t sim_misc_registers[64];
+#define CCM_ANALOG_PLL_USB1                  (sim_misc_registers[0])
+#define CCM_ANALOG_PLL_USB2                  (sim_misc_registers[4])
+#define USBPHY1_CTRL                         (sim_misc_registers[8])
+#define USBPHY1_PWD                          (sim_misc_registers[12])
+#define USBPHY2_CTRL                         (sim_misc_registers[16])
+#define USBPHY2_PWD                          (sim_misc_registers[20])
+#define CCM_CCGR6                            (sim_misc_registers[24])
+#define IOMUXC_SW_MUX_CTL_PAD_GPIO_EMC_40    (sim_misc_registers[25])
+#define IOMUXC_SW_PAD_CTL_PAD_GPIO_EMC_40    (sim_misc_registers[26])
+#define GPIO8_GDIR                           (sim_misc_registers[27])
+#define GPIO8_DR_SET                         (sim_misc_registers[28])
+#define CCM_ANALOG_PLL_USB1_LOCK             ((uint32_t)(1<<31))
+#define CCM_ANALOG_PLL_USB1_BYPASS           ((uint32_t)(1<<16))
+#define CCM_ANALOG_PLL_USB1_ENABLE           ((uint32_t)(1<<13))
+#define CCM_ANALOG_PLL_USB1_POWER            ((uint32_t)(1<<12))
+#define CCM_ANALOG_PLL_USB1_EN_USB_CLKS      ((uint32_t)(1<<6))
+#define CCM_ANALOG_PLL_USB1_DIV_SELECT       ((uint32_t)(1<<1))
+#define CCM_CCGR6_USBOH3(n)                  ((uint32_t)(((n) & 0x03) << 0))
+#define CCM_CCGR_ON                          3
+#define USBPHY_CTRL_SFTRST                   ((uint32_t)(1<<31))
+#define USBPHY_CTRL_CLKGATE                  ((uint32_t)(1<<30))
+#define USBPHY_CTRL_ENUTMILEVEL3             ((uint32_t)(1<<15))
+#define USBPHY_CTRL_ENUTMILEVEL2             ((uint32_t)(1<<14))
+#define USBPHY_CTRL_ENHOSTDISCONDETECT       ((uint32_t)(1<<1))
+
+#define USB_USBCMD_ITC(n)        ((uint32_t)(((n) & 0xFF) << 16))
+#define USB_USBCMD_FS_2          ((uint32_t)(1<<15))
+#define USB_USBCMD_ASPE          ((uint32_t)(1<<11))
+#define USB_USBCMD_ASP(n)        ((uint32_t)(((n) & 0x03) << 8))
+#define USB_USBCMD_IAA           ((uint32_t)(1<<6))
+#define USB_USBCMD_ASE           ((uint32_t)(1<<5))
+#define USB_USBCMD_PSE           ((uint32_t)(1<<4))
+#define USB_USBCMD_FS_1(n)       ((uint32_t)(((n) & 0x03) << 2))
+#define USB_USBCMD_RST           ((uint32_t)(1<<1))
+#define USB_USBCMD_RS            ((uint32_t)(1<<0))
+#define USB_USBSTS_TI1           ((uint32_t)(1<<25))
+#define USB_USBSTS_TI0           ((uint32_t)(1<<24))
+#define USB_USBSTS_NAKI          ((uint32_t)(1<<16))
+#define USB_USBSTS_AS            ((uint32_t)(1<<15))
+#define USB_USBSTS_PS            ((uint32_t)(1<<14))
+#define USB_USBSTS_HCH           ((uint32_t)(1<<12))
+#define USB_USBSTS_SLI           ((uint32_t)(1<<8))
+#define USB_USBSTS_URI           ((uint32_t)(1<<6))
+#define USB_USBSTS_AAI           ((uint32_t)(1<<5))
+#define USB_USBSTS_SEI           ((uint32_t)(1<<4))
+#define USB_USBSTS_PCI           ((uint32_t)(1<<2))
+#define USB_USBSTS_UEI           ((uint32_t)(1<<1))
+#define USB_USBINTR_TIE1         ((uint32_t)(1<<25))
+#define USB_USBINTR_TIE0         ((uint32_t)(1<<24))
+#define USB_USBINTR_UPIE         ((uint32_t)(1<<19))
+#define USB_USBINTR_UAIE         ((uint32_t)(1<<18))
+#define USB_USBINTR_AAE          ((uint32_t)(1<<5))
+#define USB_USBINTR_SEE          ((uint32_t)(1<<4))
+#define USB_USBINTR_PCE          ((uint32_t)(1<<2))
+#define USB_USBINTR_UEE          ((uint32_t)(1<<1))
+#define USB_PORTSC1_PSPD(n)      ((uint32_t)(((n) & 0x03) << 26))
+#define USB_PORTSC1_PFSC         ((uint32_t)(1<<24))
+#define USB_PORTSC1_PHCD         ((uint32_t)(1<<23))
+#define USB_PORTSC1_PP           ((uint32_t)(1<<12))
+#define USB_PORTSC1_HSP          ((uint32_t)(1<<9))
+#define USB_PORTSC1_PR           ((uint32_t)(1<<8))
+#define USB_PORTSC1_SUSP         ((uint32_t)(1<<7))
+#define USB_PORTSC1_FPR          ((uint32_t)(1<<6))
+#define USB_PORTSC1_OCC          ((uint32_t)(1<<5))
+#define USB_PORTSC1_OCA          ((uint32_t)(1<<4))
+#define USB_PORTSC1_PEC          ((uint32_t)(1<<3))
+#define USB_PORTSC1_PE           ((uint32_t)(1<<2))
+#define USB_PORTSC1_CSC          ((uint32_t)(1<<1))
+#define USB_PORTSC1_CCS          ((uint32_t)(1<<0))
+#define USB_GPTIMERCTRL_GPTRUN   ((uint32_t)(1<<31))
+#define USB_GPTIMERCTRL_GPTRST   ((uint32_t)(1<<30))
+#define USB_USBMODE_CM(n)        ((uint32_t)(((n) & 0x03) << 0))
+
+#endif
@@ -0,0 +1,33 @@
+// host simulator: just enough of Teensy's FS.h for USBHost_t36.h to compile
+
+#ifndef FS_H
+#define FS_H
+
+#include <Arduino.h>
+
+#define FILE_READ  0
+#define FILE_WRITE 1
+#define FILE_WRITE_BEGIN 2
+
+enum SeekMode {
+	SeekSet = 0,
+	SeekCur = 1,
+	SeekEnd = 2
+};
+
+class FileImpl {
+public:
+	virtual ~FileImpl() { }
+};
+
+class File {
+public:
+	File() { }
+	File(FileImpl *file) { }
+};
+
+class FS {
+public:
+};
+
+#endif
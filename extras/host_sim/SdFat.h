@@ -0,0 +1,129 @@
+// host simulator: just enough of SdFat for USBHost_t36.h and
+// MassStorageDriver.cpp to compile.  USBDrive reads & writes sectors
+// and finds partitions, but volumes never mount, as there's no FAT or
+// exFAT code here.
+
+#ifndef SdFat_h
+#define SdFat_h
+
+#include <Arduino.h>
+
+typedef int oflag_t;
+#define O_READ    0
+#define O_RDWR    2
+#define O_CREAT   4
+#define O_AT_END  8
+
+typedef Print print_t;
+
+typedef struct mbrPartition {
+	uint8_t boot;
+	uint8_t beginCHS[3];
+	uint8_t type;
+	uint8_t endCHS[3];
+	uint8_t relativeSectors[4];
+	uint8_t totalSectors[4];
+} MbrPart_t;
+
+typedef struct masterBootRecordSector {
+	uint8_t bootCode[446];
+	MbrPart_t part[4];
+	uint8_t signature[2];
+} MbrSector_t;
+
+typedef struct partitionBootSector {
+	uint8_t jmpInstruction[3];
+	char oemName[8];
+	uint8_t bpb[109];
+	uint8_t bootCode[390];
+	uint8_t signature[2];
+} pbs_t;
+
+typedef struct {
+	uint8_t signature[8];
+	uint8_t revision[4];
+	uint8_t headerSize[4];
+	uint8_t crc32[4];
+	uint8_t reserved[4];
+	uint8_t currentLBA[8];
+	uint8_t backupLBA[8];
+	uint8_t firstLBA[8];
+	uint8_t lastLBA[8];
+	uint8_t diskGUID[16];
+	uint8_t startLBAArray[8];
+	uint8_t numberPartitions[4];
+	uint8_t sizePartitionEntry[4];
+	uint8_t crc32PartitionEntries[4];
+	uint8_t unused[420];
+} GPTPartitionHeader_t;
+
+typedef struct {
+	uint8_t partitionTypeGUID[16];
+	uint8_t uniqueGUID[16];
+	uint8_t firstLBA[8];
+	uint8_t lastLBA[8];
+	uint8_t attributeFlags[8];
+	uint16_t name[36];
+} GPTPartitionEntryItem_t;
+
+typedef struct {
+	GPTPartitionEntryItem_t items[4];
+} GPTPartitionEntrySector_t;
+
+inline uint32_t getLe32(const uint8_t *src) {
+	uint32_t n;
+	memcpy(&n, src, 4);
+	return n;
+}
+
+inline uint64_t getLe64(const uint8_t *src) {
+	uint64_t n;
+	memcpy(&n, src, 8);
+	return n;
+}
+
+class FsBlockDeviceInterface {
+public:
+	virtual ~FsBlockDeviceInterface() { }
+};
+
+class FsFile {
+public:
+	operator bool() { return false; }
+	void close() { }
+	int write(const void *buf, size_t len) { return 0; }
+	int peek() { return -1; }
+	int available() { return 0; }
+	void flush() { }
+	int read(void *buf, size_t len) { return 0; }
+	bool truncate(uint64_t size) { return false; }
+	bool seekSet(uint64_t pos) { return false; }
+	bool seekCur(int64_t offset) { return false; }
+	bool seekEnd(int64_t offset) { return false; }
+	uint64_t curPosition() { return 0; }
+	uint64_t size() { return 0; }
+	bool isOpen() { return false; }
+	void getName(char *name, size_t len) { if (len) *name = 0; }
+	bool isDirectory() { return false; }
+	FsFile openNextFile() { return FsFile(); }
+	void rewindDirectory() { }
+};
+
+class FsVolume {
+public:
+	bool begin(FsBlockDeviceInterface *dev, bool setCwv=true, uint32_t firstSector=0,
+		uint32_t numSectors=0) { return false; }
+	void end() { }
+	uint8_t fatType() { return 0; }
+	FsFile open(const char *path, oflag_t oflag) { return FsFile(); }
+	bool exists(const char *path) { return false; }
+	bool mkdir(const char *path) { return false; }
+	bool rename(const char *from, const char *to) { return false; }
+	bool remove(const char *path) { return false; }
+	bool rmdir(const char *path) { return false; }
+	uint32_t clusterCount() { return 0; }
+	uint32_t freeClusterCount() { return 0; }
+	uint32_t bytesPerCluster() { return 0; }
+};
+
+#endif
@@ -0,0 +1,357 @@
+/* USB EHCI Host for Teensy 3.6 - host simulator standard class devices
+ * Copyright 2017 Paul Stoffregen (paul@pjrc.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Devices of the standard USB classes, so the library's own drivers
+// (KeyboardController, USBSerial & USBDrive) can be tested unmodified.
+// The descriptors are defined here, so include this in only 1 file.
+
+#ifndef HOST_SIM_CLASS_DEVICES_H_
+#define HOST_SIM_CLASS_DEVICES_H_
+
+#include "host_sim.h"
+
+// A low speed boot protocol keyboard.  Each report queued by press() or
+// release() is sent on the next poll of the interrupt endpoint.  The LEDs
+// from SET_REPORT are kept.
+class SimKeyboard : public SimDevice {
+public:
+	SimKeyboard() : SimDevice(1, device_desc, config_desc) { }
+	void press(uint8_t modifiers, uint8_t key) {
+		uint8_t *r = queue[head];
+		memset(r, 0, 8);
+		r[0] = modifiers;
+		r[2] = key;
+		head = (head + 1) % 16;
+	}
+	void release() { press(0, 0); }
+	virtual void bus_reset() {
+		SimDevice::bus_reset();
+		head = tail = 0;
+		leds = 0;
+	}
+	virtual int control(const setup_t &setup, uint8_t *data) {
+		switch (setup.wRequestAndType) {
+		case 0x0681: // GET_DESCRIPTOR (interface)
+			if ((setup.wValue >> 8) != 0x22) return SIM_STALL;
+			memcpy(data, report_desc, sizeof(report_desc));
+			return sizeof(report_desc);
+		case 0x0921: // SET_REPORT, the LEDs
+			leds = data[0];
+			return 0;
+		case 0x0A21: // SET_IDLE
+		case 0x0B21: // SET_PROTOCOL
+			return 0;
+		}
+		return SIM_STALL;
+	}
+	virtual int in(uint32_t endpoint, uint8_t *buf, uint32_t maxlen) {
+		if (endpoint != 1) return SIM_STALL;
+		if (head == tail) return SIM_NAK;
+		memcpy(buf, queue[tail], 8);
+		tail = (tail + 1) % 16;
+		return 8;
+	}
+	uint8_t leds = 0;
+private:
+	uint8_t queue[16][8];
+	uint32_t head = 0;
+	uint32_t tail = 0;
+	static const uint8_t device_desc[18];
+	static const uint8_t config_desc[34];
+	static const uint8_t report_desc[63];
+};
+
+const uint8_t SimKeyboard::device_desc[18] = {
+	18, 1, 0x10, 0x01, 0, 0, 0, 8, 0x09, 0x12, 0x03, 0x00, 0x00, 0x01, 0, 0, 0, 1
+};
+const uint8_t SimKeyboard::config_desc[34] = {
+	9, 2, 34, 0, 1, 1, 0, 0xA0, 50,
+	9, 4, 0, 0, 1, 3, 1, 1, 0,  // HID, boot, keyboard
+	9, 0x21, 0x11, 0x01, 0, 1, 0x22, 63, 0,
+	7, 5, 0x81, 3, 8, 0, 10     // interrupt IN, every 10 ms
+};
+const uint8_t SimKeyboard::report_desc[63] = {
+	0x05, 0x01, 0x09, 0x06, 0xA1, 0x01, 0x05, 0x07, 0x19, 0xE0, 0x29, 0xE7,
+	0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x08, 0x81, 0x02, 0x95, 0x01,
+	0x75, 0x08, 0x81, 0x01, 0x95, 0x05, 0x75, 0x01, 0x05, 0x08, 0x19, 0x01,
+	0x29, 0x05, 0x91, 0x02, 0x95, 0x01, 0x75, 0x03, 0x91, 0x01, 0x95, 0x06,
+	0x75, 0x08, 0x15, 0x00, 0x25, 0x65, 0x05, 0x07, 0x19, 0x00, 0x29, 0x65,
+	0x81, 0x00, 0xC0
+};
+
+
+// A full speed CDC ACM serial port, which echoes whatever is sent.  The
+// line coding and control line state (DTR & RTS) are kept.
+class SimSerial : public SimDevice {
+public:
+	SimSerial() : SimDevice(0, device_desc, config_desc) { }
+	uint32_t baud() { return line_coding[0] | (line_coding[1] << 8)
+		| (line_coding[2] << 16) | (line_coding[3] << 24); }
+	virtual void bus_reset() {
+		SimDevice::bus_reset();
+		head = tail = 0;
+		line_state = 0;
+	}
+	virtual int control(const setup_t &setup, uint8_t *data) {
+		switch (setup.wRequestAndType) {
+		case 0x2021: // SET_LINE_CODING
+			memcpy(line_coding, data, 7);
+			return 0;
+		case 0x21A1: // GET_LINE_CODING
+			memcpy(data, line_coding, 7);
+			return 7;
+		case 0x2221: // SET_CONTROL_LINE_STATE
+			line_state = setup.wValue;
+			return 0;
+		}
+		return SIM_STALL;
+	}
+	virtual int in(uint32_t endpoint, uint8_t *buf, uint32_t maxlen) {
+		if (endpoint == 2) return SIM_NAK; // no notifications
+		if (endpoint != 4) return SIM_STALL;
+		if (head == tail) return SIM_NAK;
+		uint32_t n = 0;
+		while (n < maxlen && tail != head) {
+			buf[n++] = fifo[tail];
+			tail = (tail + 1) % sizeof(fifo);
+		}
+		return n;
+	}
+	virtual int out(uint32_t endpoint, const uint8_t *buf, uint32_t len) {
+		if (endpoint != 3) return SIM_STALL;
+		uint32_t space = (tail + sizeof(fifo) - head - 1) % sizeof(fifo);
+		if (len > space) return SIM_NAK;
+		for (uint32_t i=0; i < len; i++) {
+			fifo[head] = buf[i];
+			head = (head + 1) % sizeof(fifo);
+		}
+		return len;
+	}
+	uint8_t line_coding[7] = {0x00, 0x96, 0x00, 0x00, 0, 0, 8}; // 38400 8N1
+	uint16_t line_state = 0;
+private:
+	uint8_t fifo[1024];
+	uint32_t head = 0;
+	uint32_t tail = 0;
+	static const uint8_t device_desc[18];
+	static const uint8_t config_desc[67];
+};
+
+const uint8_t SimSerial::device_desc[18] = {
+	18, 1, 0x00, 0x02, 2, 0, 0, 64, 0x09, 0x12, 0x04, 0x00, 0x00, 0x01, 0, 0, 0, 1
+};
+const uint8_t SimSerial::config_desc[67] = {
+	9, 2, 67, 0, 2, 1, 0, 0xC0, 50,
+	9, 4, 0, 0, 1, 2, 2, 1, 0,  // communications, ACM, AT commands
+	5, 0x24, 0, 0x10, 0x01,     // header
+	5, 0x24, 1, 1, 1,           // call management
+	4, 0x24, 2, 6,              // abstract control management
+	5, 0x24, 6, 0, 1,           // union
+	7, 5, 0x82, 3, 16, 0, 64,   // interrupt IN, notifications
+	9, 4, 1, 0, 2, 0x0A, 0, 0, 0, // data
+	7, 5, 0x03, 2, 64, 0, 0,    // bulk OUT
+	7, 5, 0x84, 2, 64, 0, 0     // bulk IN
+};
+
+
+// A high speed mass storage device, SCSI over bulk-only transport, with a
+// disk in memory.  It's not ready for the first TEST UNIT READY commands
+// after a reset, and commands beyond the end of the disk fail, with sense
+// data for REQUEST SENSE.
+#define SIM_DISK_SECTORS 256
+
+class SimDisk : public SimDevice {
+public:
+	SimDisk() : SimDevice(2, device_desc, config_desc) { }
+	virtual void bus_reset() {
+		SimDevice::bus_reset();
+		state = COMMAND;
+		not_ready = 2;
+		set_sense(0, 0, 0);
+	}
+	virtual int control(const setup_t &setup, uint8_t *data) {
+		switch (setup.wRequestAndType) {
+		case 0xFEA1: // GET_MAX_LUN
+			data[0] = 0;
+			return 1;
+		case 0xFF21: // bulk-only mass storage reset
+			state = COMMAND;
+			return 0;
+		}
+		return SIM_STALL;
+	}
+	virtual int in(uint32_t endpoint, uint8_t *buf, uint32_t maxlen) {
+		if (endpoint != 1) return SIM_STALL;
+		if (state == DATA_IN) {
+			uint32_t n = data_len - data_pos;
+			if (n > maxlen) n = maxlen;
+			memcpy(buf, data + data_pos, n);
+			data_pos += n;
+			if (data_pos >= data_len) state = STATUS;
+			return n;
+		}
+		if (state == STATUS) {
+			uint32_t signature = 0x53425355, residue = expected - data_pos;
+			memcpy(buf, &signature, 4);
+			memcpy(buf + 4, &tag, 4);
+			memcpy(buf + 8, &residue, 4);
+			buf[12] = status;
+			state = COMMAND;
+			return 13;
+		}
+		return SIM_NAK;
+	}
+	virtual int out(uint32_t endpoint, const uint8_t *buf, uint32_t len) {
+		if (endpoint != 2) return SIM_STALL;
+		if (state == DATA_OUT) {
+			uint32_t n = data_len - data_pos;
+			if (n > len) n = len;
+			if (data_pos < data_keep) {
+				memcpy(data + data_pos, buf, min(n, data_keep - data_pos));
+			}
+			data_pos += n;
+			if (data_pos >= data_len) state = STATUS;
+			return len;
+		}
+		if (state != COMMAND) return SIM_NAK;
+		uint32_t signature;
+		memcpy(&signature, buf, 4);
+		if (len != 31 || signature != 0x43425355) return SIM_STALL;
+		memcpy(&tag, buf + 4, 4);
+		memcpy(&expected, buf + 8, 4);
+		command(buf + 15, (buf[12] & 0x80) != 0);
+		commands++;
+		return len;
+	}
+	uint8_t disk[SIM_DISK_SECTORS * 512];
+	uint32_t commands = 0;
+	uint32_t not_ready = 2;
+private:
+	enum { COMMAND, DATA_IN, DATA_OUT, STATUS } state = COMMAND;
+	void set_sense(uint8_t key, uint8_t asc, uint8_t ascq) {
+		sense_key = key;
+		sense_asc = asc;
+		sense_ascq = ascq;
+	}
+	// Begin the data phase, or go straight to status if there's none
+	void data_phase(uint8_t *p, uint32_t len, bool in, uint8_t result) {
+		if (len > expected) len = expected;
+		data = p;
+		data_len = len;
+		data_pos = 0;
+		status = result;
+		if (expected == 0) {
+			state = STATUS;
+		} else if (in) {
+			state = DATA_IN; // a short or zero length packet ends it
+		} else {
+			data_keep = len; // all taken, but only len kept
+			data_len = expected;
+			state = DATA_OUT;
+		}
+	}
+	void command(const uint8_t *cb, bool in) {
+		uint32_t lba = (cb[2] << 24) | (cb[3] << 16) | (cb[4] << 8) | cb[5];
+		uint32_t count = (cb[7] << 8) | cb[8];
+		switch (cb[0]) {
+		case 0x00: // TEST UNIT READY
+			if (not_ready) {
+				not_ready--;
+				set_sense(0x02, 0x04, 0x01); // becoming ready
+				data_phase(NULL, 0, in, 1);
+				return;
+			}
+			data_phase(NULL, 0, in, 0);
+			return;
+		case 0x03: // REQUEST SENSE
+			memset(response, 0, 18);
+			response[0] = 0x70;
+			response[2] = sense_key;
+			response[7] = 10;
+			response[12] = sense_asc;
+			response[13] = sense_ascq;
+			set_sense(0, 0, 0);
+			data_phase(response, (cb[4] < 18) ? cb[4] : 18, in, 0);
+			return;
+		case 0x12: // INQUIRY
+			memset(response, 0, 36);
+			response[1] = 0x80; // removable
+			response[2] = 4;
+			response[3] = 2;
+			response[4] = 31;
+			memcpy(response + 8, "PJRC    Sim Disk        1.00", 28);
+			data_phase(response, (cb[4] < 36) ? cb[4] : 36, in, 0);
+			return;
+		case 0x1B: // START STOP UNIT
+			data_phase(NULL, 0, in, 0);
+			return;
+		case 0x25: // READ CAPACITY (10), the last sector & sector size
+			response[0] = 0;
+			response[1] = 0;
+			response[2] = (SIM_DISK_SECTORS - 1) >> 8;
+			response[3] = (SIM_DISK_SECTORS - 1) & 255;
+			response[4] = 0;
+			response[5] = 0;
+			response[6] = 2;
+			response[7] = 0;
+			data_phase(response, 8, in, 0);
+			return;
+		case 0x28: // READ (10)
+		case 0x2A: // WRITE (10)
+			if (lba + count > SIM_DISK_SECTORS) {
+				set_sense(0x05, 0x21, 0x00); // LBA out of range
+				data_phase(NULL, 0, in, 1);
+				return;
+			}
+			data_phase(disk + lba * 512, count * 512, in, 0);
+			return;
+		}
+		set_sense(0x05, 0x20, 0x00); // invalid command
+		data_phase(NULL, 0, in, 1);
+	}
+	uint8_t *data = NULL;
+	uint32_t data_len = 0;
+	uint32_t data_pos = 0;
+	uint32_t data_keep = 0;
+	uint32_t tag = 0;
+	uint32_t expected = 0;
+	uint8_t status = 0;
+	uint8_t response[36];
+	uint8_t sense_key = 0;
+	uint8_t sense_asc = 0;
+	uint8_t sense_ascq = 0;
+	static const uint8_t device_desc[18];
+	static const uint8_t config_desc[32];
+};
+
+const uint8_t SimDisk::device_desc[18] = {
+	18, 1, 0x00, 0x02, 0, 0, 0, 64, 0x09, 0x12, 0x05, 0x00, 0x00, 0x01, 0, 0, 0, 1
+};
+const uint8_t SimDisk::config_desc[32] = {
+	9, 2, 32, 0, 1, 1, 0, 0xC0, 50,
+	9, 4, 0, 0, 2, 8, 6, 0x50, 0, // mass storage, SCSI, bulk-only
+	7, 5, 0x81, 2, 0, 2, 0,     // bulk IN, 512 bytes
+	7, 5, 0x02, 2, 0, 2, 0      // bulk OUT, 512 bytes
+};
+
+#endif
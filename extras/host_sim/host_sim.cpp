@@ -0,0 +1,1348 @@
+/* USB EHCI Host for Teensy 3.6 - host simulator
+ * Copyright 2017 Paul Stoffregen (paul@pjrc.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <Arduino.h>
+#include "host_sim.h"
+
+// See host_sim.h for what this models, and what it doesn't.
+
+HardwareSerial Serial;
+HardwareSerial Serial1;
+bool sim_serial_quiet = false;
+uint32_t F_CPU_ACTUAL = F_CPU;
+uint32_t ARM_DEMCR, ARM_DWT_CTRL;
+
+// Both USB PLLs are always enabled, powered & locked
+volatile uint32_t sim_misc_registers[64] = {
+	0x80003040, 0, 0, 0, 0x80003040
+};
+
+
+/************************************************/
+/*  Time & Interrupts                           */
+/************************************************/
+
+static uint64_t now_us = 0;
+static uint64_t last_uframe_us = 0;
+
+uint32_t micros(void)
+{
+	return (uint32_t)now_us;
+}
+
+uint32_t millis(void)
+{
+	return (uint32_t)(now_us / 1000);
+}
+
+uint32_t sim_cycle_count(void)
+{
+	return (uint32_t)(now_us * (F_CPU_ACTUAL / 1000000));
+}
+
+// Interrupts all have the same priority, so a handler is never
+// interrupted, and pending interrupts run in order of their number.
+#define NVIC_NUM_INTERRUPTS 160
+static void (*vectors[NVIC_NUM_INTERRUPTS])(void);
+static bool nvic_enabled[NVIC_NUM_INTERRUPTS];
+static bool nvic_pending[NVIC_NUM_INTERRUPTS];
+static uint8_t nvic_priority[NVIC_NUM_INTERRUPTS];
+static bool primask = false;
+static bool in_handler = false;
+
+static void update_irq_lines(void);
+
+static void deliver_interrupts(void)
+{
+	if (primask || in_handler) return;
+	in_handler = true;
+	for (uint32_t irq=0; irq < NVIC_NUM_INTERRUPTS; irq++) {
+		if (!nvic_pending[irq] || !nvic_enabled[irq]) continue;
+		nvic_pending[irq] = false;
+		if (vectors[irq]) (*vectors[irq])();
+		update_irq_lines(); // still asserted means pending again
+		irq = (uint32_t)-1; // start over, lowest number first
+	}
+	in_handler = false;
+}
+
+void attachInterruptVector(IRQ_NUMBER_t irq, void (*function)(void))
+{
+	if ((uint32_t)irq < NVIC_NUM_INTERRUPTS) vectors[irq] = function;
+}
+
+void sim_disable_irq(void)
+{
+	primask = true;
+}
+
+void sim_enable_irq(void)
+{
+	primask = false;
+	deliver_interrupts();
+}
+
+void sim_nvic_enable(uint32_t irq)
+{
+	nvic_enabled[irq] = true;
+	deliver_interrupts();
+}
+
+void sim_nvic_disable(uint32_t irq)
+{
+	nvic_enabled[irq] = false;
+}
+
+void sim_nvic_set_pending(uint32_t irq)
+{
+	nvic_pending[irq] = true;
+	deliver_interrupts();
+}
+
+bool sim_nvic_is_enabled(uint32_t irq)
+{
+	return nvic_enabled[irq];
+}
+
+void sim_nvic_set_priority(uint32_t irq, uint32_t priority)
+{
+	nvic_priority[irq] = priority;
+}
+
+uint32_t sim_nvic_get_priority(uint32_t irq)
+{
+	return nvic_priority[irq];
+}
+
+// Teensy's startup code gives every interrupt priority 128
+static struct nvic_startup {
+	nvic_startup() {
+		for (uint32_t i=0; i < NVIC_NUM_INTERRUPTS; i++) nvic_priority[i] = 128;
+	}
+} nvic_startup;
+
+
+/************************************************/
+/*  Cache                                       */
+/************************************************/
+
+#define CACHED_BASE   0x20200000
+#define CACHE_LINES   (SIM_CACHED_SIZE / 32)
+
+static uint8_t *cached_memory = NULL;
+static bool line_dirty[CACHE_LINES];
+static bool line_stale[CACHE_LINES];
+static uint32_t cache_errors = 0;
+
+uint8_t * sim_cached_memory(void)
+{
+	if (!cached_memory) {
+		void *p = mmap((void *)CACHED_BASE, SIM_CACHED_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+		if (p != (void *)CACHED_BASE) {
+			printf("host_sim: can't map memory at 0x%08X\n", CACHED_BASE);
+			exit(255);
+		}
+		cached_memory = (uint8_t *)p;
+	}
+	return cached_memory;
+}
+
+// Call fn for each cache line index of addr to addr+len within the
+// cached memory.  Like the real cache, partial lines count as whole.
+template <typename F>
+static void each_line(const void *addr, uint32_t len, F fn)
+{
+	uintptr_t a = (uintptr_t)addr;
+	if (!cached_memory || len == 0) return;
+	if (a < CACHED_BASE || a >= CACHED_BASE + SIM_CACHED_SIZE) return;
+	uintptr_t end = a + len;
+	if (end > CACHED_BASE + SIM_CACHED_SIZE) end = CACHED_BASE + SIM_CACHED_SIZE;
+	for (uintptr_t line = (a - CACHED_BASE) / 32; line < (end - CACHED_BASE + 31) / 32; line++) {
+		fn(line);
+	}
+}
+
+void sim_dcache(uint32_t op, void *addr, uint32_t size)
+{
+	each_line(addr, size, [op](uintptr_t line) {
+		// flush writes back dirty lines, delete discards them either way
+		line_dirty[line] = false;
+		if (op & 2) line_stale[line] = false;
+	});
+}
+
+void sim_cache_write(const void *addr, uint32_t len)
+{
+	each_line(addr, len, [](uintptr_t line) { line_dirty[line] = true; });
+}
+
+bool sim_cache_stale(const void *addr, uint32_t len)
+{
+	bool stale = false;
+	each_line(addr, len, [&stale](uintptr_t line) { if (line_stale[line]) stale = true; });
+	return stale;
+}
+
+uint32_t sim_cache_errors(void)
+{
+	return cache_errors;
+}
+
+// The EHCI read or wrote memory
+static void cache_dma(const void *addr, uint32_t len, bool to_memory)
+{
+	each_line(addr, len, [to_memory](uintptr_t line) {
+		if (to_memory) {
+			line_stale[line] = true;
+		} else if (line_dirty[line]) {
+			cache_errors++;
+		}
+	});
+}
+
+
+/************************************************/
+/*  EHCI Registers                              */
+/************************************************/
+
+sim_register sim_usb_registers[2][128];
+
+// word offsets of the registers in USBHS_t
+#define REG_GPTIMER0LD        32
+#define REG_GPTIMER0CTRL      33
+#define REG_GPTIMER1LD        34
+#define REG_GPTIMER1CTRL      35
+#define REG_USBCMD            80
+#define REG_USBSTS            81
+#define REG_USBINTR           82
+#define REG_FRINDEX           83
+#define REG_PERIODICLISTBASE  85
+#define REG_ASYNCLISTADDR     86
+#define REG_PORTSC1           97
+
+#define ROOT_RESET_TIME       50000 // microseconds, USB 2.0 TDRSTR
+#define HUB_RESET_TIME        10000 // microseconds, USB 2.0 TDRST
+
+// A hub's transaction translator, running full & low speed transactions
+// from the SSPLITs it gets during 1 frame.  Times are full speed bytes
+// from the start of the frame, with 188 for each microframe.
+typedef struct {
+	uint8_t  hub;            // 0 if never used
+	uint8_t  port;           // 0 for a single TT hub
+	uint32_t frame;          // the frame these times are for
+	int32_t  end;            // when the TT finishes its last transaction
+	uint16_t booked[8];      // bytes to begin in each microframe
+} sim_tt_t;
+
+#define TT_COUNT              8
+
+typedef struct {
+	sim_register *regs;
+	uint32_t irq;
+	uint32_t frindex;
+	uint32_t pending_sts;    // UAI, UPI & UEI waiting for the interrupt threshold
+	uint32_t timer_remain[2];
+	uint64_t timer_expire[2];
+	bool     timer_run[2];
+	uint64_t reset_end;      // port reset in progress until this time, or 0
+	SimDevice *device;       // on the root port
+	uint32_t microframes;
+	uint32_t frames;         // count of frames begun, never wraps like frindex
+	uint32_t packets;
+	int32_t  budget[2];      // bus time left in this microframe, full & high speed
+	sim_tt_t tt[TT_COUNT];   // TTs used in this frame
+	uint32_t split_errors;
+} sim_ehci_t;
+
+static sim_ehci_t ehci[2] = {
+	{ sim_usb_registers[0], IRQ_USB1 },
+	{ sim_usb_registers[1], IRQ_USB2 }
+};
+
+#define REG(c, n) ((c)->regs[n].value)
+
+static void update_irq_lines(void)
+{
+	for (uint32_t i=0; i < 2; i++) {
+		sim_ehci_t *c = &ehci[i];
+		if (REG(c, REG_USBSTS) & REG(c, REG_USBINTR)) nvic_pending[c->irq] = true;
+	}
+}
+
+static void controller_reset(sim_ehci_t *c)
+{
+	for (uint32_t i=0; i < 128; i++) c->regs[i].value = 0;
+	REG(c, REG_USBCMD) = USB_USBCMD_ITC(8);
+	c->frindex = 0;
+	c->pending_sts = 0;
+	c->timer_run[0] = c->timer_run[1] = false;
+	c->timer_remain[0] = c->timer_remain[1] = 0;
+	c->reset_end = 0;
+}
+
+static void port_change(sim_ehci_t *c)
+{
+	REG(c, REG_USBSTS) |= USB_USBSTS_PCI;
+	update_irq_lines();
+}
+
+static void port_write(sim_ehci_t *c, uint32_t n)
+{
+	uint32_t p = REG(c, REG_PORTSC1);
+	const uint32_t w1c = USB_PORTSC1_CSC | USB_PORTSC1_PEC | USB_PORTSC1_OCC;
+	const uint32_t rw = USB_PORTSC1_PP | USB_PORTSC1_PFSC | USB_PORTSC1_PHCD
+		| USB_PORTSC1_SUSP | USB_PORTSC1_FPR;
+	p &= ~(n & w1c);
+	if (!(n & USB_PORTSC1_PE)) p &= ~USB_PORTSC1_PE; // only hardware enables
+	bool power_on = (n & USB_PORTSC1_PP) && !(p & USB_PORTSC1_PP);
+	p = (p & ~rw) | (n & rw);
+	if ((n & USB_PORTSC1_PR) && !(p & USB_PORTSC1_PR)) {
+		p |= USB_PORTSC1_PR;
+		p &= ~USB_PORTSC1_PE;
+		c->reset_end = now_us + ROOT_RESET_TIME;
+	}
+	REG(c, REG_PORTSC1) = p;
+	if (power_on && c->device) {
+		REG(c, REG_PORTSC1) |= USB_PORTSC1_CCS | USB_PORTSC1_CSC;
+		port_change(c);
+	}
+}
+
+static void port_reset_done(sim_ehci_t *c)
+{
+	uint32_t p = REG(c, REG_PORTSC1) & ~(USB_PORTSC1_PR | USB_PORTSC1_HSP
+		| USB_PORTSC1_PSPD(3));
+	c->reset_end = 0;
+	if (c->device && (p & USB_PORTSC1_CCS)) {
+		c->device->bus_reset();
+		p |= USB_PORTSC1_PE | USB_PORTSC1_PSPD(c->device->speed);
+		if (c->device->speed == 2) p |= USB_PORTSC1_HSP;
+	}
+	REG(c, REG_PORTSC1) = p;
+	port_change(c);
+}
+
+// The timers count down once per microsecond, from GPTIMERnLD to 0
+static uint32_t timer_count(sim_ehci_t *c, uint32_t t)
+{
+	if (!c->timer_run[t]) return c->timer_remain[t];
+	return (c->timer_expire[t] > now_us) ? (uint32_t)(c->timer_expire[t] - now_us) : 0;
+}
+
+static void timer_write(sim_ehci_t *c, uint32_t t, uint32_t n)
+{
+	c->timer_remain[t] = timer_count(c, t);
+	if (n & USB_GPTIMERCTRL_GPTRST) {
+		c->timer_remain[t] = (REG(c, REG_GPTIMER0LD + t * 2) & 0xFFFFFF) + 1;
+	}
+	c->timer_run[t] = (n & USB_GPTIMERCTRL_GPTRUN) ? true : false;
+	c->timer_expire[t] = now_us + c->timer_remain[t];
+	REG(c, REG_GPTIMER0CTRL + t * 2) = n & ~USB_GPTIMERCTRL_GPTRST;
+}
+
+sim_register::operator uint32_t()
+{
+	uint32_t index = this - &sim_usb_registers[0][0];
+	sim_ehci_t *c = &ehci[index / 128];
+	switch (index % 128) {
+	case REG_GPTIMER0CTRL:
+	case REG_GPTIMER1CTRL: {
+		uint32_t t = (index % 128 == REG_GPTIMER0CTRL) ? 0 : 1;
+		return (value & ~0xFFFFFF) | (timer_count(c, t) & 0xFFFFFF);
+	}
+	case REG_USBSTS: {
+		uint32_t cmd = REG(c, REG_USBCMD);
+		uint32_t n = value;
+		if (!(cmd & USB_USBCMD_RS)) n |= USB_USBSTS_HCH;
+		else if (cmd & USB_USBCMD_ASE) n |= USB_USBSTS_AS;
+		if ((cmd & USB_USBCMD_RS) && (cmd & USB_USBCMD_PSE)) n |= USB_USBSTS_PS;
+		return n;
+	}
+	case REG_FRINDEX:
+		return c->frindex & 0x3FFF;
+	}
+	return value;
+}
+
+sim_register & sim_register::operator = (uint32_t n)
+{
+	uint32_t index = this - &sim_usb_registers[0][0];
+	sim_ehci_t *c = &ehci[index / 128];
+	switch (index % 128) {
+	case REG_GPTIMER0CTRL:
+		timer_write(c, 0, n);
+		break;
+	case REG_GPTIMER1CTRL:
+		timer_write(c, 1, n);
+		break;
+	case REG_USBCMD:
+		if (n & USB_USBCMD_RST) {
+			controller_reset(c);
+			break;
+		}
+		value = n;
+		break;
+	case REG_USBSTS:
+		value &= ~n;
+		break;
+	case REG_FRINDEX:
+		c->frindex = n & 0x3FFF;
+		break;
+	case REG_PORTSC1:
+		port_write(c, n);
+		break;
+	default:
+		value = n;
+	}
+	update_irq_lines();
+	return *this;
+}
+
+
+/************************************************/
+/*  EHCI Schedules                              */
+/************************************************/
+
+// Bus time per microframe, in bytes at each speed: 13 bulk packets of 512
+// at high speed, and 188 of the 1500 byte full speed frame
+#define HS_UFRAME_BUDGET  7500
+#define FS_UFRAME_BUDGET  188
+#define HS_OVERHEAD       50
+#define FS_OVERHEAD       13
+#define FS_ISO_OVERHEAD   9
+
+static inline volatile uint32_t * ptr(uint32_t addr)
+{
+	return (volatile uint32_t *)(uintptr_t)(addr & ~0x1F);
+}
+
+static SimDevice * find_device(sim_ehci_t *c, uint32_t addr)
+{
+	if (!c->device || !(REG(c, REG_PORTSC1) & USB_PORTSC1_PE)) return NULL;
+	return c->device->find(addr);
+}
+
+// Charge a packet to the bus time of its speed, false if it doesn't fit
+static bool bus_time(sim_ehci_t *c, uint32_t speed, uint32_t bytes)
+{
+	int32_t cost;
+	uint32_t bus = (speed == 2) ? 1 : 0;
+	if (speed == 2) {
+		cost = bytes + HS_OVERHEAD;
+	} else {
+		cost = bytes + FS_OVERHEAD;
+		if (speed == 1) cost *= 8; // low speed
+	}
+	if (c->budget[bus] <= 0) return false;
+	c->budget[bus] -= cost;
+	return true;
+}
+
+// Copy between a packet and qTD or iTD buffer pages, advancing the page
+// select and offset past the bytes copied.
+static void dma_copy(volatile uint32_t *pages, uint32_t npages, uint32_t &page,
+	uint32_t &offset, uint8_t *data, uint32_t len, bool to_memory)
+{
+	while (len > 0 && page < npages) {
+		uint32_t n = 0x1000 - offset;
+		if (n > len) n = len;
+		uint8_t *mem = (uint8_t *)(uintptr_t)((pages[page] & 0xFFFFF000) + offset);
+		cache_dma(mem, n, to_memory);
+		if (to_memory) {
+			memcpy(mem, data, n);
+		} else {
+			memcpy(data, mem, n);
+		}
+		data += n;
+		len -= n;
+		offset += n;
+		if (offset >= 0x1000) {
+			offset = 0;
+			page++;
+		}
+	}
+}
+
+#define QH_IDLE      0  // no active qTD, halted, or no bus time
+#define QH_NAK       1
+#define QH_PROGRESS  2  // moved data, qTD still active
+#define QH_RETIRED   3  // qTD finished or halted
+
+// Copy the next qTD to a QH's overlay if it's not already active, false
+// if there's nothing to do
+static bool qh_fetch(volatile uint32_t *qh)
+{
+	uint32_t token = qh[6];
+	if (token & 0x40) return false; // halted
+	if (!(token & 0x80)) {
+		uint32_t next = qh[4];
+		if (next & 1) return false;
+		volatile uint32_t *qtd = ptr(next);
+		uint32_t qtoken = qtd[2];
+		if (!(qtoken & 0x80)) return false;
+		qh[3] = next & ~0x1F;
+		qh[4] = qtd[0];
+		qh[5] = qtd[1];
+		for (uint32_t i=0; i < 5; i++) qh[7 + i] = qtd[3 + i];
+		if (qh[1] & (1 << 14)) {
+			token = qtoken; // DTC, toggle from qTD
+		} else {
+			token = (token & 0x80000000) | (qtoken & 0x7FFFFFFF);
+		}
+		qh[6] = token;
+	}
+	return true;
+}
+
+// Halt a QH's qTD, EHCI 4.10.3.  0x10 = babble, 0x08 = transaction error
+static void qh_halt(sim_ehci_t *c, volatile uint32_t *qh, uint32_t error)
+{
+	uint32_t token = (qh[6] & ~0x80) | 0x40 | error;
+	qh[6] = token;
+	c->pending_sts |= USB_USBSTS_UEI;
+	volatile uint32_t *qtd = ptr(qh[3]);
+	qtd[3] = qh[7];
+	qtd[2] = token;
+}
+
+// One transaction for a QH, EHCI 4.10.  The qTD at the overlay's next
+// pointer is copied to the overlay when it's active, data goes to or from
+// the device a packet at a time, and the token & buffer offset are written
+// back to the qTD when it retires.  A split transaction's data crosses the
+// high speed bus, the full speed part was done by the TT.
+static uint32_t qh_transaction(sim_ehci_t *c, volatile uint32_t *qh, bool periodic,
+	bool split=false)
+{
+	if (!qh_fetch(qh)) return QH_IDLE;
+	uint32_t token = qh[6];
+	uint32_t cap0 = qh[1];
+	uint32_t address = cap0 & 0x7F;
+	uint32_t endpoint = (cap0 >> 8) & 15;
+	uint32_t speed = (cap0 >> 12) & 3;
+	uint32_t maxpacket = (cap0 >> 16) & 0x7FF;
+	uint32_t pid = (token >> 8) & 3;
+	uint32_t total = (token >> 16) & 0x7FFF;
+	uint32_t page = (token >> 12) & 7;
+	uint32_t offset = qh[7] & 0xFFF;
+	if (maxpacket == 0) maxpacket = 8;
+	uint32_t len = (total < maxpacket) ? total : maxpacket;
+
+	uint8_t packet[1024];
+	int32_t r;
+	SimDevice *dev = find_device(c, address);
+	if (!dev) {
+		r = SIM_STALL - 1; // no response, transaction error
+	} else if (!bus_time(c, split ? 2 : speed, len)) {
+		return QH_IDLE;
+	} else if (pid == 2) {
+		dma_copy(qh + 7, 5, page, offset, packet, 8, false);
+		r = dev->packet_setup(packet);
+	} else if (pid == 0) {
+		dma_copy(qh + 7, 5, page, offset, packet, len, false);
+		r = dev->packet_out(endpoint, packet, len);
+		if (r >= 0) r = len;
+	} else {
+		r = dev->packet_in(endpoint, packet, maxpacket);
+		if (r > (int32_t)len) {
+			r = -4; // babble
+		} else if (r > 0) {
+			dma_copy(qh + 7, 5, page, offset, packet, r, true);
+		}
+	}
+	c->packets++;
+	if (r == SIM_NAK) return QH_NAK;
+	if (r < 0) {
+		qh_halt(c, qh, (r == -4) ? 0x10 : (r == SIM_STALL - 1) ? 0x08 : 0);
+		return QH_RETIRED;
+	}
+	total -= r;
+	token ^= 0x80000000; // data toggle
+	token = (token & ~0x7FFF7000) | (total << 16) | (page << 12);
+	qh[7] = (qh[7] & 0xFFFFF000) | offset;
+	bool done = (total == 0 || (pid == 1 && (uint32_t)r < maxpacket));
+	if (done) {
+		token &= ~0x80;
+		if (pid == 1 && total > 0 && !(qh[5] & 1)) qh[4] = qh[5];
+		if (token & 0x8000) {
+			c->pending_sts |= periodic ? USBHS_USBSTS_UPI : USBHS_USBSTS_UAI;
+		}
+	}
+	qh[6] = token;
+	if (!done) return QH_PROGRESS;
+	volatile uint32_t *qtd = ptr(qh[3]);
+	qtd[3] = qh[7];
+	qtd[2] = token;
+	return QH_RETIRED;
+}
+
+// The TT for a full or low speed device behind a high speed hub, or NULL
+// if the hub is gone.  A TT's times start over in each frame, so any TT
+// not used this frame gives its place to another.
+static sim_tt_t * find_tt(sim_ehci_t *c, uint32_t hub, uint32_t port)
+{
+	SimDevice *dev = find_device(c, hub);
+	if (!dev) return NULL;
+	if (!dev->multi_tt()) port = 0;
+	uint32_t frame = c->frames;
+	sim_tt_t *avail = NULL;
+	for (uint32_t i=0; i < TT_COUNT; i++) {
+		sim_tt_t *tt = &c->tt[i];
+		if (!tt->hub || tt->frame != frame) {
+			if (!avail) avail = tt;
+		} else if (tt->hub == hub && tt->port == port) {
+			return tt;
+		}
+	}
+	if (!avail) return NULL;
+	avail->hub = hub;
+	avail->port = port;
+	avail->frame = frame;
+	avail->end = 0;
+	memset(avail->booked, 0, sizeof(avail->booked));
+	return avail;
+}
+
+// The TT begins a full speed transaction no sooner than the microframe
+// after its SSPLIT, once it's done with the ones before, USB 2.0 11.18.
+// Its buffers only hold what the host may budget, 188 bytes to begin in
+// each microframe (longer transactions take 188 from each microframe
+// they span), so more than that is lost.  Returns the first microframe a
+// CSPLIT can find it finished, or 8 when it won't be done in this frame.
+static uint32_t tt_transaction(sim_tt_t *tt, uint32_t uframe, uint32_t speed,
+	uint32_t bytes, uint32_t overhead)
+{
+	int32_t cost = bytes + overhead;
+	if (speed == 1) cost *= 8; // low speed
+	bool lost = false;
+	uint32_t y = uframe + 1;
+	for (int32_t remain=cost; remain > 0; y++) {
+		int32_t n = (remain > FS_UFRAME_BUDGET) ? FS_UFRAME_BUDGET : remain;
+		if (y > 7 || tt->booked[y] + n > FS_UFRAME_BUDGET) {
+			lost = true;
+			break;
+		}
+		tt->booked[y] += n;
+		remain -= n;
+	}
+	if (lost) return 8;
+	int32_t start = (uframe + 1) * FS_UFRAME_BUDGET;
+	if (start < tt->end) start = tt->end;
+	tt->end = start + cost;
+	uint32_t done = (tt->end + FS_UFRAME_BUDGET - 1) / FS_UFRAME_BUDGET;
+	return (done < 8) ? done : 8;
+}
+
+// Full & low speed interrupt transactions behind a high speed hub, EHCI
+// 4.12.2.  The SSPLIT in an S-mask microframe hands the transaction to the
+// TT, and SplitXstate (token bit 1) is set until a C-mask microframe's
+// CSPLIT finds it done, which moves the data like any other transaction.
+// A CSPLIT getting NYET in the last C-mask microframe is a transaction
+// error.  Rather than the partial C-prog-mask, the overlay's C-prog-mask
+// byte holds the microframe when the TT will be done.
+static void split_transaction(sim_ehci_t *c, volatile uint32_t *qh, uint32_t uframe)
+{
+	uint32_t cap1 = qh[2];
+	uint32_t smask = cap1 & 0xFF;
+	uint32_t cmask = (cap1 >> 8) & 0xFF;
+	uint32_t bit = 1 << uframe;
+	if (!(qh[6] & 0x02)) {
+		if (!(smask & bit)) return;
+		if (!qh_fetch(qh)) return;
+		sim_tt_t *tt = find_tt(c, (cap1 >> 16) & 0x7F, (cap1 >> 23) & 0x7F);
+		if (!tt) {
+			qh_transaction(c, qh, true, true); // no hub, transaction error
+			return;
+		}
+		uint32_t token = qh[6];
+		uint32_t cap0 = qh[1];
+		uint32_t maxpacket = (cap0 >> 16) & 0x7FF;
+		uint32_t total = (token >> 16) & 0x7FFF;
+		uint32_t len = (total < maxpacket) ? total : maxpacket;
+		uint32_t in = (((token >> 8) & 3) == 1);
+		if (!bus_time(c, 2, in ? 0 : len)) return;
+		uint32_t done = tt_transaction(tt, uframe, (cap0 >> 12) & 3, len, FS_OVERHEAD);
+		qh[8] = (qh[8] & ~0xFF) | done;
+		qh[6] = token | 0x02;
+		c->packets++;
+		return;
+	}
+	if (!(cmask & bit)) return;
+	if (uframe >= (qh[8] & 0xFF)) {
+		qh[6] &= ~0x02;
+		qh_transaction(c, qh, true, true);
+		return;
+	}
+	// NYET
+	bus_time(c, 2, 0);
+	c->packets++;
+	if (cmask >> (uframe + 1)) return;
+	qh[6] &= ~0x02;
+	c->split_errors++;
+	qh_halt(c, qh, 0x08);
+}
+
+// High speed isochronous, EHCI 4.7
+static void itd_transaction(sim_ehci_t *c, volatile uint32_t *itd, uint32_t uframe)
+{
+	uint32_t t = itd[1 + uframe];
+	if (!(t & 0x80000000)) return;
+	volatile uint32_t *pages = itd + 9;
+	uint32_t address = pages[0] & 0x7F;
+	uint32_t endpoint = (pages[0] >> 8) & 15;
+	uint32_t maxpacket = pages[1] & 0x7FF;
+	uint32_t in = (pages[1] >> 11) & 1;
+	uint32_t mult = pages[2] & 3;
+	uint32_t len = (t >> 16) & 0xFFF;
+	uint32_t page = (t >> 12) & 7;
+	uint32_t offset = t & 0xFFF;
+	uint8_t packet[3072];
+	SimDevice *dev = find_device(c, address);
+	t &= ~0x80000000;
+	if (!dev) {
+		t |= 0x10000000; // transaction error
+	} else if (in) {
+		uint32_t max = maxpacket * (mult ? mult : 1);
+		if (max > len) max = len;
+		int32_t r = dev->packet_in(endpoint, packet, max);
+		if (r < 0) r = 0;
+		if (r > (int32_t)max) r = max;
+		dma_copy(pages, 7, page, offset, packet, r, true);
+		t = (t & ~0x0FFF0000) | (r << 16);
+	} else {
+		dma_copy(pages, 7, page, offset, packet, len, false);
+		dev->packet_out(endpoint, packet, len);
+	}
+	bus_time(c, 2, len);
+	c->packets++;
+	itd[1 + uframe] = t;
+	if (t & 0x8000) c->pending_sts |= USBHS_USBSTS_UPI;
+}
+
+// Full & low speed isochronous, EHCI 4.12.3.  Behind a hub, the TT gets
+// the transaction at the first S-mask microframe.  OUT is then finished,
+// and IN waits for the first C-mask microframe after the TT is done, kept
+// in C-prog-mask like split_transaction().  On the root port, the whole
+// transfer is done in the first S-mask microframe.
+static void sitd_transaction(sim_ehci_t *c, volatile uint32_t *sitd, uint32_t uframe)
+{
+	uint32_t state = sitd[3];
+	if (!(state & 0x80)) return;
+	uint32_t bit = 1 << uframe;
+	uint32_t cap = sitd[1];
+	uint32_t in = cap >> 31;
+	uint32_t endpoint = (cap >> 8) & 15;
+	uint32_t hub = (cap >> 16) & 0x7F;
+	uint32_t total = (state >> 16) & 0x3FF;
+	SimDevice *dev = find_device(c, cap & 0x7F);
+	if (!(state & 0x02)) {
+		if (!(sitd[2] & bit)) return;
+		if (hub) {
+			sim_tt_t *tt = find_tt(c, hub, (cap >> 24) & 0x7F);
+			if (!tt) dev = NULL;
+			if (dev) {
+				uint32_t done = tt_transaction(tt, uframe, dev->speed, total, FS_ISO_OVERHEAD);
+				bus_time(c, 2, in ? 0 : total);
+				c->packets++;
+				if (in) {
+					sitd[3] = (state & ~0xFF00) | (done << 8) | 0x02;
+					return;
+				}
+			}
+		}
+	} else {
+		if (!((sitd[2] >> 8) & bit)) return;
+		if (uframe < ((state >> 8) & 0xFF)) {
+			// NYET
+			bus_time(c, 2, 0);
+			c->packets++;
+			if ((sitd[2] >> 8) >> (uframe + 1)) return;
+			c->split_errors++;
+			dev = NULL;
+		}
+	}
+	uint32_t page = 0;
+	uint32_t offset = sitd[4] & 0xFFF;
+	uint8_t packet[1024];
+	state &= ~0xFF;
+	if (!dev) {
+		state |= 0x08; // transaction error
+	} else if (in) {
+		int32_t r = dev->packet_in(endpoint, packet, total);
+		if (r < 0) r = 0;
+		if (r > (int32_t)total) r = total;
+		dma_copy(sitd + 4, 2, page, offset, packet, r, true);
+		bus_time(c, hub ? 2 : 0, r);
+		c->packets++;
+		total -= r;
+	} else {
+		dma_copy(sitd + 4, 2, page, offset, packet, total, false);
+		dev->packet_out(endpoint, packet, total);
+		if (!hub) {
+			bus_time(c, 0, total);
+			c->packets++;
+		}
+		total = 0;
+	}
+	state = (state & ~0x03FF0000) | (total << 16);
+	sitd[3] = state;
+	if (state & 0x80000000) c->pending_sts |= USBHS_USBSTS_UPI;
+}
+
+// Walk this microframe's periodic list, EHCI 4.6.  Anchor QHs are
+// halted, so they're passed through like any idle QH.
+static void run_periodic(sim_ehci_t *c, uint32_t frames)
+{
+	volatile uint32_t *table = ptr(REG(c, REG_PERIODICLISTBASE) & 0xFFFFF000);
+	uint32_t uframe = c->frindex & 7;
+	uint32_t link = table[(c->frindex >> 3) & (frames - 1)];
+	for (uint32_t count=0; !(link & 1) && count < 10000; count++) {
+		volatile uint32_t *p = ptr(link);
+		switch ((link >> 1) & 3) {
+		case 0: // iTD
+			itd_transaction(c, p, uframe);
+			break;
+		case 1: { // QH
+			uint32_t smask = p[2] & 0xFF;
+			if (((p[1] >> 12) & 3) != 2 && (p[2] & 0x007F0000)) {
+				split_transaction(c, p, uframe);
+			} else if (smask & (1 << uframe)) {
+				uint32_t mult = (p[2] >> 30) & 3;
+				for (uint32_t i=0; i < (mult ? mult : 1); i++) {
+					if (qh_transaction(c, p, true) != QH_PROGRESS) break;
+				}
+			}
+			break;
+		}
+		case 2: // siTD
+			sitd_transaction(c, p, uframe);
+			break;
+		}
+		link = p[0];
+	}
+}
+
+// Round robin through the async list until the microframe's bus time is
+// used, or a whole trip around the list finds nothing to do, EHCI 4.8
+static void run_async(sim_ehci_t *c)
+{
+	uint32_t head = REG(c, REG_ASYNCLISTADDR);
+	if (!head || (head & 1)) return;
+	uint32_t length = 0;
+	uint32_t link = head;
+	do {
+		link = ptr(link)[0] & ~0x1F;
+		length++;
+	} while (link != (head & ~0x1F) && length < 1000);
+	uint32_t idle = 0;
+	link = head & ~0x1F;
+	while (idle < length && (c->budget[0] > 0 || c->budget[1] > 0)) {
+		volatile uint32_t *qh = ptr(link);
+		uint32_t r = qh_transaction(c, qh, false);
+		if (r == QH_PROGRESS || r == QH_RETIRED) {
+			idle = 0;
+		} else {
+			idle++;
+		}
+		link = qh[0] & ~0x1F;
+	}
+}
+
+static void run_microframe(sim_ehci_t *c)
+{
+	uint32_t cmd = REG(c, REG_USBCMD);
+	if (!(cmd & USB_USBCMD_RS)) return;
+	c->frindex = (c->frindex + 1) & 0x3FFF;
+	c->microframes++;
+	if ((c->frindex & 7) == 0) c->frames++;
+	c->budget[0] = FS_UFRAME_BUDGET;
+	c->budget[1] = HS_UFRAME_BUDGET;
+	if (cmd & USB_USBCMD_PSE) {
+		uint32_t fs = (cmd >> 2) & 3;
+		uint32_t frames = (cmd & USB_USBCMD_FS_2) ? (64 >> fs) : (1024 >> fs);
+		run_periodic(c, frames);
+	}
+	if (cmd & USB_USBCMD_ASE) run_async(c);
+	if (cmd & USB_USBCMD_IAA) {
+		// the async schedule has moved past every QH it knew of before
+		REG(c, REG_USBCMD) &= ~USB_USBCMD_IAA;
+		REG(c, REG_USBSTS) |= USB_USBSTS_AAI;
+	}
+	uint32_t itc = (cmd >> 16) & 0xFF;
+	if (itc <= 1 || (c->frindex % itc) == 0) {
+		REG(c, REG_USBSTS) |= c->pending_sts;
+		c->pending_sts = 0;
+	}
+}
+
+
+/************************************************/
+/*  Simulation                                  */
+/************************************************/
+
+// The next time anything happens: a microframe, timer or port reset ending
+static uint64_t next_event(void)
+{
+	uint64_t next = (now_us / 125 + 1) * 125;
+	for (uint32_t i=0; i < 2; i++) {
+		sim_ehci_t *c = &ehci[i];
+		for (uint32_t t=0; t < 2; t++) {
+			if (c->timer_run[t] && c->timer_expire[t] < next) next = c->timer_expire[t];
+		}
+		if (c->reset_end && c->reset_end < next) next = c->reset_end;
+	}
+	if (next <= now_us) next = now_us + 1;
+	return next;
+}
+
+static void run_events(void)
+{
+	for (uint32_t i=0; i < 2; i++) {
+		sim_ehci_t *c = &ehci[i];
+		for (uint32_t t=0; t < 2; t++) {
+			if (c->timer_run[t] && c->timer_expire[t] <= now_us) {
+				c->timer_run[t] = false;
+				c->timer_remain[t] = 0;
+				REG(c, REG_GPTIMER0CTRL + t * 2) &= ~USB_GPTIMERCTRL_GPTRUN;
+				REG(c, REG_USBSTS) |= t ? USB_USBSTS_TI1 : USB_USBSTS_TI0;
+			}
+		}
+		if (c->reset_end && c->reset_end <= now_us) port_reset_done(c);
+	}
+	if (now_us % 125 == 0 && now_us != last_uframe_us) {
+		last_uframe_us = now_us;
+		run_microframe(&ehci[0]);
+		run_microframe(&ehci[1]);
+	}
+	update_irq_lines();
+	deliver_interrupts();
+}
+
+static void run_until(uint64_t end)
+{
+	deliver_interrupts();
+	if (in_handler) {
+		// busy waiting in an interrupt: time passes, nothing else happens
+		now_us = end;
+		return;
+	}
+	while (now_us < end) {
+		uint64_t next = next_event();
+		now_us = (next < end) ? next : end;
+		run_events();
+	}
+}
+
+void sim_run(uint32_t microseconds)
+{
+	run_until(now_us + microseconds);
+}
+
+void delay(uint32_t msec)
+{
+	run_until(now_us + (uint64_t)msec * 1000);
+}
+
+void delayMicroseconds(uint32_t usec)
+{
+	run_until(now_us + usec);
+}
+
+void yield(void)
+{
+	run_until(next_event());
+}
+
+void sim_connect(uint32_t controller, SimDevice *dev)
+{
+	sim_ehci_t *c = &ehci[(controller == 1) ? 0 : 1];
+	if (c->device) sim_disconnect(controller);
+	c->device = dev;
+	if (REG(c, REG_PORTSC1) & USB_PORTSC1_PP) {
+		REG(c, REG_PORTSC1) |= USB_PORTSC1_CCS | USB_PORTSC1_CSC;
+		port_change(c);
+	}
+	deliver_interrupts();
+}
+
+void sim_disconnect(uint32_t controller)
+{
+	sim_ehci_t *c = &ehci[(controller == 1) ? 0 : 1];
+	if (!c->device) return;
+	c->device = NULL;
+	c->reset_end = 0;
+	uint32_t p = REG(c, REG_PORTSC1);
+	if (p & USB_PORTSC1_CCS) {
+		p &= ~(USB_PORTSC1_CCS | USB_PORTSC1_PE | USB_PORTSC1_PR
+			| USB_PORTSC1_HSP | USB_PORTSC1_PSPD(3));
+		REG(c, REG_PORTSC1) = p | USB_PORTSC1_CSC;
+		port_change(c);
+	}
+	deliver_interrupts();
+}
+
+uint32_t sim_microframes(uint32_t controller)
+{
+	return ehci[(controller == 1) ? 0 : 1].microframes;
+}
+
+uint32_t sim_packets(uint32_t controller)
+{
+	return ehci[(controller == 1) ? 0 : 1].packets;
+}
+
+uint32_t sim_split_errors(uint32_t controller)
+{
+	return ehci[(controller == 1) ? 0 : 1].split_errors;
+}
+
+// A stack in .bss is below 4 GB, like everything else the EHCI can reach
+static uint8_t low_stack[1 << 20] __attribute__ ((aligned(16)));
+static ucontext_t low_stack_context, caller_context;
+static int (*low_stack_function)(void);
+static int low_stack_result;
+
+static void low_stack_start(void)
+{
+	low_stack_result = (*low_stack_function)();
+}
+
+int sim_low_stack(int (*function)(void))
+{
+	low_stack_function = function;
+	getcontext(&low_stack_context);
+	low_stack_context.uc_stack.ss_sp = low_stack;
+	low_stack_context.uc_stack.ss_size = sizeof(low_stack);
+	low_stack_context.uc_link = &caller_context;
+	makecontext(&low_stack_context, low_stack_start, 0);
+	swapcontext(&caller_context, &low_stack_context);
+	return low_stack_result;
+}
+
+
+/************************************************/
+/*  Devices                                     */
+/************************************************/
+
+SimDevice::SimDevice(uint32_t speed, const uint8_t *device_desc, const uint8_t *config_desc,
+	const char * const *strings, uint32_t string_count)
+	: speed(speed), address(0), configuration(0), halted(0), setup_count(0),
+	device_desc(device_desc), config_desc(config_desc), strings(strings),
+	string_count(string_count), ep0_len(0), ep0_pos(0), ep0_stall(false)
+{
+	memset(&setup, 0, sizeof(setup));
+}
+
+void SimDevice::bus_reset()
+{
+	address = 0;
+	configuration = 0;
+	halted = 0;
+	ep0_len = ep0_pos = 0;
+	ep0_stall = false;
+}
+
+// Chapter 9 requests, USB 2.0 page 250
+int SimDevice::standard_request(uint8_t *data)
+{
+	switch (setup.wRequestAndType) {
+	case 0x0680: { // GET_DESCRIPTOR
+		uint32_t index = setup.wValue & 255;
+		switch (setup.wValue >> 8) {
+		case 1:
+			memcpy(data, device_desc, 18);
+			return 18;
+		case 2: {
+			uint32_t len = config_desc[2] | (config_desc[3] << 8);
+			memcpy(data, config_desc, len);
+			return len;
+		}
+		case 3:
+			if (index == 0) {
+				static const uint8_t langid[4] = {4, 3, 0x09, 0x04};
+				memcpy(data, langid, 4);
+				return 4;
+			}
+			if (index <= string_count) {
+				const char *s = strings[index - 1];
+				uint32_t len = strlen(s);
+				if (len > 126) len = 126;
+				data[0] = len * 2 + 2;
+				data[1] = 3;
+				for (uint32_t i=0; i < len; i++) {
+					data[i * 2 + 2] = s[i];
+					data[i * 2 + 3] = 0;
+				}
+				return len * 2 + 2;
+			}
+		}
+		return SIM_STALL;
+	}
+	case 0x0500: // SET_ADDRESS, done after the status stage
+		return 0;
+	case 0x0900: // SET_CONFIGURATION
+		configuration = setup.wValue;
+		return 0;
+	case 0x0880: // GET_CONFIGURATION
+		data[0] = configuration;
+		return 1;
+	case 0x0080: // GET_STATUS
+	case 0x0081:
+	case 0x0082:
+		data[0] = data[1] = 0;
+		return 2;
+	case 0x0B01: // SET_INTERFACE
+		return 0;
+	case 0x0102: // CLEAR_FEATURE(ENDPOINT_HALT)
+		if (setup.wIndex & 0x80) {
+			halted &= ~(0x10000 << (setup.wIndex & 15));
+		} else {
+			halted &= ~(1 << (setup.wIndex & 15));
+		}
+		return 0;
+	}
+	return control(setup, data);
+}
+
+void SimDevice::status_stage()
+{
+	if (setup.wRequestAndType == 0x0500) address = setup.wValue & 0x7F;
+}
+
+int SimDevice::packet_setup(const uint8_t *data)
+{
+	memcpy(&setup, data, 8);
+	setup_count++;
+	halted &= ~0x10001;
+	ep0_pos = 0;
+	ep0_len = 0;
+	ep0_stall = false;
+	if (setup.bmRequestType & 0x80) {
+		int r = standard_request(ep0_data);
+		if (r < 0) {
+			ep0_stall = true;
+		} else {
+			ep0_len = (r < setup.wLength) ? r : setup.wLength;
+		}
+	}
+	return 8;
+}
+
+int SimDevice::packet_in(uint32_t endpoint, uint8_t *buf, uint32_t maxlen)
+{
+	if (endpoint > 0) {
+		if (halted & (0x10000 << endpoint)) return SIM_STALL;
+		int r = in(endpoint, buf, maxlen);
+		if (r == SIM_STALL) halted |= 0x10000 << endpoint;
+		return r;
+	}
+	if (ep0_stall) return SIM_STALL;
+	if (setup.bmRequestType & 0x80) {
+		// IN data stage
+		uint32_t n = ep0_len - ep0_pos;
+		if (n > maxlen) n = maxlen;
+		memcpy(buf, ep0_data + ep0_pos, n);
+		ep0_pos += n;
+		return n;
+	}
+	// status stage of an OUT request, which is done now
+	if (standard_request(ep0_data) < 0) {
+		ep0_stall = true;
+		return SIM_STALL;
+	}
+	status_stage();
+	return 0;
+}
+
+int SimDevice::packet_out(uint32_t endpoint, const uint8_t *buf, uint32_t len)
+{
+	if (endpoint > 0) {
+		if (halted & (1 << endpoint)) return SIM_STALL;
+		int r = out(endpoint, buf, len);
+		if (r == SIM_STALL) halted |= 1 << endpoint;
+		return r;
+	}
+	if (ep0_stall) return SIM_STALL;
+	if (!(setup.bmRequestType & 0x80)) {
+		// OUT data stage
+		uint32_t n = sizeof(ep0_data) - ep0_pos;
+		if (n > len) n = len;
+		memcpy(ep0_data + ep0_pos, buf, n);
+		ep0_pos += n;
+	}
+	return len;
+}
+
+
+SimHub::SimHub(uint32_t ports, bool multi_tt)
+	: SimDevice(2, desc, config), tt_per_port(multi_tt)
+{
+	static const uint8_t device_desc[18] = {
+		18, 1, 0x00, 0x02, 9, 0, 1, 64, 0x40, 0x1A, 0x01, 0x01, 0x11, 0x01,
+		0, 0, 0, 1
+	};
+	static const uint8_t config_desc[25] = {
+		9, 2, 25, 0, 1, 1, 0, 0xE0, 50,
+		9, 4, 0, 0, 1, 9, 0, 1, 0,
+		7, 5, 0x81, 3, 1, 0, 12
+	};
+	memcpy(desc, device_desc, sizeof(desc));
+	memcpy(config, config_desc, sizeof(config));
+	if (multi_tt) desc[6] = config[16] = 2;
+	numports = (ports < 1) ? 1 : (ports > 7) ? 7 : ports;
+	memset(port_device, 0, sizeof(port_device));
+	memset(port_status, 0, sizeof(port_status));
+	memset(port_change, 0, sizeof(port_change));
+	memset(reset_end, 0, sizeof(reset_end));
+}
+
+void SimHub::attach(uint32_t port, SimDevice *dev)
+{
+	if (port < 1 || port > numports) return;
+	if (port_device[port-1]) detach(port);
+	port_device[port-1] = dev;
+	if (port_status[port-1] & 0x0100) {
+		port_status[port-1] |= 0x0001;
+		port_change[port-1] |= 0x0001;
+	}
+}
+
+void SimHub::detach(uint32_t port)
+{
+	if (port < 1 || port > numports || !port_device[port-1]) return;
+	port_device[port-1] = NULL;
+	if (port_status[port-1] & 0x0001) {
+		port_status[port-1] &= ~0x0613;
+		port_change[port-1] |= 0x0001;
+	}
+}
+
+void SimHub::bus_reset()
+{
+	SimDevice::bus_reset();
+	memset(port_status, 0, sizeof(port_status));
+	memset(port_change, 0, sizeof(port_change));
+}
+
+// Finish port resets which have run long enough
+void SimHub::update()
+{
+	for (uint32_t i=0; i < numports; i++) {
+		if (!(port_status[i] & 0x0010)) continue;
+		if ((int32_t)(micros() - reset_end[i]) < 0) continue;
+		port_status[i] &= ~0x0010;
+		port_change[i] |= 0x0010;
+		SimDevice *dev = port_device[i];
+		if (dev) {
+			dev->bus_reset();
+			port_status[i] |= 0x0002;
+			if (dev->speed == 1) port_status[i] |= 0x0200;
+			if (dev->speed == 2) port_status[i] |= 0x0400;
+		}
+	}
+}
+
+// Hub class requests, USB 2.0 page 419
+int SimHub::control(const setup_t &setup, uint8_t *data)
+{
+	uint32_t port = setup.wIndex;
+	uint32_t i = port - 1;
+	update();
+	switch (setup.wRequestAndType) {
+	case 0x06A0: // GET_DESCRIPTOR (hub)
+		data[0] = 9;
+		data[1] = 0x29;
+		data[2] = numports;
+		data[3] = 0x09; // individual power & overcurrent
+		data[4] = 0;
+		data[5] = 50; // 100 ms power on to good
+		data[6] = 100;
+		data[7] = 0;
+		data[8] = 0xFF;
+		return 9;
+	case 0x00A0: // GET_STATUS (hub)
+		memset(data, 0, 4);
+		return 4;
+	case 0x0120: // CLEAR_FEATURE (hub)
+	case 0x0320: // SET_FEATURE (hub)
+		return 0;
+	}
+	if (port < 1 || port > numports) return SIM_STALL;
+	switch (setup.wRequestAndType) {
+	case 0x00A3: // GET_STATUS (port)
+		data[0] = port_status[i];
+		data[1] = port_status[i] >> 8;
+		data[2] = port_change[i];
+		data[3] = port_change[i] >> 8;
+		return 4;
+	case 0x0323: // SET_FEATURE (port)
+		if (setup.wValue == 8) { // PORT_POWER
+			port_status[i] |= 0x0100;
+			if (port_device[i] && !(port_status[i] & 0x0001)) {
+				port_status[i] |= 0x0001;
+				port_change[i] |= 0x0001;
+			}
+		} else if (setup.wValue == 4) { // PORT_RESET
+			if (port_status[i] & 0x0001) {
+				port_status[i] = (port_status[i] & ~0x0602) | 0x0010;
+				reset_end[i] = micros() + HUB_RESET_TIME;
+			}
+		}
+		return 0;
+	case 0x0123: // CLEAR_FEATURE (port)
+		if (setup.wValue == 1) port_status[i] &= ~0x0002; // PORT_ENABLE
+		if (setup.wValue == 8) port_status[i] &= ~0x0103; // PORT_POWER
+		if (setup.wValue >= 16 && setup.wValue <= 20) {
+			port_change[i] &= ~(1 << (setup.wValue - 16));
+		}
+		return 0;
+	}
+	return SIM_STALL;
+}
+
+// The status change endpoint NAKs until a port has a change to report
+int SimHub::in(uint32_t endpoint, uint8_t *buf, uint32_t maxlen)
+{
+	if (endpoint != 1) return SIM_STALL;
+	update();
+	uint32_t bits = 0;
+	for (uint32_t i=0; i < numports; i++) {
+		if (port_change[i]) bits |= 1 << (i + 1);
+	}
+	if (!bits) return SIM_NAK;
+	buf[0] = bits;
+	return 1;
+}
+
+SimDevice * SimHub::find(uint32_t addr)
+{
+	if (addr == address) return this;
+	for (uint32_t i=0; i < numports; i++) {
+		if (!port_device[i] || !(port_status[i] & 0x0002)) continue;
+		SimDevice *dev = port_device[i]->find(addr);
+		if (dev) return dev;
+	}
+	return NULL;
+}
@@ -0,0 +1,156 @@
+/* USB EHCI Host for Teensy 3.6 - host simulator
+ * Copyright 2017 Paul Stoffregen (paul@pjrc.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// A software model of Teensy 4's two EHCI controllers, so the library's
+// schedule, interrupt and enumeration code can run and be tested on a PC.
+// The model walks the same QH, qTD, iTD & siTD lists the hardware would,
+// once per 125 us microframe, moving data to and from SimDevice objects
+// which stand in for real USB devices.  It sets USBSTS's UAI, UPI, UEI,
+// PCI, AAI, TI0 & TI1 bits and interrupts through a small NVIC model.
+// Periodic full & low speed transactions behind a hub are split, through
+// a model of the hub's TT, but async ones are done all at once.
+//
+// Everything runs on 1 thread.  Simulated time only moves forward inside
+// sim_run(), delay(), delayMicroseconds() and yield(), and interrupts only
+// happen there, or when __enable_irq() or NVIC_ENABLE_IRQ() allow one which
+// is pending.  So code running between those is never interrupted.
+//
+// The EHCI uses 32 bit addresses.  The simulator must be built without PIE
+// (-no-pie -fno-pie), so global & static variables are below 4 GB.  Any
+// buffer given to the library must be one of those, never malloc()'d
+// memory, which may be above 4 GB.  Local variables are only allowed in
+// code run by sim_low_stack(), which some drivers (USBDrive) need.
+
+#ifndef HOST_SIM_H_
+#define HOST_SIM_H_
+
+#include <Arduino.h>
+#include "USBHost_t36.h"
+
+// SimDevice::in() & out() may return these instead of a byte count
+#define SIM_NAK   (-1)
+#define SIM_STALL (-2)
+
+// A USB device.  Standard requests are handled here, from the descriptors.
+// Subclasses give the descriptors and implement their endpoints.
+class SimDevice {
+public:
+	// speed: 0=12, 1=1.5, 2=480 Mbit/sec, as Device_t
+	SimDevice(uint32_t speed, const uint8_t *device_desc, const uint8_t *config_desc,
+		const char * const *strings=NULL, uint32_t string_count=0);
+	virtual ~SimDevice() { }
+	// Non-standard control requests.  For IN, write up to setup.wLength
+	// bytes to data and return the count.  For OUT, data has the bytes
+	// received.  Return SIM_STALL to refuse the request.
+	virtual int control(const setup_t &setup, uint8_t *data) { return SIM_STALL; }
+	// Endpoints other than 0.  in() returns the bytes written to buf (up
+	// to maxlen), out() returns len, or either may return SIM_NAK or
+	// SIM_STALL.  Isochronous endpoints may not NAK.
+	virtual int in(uint32_t endpoint, uint8_t *buf, uint32_t maxlen) { return SIM_STALL; }
+	virtual int out(uint32_t endpoint, const uint8_t *buf, uint32_t len) { return SIM_STALL; }
+	// Bus reset, from the root port or a hub port
+	virtual void bus_reset();
+	// The device responding to this address, here or downstream of a hub
+	virtual SimDevice * find(uint32_t addr) { return (addr == address) ? this : NULL; }
+	// A hub with a transaction translator for each port
+	virtual bool multi_tt() { return false; }
+
+	// Packets from the EHCI model.  Endpoint 0 is done here.
+	int packet_setup(const uint8_t *data);
+	int packet_in(uint32_t endpoint, uint8_t *buf, uint32_t maxlen);
+	int packet_out(uint32_t endpoint, const uint8_t *buf, uint32_t len);
+
+	const uint8_t speed;
+	uint8_t address;
+	uint8_t configuration;
+	uint32_t halted; // endpoints stalled, bit 0-15 OUT, 16-31 IN
+	uint32_t setup_count; // SETUP packets received
+private:
+	int standard_request(uint8_t *data);
+	void status_stage();
+	const uint8_t *device_desc;
+	const uint8_t *config_desc;
+	const char * const *strings;
+	uint32_t string_count;
+	setup_t setup;
+	uint8_t ep0_data[1024]; // IN response or OUT data of the control transfer
+	uint16_t ep0_len;
+	uint16_t ep0_pos;
+	bool ep0_stall;
+};
+
+// A high speed hub, with 1 to 7 ports
+class SimHub : public SimDevice {
+public:
+	SimHub(uint32_t ports=4, bool multi_tt=false);
+	void attach(uint32_t port, SimDevice *dev);
+	void detach(uint32_t port);
+	virtual int control(const setup_t &setup, uint8_t *data);
+	virtual int in(uint32_t endpoint, uint8_t *buf, uint32_t maxlen);
+	virtual void bus_reset();
+	virtual SimDevice * find(uint32_t addr);
+	virtual bool multi_tt() { return tt_per_port; }
+private:
+	void update();
+	const bool tt_per_port;
+	uint32_t numports;
+	SimDevice *port_device[7];
+	uint16_t port_status[7];
+	uint16_t port_change[7];
+	uint32_t reset_end[7]; // micros() when a port reset finishes
+	uint8_t config[25];
+	uint8_t desc[18];
+};
+
+// Plug a device into a controller's root port (1 for USB1, 2 for USB2),
+// or unplug it
+void sim_connect(uint32_t controller, SimDevice *dev);
+void sim_disconnect(uint32_t controller);
+
+// Run the simulation for some microseconds, with all interrupts
+void sim_run(uint32_t microseconds);
+
+// Run function on a stack below 4 GB, and return what it returns
+int sim_low_stack(int (*function)(void));
+
+// Microframes each controller ran, and packets sent or received
+uint32_t sim_microframes(uint32_t controller);
+uint32_t sim_packets(uint32_t controller);
+
+// Periodic split transactions the TT hadn't finished by the last CSPLIT
+uint32_t sim_split_errors(uint32_t controller);
+
+// Teensy 4 caches memory from 0x20200000 up (OCRAM & EXTMEM), so the
+// library does cache maintenance for buffers there.  sim_cached_memory()
+// maps SIM_CACHED_SIZE bytes at that address, for buffers which test it.
+// Memory is really always coherent, but each 32 byte line keeps 2 flags:
+// dirty, when the test says the CPU wrote it, until it's flushed, and
+// stale, when the EHCI wrote it, until it's deleted.  An EHCI read of a
+// dirty line is a cache error, as the device would get old data.
+#define SIM_CACHED_SIZE 262144
+uint8_t * sim_cached_memory(void);
+void sim_cache_write(const void *addr, uint32_t len); // CPU wrote, lines dirty
+bool sim_cache_stale(const void *addr, uint32_t len); // any line stale
+uint32_t sim_cache_errors(void);
+
+#endif
@@ -0,0 +1,783 @@
+/* USB EHCI Host for Teensy 3.6 - host simulator tests
+ * Copyright 2017 Paul Stoffregen (paul@pjrc.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Runs the library against the simulated EHCI controllers in host_sim.cpp:
+// enumeration, interrupt & bulk pipes, scatter-gather and isochronous
+// transfers with cache maintenance, control requests which stall, timers,
+// the keyboard, serial & mass storage drivers, a hub with a full speed
+// device, split transactions within the TT budget, both controllers at
+// once, and disconnects returning all memory to the pools.
+//
+// Build on Linux (the EHCI needs everything below 4 GB, so no PIE):
+//   g++ -O2 -std=gnu++14 -fno-rtti -fno-exceptions -fpermissive -w \
+//     -no-pie -fno-pie -D__IMXRT1062__ -DARDUINO_TEENSY41 \
+//     -DUSBHOST_CONTROLLERS=2 -I. -I../.. -o host_sim_test \
+//     host_sim_test.cpp host_sim.cpp ../../ehci.cpp ../../memory.cpp \
+//     ../../enumeration.cpp ../../hub.cpp ../../print.cpp ../../hid.cpp \
+//     ../../keyboard.cpp ../../bluetooth.cpp ../../serial.cpp \
+//     ../../MassStorageDriver.cpp
+//
+// Use:
+//   ./host_sim_test       (exit status is the number of failed checks)
+
+#include <Arduino.h>
+#include "host_sim.h"
+#include "loopback.h"
+#include "class_devices.h"
+#include "USBFilesystemFormatter.h"
+
+static uint32_t failures = 0;
+static uint32_t checks = 0;
+
+#define CHECK(cond) do { \
+	checks++; \
+	if (!(cond)) { \
+		printf("  FAIL line %d: %s\n", __LINE__, #cond); \
+		failures++; \
+	} \
+} while (0)
+
+// A high speed device with isochronous IN & OUT endpoints, 64 bytes every
+// microframe.  IN sends a count of bytes, and OUT expects one.
+class IsoDevice : public SimDevice {
+public:
+	IsoDevice() : SimDevice(2, device_desc, config_desc) { }
+	virtual int in(uint32_t endpoint, uint8_t *buf, uint32_t maxlen) {
+		if (endpoint != 4) return SIM_STALL;
+		for (uint32_t i=0; i < maxlen; i++) buf[i] = in_count++;
+		return maxlen;
+	}
+	virtual int out(uint32_t endpoint, const uint8_t *buf, uint32_t len) {
+		if (endpoint != 5) return SIM_STALL;
+		for (uint32_t i=0; i < len; i++) {
+			if (buf[i] != (uint8_t)out_count++) out_errors++;
+		}
+		return len;
+	}
+	uint32_t in_count = 0;
+	uint32_t out_count = 0;
+	uint32_t out_errors = 0;
+private:
+	static const uint8_t device_desc[18];
+	static const uint8_t config_desc[32];
+};
+const uint8_t IsoDevice::device_desc[18] = {
+	18, 1, 0x00, 0x02, 0xFF, 0, 0, 64, 0x09, 0x12, 0x02, 0x00, 0x00, 0x01, 0, 0, 0, 1
+};
+const uint8_t IsoDevice::config_desc[32] = {
+	9, 2, 32, 0, 1, 1, 0, 0xC0, 50,
+	9, 4, 0, 0, 2, 0xFF, 0, 0, 0,
+	7, 5, 0x84, 1, 64, 0, 1,    // isochronous IN, every microframe
+	7, 5, 0x05, 1, 64, 0, 1     // isochronous OUT, every microframe
+};
+
+#define ISO_FRAMES 4
+#define ISO_FRAME_BYTES (64 * 8)
+
+// The driver for IsoDevice, with its buffers in cached memory.  Each IN
+// frame is checked, and each OUT frame filled, by the callbacks.
+class IsoDriver : public USBDriver {
+public:
+	IsoDriver(USBHost &host) { init(); }
+	uint8_t *in_data = NULL;
+	uint8_t *out_data = NULL;
+	uint32_t in_frames = 0;
+	uint32_t in_count = 0;
+	uint32_t in_errors = 0;
+	uint32_t in_stale = 0;
+	uint32_t out_count = 0;
+protected:
+	virtual bool claim(Device_t *dev, int type, const uint8_t *descriptors, uint32_t len) {
+		if (type != 0 || dev->idVendor != 0x1209 || dev->idProduct != 0x0002) return false;
+		inpipe = new_Pipe(dev, 1, 4, 1, 64, 1);
+		outpipe = new_Pipe(dev, 1, 5, 0, 64, 1);
+		if (!inpipe || !outpipe) return false;
+		inpipe->isochronous_callback = in_callback;
+		outpipe->isochronous_callback = out_callback;
+		for (uint32_t i=0; i < ISO_FRAMES; i++) fill(out_data + i * ISO_FRAME_BYTES);
+		memset(in_data, 0, ISO_FRAMES * ISO_FRAME_BYTES);
+		sim_cache_write(in_data, ISO_FRAMES * ISO_FRAME_BYTES);
+		return start_Isochronous(inpipe, in_data, ISO_FRAMES, this)
+			&& start_Isochronous(outpipe, out_data, ISO_FRAMES, this);
+	}
+	virtual void disconnect() {
+		inpipe = outpipe = NULL;
+	}
+	void init() {
+		contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
+		contribute_Isochronous(myiso, sizeof(myiso)/sizeof(Isochronous_t));
+		driver_ready_for_device(this);
+	}
+	void fill(uint8_t *p) {
+		for (uint32_t i=0; i < ISO_FRAME_BYTES; i++) p[i] = out_count++;
+		sim_cache_write(p, ISO_FRAME_BYTES);
+	}
+	static void in_callback(Isochronous_t *iso) {
+		IsoDriver *d = (IsoDriver *)iso->driver;
+		const uint8_t *p = (const uint8_t *)iso->buffer;
+		if (sim_cache_stale(p, ISO_FRAME_BYTES)) d->in_stale++;
+		for (uint32_t i=0; i < 8; i++) {
+			uint32_t len = isochronous_Length(iso, i);
+			if (len != 64) d->in_errors++;
+			for (uint32_t j=0; j < len; j++) {
+				if (p[i * 64 + j] != (uint8_t)d->in_count++) d->in_errors++;
+			}
+		}
+		d->in_frames++;
+		sim_cache_write(iso->buffer, ISO_FRAME_BYTES); // the checks read it
+	}
+	static void out_callback(Isochronous_t *iso) {
+		((IsoDriver *)iso->driver)->fill((uint8_t *)iso->buffer);
+	}
+	Pipe_t *inpipe = NULL;
+	Pipe_t *outpipe = NULL;
+	Pipe_t mypipes[2] __attribute__ ((aligned(32)));
+	Isochronous_t myiso[ISO_FRAMES * 2] __attribute__ ((aligned(32)));
+};
+
+// A full speed device with 10 interrupt IN endpoints, 64 bytes every
+// 1 ms, more than a TT can do.  Each packet has its endpoint number and
+// a sequence number.
+class InterruptDevice : public SimDevice {
+public:
+	InterruptDevice() : SimDevice(0, device_desc, config_desc) { }
+	virtual int in(uint32_t endpoint, uint8_t *buf, uint32_t maxlen) {
+		if (endpoint < 1 || endpoint > 10 || maxlen < 64) return SIM_STALL;
+		memset(buf, 0, 64);
+		buf[0] = endpoint;
+		memcpy(buf + 4, &sequence[endpoint-1], 4);
+		sequence[endpoint-1]++;
+		return 64;
+	}
+	uint32_t sequence[10] = {0};
+private:
+	static const uint8_t device_desc[18];
+	static const uint8_t config_desc[88];
+};
+const uint8_t InterruptDevice::device_desc[18] = {
+	18, 1, 0x00, 0x02, 0xFF, 0, 0, 64, 0x09, 0x12, 0x06, 0x00, 0x00, 0x01, 0, 0, 0, 1
+};
+const uint8_t InterruptDevice::config_desc[88] = {
+	9, 2, 88, 0, 1, 1, 0, 0xC0, 50,
+	9, 4, 0, 0, 10, 0xFF, 0, 0, 0,
+	7, 5, 0x81, 3, 64, 0, 1,
+	7, 5, 0x82, 3, 64, 0, 1,
+	7, 5, 0x83, 3, 64, 0, 1,
+	7, 5, 0x84, 3, 64, 0, 1,
+	7, 5, 0x85, 3, 64, 0, 1,
+	7, 5, 0x86, 3, 64, 0, 1,
+	7, 5, 0x87, 3, 64, 0, 1,
+	7, 5, 0x88, 3, 64, 0, 1,
+	7, 5, 0x89, 3, 64, 0, 1,
+	7, 5, 0x8A, 3, 64, 0, 1
+};
+
+// The driver for InterruptDevice, opening as many of its endpoints as the
+// bandwidth allows, and keeping a transfer queued on each
+class InterruptDriver : public USBDriver {
+public:
+	InterruptDriver(USBHost &host) { init(); }
+	uint32_t pipes = 0;
+	USBHost::bandwidth_result_t result = USBHost::BANDWIDTH_OK;
+	uint32_t count[10];
+	uint32_t errors = 0;
+protected:
+	virtual bool claim(Device_t *dev, int type, const uint8_t *descriptors, uint32_t len) {
+		if (type != 0 || dev->idVendor != 0x1209 || dev->idProduct != 0x0006) return false;
+		pipes = 0;
+		result = USBHost::BANDWIDTH_OK;
+		errors = 0;
+		memset(count, 0, sizeof(count));
+		while (pipes < 10) {
+			Pipe_t *pipe = new_Pipe(dev, 3, pipes + 1, 1, 64, 1);
+			if (!pipe) {
+				result = bandwidthResult();
+				break;
+			}
+			pipe->callback_function = callback;
+			queue_Data_Transfer(pipe, buf[pipes], 64, this);
+			pipes++;
+		}
+		return true;
+	}
+	virtual void disconnect() {
+		pipes = 0;
+	}
+	void init() {
+		contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
+		contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t), this);
+		driver_ready_for_device(this);
+	}
+	static void callback(const Transfer_t *transfer) {
+		InterruptDriver *d = (InterruptDriver *)transfer->driver;
+		uint8_t *p = (uint8_t *)transfer->buffer;
+		uint32_t i = (p - d->buf[0]) / 64;
+		uint32_t sequence;
+		memcpy(&sequence, p + 4, 4);
+		if (p[0] != i + 1) d->errors++;
+		if (d->count[i] > 0 && sequence != d->last[i] + 1) d->errors++;
+		d->last[i] = sequence;
+		d->count[i]++;
+		queue_Data_Transfer(transfer->pipe, p, 64, d);
+	}
+	uint32_t last[10];
+	uint8_t buf[10][64] __attribute__ ((aligned(32)));
+	Pipe_t mypipes[10] __attribute__ ((aligned(32)));
+	Transfer_t mytransfers[20] __attribute__ ((aligned(32)));
+};
+
+USBHost myusb;
+// USB2 starts first and gets the longest periodic schedule, with a capped
+// anchor tree, and USB1 the default
+USBHostConfig<1, 1, 1, 0, 1024> myusbmemory;
+USBHostController usb1(1);
+USBHub hub1(myusb);
+LoopbackDriver loop1(myusb);
+LoopbackDriver loop2(myusb);
+IsoDriver iso1(myusb);
+InterruptDriver int1(myusb);
+InterruptDriver int2(myusb);
+KeyboardController keyboard1(myusb);
+USBHIDParser hid1(myusb);
+USBSerial userial(myusb);
+USBDrive drive1(myusb);
+
+LoopbackDevice hs_device(2);
+LoopbackDevice hs_device2(2);
+LoopbackDevice fs_device(0);
+SimHub hub_device(4);
+SimHub mtt_hub_device(4, true);
+IsoDevice iso_device;
+SimKeyboard keyboard_device;
+SimSerial serial_device;
+SimDisk disk_device;
+InterruptDevice int_device;
+InterruptDevice int_device2;
+
+static uint8_t out_buf[2][65536];
+static uint8_t in_buf[2][65536];
+
+// USBFilesystemFormatter.cpp needs much more of SdFat than SdFat.h has,
+// so it's not built, and formatting always fails
+bool USBFilesystemFormatter::format(USBFilesystem &fs, uint8_t fat_type,
+	uint8_t *secBuf, print_t *pr)
+{
+	return false;
+}
+
+
+// run the simulation for some milliseconds, calling Task() every 1 ms
+static void run(uint32_t ms)
+{
+	while (ms--) {
+		delay(1);
+		myusb.Task();
+	}
+}
+
+static LoopbackDriver * driver_for(SimDevice &dev, USBHostController *hc=NULL)
+{
+	LoopbackDriver *list[2] = {&loop1, &loop2};
+	for (LoopbackDriver *d : list) {
+		if (!*d) continue;
+		if (d->dev()->address != dev.address) continue;
+		if (hc && d->dev()->controller != hc) continue;
+		return d;
+	}
+	return NULL;
+}
+
+static bool free_counts_are(const uint32_t *expected)
+{
+	uint32_t n[4];
+	USBHost::countFree(n[0], n[1], n[2], n[3]);
+	if (memcmp(n, expected, sizeof(n)) == 0) return true;
+	printf("  free devices %u, pipes %u, transfers %u, strings %u\n",
+		n[0], n[1], n[2], n[3]);
+	return false;
+}
+
+// Send len bytes through the bulk loopback, return how many came back
+// the same, and the time it took
+static uint32_t loopback(LoopbackDriver *d, uint32_t which, uint32_t len, uint32_t &usec)
+{
+	for (uint32_t i=0; i < len; i++) out_buf[which][i] = i * 7 + (i >> 8) + which;
+	memset(in_buf[which], 0, len);
+	uint32_t begin = micros();
+	if (!d->send(out_buf[which], len)) return 0;
+	if (!d->receive(in_buf[which], len)) return 0;
+	for (uint32_t ms=0; ms < 2000 && !(d->out_done && d->in_done); ms++) run(1);
+	usec = micros() - begin;
+	if (!d->out_done || !d->in_done || d->in_length != len) return 0;
+	return (memcmp(out_buf[which], in_buf[which], len) == 0) ? len : 0;
+}
+
+static uint32_t baseline[4];
+
+static void test_enumeration()
+{
+	printf("high speed device on USB2\n");
+	sim_connect(2, &hs_device);
+	run(500);
+	LoopbackDriver *d = driver_for(hs_device);
+	CHECK(d != NULL);
+	if (!d) return;
+	CHECK(hs_device.address != 0);
+	CHECK(hs_device.configuration == 1);
+	CHECK(d->dev()->speed == 2);
+	CHECK(d->dev()->controller != &usb1);
+	CHECK(d->manufacturer() && strcmp((const char *)d->manufacturer(), "PJRC") == 0);
+	CHECK(d->product() && strcmp((const char *)d->product(), "Loopback") == 0);
+	uint32_t count = d->int_count;
+	run(100);
+	count = d->int_count - count;
+	CHECK(count >= 99 && count <= 101);
+	CHECK(d->int_in_order);
+}
+
+static void test_bulk()
+{
+	printf("bulk loopback, 64 KB at high speed\n");
+	LoopbackDriver *d = driver_for(hs_device);
+	if (!d) return;
+	uint32_t usec = 0;
+	CHECK(loopback(d, 0, 65536, usec) == 65536);
+	// 13 packets per microframe, out and back is at least 2.5 ms
+	printf("  %u us\n", usec);
+	CHECK(usec >= 2400 && usec < 10000);
+	CHECK(loopback(d, 0, 1000, usec) == 1000); // ends with a short packet
+}
+
+// Send the OUT segments through the bulk loopback, into the IN segments,
+// all in cached memory.  Return how many bytes came back the same.
+static uint32_t loopback(LoopbackDriver *d, const segment_t *out, uint32_t out_count,
+	const segment_t *in, uint32_t in_count)
+{
+	uint32_t len = 0;
+	for (uint32_t i=0; i < out_count; i++) {
+		uint8_t *p = (uint8_t *)out[i].data;
+		for (uint32_t j=0; j < out[i].length; j++, len++) p[j] = len * 13 + (len >> 9);
+		sim_cache_write(p, out[i].length);
+	}
+	for (uint32_t i=0; i < in_count; i++) {
+		memset(in[i].data, 0, in[i].length);
+		sim_cache_write(in[i].data, in[i].length);
+	}
+	if (!d->send(out, out_count)) return 0;
+	if (!d->receive(in, in_count)) return 0;
+	for (uint32_t ms=0; ms < 2000 && !(d->out_done && d->in_done); ms++) run(1);
+	if (!d->out_done || !d->in_done || d->in_length != len) return 0;
+	uint32_t same = 0, n = 0;
+	for (uint32_t i=0; i < in_count; i++) {
+		const uint8_t *p = (const uint8_t *)in[i].data;
+		for (uint32_t j=0; j < in[i].length; j++, n++) {
+			if (p[j] == (uint8_t)(n * 13 + (n >> 9))) same++;
+		}
+	}
+	return same;
+}
+
+static void test_segments()
+{
+	printf("scatter-gather bulk, cached memory\n");
+	LoopbackDriver *d = driver_for(hs_device);
+	if (!d) return;
+	uint8_t *mem = sim_cached_memory();
+	uint32_t before[4];
+	USBHost::countFree(before[0], before[1], before[2], before[3]);
+	// 1 segment needing 2 qTDs, which doesn't start on a page, so the
+	// first qTD's 5 pages end in the middle of a packet
+	segment_t out1[1] = {{mem + 0x00100, 32768}};
+	segment_t in1[1] = {{mem + 0x10100, 32768}};
+	CHECK(loopback(d, out1, 1, in1, 1) == 32768);
+	CHECK(!sim_cache_stale(in1[0].data, in1[0].length));
+	// several segments, which join at page boundaries or after whole
+	// packets, and differ for OUT & IN
+	segment_t out2[3] = {
+		{mem + 0x20800, 0x0800}, // to the end of its page
+		{mem + 0x21000, 0x3000}, // from the start of the next
+		{mem + 0x24020, 0x0600}  // after 0x3800 bytes, 28 packets
+	};
+	segment_t in2[3] = {
+		{mem + 0x28E00, 0x0200},
+		{mem + 0x29000, 0x2000},
+		{mem + 0x2C040, 0x1C00}  // after 0x2200 bytes, 17 packets
+	};
+	CHECK(loopback(d, out2, 3, in2, 3) == 0x3E00);
+	for (uint32_t i=0; i < 3; i++) {
+		CHECK(!sim_cache_stale(in2[i].data, in2[i].length));
+	}
+	CHECK(sim_cache_errors() == 0);
+	// a header which ends in the middle of a packet and a page
+	segment_t bad[2] = {{mem + 0x30040, 64}, {mem + 0x31000, 512}};
+	CHECK(!d->send(bad, 2));
+	CHECK(free_counts_are(before));
+}
+
+static void test_isochronous()
+{
+	printf("isochronous IN & OUT, cached memory\n");
+	uint8_t *mem = sim_cached_memory();
+	iso1.in_data = mem + 0x38000;
+	iso1.out_data = mem + 0x39000;
+	sim_disconnect(2);
+	run(50);
+	sim_connect(2, &iso_device);
+	run(500);
+	CHECK(iso1);
+	uint32_t frames = iso1.in_frames;
+	run(100);
+	frames = iso1.in_frames - frames;
+	CHECK(frames >= 99 && frames <= 101);
+	CHECK(iso1.in_count > 0 && iso1.in_errors == 0);
+	CHECK(iso1.in_stale == 0);
+	CHECK(iso_device.out_count > 50 * ISO_FRAME_BYTES);
+	CHECK(iso_device.out_errors == 0);
+	CHECK(sim_cache_errors() == 0);
+	sim_disconnect(2);
+	run(50);
+	CHECK(!iso1);
+	sim_connect(2, &hs_device);
+	run(500);
+	CHECK(driver_for(hs_device) != NULL);
+}
+
+static void test_control()
+{
+	printf("control requests, stall and recovery\n");
+	LoopbackDriver *d = driver_for(hs_device);
+	if (!d) return;
+	CHECK(d->request(0x40, 1, 0x1234, 0));
+	run(5);
+	CHECK(d->control_done && !(d->control_token & 0x40));
+	CHECK(hs_device.value == 0x1234);
+	CHECK(d->request(0xC0, 3, 0, 2)); // unsupported, stalls
+	run(5);
+	CHECK(d->control_done && (d->control_token & 0x40));
+	CHECK(d->request(0xC0, 2, 0, 2)); // the pipe works again
+	run(5);
+	CHECK(d->control_done && !(d->control_token & 0x40));
+	CHECK(d->control_buf[0] == 0x34 && d->control_buf[1] == 0x12);
+}
+
+static void test_timers()
+{
+	printf("driver timers\n");
+	LoopbackDriver *d = driver_for(hs_device);
+	if (!d) return;
+	uint32_t begin = micros();
+	d->timer_micros = 0;
+	d->timer.start(25000);
+	run(30);
+	CHECK(d->timer_micros - begin >= 25000 && d->timer_micros - begin < 25300);
+	begin = micros();
+	d->timer_micros = 0;
+	d->timer.start(3000000); // beyond level 1 of the wheel
+	run(3010);
+	CHECK(d->timer_micros - begin >= 3000000 && d->timer_micros - begin < 3001000);
+	d->timer_micros = 0;
+	d->timer.start(50000);
+	run(10);
+	d->timer.stop();
+	run(100);
+	CHECK(d->timer_micros == 0);
+}
+
+static void test_disconnect()
+{
+	printf("disconnect\n");
+	sim_disconnect(2);
+	run(50);
+	CHECK(!loop1 && !loop2);
+	CHECK(free_counts_are(baseline));
+}
+
+static char typed[16];
+static uint32_t typed_count = 0;
+
+static void key_pressed(int unicode)
+{
+	if (typed_count < sizeof(typed)) typed[typed_count++] = unicode;
+}
+
+static void test_keyboard()
+{
+	printf("low speed keyboard\n");
+	keyboard1.attachPress(key_pressed);
+	sim_connect(2, &keyboard_device);
+	run(500);
+	CHECK(keyboard1);
+	if (!keyboard1) return;
+	// H with shift, i, ! with shift, then enter, each pressed & released
+	static const uint8_t keys[4][2] = {{0x02, 11}, {0, 12}, {0x20, 30}, {0, 40}};
+	for (uint32_t i=0; i < 4; i++) {
+		keyboard_device.press(keys[i][0], keys[i][1]);
+		keyboard_device.release();
+	}
+	run(100);
+	CHECK(typed_count == 4 && memcmp(typed, "Hi!\n", 4) == 0);
+	// caps lock lights the keyboard's LED, and shifts letters
+	keyboard_device.press(0, 57);
+	keyboard_device.release();
+	keyboard_device.press(0, 4);
+	keyboard_device.release();
+	run(100);
+	CHECK(keyboard1.capsLock());
+	CHECK(keyboard_device.leds == 0x02);
+	CHECK(typed_count == 6 && typed[5] == 'A');
+	CHECK(keyboard1.getOemKey() == 4 && keyboard1.getModifiers() == 0);
+	sim_disconnect(2);
+	run(50);
+	CHECK(!keyboard1);
+	CHECK(free_counts_are(baseline));
+}
+
+static void test_serial()
+{
+	printf("full speed CDC serial\n");
+	sim_connect(2, &serial_device);
+	run(500);
+	CHECK(userial);
+	if (!userial) return;
+	userial.begin(115200);
+	run(5);
+	CHECK(serial_device.baud() == 115200);
+	CHECK(serial_device.line_state == 3); // DTR & RTS
+	// more than the driver's buffers hold, written as there's room, and
+	// the last partial packet sent by the driver's timer
+	const uint32_t len = 2000;
+	uint32_t sent = 0, received = 0, errors = 0;
+	for (uint32_t ms=0; ms < 2000 && received < len; ms++) {
+		while (sent < len && userial.availableForWrite() > 0) {
+			userial.write((uint8_t)(sent * 7 + (sent >> 8)));
+			sent++;
+		}
+		run(1);
+		while (userial.available()) {
+			int c = userial.read();
+			if (c != (uint8_t)(received * 7 + (received >> 8))) errors++;
+			received++;
+		}
+	}
+	CHECK(sent == len && received == len && errors == 0);
+	sim_disconnect(2);
+	run(50);
+	CHECK(!userial);
+	CHECK(free_counts_are(baseline));
+}
+
+static uint8_t sector_buf[2][4 * 512];
+
+static void test_drive()
+{
+	printf("mass storage drive\n");
+	sim_connect(2, &disk_device);
+	run(500);
+	CHECK(drive1.msDriveInfo.connected);
+	if (!drive1.msDriveInfo.connected) return;
+	// the command blocks are local variables, so this must run on the
+	// low stack, see main()
+	CHECK(drive1.begin());
+	CHECK(disk_device.not_ready == 0); // waited until it was ready
+	CHECK(drive1.msDriveInfo.capacity.Blocks == SIM_DISK_SECTORS - 1);
+	CHECK(drive1.msDriveInfo.capacity.BlockSize == 512);
+	CHECK(memcmp(drive1.msDriveInfo.inquiry.ProductID, "Sim Disk", 8) == 0);
+	for (uint32_t i=0; i < sizeof(sector_buf[0]); i++) sector_buf[0][i] = i * 3 + (i >> 9);
+	CHECK(drive1.writeSectors(10, sector_buf[0], 4));
+	CHECK(memcmp(disk_device.disk + 10 * 512, sector_buf[0], 4 * 512) == 0);
+	for (uint32_t i=0; i < 4 * 512; i++) disk_device.disk[100 * 512 + i] = i * 5 + 1;
+	CHECK(drive1.readSectors(100, sector_buf[1], 4));
+	CHECK(memcmp(disk_device.disk + 100 * 512, sector_buf[1], 4 * 512) == 0);
+	// past the end fails, and REQUEST SENSE says why
+	CHECK(!drive1.readSectors(SIM_DISK_SECTORS - 1, sector_buf[1], 2));
+	CHECK(drive1.msSense.SenseKey == 0x05);
+	CHECK(drive1.msSense.AdditionalSenseCode == 0x21);
+	CHECK(drive1.readSector(100, sector_buf[1]));
+	CHECK(memcmp(disk_device.disk + 100 * 512, sector_buf[1], 512) == 0);
+	sim_disconnect(2);
+	run(50);
+	CHECK(!drive1.msDriveInfo.connected);
+	CHECK(free_counts_are(baseline));
+}
+
+static void test_hub()
+{
+	printf("hub with a full speed device\n");
+	hub_device.attach(3, &fs_device);
+	sim_connect(2, &hub_device);
+	run(1500);
+	CHECK(hub1);
+	LoopbackDriver *d = driver_for(fs_device);
+	CHECK(d != NULL);
+	if (!d) return;
+	CHECK(d->dev()->speed == 0);
+	CHECK(d->dev()->hub_port == 3);
+	uint32_t count = d->int_count;
+	run(100);
+	count = d->int_count - count;
+	CHECK(count >= 99 && count <= 101);
+	CHECK(d->int_in_order);
+	uint32_t usec = 0;
+	CHECK(loopback(d, 0, 8192, usec) == 8192);
+	// about 19 packets per frame at full speed
+	printf("  8 KB in %u us\n", usec);
+	CHECK(usec >= 12000 && usec < 20000);
+
+	hub_device.detach(3);
+	run(500);
+	CHECK(!loop1 && !loop2);
+	CHECK(hub1);
+	hub_device.attach(3, &fs_device);
+	run(1000);
+	CHECK(driver_for(fs_device) != NULL);
+	sim_disconnect(2);
+	run(50);
+	CHECK(!hub1 && !loop1 && !loop2);
+	CHECK(free_counts_are(baseline));
+}
+
+// Every interrupt pipe's packets arrived, about 1 per ms
+static bool interrupts_ok(InterruptDriver &d, uint32_t ms)
+{
+	uint32_t before[10];
+	memcpy(before, d.count, sizeof(before));
+	run(ms);
+	for (uint32_t i=0; i < d.pipes; i++) {
+		uint32_t n = d.count[i] - before[i];
+		if (n + 1 < ms || n > ms + 1) return false;
+	}
+	return d.errors == 0;
+}
+
+static void test_split()
+{
+	printf("split transactions & TT budget\n");
+	uint32_t errors = sim_split_errors(2);
+	// a TT can fit 2 of these in each of the 4 microframes a
+	// full speed interrupt transaction may start in
+	hub_device.attach(1, &int_device);
+	sim_connect(2, &hub_device);
+	run(1500);
+	CHECK(int1.pipes == 8);
+	CHECK(int1.result == USBHost::BANDWIDTH_TT_UFRAME);
+	CHECK(interrupts_ok(int1, 100));
+	// nothing left for another device on the same TT, until the
+	// first device's pipes are gone
+	hub_device.attach(2, &int_device2);
+	run(1000);
+	CHECK(int2.pipes == 0);
+	CHECK(int2.result == USBHost::BANDWIDTH_TT_UFRAME);
+	hub_device.detach(1);
+	hub_device.detach(2);
+	run(500);
+	hub_device.attach(2, &int_device2);
+	run(1000);
+	CHECK(int1.pipes + int2.pipes == 8);
+	sim_disconnect(2);
+	run(50);
+	CHECK(free_counts_are(baseline));
+	// a multi-TT hub has a TT for each port
+	mtt_hub_device.attach(1, &int_device);
+	mtt_hub_device.attach(3, &int_device2);
+	sim_connect(2, &mtt_hub_device);
+	run(2000);
+	CHECK(int1.pipes == 8 && int2.pipes == 8);
+	CHECK(interrupts_ok(int1, 100) && interrupts_ok(int2, 100));
+	CHECK(sim_split_errors(2) == errors);
+	sim_disconnect(2);
+	run(50);
+	CHECK(!hub1 && !int1 && !int2);
+	CHECK(free_counts_are(baseline));
+}
+
+static void test_two_controllers()
+{
+	printf("two controllers\n");
+	// Teensy's USB device code may leave USB1 at another priority
+	NVIC_SET_PRIORITY(IRQ_USB1, 32);
+	CHECK(usb1.begin());
+	CHECK(NVIC_GET_PRIORITY(IRQ_USB1) == NVIC_GET_PRIORITY(IRQ_USB2));
+	USBHost::countFree(baseline[0], baseline[1], baseline[2], baseline[3]);
+	sim_connect(1, &hs_device2);
+	sim_connect(2, &hs_device);
+	run(1000);
+	LoopbackDriver *d1 = driver_for(hs_device2, &usb1);
+	LoopbackDriver *d2 = driver_for(hs_device);
+	CHECK(d1 != NULL && d2 != NULL && d1 != d2);
+	if (!d1 || !d2 || d1 == d2) return;
+	CHECK(d2->dev()->controller != &usb1);
+	CHECK(usb1.rootDevice() == d1->dev());
+	// both at once
+	uint32_t n1 = sim_packets(1), n2 = sim_packets(2);
+	for (uint32_t i=0; i < sizeof(out_buf[0]); i++) {
+		out_buf[0][i] = i;
+		out_buf[1][i] = ~i;
+	}
+	d1->send(out_buf[0], 65536);
+	d1->receive(in_buf[0], 65536);
+	d2->send(out_buf[1], 65536);
+	d2->receive(in_buf[1], 65536);
+	for (uint32_t ms=0; ms < 100; ms++) {
+		if (d1->in_done && d2->in_done) break;
+		run(1);
+	}
+	CHECK(d1->in_done && d1->in_length == 65536);
+	CHECK(d2->in_done && d2->in_length == 65536);
+	CHECK(memcmp(out_buf[0], in_buf[0], 65536) == 0);
+	CHECK(memcmp(out_buf[1], in_buf[1], 65536) == 0);
+	CHECK(sim_packets(1) - n1 >= 256 && sim_packets(2) - n2 >= 256);
+	CHECK(d1->int_in_order && d2->int_in_order);
+	sim_disconnect(1);
+	sim_disconnect(2);
+	run(50);
+	CHECK(!loop1 && !loop2);
+	CHECK(free_counts_are(baseline));
+}
+
+static int run_tests()
+{
+	myusb.begin();
+	run(10);
+	USBHost::countFree(baseline[0], baseline[1], baseline[2], baseline[3]);
+	test_enumeration();
+	test_bulk();
+	test_segments();
+	test_isochronous();
+	test_control();
+	test_timers();
+	test_disconnect();
+	test_keyboard();
+	test_serial();
+	test_drive();
+	test_hub();
+	test_split();
+	test_two_controllers();
+	printf("%u checks, %u failed\n", checks, failures);
+	return failures;
+}
+
+int main()
+{
+	// USBDrive gives the EHCI its local variables
+	return sim_low_stack(run_tests);
+}
@@ -0,0 +1,214 @@
+// host simulator: the US English layout from Teensy's keylayouts.h, only
+// the parts keyboard.cpp uses
+
+#ifndef KEYLAYOUTS_H__
+#define KEYLAYOUTS_H__
+
+#include <stdint.h>
+
+#define KEY_A                   (   4  | 0xF000 )
+#define KEY_B                   (   5  | 0xF000 )
+#define KEY_C                   (   6  | 0xF000 )
+#define KEY_D                   (   7  | 0xF000 )
+#define KEY_E                   (   8  | 0xF000 )
+#define KEY_F                   (   9  | 0xF000 )
+#define KEY_G                   (  10  | 0xF000 )
+#define KEY_H                   (  11  | 0xF000 )
+#define KEY_I                   (  12  | 0xF000 )
+#define KEY_J                   (  13  | 0xF000 )
+#define KEY_K                   (  14  | 0xF000 )
+#define KEY_L                   (  15  | 0xF000 )
+#define KEY_M                   (  16  | 0xF000 )
+#define KEY_N                   (  17  | 0xF000 )
+#define KEY_O                   (  18  | 0xF000 )
+#define KEY_P                   (  19  | 0xF000 )
+#define KEY_Q                   (  20  | 0xF000 )
+#define KEY_R                   (  21  | 0xF000 )
+#define KEY_S                   (  22  | 0xF000 )
+#define KEY_T                   (  23  | 0xF000 )
+#define KEY_U                   (  24  | 0xF000 )
+#define KEY_V                   (  25  | 0xF000 )
+#define KEY_W                   (  26  | 0xF000 )
+#define KEY_X                   (  27  | 0xF000 )
+#define KEY_Y                   (  28  | 0xF000 )
+#define KEY_Z                   (  29  | 0xF000 )
+#define KEY_1                   (  30  | 0xF000 )
+#define KEY_2                   (  31  | 0xF000 )
+#define KEY_3                   (  32  | 0xF000 )
+#define KEY_4                   (  33  | 0xF000 )
+#define KEY_5                   (  34  | 0xF000 )
+#define KEY_6                   (  35  | 0xF000 )
+#define KEY_7                   (  36  | 0xF000 )
+#define KEY_8                   (  37  | 0xF000 )
+#define KEY_9                   (  38  | 0xF000 )
+#define KEY_0                   (  39  | 0xF000 )
+#define KEY_ENTER               (  40  | 0xF000 )
+#define KEY_ESC                 (  41  | 0xF000 )
+#define KEY_BACKSPACE           (  42  | 0xF000 )
+#define KEY_TAB                 (  43  | 0xF000 )
+#define KEY_SPACE               (  44  | 0xF000 )
+#define KEY_MINUS               (  45  | 0xF000 )
+#define KEY_EQUAL               (  46  | 0xF000 )
+#define KEY_LEFT_BRACE          (  47  | 0xF000 )
+#define KEY_RIGHT_BRACE         (  48  | 0xF000 )
+#define KEY_BACKSLASH           (  49  | 0xF000 )
+#define KEY_NON_US_NUM          (  50  | 0xF000 )
+#define KEY_SEMICOLON           (  51  | 0xF000 )
+#define KEY_QUOTE               (  52  | 0xF000 )
+#define KEY_TILDE               (  53  | 0xF000 )
+#define KEY_COMMA               (  54  | 0xF000 )
+#define KEY_PERIOD              (  55  | 0xF000 )
+#define KEY_SLASH               (  56  | 0xF000 )
+#define KEY_CAPS_LOCK           (  57  | 0xF000 )
+#define KEY_F1                  (  58  | 0xF000 )
+#define KEY_F2                  (  59  | 0xF000 )
+#define KEY_F3                  (  60  | 0xF000 )
+#define KEY_F4                  (  61  | 0xF000 )
+#define KEY_F5                  (  62  | 0xF000 )
+#define KEY_F6                  (  63  | 0xF000 )
+#define KEY_F7                  (  64  | 0xF000 )
+#define KEY_F8                  (  65  | 0xF000 )
+#define KEY_F9                  (  66  | 0xF000 )
+#define KEY_F10                 (  67  | 0xF000 )
+#define KEY_F11                 (  68  | 0xF000 )
+#define KEY_F12                 (  69  | 0xF000 )
+#define KEY_PRINTSCREEN         (  70  | 0xF000 )
+#define KEY_SCROLL_LOCK         (  71  | 0xF000 )
+#define KEY_PAUSE               (  72  | 0xF000 )
+#define KEY_INSERT              (  73  | 0xF000 )
+#define KEY_HOME                (  74  | 0xF000 )
+#define KEY_PAGE_UP             (  75  | 0xF000 )
+#define KEY_DELETE              (  76  | 0xF000 )
+#define KEY_END                 (  77  | 0xF000 )
+#define KEY_PAGE_DOWN           (  78  | 0xF000 )
+#define KEY_RIGHT               (  79  | 0xF000 )
+#define KEY_LEFT                (  80  | 0xF000 )
+#define KEY_DOWN                (  81  | 0xF000 )
+#define KEY_UP                  (  82  | 0xF000 )
+#define KEY_NUM_LOCK            (  83  | 0xF000 )
+#define KEYPAD_SLASH            (  84  | 0xF000 )
+#define KEYPAD_ASTERIX          (  85  | 0xF000 )
+#define KEYPAD_MINUS            (  86  | 0xF000 )
+#define KEYPAD_PLUS             (  87  | 0xF000 )
+#define KEYPAD_ENTER            (  88  | 0xF000 )
+#define KEYPAD_1                (  89  | 0xF000 )
+#define KEYPAD_2                (  90  | 0xF000 )
+#define KEYPAD_3                (  91  | 0xF000 )
+#define KEYPAD_4                (  92  | 0xF000 )
+#define KEYPAD_5                (  93  | 0xF000 )
+#define KEYPAD_6                (  94  | 0xF000 )
+#define KEYPAD_7                (  95  | 0xF000 )
+#define KEYPAD_8                (  96  | 0xF000 )
+#define KEYPAD_9                (  97  | 0xF000 )
+#define KEYPAD_0                (  98  | 0xF000 )
+#define KEYPAD_PERIOD           (  99  | 0xF000 )
+
+#define SHIFT_MASK		0x40
+#define KEYCODE_TYPE		uint8_t
+#define KEYCODE_MASK		0x007F
+
+// keylayouts.c builds this from the ASCII_20 to ASCII_7F macros, with
+// each entry masked by KEYCODE_MASK.  Only keyboard.cpp includes this.
+#define KEYCODE_US(n)		((n) & KEYCODE_MASK)
+#define KEYCODE_US_SHIFT(n)	(((n) + SHIFT_MASK) & KEYCODE_MASK)
+
+static const KEYCODE_TYPE keycodes_ascii[96] = {
+	KEYCODE_US(KEY_SPACE),                // 32
+	KEYCODE_US_SHIFT(KEY_1),              // 33 !
+	KEYCODE_US_SHIFT(KEY_QUOTE),          // 34 "
+	KEYCODE_US_SHIFT(KEY_3),              // 35 #
+	KEYCODE_US_SHIFT(KEY_4),              // 36 $
+	KEYCODE_US_SHIFT(KEY_5),              // 37 %
+	KEYCODE_US_SHIFT(KEY_7),              // 38 &
+	KEYCODE_US(KEY_QUOTE),                // 39 '
+	KEYCODE_US_SHIFT(KEY_9),              // 40 (
+	KEYCODE_US_SHIFT(KEY_0),              // 41 )
+	KEYCODE_US_SHIFT(KEY_8),              // 42 *
+	KEYCODE_US_SHIFT(KEY_EQUAL),          // 43 +
+	KEYCODE_US(KEY_COMMA),                // 44 ,
+	KEYCODE_US(KEY_MINUS),                // 45 -
+	KEYCODE_US(KEY_PERIOD),               // 46 .
+	KEYCODE_US(KEY_SLASH),                // 47 /
+	KEYCODE_US(KEY_0),                    // 48 0
+	KEYCODE_US(KEY_1),                    // 49 1
+	KEYCODE_US(KEY_2),                    // 50 2
+	KEYCODE_US(KEY_3),                    // 51 3
+	KEYCODE_US(KEY_4),                    // 52 4
+	KEYCODE_US(KEY_5),                    // 53 5
+	KEYCODE_US(KEY_6),                    // 54 6
+	KEYCODE_US(KEY_7),                    // 55 7
+	KEYCODE_US(KEY_8),                    // 56 8
+	KEYCODE_US(KEY_9),                    // 57 9
+	KEYCODE_US_SHIFT(KEY_SEMICOLON),      // 58 :
+	KEYCODE_US(KEY_SEMICOLON),            // 59 ;
+	KEYCODE_US_SHIFT(KEY_COMMA),          // 60 <
+	KEYCODE_US(KEY_EQUAL),                // 61 =
+	KEYCODE_US_SHIFT(KEY_PERIOD),         // 62 >
+	KEYCODE_US_SHIFT(KEY_SLASH),          // 63 ?
+	KEYCODE_US_SHIFT(KEY_2),              // 64 @
+	KEYCODE_US_SHIFT(KEY_A),              // 65 A
+	KEYCODE_US_SHIFT(KEY_B),              // 66 B
+	KEYCODE_US_SHIFT(KEY_C),              // 67 C
+	KEYCODE_US_SHIFT(KEY_D),              // 68 D
+	KEYCODE_US_SHIFT(KEY_E),              // 69 E
+	KEYCODE_US_SHIFT(KEY_F),              // 70 F
+	KEYCODE_US_SHIFT(KEY_G),              // 71 G
+	KEYCODE_US_SHIFT(KEY_H),              // 72 H
+	KEYCODE_US_SHIFT(KEY_I),              // 73 I
+	KEYCODE_US_SHIFT(KEY_J),              // 74 J
+	KEYCODE_US_SHIFT(KEY_K),              // 75 K
+	KEYCODE_US_SHIFT(KEY_L),              // 76 L
+	KEYCODE_US_SHIFT(KEY_M),              // 77 M
+	KEYCODE_US_SHIFT(KEY_N),              // 78 N
+	KEYCODE_US_SHIFT(KEY_O),              // 79 O
+	KEYCODE_US_SHIFT(KEY_P),              // 80 P
+	KEYCODE_US_SHIFT(KEY_Q),              // 81 Q
+	KEYCODE_US_SHIFT(KEY_R),              // 82 R
+	KEYCODE_US_SHIFT(KEY_S),              // 83 S
+	KEYCODE_US_SHIFT(KEY_T),              // 84 T
+	KEYCODE_US_SHIFT(KEY_U),              // 85 U
+	KEYCODE_US_SHIFT(KEY_V),              // 86 V
+	KEYCODE_US_SHIFT(KEY_W),              // 87 W
+	KEYCODE_US_SHIFT(KEY_X),              // 88 X
+	KEYCODE_US_SHIFT(KEY_Y),              // 89 Y
+	KEYCODE_US_SHIFT(KEY_Z),              // 90 Z
+	KEYCODE_US(KEY_LEFT_BRACE),           // 91 [
+	KEYCODE_US(KEY_BACKSLASH),            // 92 \ (backslash)
+	KEYCODE_US(KEY_RIGHT_BRACE),          // 93 ]
+	KEYCODE_US_SHIFT(KEY_6),              // 94 ^
+	KEYCODE_US_SHIFT(KEY_MINUS),          // 95 _
+	KEYCODE_US(KEY_TILDE),                // 96 `
+	KEYCODE_US(KEY_A),                    // 97 a
+	KEYCODE_US(KEY_B),                    // 98 b
+	KEYCODE_US(KEY_C),                    // 99 c
+	KEYCODE_US(KEY_D),                    // 100 d
+	KEYCODE_US(KEY_E),                    // 101 e
+	KEYCODE_US(KEY_F),                    // 102 f
+	KEYCODE_US(KEY_G),                    // 103 g
+	KEYCODE_US(KEY_H),                    // 104 h
+	KEYCODE_US(KEY_I),                    // 105 i
+	KEYCODE_US(KEY_J),                    // 106 j
+	KEYCODE_US(KEY_K),                    // 107 k
+	KEYCODE_US(KEY_L),                    // 108 l
+	KEYCODE_US(KEY_M),                    // 109 m
+	KEYCODE_US(KEY_N),                    // 110 n
+	KEYCODE_US(KEY_O),                    // 111 o
+	KEYCODE_US(KEY_P),                    // 112 p
+	KEYCODE_US(KEY_Q),                    // 113 q
+	KEYCODE_US(KEY_R),                    // 114 r
+	KEYCODE_US(KEY_S),                    // 115 s
+	KEYCODE_US(KEY_T),                    // 116 t
+	KEYCODE_US(KEY_U),                    // 117 u
+	KEYCODE_US(KEY_V),                    // 118 v
+	KEYCODE_US(KEY_W),                    // 119 w
+	KEYCODE_US(KEY_X),                    // 120 x
+	KEYCODE_US(KEY_Y),                    // 121 y
+	KEYCODE_US(KEY_Z),                    // 122 z
+	KEYCODE_US_SHIFT(KEY_LEFT_BRACE),     // 123 {
+	KEYCODE_US_SHIFT(KEY_BACKSLASH),      // 124 |
+	KEYCODE_US_SHIFT(KEY_RIGHT_BRACE),    // 125 }
+	KEYCODE_US_SHIFT(KEY_TILDE),          // 126 ~
+	KEYCODE_US(KEY_BACKSPACE)             // 127 DEL
+};
+
+#endif
@@ -0,0 +1,220 @@
+/* USB EHCI Host for Teensy 3.6 - host simulator loopback device
+ * Copyright 2017 Paul Stoffregen (paul@pjrc.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// A scripted device and its driver, for the simulator's test programs.
+// Buffers given to the driver must be global or static, see host_sim.h.
+// The descriptors are defined here, so include this in only 1 file.
+
+#ifndef HOST_SIM_LOOPBACK_H_
+#define HOST_SIM_LOOPBACK_H_
+
+#include "host_sim.h"
+
+// A vendor specific device with an interrupt IN endpoint, sending a
+// sequence number every 1 ms, and a pair of bulk endpoints which loop
+// back whatever is sent.  Vendor request 1 sets a value, 2 reads it back,
+// and all others stall.
+class LoopbackDevice : public SimDevice {
+public:
+	LoopbackDevice(uint32_t speed)
+		: SimDevice(speed, (speed == 2) ? hs_device : fs_device,
+			(speed == 2) ? hs_config : fs_config, strings, 3) { }
+	virtual int control(const setup_t &setup, uint8_t *data) {
+		if (setup.wRequestAndType == 0x0140) {
+			value = setup.wValue;
+			return 0;
+		}
+		if (setup.wRequestAndType == 0x02C0) {
+			data[0] = value;
+			data[1] = value >> 8;
+			return 2;
+		}
+		return SIM_STALL;
+	}
+	virtual int in(uint32_t endpoint, uint8_t *buf, uint32_t maxlen) {
+		if (endpoint == 1) {
+			if (millis() == last_ms) return SIM_NAK;
+			last_ms = millis();
+			memset(buf, 0, 8);
+			memcpy(buf, &sequence, 4);
+			sequence++;
+			return 8;
+		}
+		if (endpoint == 3) {
+			if (head == tail) return SIM_NAK;
+			uint32_t n = 0;
+			while (n < maxlen && tail != head) {
+				buf[n++] = fifo[tail];
+				tail = (tail + 1) % sizeof(fifo);
+			}
+			return n;
+		}
+		return SIM_STALL;
+	}
+	virtual int out(uint32_t endpoint, const uint8_t *buf, uint32_t len) {
+		if (endpoint != 2) return SIM_STALL;
+		uint32_t space = (tail + sizeof(fifo) - head - 1) % sizeof(fifo);
+		if (len > space) return SIM_NAK;
+		for (uint32_t i=0; i < len; i++) {
+			fifo[head] = buf[i];
+			head = (head + 1) % sizeof(fifo);
+		}
+		return len;
+	}
+	uint32_t sequence = 0;
+	uint32_t last_ms = 0;
+	uint16_t value = 0;
+private:
+	uint8_t fifo[16384];
+	uint32_t head = 0;
+	uint32_t tail = 0;
+	static const uint8_t hs_device[18];
+	static const uint8_t fs_device[18];
+	static const uint8_t hs_config[39];
+	static const uint8_t fs_config[39];
+	static const char * const strings[3];
+};
+
+const uint8_t LoopbackDevice::hs_device[18] = {
+	18, 1, 0x00, 0x02, 0xFF, 0, 0, 64, 0x09, 0x12, 0x01, 0x00, 0x00, 0x01, 1, 2, 3, 1
+};
+const uint8_t LoopbackDevice::fs_device[18] = {
+	18, 1, 0x00, 0x02, 0xFF, 0, 0, 8, 0x09, 0x12, 0x01, 0x00, 0x00, 0x01, 1, 2, 3, 1
+};
+const uint8_t LoopbackDevice::hs_config[39] = {
+	9, 2, 39, 0, 1, 1, 0, 0xC0, 50,
+	9, 4, 0, 0, 3, 0xFF, 0, 0, 0,
+	7, 5, 0x81, 3, 8, 0, 4,     // interrupt IN, every 8 microframes
+	7, 5, 0x02, 2, 0, 2, 0,     // bulk OUT, 512 bytes
+	7, 5, 0x83, 2, 0, 2, 0      // bulk IN, 512 bytes
+};
+const uint8_t LoopbackDevice::fs_config[39] = {
+	9, 2, 39, 0, 1, 1, 0, 0xC0, 50,
+	9, 4, 0, 0, 3, 0xFF, 0, 0, 0,
+	7, 5, 0x81, 3, 8, 0, 1,     // interrupt IN, every 1 ms
+	7, 5, 0x02, 2, 64, 0, 0,    // bulk OUT, 64 bytes
+	7, 5, 0x83, 2, 64, 0, 0     // bulk IN, 64 bytes
+};
+const char * const LoopbackDevice::strings[3] = {
+	"PJRC", "Loopback", "12345"
+};
+
+
+// The driver for LoopbackDevice
+class LoopbackDriver : public USBDriver {
+public:
+	LoopbackDriver(USBHost &host) : timer(this) { init(); }
+	bool send(void *buf, uint32_t len) {
+		out_done = false;
+		return queue_Data_Transfer(outpipe, buf, len, this);
+	}
+	bool receive(void *buf, uint32_t len) {
+		in_done = false;
+		in_length = 0;
+		return queue_Data_Transfer(inpipe, buf, len, this);
+	}
+	bool send(const segment_t *segments, uint32_t count) {
+		out_done = false;
+		return queue_Data_Transfer(outpipe, segments, count, this);
+	}
+	bool receive(const segment_t *segments, uint32_t count) {
+		in_done = false;
+		in_length = 0;
+		return queue_Data_Transfer(inpipe, segments, count, this);
+	}
+	bool request(uint32_t bmRequestType, uint32_t bRequest, uint32_t wValue, uint32_t wLength) {
+		control_done = false;
+		mk_setup(setup, bmRequestType, bRequest, wValue, 0, wLength);
+		return queue_Control_Transfer(device, &setup, control_buf, this);
+	}
+	Device_t * dev() { return device; }
+	USBDriverTimer timer;
+	uint32_t timer_micros = 0;
+	uint32_t int_count = 0;
+	uint32_t int_sequence = 0;
+	bool int_in_order = true;
+	bool out_done = false;
+	bool in_done = false;
+	uint32_t in_length = 0;
+	bool control_done = false;
+	uint32_t control_token = 0;
+	uint8_t control_buf[8];
+protected:
+	virtual bool claim(Device_t *dev, int type, const uint8_t *descriptors, uint32_t len) {
+		if (type != 0 || dev->idVendor != 0x1209 || dev->idProduct != 0x0001) return false;
+		uint32_t bulk = (dev->speed == 2) ? 512 : 64;
+		uint32_t interval = (dev->speed == 2) ? 4 : 1;
+		intpipe = new_Pipe(dev, 3, 1, 1, 8, interval);
+		outpipe = new_Pipe(dev, 2, 2, 0, bulk);
+		inpipe = new_Pipe(dev, 2, 3, 1, bulk);
+		if (!intpipe || !outpipe || !inpipe) return false;
+		intpipe->callback_function = int_callback;
+		outpipe->callback_function = out_callback;
+		inpipe->callback_function = in_callback;
+		int_count = 0;
+		int_in_order = true;
+		queue_Data_Transfer(intpipe, int_buf, 8, this);
+		return true;
+	}
+	virtual void control(const Transfer_t *transfer) {
+		control_token = transfer->qtd.token;
+		control_done = true;
+	}
+	virtual void timer_event(USBDriverTimer *whichTimer) {
+		timer_micros = micros();
+	}
+	virtual void disconnect() {
+		intpipe = outpipe = inpipe = NULL;
+	}
+	void init() {
+		contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
+		contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t), this);
+		driver_ready_for_device(this);
+	}
+	static void int_callback(const Transfer_t *transfer) {
+		LoopbackDriver *d = (LoopbackDriver *)transfer->driver;
+		uint32_t sequence;
+		memcpy(&sequence, d->int_buf, 4);
+		if (d->int_count > 0 && sequence != d->int_sequence + 1) d->int_in_order = false;
+		d->int_sequence = sequence;
+		d->int_count++;
+		queue_Data_Transfer(d->intpipe, d->int_buf, 8, d);
+	}
+	static void out_callback(const Transfer_t *transfer) {
+		((LoopbackDriver *)transfer->driver)->out_done = true;
+	}
+	static void in_callback(const Transfer_t *transfer) {
+		LoopbackDriver *d = (LoopbackDriver *)transfer->driver;
+		d->in_length = transfer->length - ((transfer->qtd.token >> 16) & 0x7FFF);
+		d->in_done = true;
+	}
+	Pipe_t *intpipe = NULL;
+	Pipe_t *outpipe = NULL;
+	Pipe_t *inpipe = NULL;
+	setup_t setup;
+	uint8_t int_buf[8];
+	Pipe_t mypipes[3] __attribute__ ((aligned(32)));
+	Transfer_t mytransfers[12] __attribute__ ((aligned(32)));
+};
+
+#endif
@@ -0,0 +1,276 @@
+/* USB EHCI Host for Teensy 3.6 - memory pool stress test
+ * Copyright 2017 Paul Stoffregen (paul@pjrc.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Tests the lock-free pools, as built for PCs, where a count of items
+// taken shares the list word with the first item's address.
+//
+// First, pool_pop() is "interrupted" where it would do the most harm:
+// after reading the first item's link, before its compare & exchange.
+// The interrupt takes that item and the next, then gives back only the
+// first (the ABA case), so the list begins with the same item.
+//
+// Then allocate_Transfer() and free_Transfer() run from several threads
+// at once, which on a PC really do run at the same time, unlike
+// interrupts and loop() on Teensy.  With only 1 CPU, the threads yield at
+// that same point in pool_pop() now and then.  Each thread has its own
+// driver, with Transfer_t reserved for it, and also borrows from the
+// shared ones until the pool runs out.
+//
+// Every Transfer_t taken is marked with its holder, so one given out
+// twice is found, and a driver refused within its reservation is counted.
+// At the end countFree(), poolStats() and each driver's count must be
+// back where they started.
+//
+// Build on Linux (the pools need everything below 4 GB, so no PIE):
+//   g++ -O2 -std=gnu++14 -fno-rtti -fno-exceptions -fpermissive -w \
+//     -no-pie -fno-pie -pthread -D__IMXRT1062__ -DARDUINO_TEENSY41 \
+//     -DUSBHOST_POOL_TEST \
+//     -I../host_sim -I../.. -o pool_test pool_test.cpp \
+//     ../host_sim/host_sim.cpp ../../ehci.cpp ../../memory.cpp \
+//     ../../enumeration.cpp ../../hub.cpp ../../print.cpp
+//
+// Use:
+//   ./pool_test [rounds per thread]
+//
+// The exit status is the number of failed checks.
+
+#include <atomic>
+#include <thread>   // before Arduino.h, which defines min() & max()
+#include <Arduino.h>
+#include "USBHost_t36.h"
+
+#define THREADS  4
+#define RESERVED 16   // Transfer_t each thread's driver contributes
+#define HOLD     24   // most each thread holds, more than its reservation
+
+#if !defined(USBHOST_POOL_TEST)
+#error "pool_test must be built with -DUSBHOST_POOL_TEST"
+#endif
+
+static uint32_t failures = 0;
+static uint32_t checks = 0;
+
+#define CHECK(cond) do { \
+	checks++; \
+	if (!(cond)) { \
+		printf("  FAIL line %d: %s\n", __LINE__, #cond); \
+		failures++; \
+	} \
+} while (0)
+
+// Transfer_t anyone may borrow
+USBHostConfig<1, 1, 32> sharedmemory;
+
+// A driver which never claims a device, only uses the pool
+class PoolUser : public USBDriver {
+public:
+	PoolUser() {
+		contribute_Transfers(mytransfers, RESERVED, this);
+	}
+	// Transfer_t's length is only set by the queue functions, so it can
+	// hold who has this one
+	Transfer_t * take(bool own, uint32_t owner) {
+		Transfer_t *t = allocate_Transfer(own ? this : NULL);
+		if (!t) return NULL;
+		if (__atomic_exchange_n(&t->length, owner, __ATOMIC_RELAXED) != 0) twice++;
+		return t;
+	}
+	void give(Transfer_t *t, uint32_t owner) {
+		if (__atomic_exchange_n(&t->length, 0, __ATOMIC_RELAXED) != owner) twice++;
+		free_Transfer(t);
+	}
+	uint32_t used() { return transfers_used; }
+	uint32_t twice = 0;
+	uint32_t refused = 0;
+	uint32_t empty = 0;
+protected:
+	virtual bool claim(Device_t *device, int type, const uint8_t *descriptors, uint32_t len) {
+		return false;
+	}
+	virtual void disconnect() {
+	}
+	Transfer_t mytransfers[RESERVED] __attribute__ ((aligned(32)));
+};
+
+static PoolUser users[THREADS];
+static std::atomic<bool> go(false);
+static std::atomic<uint32_t> finished(0);
+
+// What pool_test_interrupt() does
+enum { NONE, ABA, YIELD };
+static volatile int interrupt_mode = NONE;
+static Transfer_t *aba_held = NULL;
+#define ABA_OWNER 0xABA
+
+// Called by pool_pop() between reading the first item's link and the
+// compare & exchange.
+void pool_test_interrupt(void)
+{
+	static thread_local bool busy = false;
+	static thread_local uint32_t calls = 0;
+	if (busy) return; // not while the interrupt itself uses the pool
+	if (interrupt_mode == ABA) {
+		interrupt_mode = NONE;
+		busy = true;
+		Transfer_t *first = users[1].take(false, ABA_OWNER);
+		aba_held = users[1].take(false, ABA_OWNER);
+		users[1].give(first, ABA_OWNER);
+		busy = false;
+	} else if (interrupt_mode == YIELD) {
+		if ((++calls & 15) == 0) std::this_thread::yield();
+	}
+}
+
+// xorshift, so each thread has its own numbers without locking
+static uint32_t rnd(uint32_t &state)
+{
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+static void worker(uint32_t n, uint32_t rounds)
+{
+	PoolUser &user = users[n];
+	const uint32_t owner = n + 1;
+	Transfer_t *held[HOLD];
+	bool own[HOLD];
+	uint32_t count = 0, own_count = 0;
+	uint32_t state = 0x9E3779B9 * owner;
+	while (!go) ;
+	for (uint32_t i=0; i < rounds; i++) {
+		uint32_t r = rnd(state);
+		if (count < HOLD && (count == 0 || (r & 1))) {
+			// mostly from this driver's count, sometimes as USBHost itself
+			bool mine = (r & 6) != 0;
+			Transfer_t *t = user.take(mine, owner);
+			if (t) {
+				held[count] = t;
+				own[count++] = mine;
+				if (mine) own_count++;
+			} else {
+				if (mine && own_count < RESERVED) user.refused++;
+				user.empty++;
+			}
+		} else {
+			// give back any one held, not only the last
+			uint32_t k = (r >> 8) % count;
+			if (own[k]) own_count--;
+			user.give(held[k], owner);
+			held[k] = held[--count];
+			own[k] = own[count];
+		}
+	}
+	while (count > 0) user.give(held[--count], owner);
+	finished++;
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t rounds = (argc > 1) ? atol(argv[1]) : 2000000;
+	uint32_t before[4], after[4];
+	poolstats_t devices, pipes, trans, strs;
+
+	USBHost::countFree(before[0], before[1], before[2], before[3]);
+	USBHost::poolStats(devices, pipes, trans, strs, true);
+	uint32_t free_before = trans.free;
+	CHECK(before[2] == 32 + THREADS * RESERVED);
+	CHECK(free_before == before[2]);
+
+	printf("interrupted pool_pop\n");
+	interrupt_mode = ABA;
+	Transfer_t *t1 = users[0].take(true, 1);
+	CHECK(t1 != NULL && aba_held != NULL && t1 != aba_held);
+	CHECK(interrupt_mode == NONE);
+	// the held one must not be first on the list
+	Transfer_t *t2 = users[0].take(true, 1);
+	CHECK(t2 != NULL && t2 != aba_held && t2 != t1);
+	if (t2) users[0].give(t2, 1);
+	if (t1) users[0].give(t1, 1);
+	if (aba_held) users[1].give(aba_held, ABA_OWNER);
+	CHECK(users[0].twice == 0 && users[1].twice == 0);
+	if (failures) {
+		// the list may now loop back on itself, so countFree() can't be used
+		printf("%u checks, %u failed\n", checks, failures);
+		return failures;
+	}
+	USBHost::countFree(after[0], after[1], after[2], after[3]);
+	CHECK(memcmp(before, after, sizeof(before)) == 0);
+
+	printf("%d threads, %u rounds each\n", THREADS, rounds);
+	interrupt_mode = YIELD;
+	std::thread threads[THREADS];
+	for (uint32_t n=0; n < THREADS; n++) {
+		threads[n] = std::thread(worker, n, rounds);
+	}
+	go = true;
+	// a broken list can leave a thread looping forever, so don't wait long
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(60);
+	while (finished < THREADS && std::chrono::steady_clock::now() < deadline) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	CHECK(finished == THREADS);
+	if (finished < THREADS) {
+		printf("%u checks, %u failed\n", checks, failures);
+		fflush(stdout);
+		_Exit(failures);
+	}
+	for (uint32_t n=0; n < THREADS; n++) {
+		threads[n].join();
+	}
+	interrupt_mode = NONE;
+	uint32_t empty = 0;
+	for (uint32_t n=0; n < THREADS; n++) {
+		CHECK(users[n].twice == 0);
+		CHECK(users[n].refused == 0);
+		CHECK(users[n].used() == 0);
+		empty += users[n].empty;
+	}
+	if (failures) {
+		printf("%u checks, %u failed\n", checks, failures);
+		return failures;
+	}
+
+	USBHost::countFree(after[0], after[1], after[2], after[3]);
+	USBHost::poolStats(devices, pipes, trans, strs);
+	printf("pool empty %u times, lowest free %u of %u\n", empty, trans.min_free, trans.total);
+	CHECK(memcmp(before, after, sizeof(before)) == 0);
+	CHECK(trans.free == free_before);
+
+	// and everyone can still take everything they should
+	Transfer_t *t[THREADS * RESERVED];
+	uint32_t count = 0;
+	for (uint32_t n=0; n < THREADS; n++) {
+		for (uint32_t i=0; i < RESERVED; i++) {
+			t[count] = users[n].take(true, n + 1);
+			CHECK(t[count] != NULL);
+			if (t[count]) count++;
+		}
+	}
+	for (uint32_t i=0; i < count; i++) users[i / RESERVED].give(t[i], i / RESERVED + 1);
+	for (uint32_t n=0; n < THREADS; n++) CHECK(users[n].twice == 0);
+
+	printf("%u checks, %u failed\n", checks, failures);
+	return failures;
+}
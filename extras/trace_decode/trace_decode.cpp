@@ -0,0 +1,208 @@
+/* USB EHCI Host for Teensy 3.6 - trace buffer decoder
+ * Copyright 2017 Paul Stoffregen (paul@pjrc.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Turns the output of USBHost::traceDump() into a readable timeline, and
+// optionally a JSON file for Chrome's about:tracing or ui.perfetto.dev
+//
+// Build on Linux or MacOS:
+//   g++ -O2 -o trace_decode trace_decode.cpp
+//
+// Use:
+//   1: #define USBHOST_TRACE in USBHost_t36.h
+//   2: call USBHost::traceDump(Serial) after the problem happens
+//   3: save the serial monitor output to a file (other text is ignored)
+//   4: ./trace_decode capture.txt [trace.json]
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+// must match USBHost::trace_event_t in USBHost_t36.h
+static const char *event_names[] = {
+	"?", "isr", "isr_exit", "port_change", "queue", "complete", "halt",
+	"isochronous", "timer", "enumeration"
+};
+#define NUM_EVENTS (sizeof(event_names) / sizeof(event_names[0]))
+
+typedef struct {
+	uint32_t seq;
+	uint32_t cycles;
+	uint32_t event;
+	uint32_t ptr;
+	uint32_t value;
+	double   us; // time since the first record
+} record_t;
+
+// USBSTS bits, EHCI 2.3.2 (and NXP's extra bits for timers 0 & 1)
+static void print_usbsts(char *out, size_t size, uint32_t stat)
+{
+	static const struct { uint32_t mask; const char *name; } bits[] = {
+		{1 << 0, "UI"}, {1 << 1, "UEI"}, {1 << 2, "PCI"}, {1 << 3, "FRI"},
+		{1 << 4, "SEI"}, {1 << 5, "AAI"}, {1 << 18, "UAI"}, {1 << 19, "UPI"},
+		{1 << 24, "TI0"}, {1 << 25, "TI1"}
+	};
+	size_t len = snprintf(out, size, "USBSTS=%08X", stat);
+	for (size_t i=0; i < sizeof(bits) / sizeof(bits[0]) && len < size; i++) {
+		if (stat & bits[i].mask) len += snprintf(out + len, size - len, " %s", bits[i].name);
+	}
+}
+
+// qTD token, EHCI 3.5.3
+static void print_token(char *out, size_t size, uint32_t token)
+{
+	static const char *pid[] = {"OUT", "IN", "SETUP", "?"};
+	size_t len = snprintf(out, size, "token=%08X %s len=%u%s", token,
+		pid[(token >> 8) & 3], (token >> 16) & 0x7FFF,
+		(token & 0x8000) ? " IOC" : "");
+	static const struct { uint32_t mask; const char *name; } bits[] = {
+		{0x80, "Active"}, {0x40, "Halted"}, {0x20, "BufferErr"},
+		{0x10, "Babble"}, {0x08, "XactErr"}, {0x04, "MissedUframe"}
+	};
+	for (size_t i=0; i < sizeof(bits) / sizeof(bits[0]) && len < size; i++) {
+		if (token & bits[i].mask) len += snprintf(out + len, size - len, " %s", bits[i].name);
+	}
+}
+
+static void describe(char *out, size_t size, const record_t &r)
+{
+	switch (r.event) {
+	  case 1: print_usbsts(out, size, r.value); break;
+	  case 2: out[0] = 0; break;
+	  case 3: snprintf(out, size, "PORTSC1=%08X%s%s", r.value,
+			(r.value & 1) ? " connected" : " disconnected",
+			(r.value & 4) ? " enabled" : ""); break;
+	  case 4:
+	  case 5: {
+		char tok[128];
+		print_token(tok, sizeof(tok), r.value);
+		snprintf(out, size, "qTD %08X %s", r.ptr, tok);
+		} break;
+	  case 6: {
+		char tok[128];
+		print_token(tok, sizeof(tok), r.value);
+		snprintf(out, size, "pipe %08X %s", r.ptr, tok);
+		} break;
+	  case 7: snprintf(out, size, "iso %08X frame %u", r.ptr, r.value); break;
+	  case 8: snprintf(out, size, "timer %08X tick %u", r.ptr, r.value); break;
+	  case 9: snprintf(out, size, "device %08X state %u", r.ptr, r.value); break;
+	  default: snprintf(out, size, "ptr=%08X value=%08X", r.ptr, r.value);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "Usage: %s capture.txt [trace.json]\n", argv[0]);
+		return 1;
+	}
+	FILE *in = fopen(argv[1], "r");
+	if (!in) {
+		perror(argv[1]);
+		return 1;
+	}
+	// find the last dump in the file, as the capture may hold several
+	std::vector<record_t> records;
+	double cpu_hz = 0;
+	bool in_dump = false;
+	char line[256];
+	while (fgets(line, sizeof(line), in)) {
+		unsigned long hz;
+		if (sscanf(line, "USBHost_t36 trace %lu", &hz) == 1) {
+			records.clear();
+			cpu_hz = hz;
+			in_dump = true;
+			continue;
+		}
+		if (!in_dump) continue;
+		if (strncmp(line, "end", 3) == 0) {
+			in_dump = false;
+			continue;
+		}
+		record_t r;
+		if (sscanf(line, "%u %x %u %x %x", &r.seq, &r.cycles, &r.event,
+		  &r.ptr, &r.value) == 5) {
+			records.push_back(r);
+		}
+	}
+	fclose(in);
+	if (records.empty() || cpu_hz <= 0) {
+		fprintf(stderr, "No trace found in %s\n", argv[1]);
+		return 1;
+	}
+	// the cycle counter wraps every few seconds, so time is the sum of
+	// the (unsigned 32 bit) differences between consecutive records
+	double us = 0;
+	for (size_t i=0; i < records.size(); i++) {
+		if (i > 0) {
+			uint32_t delta = records[i].cycles - records[i-1].cycles;
+			us += delta * 1e6 / cpu_hz;
+			if (records[i].seq != records[i-1].seq + 1) {
+				printf("  ... %u records lost\n", records[i].seq - records[i-1].seq - 1);
+			}
+		}
+		records[i].us = us;
+		const record_t &r = records[i];
+		char desc[256];
+		describe(desc, sizeof(desc), r);
+		const char *name = (r.event < NUM_EVENTS) ? event_names[r.event] : "?";
+		printf("%12.3f us  %-12s %s\n", r.us, name, desc);
+	}
+	if (argc < 3) return 0;
+
+	FILE *out = fopen(argv[2], "w");
+	if (!out) {
+		perror(argv[2]);
+		return 1;
+	}
+	// Chrome trace event format: the interrupt is shown as a duration,
+	// everything else as instant events, on separate rows by kind.
+	fprintf(out, "{\"traceEvents\":[\n");
+	bool in_isr = false;
+	for (size_t i=0; i < records.size(); i++) {
+		const record_t &r = records[i];
+		char desc[256];
+		describe(desc, sizeof(desc), r);
+		const char *name = (r.event < NUM_EVENTS) ? event_names[r.event] : "?";
+		const char *sep = (i > 0) ? ",\n" : "";
+		if (r.event == 1) {
+			if (in_isr) fprintf(out, "%s{\"name\":\"isr\",\"ph\":\"E\",\"pid\":1,\"tid\":1,\"ts\":%.3f}", sep, r.us), sep = ",\n";
+			fprintf(out, "%s{\"name\":\"isr\",\"ph\":\"B\",\"pid\":1,\"tid\":1,\"ts\":%.3f,"
+				"\"args\":{\"status\":\"%s\"}}", sep, r.us, desc);
+			in_isr = true;
+		} else if (r.event == 2) {
+			fprintf(out, "%s{\"name\":\"isr\",\"ph\":\"E\",\"pid\":1,\"tid\":1,\"ts\":%.3f}", sep, r.us);
+			in_isr = false;
+		} else {
+			fprintf(out, "%s{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%u,"
+				"\"ts\":%.3f,\"args\":{\"detail\":\"%s\"}}", sep, name, r.event, r.us, desc);
+		}
+	}
+	if (in_isr) {
+		fprintf(out, ",\n{\"name\":\"isr\",\"ph\":\"E\",\"pid\":1,\"tid\":1,\"ts\":%.3f}",
+			records.back().us);
+	}
+	fprintf(out, "\n]}\n");
+	fclose(out);
+	return 0;
+}
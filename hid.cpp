@@ -38,7 +38,7 @@
 void USBHIDParser::init()
 {
 	contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
-	contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
+	contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t), this);
 	contribute_String_Buffers(mystring_bufs, sizeof(mystring_bufs)/sizeof(strbuf_t));
 	driver_ready_for_device(this);
 }
@@ -143,6 +143,11 @@ bool USBHIDParser::claim(Device_t *dev, int type, const uint8_t *descriptors, ui
 		}
 		out_pipe->callback_function = out_callback;
 	}
+	// reports are received into report_ring, which has 64 bytes for each.
+	// A high speed device with a larger endpoint may still send short
+	// reports, but anything over 64 bytes is a babble error, rather than
+	// being written past the end of the buffer.
+	if (in_size > sizeof(report_ring[0])) in_size = sizeof(report_ring[0]);
 	in_pipe->callback_function = in_callback;
 	for (uint32_t i=0; i < TOPUSAGE_LIST_LEN; i++) {
 		//topusage_list[i] = 0;
@@ -172,8 +177,12 @@ void USBHIDParser::control(const Transfer_t *transfer)
 	if (mesg == 0x22000681 && transfer->length == descsize) { // HID report descriptor
 		println("  got report descriptor");
 		parse();
-		queue_Data_Transfer(in_pipe, report, in_size, this);
-		queue_Data_Transfer(in_pipe, report2, in_size, this);
+		// report_ring holds the 2 qTDs of the persistent ring, in_size
+		// bytes apart, which fits because claim() limited in_size to 64
+		if (!start_Persistent(in_pipe, report_ring, in_size, 2, this)) {
+			queue_Data_Transfer(in_pipe, report_ring[0], in_size, this);
+			queue_Data_Transfer(in_pipe, report_ring[1], in_size, this);
+		}
 		if (device->idVendor == 0x054C && 
 				((device->idProduct == 0x0268) || (device->idProduct == 0x042F)/* || (device->idProduct == 0x03D5)*/)) {
 			println("send special PS3 feature command");
@@ -243,8 +252,9 @@ void USBHIDParser::in_data(const Transfer_t *transfer)
 			}
 		}
 	}
-	if (buf == report2) queue_Data_Transfer(in_pipe, report2, in_size, this);
-	else queue_Data_Transfer(in_pipe, report, in_size, this);
+	if (in_pipe->persistent) return; // EHCI reuses the same qTD
+	if (buf == report_ring[1]) queue_Data_Transfer(in_pipe, report_ring[1], in_size, this);
+	else queue_Data_Transfer(in_pipe, report_ring[0], in_size, this);
 }
 
 
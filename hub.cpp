@@ -36,7 +36,8 @@ void USBHub::init()
 {
 	contribute_Devices(mydevices, sizeof(mydevices)/sizeof(Device_t));
 	contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
-	contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
+	contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t), this);
+	contribute_Transfers(mydevice_halts, sizeof(mydevice_halts)/sizeof(Transfer_t));
 	contribute_String_Buffers(mystring_bufs, sizeof(mystring_bufs)/sizeof(strbuf_t));
 	driver_ready_for_device(this);
 }
@@ -256,7 +257,10 @@ void USBHub::control(const Transfer_t *transfer)
 		if (port == numports && changepipe == NULL) {
 			println("power turned on to all ports");
 			println("device addr = ", device->address);
+			// the pipe's halt qTD is ours, as if made in claim()
+			claiming_driver = this;
 			changepipe = new_Pipe(device, 3, endpoint, 1, 1, interval);
+			claiming_driver = NULL;
 			println("pipe cap1 = ", changepipe->qh.capabilities[0], HEX);
 			changepipe->callback_function = callback;
 			queue_Data_Transfer(changepipe, &changebits, 1, this);
@@ -459,7 +463,11 @@ void USBHub::timer_event(USBDriverTimer *timer)
 				println("PORT_RECOVERY");
 				// begin enumeration process
 				uint8_t speed = port_doing_reset_speed;
-				devicelist[port-1] = new_Device(speed, device->address, port);
+				Device_t *dev;
+				dev = new_Device(speed, device->address, port, device);
+				// Multi-TT hubs have a TT for each port
+				if (dev && device->speed == 2 && protocol == 2) dev->tt_port = port;
+				devicelist[port-1] = dev;
 				// TODO: if return is NULL, what to do?  Panic?
 				// Can we disable the port?  Will this device
 				// play havoc if it sits unconfigured responding
@@ -40,90 +40,246 @@
 // allocates Device_t, the memory actually comes from these structures
 // physically located within the device driver instances.  The usage
 // model looks like traditional malloc/free dynamic memory on the heap,
-// but in fact it's a simple memory pool from the drivers.
+// but in fact it's a simple memory pool from the drivers.  Programs can
+// also add a stated amount with USBHostConfig, see USBHost_t36.h.
 //
 // Timing is deterministic and fast, because each pool allocates only
 // a single fixed size object.  In theory, each driver should contribute
 // the number of items it will use, so we should not ever end up with
 // a situation where an item can't be allocated when it's needed.  Well,
 // unless there's a bug or oversight...
+//
+// Transfer_t are the exception, where drivers use a varying number as
+// they queue and complete transfers.  So one busy driver doesn't starve
+// others, each driver may always use as many as it contributed.  Beyond
+// that, it may borrow from the Transfer_t which aren't reserved by other
+// drivers, except for a few kept for enumeration.  Each Transfer_t's
+// driver field remembers whose count it belongs to, until it's freed.
+
+
+// Lists of "free" memory.  On ARM, each is a pointer to the first free
+// item.  Other CPUs, as in the host simulator, have no LDREX & STREX, so
+// the first item's 32 bit address shares a 64 bit word with a count of
+// items taken from the list, see pool_pop().
+#if defined(__arm__)
+typedef void * pool_list_t;
+static inline void * pool_first(pool_list_t list) { return list; }
+#else
+typedef uint64_t pool_list_t;
+static inline void * pool_first(pool_list_t list) { return (void *)(uintptr_t)(uint32_t)list; }
+#endif
+static pool_list_t free_Device_list = 0;
+static pool_list_t free_Pipe_list = 0;
+static pool_list_t free_Transfer_list = 0;
+static pool_list_t free_Isochronous_list = 0;
+static pool_list_t free_strbuf_list = 0;
+#if defined(USBHOST_POOL_TEST)
+extern void pool_test_interrupt(void);
+#endif
+#define TRANSFER_LINK offsetof(Transfer_t, next_followup)
+// Usage of each pool, for poolStats()
+static poolstats_t Device_stats;
+static poolstats_t Pipe_stats;
+static poolstats_t Transfer_stats;
+static poolstats_t strbuf_stats;
+// Transfer_t reserved by drivers and not in use, so not for borrowing
+static uint32_t transfer_reserve_unused = 0;
+// Transfer_t drivers may not borrow, so enumeration can always proceed
+#if defined(USBHOST_TRANSFER_RESERVE)
+#define TRANSFER_RESERVE (USBHOST_TRANSFER_RESERVE)
+#else
+#define TRANSFER_RESERVE 3 // setup, data & status of 1 control transfer
+#endif
+// There is no memory here.  Each USBHostController, when it begins, gives
+// the pools a Device_t, Pipe_t & 3 Transfer_t for its root port's device.
+
+// The free lists are lock-free stacks, so any code, interrupt or not,
+// may allocate and free.  Each free item links to the next with a pointer
+// at "link" bytes into the item.  Transfer_t keeps it in next_followup,
+// so the qTD's cache line is left alone while the Transfer_t is free.
+// Removing an item uses LDREX & STREX around reading its link to the
+// next item.  If an interrupt runs in between, even one which takes this
+// same item and puts it back (the "ABA" problem), the exception clears
+// the exclusive monitor, so STREX fails and we retry with the list as it
+// is now.
+static void * pool_pop(pool_list_t *list, uint32_t link)
+{
+#if defined(__arm__)
+	uint32_t item, fail;
+	do {
+		asm volatile("ldrex %0, [%1]" : "=r" (item) : "r" (list) : "memory");
+		if (!item) {
+			asm volatile("clrex" ::: "memory");
+			return NULL;
+		}
+		uint32_t next = *(uint32_t *)(item + link);
+		asm volatile("strex %0, %2, [%1]" : "=&r" (fail) : "r" (list), "r" (next) : "memory");
+	} while (fail);
+	return (void *)item;
+#else
+	// Each pop adds 1 to the count in the upper half, so if this item is
+	// taken and put back while we read its link, the list word differs
+	// and compare & exchange fails, much as STREX would.
+	pool_list_t head = __atomic_load_n(list, __ATOMIC_ACQUIRE);
+	pool_list_t newhead;
+	void *item;
+	do {
+		item = pool_first(head);
+		if (!item) return NULL;
+		void *next = __atomic_load_n((void **)((uint8_t *)item + link), __ATOMIC_RELAXED);
+#if defined(USBHOST_POOL_TEST)
+		pool_test_interrupt(); // extras/pool_test may change the list here
+#endif
+		newhead = ((head >> 32) + 1) << 32 | (uint32_t)(uintptr_t)next;
+	} while (!__atomic_compare_exchange_n(list, &head, newhead, true,
+		__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+	return item;
+#endif
+}
+
+// Adding an item can't suffer from ABA, so compare & exchange is enough.
+static void pool_push(pool_list_t *list, uint32_t link, void *item)
+{
+	pool_list_t head = __atomic_load_n(list, __ATOMIC_RELAXED);
+	pool_list_t newhead;
+	do {
+		__atomic_store_n((void **)((uint8_t *)item + link), pool_first(head), __ATOMIC_RELAXED);
+#if defined(__arm__)
+		newhead = item;
+#else
+		newhead = (head & 0xFFFFFFFF00000000ull) | (uint32_t)(uintptr_t)item;
+#endif
+	} while (!__atomic_compare_exchange_n(list, &head, newhead, true,
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
 
+// Claim 1 of the free count, if more than keep are free.  Items are
+// counted only after they're on the list, and uncounted before they're
+// taken, so after this succeeds pool_pop() can't find the list empty.
+// The number to keep may also include a count of reservations, which is
+// read after the free count each time, so the check is never too loose.
+static bool pool_claim(poolstats_t &stats, uint32_t keep, const uint32_t *reserve=NULL)
+{
+	uint16_t n = __atomic_load_n(&stats.free, __ATOMIC_ACQUIRE);
+	do {
+		uint32_t k = keep;
+		if (reserve) k += __atomic_load_n(reserve, __ATOMIC_ACQUIRE);
+		if (n <= k) {
+			if (stats.failures < 0xFFFF) __atomic_fetch_add(&stats.failures, 1, __ATOMIC_RELAXED);
+			return false;
+		}
+	} while (!__atomic_compare_exchange_n(&stats.free, &n, n - 1, true,
+		__ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+	uint16_t min = __atomic_load_n(&stats.min_free, __ATOMIC_RELAXED);
+	while (n - 1 < min && !__atomic_compare_exchange_n(&stats.min_free, &min, n - 1,
+		true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) ;
+	return true;
+}
 
-// Lists of "free" memory
-static Device_t * free_Device_list = NULL;
-static Pipe_t * free_Pipe_list = NULL;
-static Transfer_t * free_Transfer_list = NULL;
-static strbuf_t * free_strbuf_list = NULL;
-// A small amount of non-driver memory, just to get things started
-// TODO: is this really necessary?  Can these be eliminated, so we
-// use only memory from the drivers?
-static Device_t memory_Device[1];
-static Pipe_t memory_Pipe[1] __attribute__ ((aligned(32)));
-static Transfer_t memory_Transfer[4] __attribute__ ((aligned(32)));
+static void * pool_allocate(pool_list_t *list, poolstats_t &stats, USBDriver *driver)
+{
+	if (pool_claim(stats, 0)) return pool_pop(list, 0);
+	stats.failed_driver = driver;
+	return NULL;
+}
 
-void USBHost::init_Device_Pipe_Transfer_memory(void)
+static void pool_free(pool_list_t *list, uint32_t link, poolstats_t &stats, void *item)
 {
-	contribute_Devices(memory_Device, sizeof(memory_Device)/sizeof(Device_t));
-	contribute_Pipes(memory_Pipe, sizeof(memory_Pipe)/sizeof(Pipe_t));
-	contribute_Transfers(memory_Transfer, sizeof(memory_Transfer)/sizeof(Transfer_t));
+	pool_push(list, link, item);
+	__atomic_fetch_add(&stats.free, 1, __ATOMIC_RELEASE);
 }
 
 Device_t * USBHost::allocate_Device(void)
 {
-	Device_t *device = free_Device_list;
-	if (device) free_Device_list = *(Device_t **)device;
-	return device;
+	return (Device_t *)pool_allocate(&free_Device_list, Device_stats, NULL);
 }
 
 void USBHost::free_Device(Device_t *device)
 {
-	*(Device_t **)device = free_Device_list;
-	free_Device_list = device;
+	pool_free(&free_Device_list, 0, Device_stats, device);
 }
 
-Pipe_t * USBHost::allocate_Pipe(void)
+Pipe_t * USBHost::allocate_Pipe(USBDriver *driver)
 {
-	Pipe_t *pipe = free_Pipe_list;
-	if (pipe) free_Pipe_list = *(Pipe_t **)pipe;
-	return pipe;
+	return (Pipe_t *)pool_allocate(&free_Pipe_list, Pipe_stats, driver);
 }
 
 void USBHost::free_Pipe(Pipe_t *pipe)
 {
-	*(Pipe_t **)pipe = free_Pipe_list;
-	free_Pipe_list = pipe;
+	pool_free(&free_Pipe_list, 0, Pipe_stats, pipe);
 }
 
-Transfer_t * USBHost::allocate_Transfer(void)
+// driver is who the Transfer_t is for, or NULL for USBHost itself.
+// A driver within its reservation is always given one.  Otherwise it must
+// leave enough for everyone's unused reservations and enumeration.  To
+// stay correct when interrupted, reservations are counted as unused
+// before a Transfer_t is freed, and as used only after one is claimed.
+Transfer_t * USBHost::allocate_Transfer(USBDriver *driver)
 {
-	Transfer_t *transfer = free_Transfer_list;
-	if (transfer) free_Transfer_list = *(Transfer_t **)transfer;
+	bool reserved = false;
+	if (driver) {
+		uint16_t used = __atomic_load_n(&driver->transfers_used, __ATOMIC_RELAXED);
+		do {
+			reserved = (used < driver->transfers_reserved);
+		} while (!__atomic_compare_exchange_n(&driver->transfers_used, &used, used + 1,
+			true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	}
+	bool ok;
+	if (reserved) {
+		ok = pool_claim(Transfer_stats, 0);
+	} else {
+		ok = pool_claim(Transfer_stats, driver ? TRANSFER_RESERVE : 0,
+			&transfer_reserve_unused);
+	}
+	if (!ok) {
+		if (driver) __atomic_fetch_sub(&driver->transfers_used, 1, __ATOMIC_RELAXED);
+		Transfer_stats.failed_driver = driver;
+		return NULL;
+	}
+	if (reserved) __atomic_fetch_sub(&transfer_reserve_unused, 1, __ATOMIC_RELEASE);
+	Transfer_t *transfer = (Transfer_t *)pool_pop(&free_Transfer_list, TRANSFER_LINK);
+	transfer->driver = driver;
 	return transfer;
 }
 
 void USBHost::free_Transfer(Transfer_t *transfer)
 {
-	*(Transfer_t **)transfer = free_Transfer_list;
-	free_Transfer_list = transfer;
+	USBDriver *driver = transfer->driver;
+	if (driver) {
+		// the reservation is available again, unless this one was borrowed
+		uint16_t used = __atomic_fetch_sub(&driver->transfers_used, 1, __ATOMIC_RELAXED);
+		if (used <= driver->transfers_reserved) {
+			__atomic_fetch_add(&transfer_reserve_unused, 1, __ATOMIC_RELEASE);
+		}
+	}
+	pool_free(&free_Transfer_list, TRANSFER_LINK, Transfer_stats, transfer);
+}
+
+Isochronous_t * USBHost::allocate_Isochronous(void)
+{
+	return (Isochronous_t *)pool_pop(&free_Isochronous_list, 0);
+}
+
+void USBHost::free_Isochronous(Isochronous_t *iso)
+{
+	pool_push(&free_Isochronous_list, 0, iso);
 }
 
 strbuf_t * USBHost::allocate_string_buffer(void)
 {
-	strbuf_t *strbuf = free_strbuf_list;
+	strbuf_t *strbuf = (strbuf_t *)pool_allocate(&free_strbuf_list, strbuf_stats, NULL);
 	if (strbuf) {
-		free_strbuf_list = *(strbuf_t **)strbuf;
 		strbuf->iStrings[strbuf_t::STR_ID_MAN] = 0;  // Set indexes into string buffer to say not there...
 		strbuf->iStrings[strbuf_t::STR_ID_PROD] = 0;
 		strbuf->iStrings[strbuf_t::STR_ID_SERIAL] = 0;
 		strbuf->buffer[0] = 0;	// have trailing NULL..
-	} 
+	}
 	return strbuf;
 }
 
 void USBHost::free_string_buffer(strbuf_t *strbuf) 
 {
-	*(strbuf_t **)strbuf = free_strbuf_list;
-	free_strbuf_list = strbuf;
+	pool_free(&free_strbuf_list, 0, strbuf_stats, strbuf);
 }
 
 void USBHost::contribute_Devices(Device_t *devices, uint32_t num)
@@ -132,6 +288,8 @@ void USBHost::contribute_Devices(Device_t *devices, uint32_t num)
 	for (Device_t *device = devices ; device < end; device++) {
 		free_Device(device);
 	}
+	Device_stats.total += num;
+	__atomic_fetch_add(&Device_stats.min_free, num, __ATOMIC_RELAXED);
 }
 
 void USBHost::contribute_Pipes(Pipe_t *pipes, uint32_t num)
@@ -140,15 +298,35 @@ void USBHost::contribute_Pipes(Pipe_t *pipes, uint32_t num)
 	for (Pipe_t *pipe = pipes; pipe < end; pipe++) {
 		free_Pipe(pipe);
 	}
-
+	Pipe_stats.total += num;
+	__atomic_fetch_add(&Pipe_stats.min_free, num, __ATOMIC_RELAXED);
 }
 
-void USBHost::contribute_Transfers(Transfer_t *transfers, uint32_t num)
+// With an owner, these Transfer_t are reserved for that driver.  Drivers
+// contribute from their constructors, before they have used any.
+void USBHost::contribute_Transfers(Transfer_t *transfers, uint32_t num, USBDriver *owner)
 {
 	Transfer_t *end = transfers + num;
 	for (Transfer_t *transfer = transfers ; transfer < end; transfer++) {
+		transfer->driver = NULL;
 		free_Transfer(transfer);
 	}
+	Transfer_stats.total += num;
+	__atomic_fetch_add(&Transfer_stats.min_free, num, __ATOMIC_RELAXED);
+	if (owner) {
+		owner->transfers_reserved += num;
+		__atomic_fetch_add(&transfer_reserve_unused, num, __ATOMIC_RELEASE);
+	}
+}
+
+// Only drivers for isochronous devices need to contribute these.
+// There is no starting memory, as most programs never use them.
+void USBHost::contribute_Isochronous(Isochronous_t *isochronous, uint32_t num)
+{
+	Isochronous_t *end = isochronous + num;
+	for (Isochronous_t *iso = isochronous ; iso < end; iso++) {
+		free_Isochronous(iso);
+	}
 }
 
 void USBHost::contribute_String_Buffers(strbuf_t *strbufs, uint32_t num)
@@ -157,6 +335,8 @@ void USBHost::contribute_String_Buffers(strbuf_t *strbufs, uint32_t num)
 	for (strbuf_t *str = strbufs ; str < end; str++) {
 		free_string_buffer(str);
 	}
+	strbuf_stats.total += num;
+	__atomic_fetch_add(&strbuf_stats.min_free, num, __ATOMIC_RELAXED);
 }
 
 // for debugging, hopefully never needed...
@@ -164,22 +344,22 @@ void USBHost::countFree(uint32_t &devices, uint32_t &pipes, uint32_t &transfers,
 {
 	uint32_t ndev=0, npipe=0, ntransfer=0, nstr=0;
 	__disable_irq();
-	Device_t *dev = free_Device_list;
+	Device_t *dev = (Device_t *)pool_first(free_Device_list);
 	while (dev) {
 		ndev++;
 		dev = *(Device_t **)dev;
 	}
-	Pipe_t *pipe = free_Pipe_list;
+	Pipe_t *pipe = (Pipe_t *)pool_first(free_Pipe_list);
 	while (pipe) {
 		npipe++;
 		pipe = *(Pipe_t **)pipe;
 	}
-	Transfer_t *transfer = free_Transfer_list;
+	Transfer_t *transfer = (Transfer_t *)pool_first(free_Transfer_list);
 	while (transfer) {
 		ntransfer++;
-		transfer = *(Transfer_t **)transfer;
+		transfer = transfer->next_followup;
 	}
-	strbuf_t *str = free_strbuf_list;
+	strbuf_t *str = (strbuf_t *)pool_first(free_strbuf_list);
 	while (str) {
 		nstr++;
 		str = *(strbuf_t **)str;
@@ -190,3 +370,25 @@ void USBHost::countFree(uint32_t &devices, uint32_t &pipes, uint32_t &transfers,
 	transfers = ntransfer;
 	strs = nstr;
 }
+
+// Usage of the pools since startup, or since the last reset.  Unlike
+// countFree(), this also shows how close each pool came to running out,
+// and which driver was refused when one did.
+void USBHost::poolStats(poolstats_t &devices, poolstats_t &pipes, poolstats_t &trans,
+	poolstats_t &strs, bool reset)
+{
+	__disable_irq();
+	devices = Device_stats;
+	pipes = Pipe_stats;
+	trans = Transfer_stats;
+	strs = strbuf_stats;
+	if (reset) {
+		poolstats_t *list[4] = {&Device_stats, &Pipe_stats, &Transfer_stats, &strbuf_stats};
+		for (uint32_t i=0; i < 4; i++) {
+			list[i]->min_free = list[i]->free;
+			list[i]->failures = 0;
+			list[i]->failed_driver = NULL;
+		}
+	}
+	__enable_irq();
+}
@@ -329,3 +329,77 @@ void USBHost::print_hexbytes(const void *ptr, uint32_t len)
 }
 
 #endif
+
+#if defined(USBHOST_TRACE)
+// Trace buffer, the most recent USBHOST_TRACE_SIZE events.  Any code,
+// interrupt or not, may add events.  Each claims its record with an
+// atomic increment (LDREX/STREX), and writes the sequence number last,
+// so traceDump() can skip records which are being overwritten.
+#if defined(USBHOST_TRACE_SIZE)
+#define TRACE_SIZE (USBHOST_TRACE_SIZE) // must be a power of 2
+#else
+#define TRACE_SIZE  256
+#endif
+typedef struct {
+	uint32_t cycles;
+	uint32_t ptr;
+	uint32_t value;
+	volatile uint32_t tag; // sequence number << 8 | event
+} trace_record_t;
+static trace_record_t trace_ring[TRACE_SIZE];
+static uint32_t trace_head=0;
+
+void USBHost::trace_(trace_event_t event, const void *ptr, uint32_t value)
+{
+	uint32_t seq = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+	trace_record_t *r = &trace_ring[seq & (TRACE_SIZE - 1)];
+	r->tag = 0;
+	__atomic_thread_fence(__ATOMIC_RELEASE); // tag cleared before the data
+	r->cycles = ARM_DWT_CYCCNT;
+	r->ptr = (uint32_t)ptr;
+	r->value = value;
+	__atomic_store_n(&r->tag, (seq << 8) | event, __ATOMIC_RELEASE);
+}
+
+// Print the trace buffer, oldest first, as text lines which
+// extras/trace_decode turns into a timeline and Chrome trace JSON.
+void USBHost::traceDump(Print &out)
+{
+	uint32_t head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+	uint32_t seq = (head > TRACE_SIZE) ? head - TRACE_SIZE : 0;
+	out.print("USBHost_t36 trace ");
+#if defined(__IMXRT1062__)
+	out.println(F_CPU_ACTUAL);
+#else
+	out.println(F_CPU);
+#endif
+	for (; seq != head; seq++) {
+		const trace_record_t *r = &trace_ring[seq & (TRACE_SIZE - 1)];
+		uint32_t tag = __atomic_load_n(&r->tag, __ATOMIC_ACQUIRE);
+		trace_record_t copy = *r;
+		// copy is read before tag is checked again
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		// skip if rewritten by a newer event while we looked
+		if (tag != ((seq << 8) | (tag & 0xFF))
+		  || __atomic_load_n(&r->tag, __ATOMIC_RELAXED) != tag) continue;
+		out.print(seq);
+		out.print(' ');
+		out.print(copy.cycles, HEX);
+		out.print(' ');
+		out.print(tag & 0xFF);
+		out.print(' ');
+		out.print(copy.ptr, HEX);
+		out.print(' ');
+		out.println(copy.value, HEX);
+	}
+	out.println("end");
+}
+
+void USBHost::traceClear()
+{
+	__disable_irq();
+	memset(trace_ring, 0, sizeof(trace_ring));
+	trace_head = 0;
+	__enable_irq();
+}
+#endif
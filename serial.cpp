@@ -67,7 +67,7 @@ USBSerialBase::product_vendor_mapping_t USBSerialBase::pid_vid_mapping[] = {
 void USBSerialBase::init()
 {
 	contribute_Pipes(mypipes, sizeof(mypipes)/sizeof(Pipe_t));
-	contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t));
+	contribute_Transfers(mytransfers, sizeof(mytransfers)/sizeof(Transfer_t), this);
 	contribute_String_Buffers(mystring_bufs, sizeof(mystring_bufs)/sizeof(strbuf_t));
 	driver_ready_for_device(this);
 	format_ = USBHOST_SERIAL_8N1;
@@ -185,6 +185,9 @@ bool USBSerialBase::claim(Device_t *dev, int type, const uint8_t *descriptors, u
 		println("  tx buffer size:", txsize);
 		rxpipe = new_Pipe(dev, 2, rx_ep & 15, 1, rx_size);
 		if (!rxpipe) return false;
+		// mostly idle, so don't slow down other bulk pipes
+		set_NAK_Reload(rxpipe, 1);
+		set_Priority(rxpipe, -1);
 		txpipe = new_Pipe(dev, 2, tx_ep, 0, tx_size);
 		if (!txpipe) {
 			// TODO: free rxpipe
@@ -308,6 +311,8 @@ bool USBSerialBase::claim(Device_t *dev, int type, const uint8_t *descriptors, u
 
 	rxpipe = new_Pipe(dev, 2, rxep & 15, 1, rx_size);
 	if (!rxpipe) return false;
+	set_NAK_Reload(rxpipe, 1);
+	set_Priority(rxpipe, -1);
 	txpipe = new_Pipe(dev, 2, txep, 0, tx_size);
 	if (!txpipe) {
 		//free_Pipe(rxpipe);
@@ -1062,6 +1067,9 @@ void USBSerialBase::rx_queue_packets(uint32_t head, uint32_t tail)
 		avail = tail - head - 1;
 	}
 	uint32_t packetsize = rx2 - rx1;
+	// a packet already queued may still arrive into the free space
+	if (rxstate & 0x01) avail = (avail > packetsize) ? avail - packetsize : 0;
+	if (rxstate & 0x02) avail = (avail > packetsize) ? avail - packetsize : 0;
 	if (avail >= packetsize) {
 		if ((rxstate & 0x01) == 0) {
 			queue_Data_Transfer(rxpipe, rx1, packetsize, this);
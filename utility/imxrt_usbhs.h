@@ -4,25 +4,21 @@
 #if defined(__IMXRT1052__) || defined(__IMXRT1062__)
  
 // Allow USB host code written for "USBHS" on Teensy 3.6 to compile for "USB2" on Teensy 4.0
+//
+// The IMXRT has 2 identical USB controllers.  Teensy 4 uses USB1 for its
+// own USB port, so the default host controller is USB2, unless
+// USBHOST_CONTROLLER is 1.  Its interrupt is IRQ_USBHS.  The registers
+// of each controller are accessed by USBHostController, see ehci.cpp.
 
+#if defined(USBHOST_CONTROLLER) && USBHOST_CONTROLLER == 1
+#define USBHS_CONTROLLER	1
+#define IRQ_USBHS		IRQ_USB1
+#elif !defined(USBHOST_CONTROLLER) || USBHOST_CONTROLLER == 2
+#define USBHS_CONTROLLER	2
 #define IRQ_USBHS		IRQ_USB2
-
-#define USBPHY_CTRL		USBPHY2_CTRL
-#define USBPHY_CTRL_CLR		USBPHY2_CTRL_CLR
-#define USBPHY_CTRL_SET		USBPHY2_CTRL_SET
-
-#define USBHS_USBCMD		USB2_USBCMD
-#define USBHS_USBSTS		USB2_USBSTS
-#define USBHS_USBINTR		USB2_USBINTR
-#define USBHS_FRINDEX		USB2_FRINDEX
-#define USBHS_PERIODICLISTBASE	USB2_PERIODICLISTBASE
-#define USBHS_ASYNCLISTADDR	USB2_ASYNCLISTADDR
-#define USBHS_PORTSC1		USB2_PORTSC1
-#define USBHS_USBMODE		USB2_USBMODE
-#define USBHS_GPTIMER0CTL	USB2_GPTIMER0CTRL
-#define USBHS_GPTIMER0LD	USB2_GPTIMER0LD
-#define USBHS_GPTIMER1CTL	USB2_GPTIMER1CTRL
-#define USBHS_GPTIMER1LD	USB2_GPTIMER1LD
+#else
+#error "USBHOST_CONTROLLER must be 1 or 2"
+#endif
 
 #define USBHS_USBCMD_ASE	USB_USBCMD_ASE
 #define USBHS_USBCMD_IAA	USB_USBCMD_IAA
@@ -55,6 +51,7 @@
 #define USBHS_USBINTR_TIE1	USB_USBINTR_TIE1
 #define USBHS_USBINTR_UEE	USB_USBINTR_UEE
 #define USBHS_USBINTR_SEE	USB_USBINTR_SEE
+#define USBHS_USBINTR_AAE	USB_USBINTR_AAE
 #define USBHS_USBINTR_UPIE	USB_USBINTR_UPIE
 #define USBHS_USBINTR_UAIE	USB_USBINTR_UAIE
 
@@ -74,9 +71,6 @@
 
 #define USBHS_USBMODE_CM(n)	USB_USBMODE_CM(n)
 
-// TODO: what is the best setting for this register on IMXRT ???
-#define USBHS_USB_SBUSCFG	USB2_SBUSCFG
-
 
 #endif // __IMXRT1052__ or __IMXRT1062__
 #endif // IMXRT_USBHS_H_